@@ -194,6 +194,31 @@ void deserialise(...)
 			field = newSVuv(htonl(flow.finf.source_id));
 			F_STORE("source_id");
 		}
+		if (fields & STORE_FIELD_SAMPLING) {
+			tmp = store_ntohll(flow.samp.sampler_id);
+			if (tmp < (1ULL << 32))
+				field = newSVuv(tmp);
+			else
+				field = newSVnv(tmp * 1.0);
+			F_STORE("sampler_id");
+			field = newSVuv(ntohl(flow.samp.interval));
+			F_STORE("sampling_interval");
+			field = newSViv(flow.samp.algorithm);
+			F_STORE("sampling_algorithm");
+			field = newSViv(flow.samp.flags);
+			F_STORE("sampling_flags");
+		}
+		if (fields & STORE_FIELD_ABS_TIMES) {
+			tmp = store_ntohll(flow.atimes.flow_start_ms);
+			field = newSVnv(tmp * 1.0);
+			F_STORE("flow_start_ms");
+			tmp = store_ntohll(flow.atimes.flow_finish_ms);
+			field = newSVnv(tmp * 1.0);
+			F_STORE("flow_finish_ms");
+			tmp = store_ntohll(flow.atimes.skew_ms);
+			field = newSVnv((int64_t)tmp * 1.0);
+			F_STORE("skew_ms");
+		}
 		if (fields & STORE_FIELD_CRC32) {
 			field = newSVuv(ntohl(flow.crc32.crc32));
 			F_STORE("crc");
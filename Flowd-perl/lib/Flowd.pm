@@ -43,6 +43,8 @@ use constant AGENT_INFO		=> 0x00008000;
 use constant FLOW_TIMES		=> 0x00010000;
 use constant AS_INFO		=> 0x00020000;
 use constant FLOW_ENGINE_INFO	=> 0x00040000;
+use constant SAMPLING		=> 0x00080000;
+use constant ABS_TIMES		=> 0x00100000;
 use constant CRC32		=> 0x40000000;
 
 # Some useful combinations
@@ -52,7 +54,7 @@ use constant DST_ADDR		=> 0x00000180;
 use constant SRCDST_ADDR	=> 0x000001e0;
 use constant GATEWAY_ADDR	=> 0x00000600;
 use constant BRIEF		=> 0x000039ff;
-use constant ALL		=> 0x4007ffff;
+use constant ALL		=> 0x401fffff;
 
 require Exporter;
 
@@ -242,8 +244,13 @@ sub format
 		    Flowd::iso_time($flowfields->{time_sec}, $utc_flag);
 		$ret .= sprintf "time_nanosec %u ",
 		    $flowfields->{time_nanosec};
-		$ret .= sprintf "netflow ver %u ",
-			$flowfields->{netflow_version};
+		if ($flowfields->{netflow_version} & 0x8000) {
+			$ret .= sprintf "sflow ver %u ",
+				$flowfields->{netflow_version} & 0x7fff;
+		} else {
+			$ret .= sprintf "netflow ver %u ",
+				$flowfields->{netflow_version};
+		}
 	}
 	if ($fields & FLOW_TIMES) {
 		$ret .= sprintf "flow_start %s ",
@@ -265,6 +272,23 @@ sub format
 		$ret .= sprintf "engine_id %u ", $flowfields->{engine_id};
 		$ret .= sprintf "seq %u ", $flowfields->{flow_sequence};
 	}
+	if ($fields & SAMPLING) {
+		$ret .= sprintf "sampler %s ", $flowfields->{sampler_id};
+		$ret .= sprintf "interval %u ",
+		    $flowfields->{sampling_interval};
+		$ret .= sprintf "algorithm %u ",
+		    $flowfields->{sampling_algorithm};
+		$ret .= "upscaled " if $flowfields->{sampling_flags} & 1;
+	}
+	if ($fields & ABS_TIMES) {
+		$ret .= sprintf "flow_start_abs %s.%03u ",
+		    Flowd::iso_time(int($flowfields->{flow_start_ms} / 1000),
+		    $utc_flag), $flowfields->{flow_start_ms} % 1000;
+		$ret .= sprintf "flow_finish_abs %s.%03u ",
+		    Flowd::iso_time(int($flowfields->{flow_finish_ms} / 1000),
+		    $utc_flag), $flowfields->{flow_finish_ms} % 1000;
+		$ret .= sprintf "skew_ms %d ", $flowfields->{skew_ms};
+	}
 	if ($fields & CRC32) {
 		$ret .= sprintf "crc32 %08x ", $flowfields->{crc};
 	}
@@ -468,7 +468,7 @@ addr_netmatch(const struct xaddr *host, const struct xaddr *net, u_int masklen)
 const char *
 addr_ntop_buf(const struct xaddr *a)
 {
-	static char hbuf[64];
+	static __tls char hbuf[64];
 
 	if (addr_ntop(a, hbuf, sizeof(hbuf)) == -1)
 		return NULL;
@@ -0,0 +1,583 @@
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "flowd-common.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture.h"
+
+RCSID("$Id$");
+
+/* Stash error message in "ebuf" and return */
+#define SFAILX(i, m, f) do {						\
+		if (ebuf != NULL && elen > 0) {				\
+			snprintf(ebuf, elen, "%s%s%s",			\
+			    (f) ? __func__ : "", (f) ? ": " : "", m);	\
+		}							\
+		return (i);						\
+	} while (0)
+
+/* Stash error message, appending strerror into "ebuf" and return */
+#define SFAIL(i, m, f) do {						\
+		if (ebuf != NULL && elen > 0) {				\
+			snprintf(ebuf, elen, "%s%s%s: %s", 		\
+			    (f) ? __func__ : "", (f) ? ": " : "", m, 	\
+			    strerror(errno));				\
+		}							\
+		return (i);						\
+	} while (0)
+
+/* pcap file and record headers */
+#define PCAP_MAGIC		0xa1b2c3d4
+#define PCAP_MAGIC_NSEC		0xa1b23c4d
+#define PCAP_HDR_LEN		24
+#define PCAP_REC_LEN		16
+
+/* pcapng block types and the options that we care about */
+#define PCAPNG_SHB		0x0a0d0d0a	/* Section header */
+#define PCAPNG_IDB		0x00000001	/* Interface description */
+#define PCAPNG_PB		0x00000002	/* Packet (obsolete) */
+#define PCAPNG_SPB		0x00000003	/* Simple packet */
+#define PCAPNG_EPB		0x00000006	/* Enhanced packet */
+#define PCAPNG_BYTE_ORDER	0x1a2b3c4d
+#define PCAPNG_OPT_END		0
+#define PCAPNG_OPT_TSRESOL	9
+
+/* Link layer types, as they appear in capture files */
+#define LT_NULL			0
+#define LT_EN10MB		1
+#define LT_RAW_ALT1		12
+#define LT_RAW_ALT2		14
+#define LT_RAW			101
+#define LT_LOOP			108
+#define LT_LINUX_SLL		113
+#define LT_IPV4			228
+#define LT_IPV6			229
+#define LT_LINUX_SLL2		276
+
+#define ETHERTYPE_IP		0x0800
+#define ETHERTYPE_IPV6		0x86dd
+#define ETHERTYPE_VLAN		0x8100
+#define ETHERTYPE_QINQ		0x88a8
+#define ETHERTYPE_QINQ_OLD	0x9100
+
+#define IP_PROTO_UDP		17
+
+/* A pcapng interface, packets refer to these by index */
+struct capture_iface {
+	u_int linktype;
+	u_int64_t tsunits;		/* Timestamp units per second */
+};
+
+struct capture {
+	u_int8_t *buf;			/* The whole file, mapped */
+	size_t len, off;
+	int pcapng;
+	int swap;			/* File is in the other byte order */
+
+	/* pcap */
+	u_int linktype;
+	int nsec;
+
+	/* pcapng, reset at each section header */
+	struct capture_iface *ifaces;
+	u_int nifaces, ifaces_alloc;
+	struct timeval last_ts;
+
+	struct capture_stats stats;
+};
+
+static u_int32_t
+swap32(u_int32_t v)
+{
+	return ((v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) |
+	    (v << 24));
+}
+
+/* Fetch values in the capture file's byte order */
+static u_int32_t
+cap32(struct capture *cap, const u_int8_t *p)
+{
+	u_int32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return (cap->swap ? swap32(v) : v);
+}
+
+static u_int16_t
+cap16(struct capture *cap, const u_int8_t *p)
+{
+	u_int16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return (cap->swap ? (u_int16_t)((v >> 8) | (v << 8)) : v);
+}
+
+/* Fetch a value in network byte order from a packet */
+static u_int16_t
+net16(const u_int8_t *p)
+{
+	return ((p[0] << 8) | p[1]);
+}
+
+struct capture *
+capture_open(const char *path, char *ebuf, int elen)
+{
+	struct capture *cap;
+	struct stat sb;
+	u_int32_t magic;
+	void *buf;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		SFAIL(NULL, path, 0);
+	if (fstat(fd, &sb) == -1) {
+		close(fd);
+		SFAIL(NULL, "fstat", 1);
+	}
+	if (sb.st_size < PCAP_HDR_LEN) {
+		close(fd);
+		SFAILX(NULL, "file too short to be a capture", 0);
+	}
+	buf = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (buf == MAP_FAILED)
+		SFAIL(NULL, "mmap", 1);
+#ifdef MADV_SEQUENTIAL
+	madvise(buf, sb.st_size, MADV_SEQUENTIAL);
+#endif
+	if ((cap = calloc(1, sizeof(*cap))) == NULL) {
+		munmap(buf, sb.st_size);
+		SFAILX(NULL, "calloc failed", 1);
+	}
+	cap->buf = buf;
+	cap->len = sb.st_size;
+
+	memcpy(&magic, cap->buf, sizeof(magic));
+	if (magic == PCAPNG_SHB) {
+		/* Byte order is established by each section header */
+		cap->pcapng = 1;
+		return (cap);
+	}
+	if (magic == swap32(PCAP_MAGIC) || magic == swap32(PCAP_MAGIC_NSEC)) {
+		cap->swap = 1;
+		magic = swap32(magic);
+	}
+	if (magic != PCAP_MAGIC && magic != PCAP_MAGIC_NSEC) {
+		capture_close(cap);
+		SFAILX(NULL, "not a pcap or pcapng file", 0);
+	}
+	cap->nsec = magic == PCAP_MAGIC_NSEC;
+	/* The top bits of the link type carry FCS information */
+	cap->linktype = cap32(cap, cap->buf + 20) & 0x0fffffff;
+	cap->off = PCAP_HDR_LEN;
+	return (cap);
+}
+
+void
+capture_close(struct capture *cap)
+{
+	munmap(cap->buf, cap->len);
+	free(cap->ifaces);
+	free(cap);
+}
+
+const struct capture_stats *
+capture_stats(struct capture *cap)
+{
+	return (&cap->stats);
+}
+
+/* Extract a UDP datagram, returns 1 if one was found or 0 to skip */
+static int
+capture_udp(struct capture *cap, const u_int8_t *p, u_int len,
+    struct capture_udp *cu)
+{
+	u_int ulen;
+
+	if (len < 8) {
+		cap->stats.truncated++;
+		return (0);
+	}
+	if ((ulen = net16(p + 4)) < 8) {
+		cap->stats.skipped++;
+		return (0);
+	}
+	if (ulen > len) {
+		cap->stats.truncated++;
+		return (0);
+	}
+	cu->sport = net16(p);
+	cu->dport = net16(p + 2);
+	cu->data = p + 8;
+	cu->len = ulen - 8;
+	return (1);
+}
+
+static int
+capture_ipv4(struct capture *cap, const u_int8_t *p, u_int len,
+    struct capture_udp *cu)
+{
+	u_int hlen, tlen;
+
+	if (len < 20 || (p[0] >> 4) != 4) {
+		cap->stats.skipped++;
+		return (0);
+	}
+	hlen = (p[0] & 0x0f) * 4;
+	tlen = net16(p + 2);
+	if (hlen < 20 || tlen < hlen) {
+		cap->stats.skipped++;
+		return (0);
+	}
+	if (tlen > len) {
+		cap->stats.truncated++;
+		return (0);
+	}
+	/* Offset or more-fragments set */
+	if ((net16(p + 6) & 0x3fff) != 0) {
+		cap->stats.fragments++;
+		return (0);
+	}
+	if (p[9] != IP_PROTO_UDP) {
+		cap->stats.skipped++;
+		return (0);
+	}
+	cu->src.af = cu->dst.af = AF_INET;
+	memcpy(&cu->src.v4, p + 12, sizeof(cu->src.v4));
+	memcpy(&cu->dst.v4, p + 16, sizeof(cu->dst.v4));
+	/* Trailing link-layer padding isn't part of the datagram */
+	return (capture_udp(cap, p + hlen, tlen - hlen, cu));
+}
+
+static int
+capture_ipv6(struct capture *cap, const u_int8_t *p, u_int len,
+    struct capture_udp *cu)
+{
+	u_int off, nh;
+
+	if (len < 40 || (p[0] >> 4) != 6) {
+		cap->stats.skipped++;
+		return (0);
+	}
+	if (40 + net16(p + 4) > len) {
+		cap->stats.truncated++;
+		return (0);
+	}
+	len = 40 + net16(p + 4);
+	cu->src.af = cu->dst.af = AF_INET6;
+	memcpy(&cu->src.v6, p + 8, sizeof(cu->src.v6));
+	memcpy(&cu->dst.v6, p + 24, sizeof(cu->dst.v6));
+
+	/* Walk over any extension headers that may precede UDP */
+	for (off = 40, nh = p[6];;) {
+		switch (nh) {
+		case IP_PROTO_UDP:
+			return (capture_udp(cap, p + off, len - off, cu));
+		case 0:		/* Hop-by-hop options */
+		case 43:	/* Routing */
+		case 60:	/* Destination options */
+			if (len - off < 8) {
+				cap->stats.truncated++;
+				return (0);
+			}
+			nh = p[off];
+			off += (p[off + 1] + 1) * 8;
+			if (off > len) {
+				cap->stats.truncated++;
+				return (0);
+			}
+			break;
+		case 44:	/* Fragment */
+			cap->stats.fragments++;
+			return (0);
+		default:
+			cap->stats.skipped++;
+			return (0);
+		}
+	}
+}
+
+/* Strip the link layer from a captured frame and look for UDP inside */
+static int
+capture_decode(struct capture *cap, u_int linktype, const u_int8_t *p,
+    u_int len, struct capture_udp *cu)
+{
+	u_int etype = 0;
+
+	switch (linktype) {
+	case LT_NULL:
+	case LT_LOOP:
+		/* Address family, but not in a predictable byte order */
+		if (len < 4)
+			goto skip;
+		p += 4;
+		len -= 4;
+		break;
+	case LT_EN10MB:
+		if (len < 14)
+			goto skip;
+		etype = net16(p + 12);
+		p += 14;
+		len -= 14;
+		while (etype == ETHERTYPE_VLAN || etype == ETHERTYPE_QINQ ||
+		    etype == ETHERTYPE_QINQ_OLD) {
+			if (len < 4)
+				goto skip;
+			etype = net16(p + 2);
+			p += 4;
+			len -= 4;
+		}
+		break;
+	case LT_LINUX_SLL:
+		if (len < 16)
+			goto skip;
+		etype = net16(p + 14);
+		p += 16;
+		len -= 16;
+		break;
+	case LT_LINUX_SLL2:
+		if (len < 20)
+			goto skip;
+		etype = net16(p);
+		p += 20;
+		len -= 20;
+		break;
+	case LT_RAW:
+	case LT_RAW_ALT1:
+	case LT_RAW_ALT2:
+	case LT_IPV4:
+	case LT_IPV6:
+		break;
+	default:
+		goto skip;
+	}
+
+	/* No ethertype, go by the IP version */
+	if (etype == 0 && len > 0) {
+		if ((p[0] >> 4) == 4)
+			etype = ETHERTYPE_IP;
+		else if ((p[0] >> 4) == 6)
+			etype = ETHERTYPE_IPV6;
+	}
+
+	bzero(&cu->src, sizeof(cu->src));
+	bzero(&cu->dst, sizeof(cu->dst));
+	switch (etype) {
+	case ETHERTYPE_IP:
+		return (capture_ipv4(cap, p, len, cu));
+	case ETHERTYPE_IPV6:
+		return (capture_ipv6(cap, p, len, cu));
+	}
+ skip:
+	cap->stats.skipped++;
+	return (0);
+}
+
+/* Convert a pcapng timestamp to a timeval */
+static void
+capture_ts(struct capture_iface *ci, u_int64_t ts, struct timeval *tv)
+{
+	u_int64_t rem = ts % ci->tsunits;
+
+	tv->tv_sec = ts / ci->tsunits;
+	if (ci->tsunits >= 1000000)
+		tv->tv_usec = rem / (ci->tsunits / 1000000);
+	else
+		tv->tv_usec = (rem * 1000000) / ci->tsunits;
+}
+
+/* Record a pcapng interface description block */
+static int
+capture_idb(struct capture *cap, const u_int8_t *p, u_int blen,
+    char *ebuf, int elen)
+{
+	struct capture_iface *ci, *tmp;
+	u_int off, olen, n;
+
+	if (blen < 20)
+		SFAILX(-1, "short interface description block", 0);
+	if (cap->nifaces == cap->ifaces_alloc) {
+		n = cap->ifaces_alloc == 0 ? 4 : cap->ifaces_alloc * 2;
+		if ((tmp = realloc(cap->ifaces, n * sizeof(*tmp))) == NULL)
+			SFAILX(-1, "realloc failed", 1);
+		cap->ifaces = tmp;
+		cap->ifaces_alloc = n;
+	}
+	ci = &cap->ifaces[cap->nifaces++];
+	ci->linktype = cap16(cap, p + 8);
+	ci->tsunits = 1000000;
+
+	/* Options run up to the trailing length word */
+	for (off = 16; off + 4 <= blen - 4; off += 4 + ((olen + 3) & ~3)) {
+		olen = cap16(cap, p + off + 2);
+		if (cap16(cap, p + off) == PCAPNG_OPT_END ||
+		    off + 4 + olen > blen - 4)
+			break;
+		if (cap16(cap, p + off) != PCAPNG_OPT_TSRESOL || olen < 1)
+			continue;
+		/* Top bit set means a power of two, otherwise of ten */
+		n = p[off + 4] & 0x7f;
+		if (p[off + 4] & 0x80)
+			ci->tsunits = n < 64 ? (u_int64_t)1 << n : 0;
+		else if (n <= 19) {
+			for (ci->tsunits = 1; n > 0; n--)
+				ci->tsunits *= 10;
+		} else
+			ci->tsunits = 0;
+		if (ci->tsunits == 0)
+			SFAILX(-1, "bad interface timestamp resolution", 0);
+	}
+	return (0);
+}
+
+static int
+capture_next_pcap(struct capture *cap, struct capture_udp *cu, char *ebuf,
+    int elen)
+{
+	const u_int8_t *p;
+	u_int caplen;
+
+	for (;;) {
+		if (cap->off == cap->len)
+			return (0);
+		if (cap->len - cap->off < PCAP_REC_LEN)
+			SFAILX(-1, "truncated record header", 0);
+		p = cap->buf + cap->off;
+		caplen = cap32(cap, p + 8);
+		if (caplen > cap->len - cap->off - PCAP_REC_LEN)
+			SFAILX(-1, "truncated record", 0);
+		cap->off += PCAP_REC_LEN + caplen;
+		cap->stats.frames++;
+		if (capture_decode(cap, cap->linktype, p + PCAP_REC_LEN,
+		    caplen, cu)) {
+			cu->ts.tv_sec = cap32(cap, p);
+			cu->ts.tv_usec = cap32(cap, p + 4);
+			if (cap->nsec)
+				cu->ts.tv_usec /= 1000;
+			return (1);
+		}
+	}
+}
+
+static int
+capture_next_pcapng(struct capture *cap, struct capture_udp *cu, char *ebuf,
+    int elen)
+{
+	struct capture_iface *ci;
+	const u_int8_t *p;
+	u_int32_t btype, magic;
+	u_int blen, caplen, iface;
+
+	for (;;) {
+		if (cap->off == cap->len)
+			return (0);
+		if (cap->len - cap->off < 12)
+			SFAILX(-1, "truncated block header", 0);
+		p = cap->buf + cap->off;
+		memcpy(&btype, p, sizeof(btype));
+		if (btype == PCAPNG_SHB) {
+			/* The block type reads the same in either order */
+			if (cap->len - cap->off < 28)
+				SFAILX(-1, "truncated section header", 0);
+			memcpy(&magic, p + 8, sizeof(magic));
+			if (magic == PCAPNG_BYTE_ORDER)
+				cap->swap = 0;
+			else if (magic == swap32(PCAPNG_BYTE_ORDER))
+				cap->swap = 1;
+			else
+				SFAILX(-1, "bad section byte order magic", 0);
+			cap->nifaces = 0;
+		}
+		btype = cap32(cap, p);
+		blen = cap32(cap, p + 4);
+		if (blen < 12 || (blen & 3) != 0)
+			SFAILX(-1, "bad block length", 0);
+		if (blen > cap->len - cap->off)
+			SFAILX(-1, "truncated block", 0);
+		cap->off += blen;
+
+		switch (btype) {
+		case PCAPNG_IDB:
+			if (capture_idb(cap, p, blen, ebuf, elen) == -1)
+				return (-1);
+			continue;
+		case PCAPNG_EPB:
+		case PCAPNG_PB:
+			if (blen < 32)
+				SFAILX(-1, "short packet block", 0);
+			/* The obsolete block has a 16 bit interface ID */
+			iface = btype == PCAPNG_EPB ? cap32(cap, p + 8) :
+			    cap16(cap, p + 8);
+			caplen = cap32(cap, p + 20);
+			if (caplen > blen - 32)
+				SFAILX(-1, "packet overruns its block", 0);
+			if (iface >= cap->nifaces)
+				SFAILX(-1, "packet on undescribed interface", 0);
+			ci = &cap->ifaces[iface];
+			capture_ts(ci, ((u_int64_t)cap32(cap, p + 12) << 32) |
+			    cap32(cap, p + 16), &cap->last_ts);
+			p += 28;
+			break;
+		case PCAPNG_SPB:
+			if (blen < 16)
+				SFAILX(-1, "short simple packet block", 0);
+			if (cap->nifaces == 0)
+				SFAILX(-1, "packet on undescribed interface", 0);
+			/* No timestamp, so reuse the previous one */
+			ci = &cap->ifaces[0];
+			caplen = MIN(cap32(cap, p + 8), blen - 16);
+			p += 12;
+			break;
+		default:
+			continue;
+		}
+		cap->stats.frames++;
+		if (capture_decode(cap, ci->linktype, p, caplen, cu)) {
+			cu->ts = cap->last_ts;
+			return (1);
+		}
+	}
+}
+
+/*
+ * Read the next UDP datagram from the capture. Returns 1 if one was read,
+ * 0 at the end of the file or -1 on error.
+ */
+int
+capture_next(struct capture *cap, struct capture_udp *cu, char *ebuf,
+    int elen)
+{
+	int r;
+
+	if (cap->pcapng)
+		r = capture_next_pcapng(cap, cu, ebuf, elen);
+	else
+		r = capture_next_pcap(cap, cu, ebuf, elen);
+	if (r == 1)
+		cap->stats.udp++;
+	return (r);
+}
@@ -0,0 +1,52 @@
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Reader for UDP datagrams in pcap and pcapng capture files, without
+ * depending on libpcap. Only whole, unfragmented IPv4 and IPv6 UDP
+ * datagrams are returned; everything else is counted and skipped.
+ */
+
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include "addr.h"
+
+struct capture_udp {
+	struct timeval ts;		/* Capture timestamp */
+	struct xaddr src, dst;
+	u_int16_t sport, dport;		/* Host byte order */
+	const u_int8_t *data;		/* UDP payload, valid until next read */
+	u_int len;
+};
+
+struct capture_stats {
+	u_int64_t frames;		/* Captured frames read */
+	u_int64_t udp;			/* UDP datagrams returned */
+	u_int64_t skipped;		/* Not IP/UDP or unsupported link type */
+	u_int64_t fragments;		/* IP fragments (not reassembled) */
+	u_int64_t truncated;		/* Datagram cut short by the snaplen */
+};
+
+struct capture;
+
+struct capture *capture_open(const char *path, char *ebuf, int elen);
+int capture_next(struct capture *cap, struct capture_udp *cu, char *ebuf,
+    int elen);
+const struct capture_stats *capture_stats(struct capture *cap);
+void capture_close(struct capture *cap);
+
+#endif /* _CAPTURE_H */
@@ -0,0 +1,316 @@
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "flowd-common.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE1) && \
+    defined(HAVE_SYS_SIGNALFD_H) && defined(HAVE_SYS_TIMERFD_H)
+# define EVLOOP_EPOLL
+# include <sys/epoll.h>
+# include <sys/signalfd.h>
+# include <sys/timerfd.h>
+#endif
+
+#include "flowd.h"
+#include "evloop.h"
+
+RCSID("$Id$");
+
+struct evloop {
+#ifdef EVLOOP_EPOLL
+	int epfd;
+	int sig_fd;
+	int timer_fd;
+#else
+	struct pollfd *pfd;
+	void **args;
+	u_int nfds, fds_alloc;
+#endif
+	time_t timer_when;		/* Timer expiry, 0 if not armed */
+
+	/* Sources to report again without waiting */
+	void **again;
+	u_int nagain, again_alloc;
+};
+
+struct evloop *
+evloop_new(void)
+{
+	struct evloop *ev;
+
+	if ((ev = calloc(1, sizeof(*ev))) == NULL)
+		return (NULL);
+#ifdef EVLOOP_EPOLL
+	ev->sig_fd = ev->timer_fd = -1;
+	if ((ev->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		free(ev);
+		return (NULL);
+	}
+#endif
+	return (ev);
+}
+
+void
+evloop_free(struct evloop *ev)
+{
+#ifdef EVLOOP_EPOLL
+	close(ev->epfd);
+	if (ev->sig_fd != -1)
+		close(ev->sig_fd);
+	if (ev->timer_fd != -1)
+		close(ev->timer_fd);
+#else
+	free(ev->pfd);
+	free(ev->args);
+#endif
+	free(ev->again);
+	free(ev);
+}
+
+/* Watch "fd" for readability, reporting it to the caller as "arg" */
+int
+evloop_add(struct evloop *ev, int fd, void *arg)
+{
+#ifdef EVLOOP_EPOLL
+	struct epoll_event e;
+
+	bzero(&e, sizeof(e));
+	e.events = EPOLLIN|EPOLLET;
+	e.data.ptr = arg;
+	return (epoll_ctl(ev->epfd, EPOLL_CTL_ADD, fd, &e));
+#else
+	struct pollfd *tmp_pfd;
+	void **tmp_args;
+	u_int n;
+
+	if (ev->nfds == ev->fds_alloc) {
+		n = ev->fds_alloc == 0 ? 8 : ev->fds_alloc * 2;
+		if ((tmp_pfd = realloc(ev->pfd, n * sizeof(*tmp_pfd))) == NULL)
+			return (-1);
+		ev->pfd = tmp_pfd;
+		if ((tmp_args = realloc(ev->args,
+		    n * sizeof(*tmp_args))) == NULL)
+			return (-1);
+		ev->args = tmp_args;
+		ev->fds_alloc = n;
+	}
+	ev->pfd[ev->nfds].fd = fd;
+	ev->pfd[ev->nfds].events = POLLIN;
+	ev->pfd[ev->nfds].revents = 0;
+	ev->args[ev->nfds] = arg;
+	ev->nfds++;
+	return (0);
+#endif
+}
+
+/* Stop watching "fd". Must be called before it is closed */
+void
+evloop_del(struct evloop *ev, int fd, void *arg)
+{
+	u_int i;
+
+#ifdef EVLOOP_EPOLL
+	if (epoll_ctl(ev->epfd, EPOLL_CTL_DEL, fd, NULL) == -1)
+		logit(LOG_WARNING, "%s: epoll_ctl(fd = %d)", __func__, fd);
+#else
+	for (i = 0; i < ev->nfds; i++) {
+		if (ev->pfd[i].fd != fd)
+			continue;
+		ev->nfds--;
+		ev->pfd[i] = ev->pfd[ev->nfds];
+		ev->args[i] = ev->args[ev->nfds];
+		break;
+	}
+#endif
+	for (i = 0; i < ev->nagain; i++) {
+		if (ev->again[i] != arg)
+			continue;
+		ev->again[i] = ev->again[--ev->nagain];
+		break;
+	}
+}
+
+/* Report "arg" from the next evloop_wait() even if nothing new arrives */
+void
+evloop_again(struct evloop *ev, void *arg)
+{
+	void **tmp;
+	u_int i, n;
+
+	for (i = 0; i < ev->nagain; i++) {
+		if (ev->again[i] == arg)
+			return;
+	}
+	if (ev->nagain == ev->again_alloc) {
+		n = ev->again_alloc == 0 ? 8 : ev->again_alloc * 2;
+		if ((tmp = realloc(ev->again, n * sizeof(*tmp))) == NULL)
+			logerrx("%s: realloc failed", __func__);
+		ev->again = tmp;
+		ev->again_alloc = n;
+	}
+	ev->again[ev->nagain++] = arg;
+}
+
+/*
+ * Deliver "sigs" through the event loop. The signals are blocked, so this
+ * must be called before any other threads are started. Without signalfd,
+ * the caller's signal handlers will interrupt evloop_wait() instead.
+ */
+void
+evloop_signals(struct evloop *ev, const sigset_t *sigs)
+{
+#ifdef EVLOOP_EPOLL
+	struct epoll_event e;
+
+	if (sigprocmask(SIG_BLOCK, sigs, NULL) == -1)
+		logerr("%s: sigprocmask", __func__);
+	if ((ev->sig_fd = signalfd(ev->sig_fd, sigs,
+	    SFD_NONBLOCK|SFD_CLOEXEC)) == -1)
+		logerr("%s: signalfd", __func__);
+	bzero(&e, sizeof(e));
+	e.events = EPOLLIN;
+	e.data.ptr = &ev->sig_fd;
+	if (epoll_ctl(ev->epfd, EPOLL_CTL_ADD, ev->sig_fd, &e) == -1 &&
+	    errno != EEXIST)
+		logerr("%s: epoll_ctl", __func__);
+#endif
+}
+
+/* Arm the timer to expire at wall clock time "when", or disarm it if 0 */
+void
+evloop_timer(struct evloop *ev, time_t when)
+{
+#ifdef EVLOOP_EPOLL
+	struct itimerspec its;
+	struct epoll_event e;
+#endif
+
+	if (when == ev->timer_when)
+		return;
+	ev->timer_when = when;
+#ifdef EVLOOP_EPOLL
+	if (ev->timer_fd == -1) {
+		if ((ev->timer_fd = timerfd_create(CLOCK_REALTIME,
+		    TFD_NONBLOCK|TFD_CLOEXEC)) == -1)
+			logerr("%s: timerfd_create", __func__);
+		bzero(&e, sizeof(e));
+		e.events = EPOLLIN;
+		e.data.ptr = &ev->timer_fd;
+		if (epoll_ctl(ev->epfd, EPOLL_CTL_ADD, ev->timer_fd, &e) == -1)
+			logerr("%s: epoll_ctl", __func__);
+	}
+	bzero(&its, sizeof(its));
+	its.it_value.tv_sec = when;
+	if (timerfd_settime(ev->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+		logerr("%s: timerfd_settime", __func__);
+#endif
+}
+
+/*
+ * Wait for events and store up to "max" of them in "events". Returns the
+ * number stored, which may be zero if the wait was interrupted.
+ */
+int
+evloop_wait(struct evloop *ev, struct ev_event *events, int max)
+{
+	int i, n, r, timeout;
+#ifdef EVLOOP_EPOLL
+	struct epoll_event eevs[EV_MAX_EVENTS];
+	struct signalfd_siginfo si;
+	u_int64_t expiries;
+#else
+	time_t now;
+#endif
+
+	/* Sources that still have data pending go first, without waiting */
+	for (n = 0; ev->nagain > 0 && n < max; n++) {
+		bzero(&events[n], sizeof(events[n]));
+		events[n].type = EV_READ;
+		events[n].arg = ev->again[--ev->nagain];
+	}
+	if (n == max)
+		return (n);
+	timeout = n > 0 ? 0 : INFTIM;
+
+#ifdef EVLOOP_EPOLL
+	if ((r = epoll_wait(ev->epfd, eevs, MIN(max - n, EV_MAX_EVENTS),
+	    timeout)) == -1) {
+		if (errno != EINTR)
+			logerr("%s: epoll_wait", __func__);
+		return (n);
+	}
+	for (i = 0; i < r && n < max; i++) {
+		bzero(&events[n], sizeof(events[n]));
+		if (eevs[i].data.ptr == &ev->sig_fd) {
+			/*
+			 * Level triggered, so leftovers are seen next time.
+			 * Leave room for the rest of this batch of events.
+			 */
+			while (n < max - (r - i - 1) && read(ev->sig_fd, &si,
+			    sizeof(si)) == sizeof(si)) {
+				bzero(&events[n], sizeof(events[n]));
+				events[n].type = EV_SIGNAL;
+				events[n].signo = si.ssi_signo;
+				n++;
+			}
+		} else if (eevs[i].data.ptr == &ev->timer_fd) {
+			if (read(ev->timer_fd, &expiries,
+			    sizeof(expiries)) == sizeof(expiries)) {
+				ev->timer_when = 0;
+				events[n++].type = EV_TIMER;
+			}
+		} else {
+			events[n].type = EV_READ;
+			events[n].arg = eevs[i].data.ptr;
+			n++;
+		}
+	}
+#else
+	if (timeout == INFTIM && ev->timer_when != 0) {
+		now = time(NULL);
+		timeout = now >= ev->timer_when ? 0 :
+		    MIN(ev->timer_when - now, 3600) * 1000;
+	}
+	if ((r = poll(ev->pfd, ev->nfds, timeout)) == -1) {
+		if (errno != EINTR)
+			logerr("%s: poll", __func__);
+		return (n);
+	}
+	for (i = 0; r > 0 && i < (int)ev->nfds && n < max; i++) {
+		if (ev->pfd[i].revents == 0)
+			continue;
+		bzero(&events[n], sizeof(events[n]));
+		events[n].type = EV_READ;
+		events[n].arg = ev->args[i];
+		n++;
+	}
+	if (ev->timer_when != 0 && n < max && time(NULL) >= ev->timer_when) {
+		ev->timer_when = 0;
+		bzero(&events[n], sizeof(events[n]));
+		events[n++].type = EV_TIMER;
+	}
+#endif
+	return (n);
+}
@@ -0,0 +1,56 @@
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Minimal event loop: readable file descriptors, signals and a single
+ * wall-clock timer. On Linux this uses edge-triggered epoll, signalfd
+ * and timerfd; elsewhere it falls back to poll(2), ordinary signal
+ * handlers (which interrupt the poll) and a poll timeout.
+ *
+ * Descriptors are only reported when they become readable, so a caller
+ * that stops reading before a descriptor is drained must call
+ * evloop_again() to have it reported on the next evloop_wait().
+ */
+
+#ifndef _EVLOOP_H
+#define _EVLOOP_H
+
+#include <sys/types.h>
+#include <signal.h>
+#include <time.h>
+
+#define EV_READ		1	/* Descriptor is readable */
+#define EV_SIGNAL	2	/* Signal was delivered (signalfd only) */
+#define EV_TIMER	3	/* Timer has expired */
+
+#define EV_MAX_EVENTS	64
+
+struct ev_event {
+	int type;
+	int signo;		/* EV_SIGNAL */
+	void *arg;		/* EV_READ */
+};
+
+struct evloop;
+
+struct evloop *evloop_new(void);
+void evloop_free(struct evloop *ev);
+int evloop_add(struct evloop *ev, int fd, void *arg);
+void evloop_del(struct evloop *ev, int fd, void *arg);
+void evloop_again(struct evloop *ev, void *arg);
+void evloop_signals(struct evloop *ev, const sigset_t *sigs);
+void evloop_timer(struct evloop *ev, time_t when);
+int evloop_wait(struct evloop *ev, struct ev_event *events, int max);
+
+#endif /* _EVLOOP_H */
@@ -190,15 +190,17 @@ format_rule(const struct filter_rule *rule)
 static int
 flow_daytime_match(time_t recv_sec, int day_mask, int dayafter, int daybefore)
 {
-	struct tm *tm;
+	struct tm tm;
 	int sec;
 
-	tm = localtime(&recv_sec);
+	/* Workers filter concurrently, so don't use localtime()'s buffer */
+	if (localtime_r(&recv_sec, &tm) == NULL)
+		return (0);
 
-	if (day_mask != 0 && (day_mask & (1 << tm->tm_wday)) == 0)
+	if (day_mask != 0 && (day_mask & (1 << tm.tm_wday)) == 0)
 		return (0);
 
-	sec = tm->tm_sec + (tm->tm_min * 60) + (tm->tm_hour * 3600);
+	sec = tm.tm_sec + (tm.tm_min * 60) + (tm.tm_hour * 3600);
 
 	if ((daybefore != -1) && sec > daybefore)
 		return (0);
@@ -208,115 +210,610 @@ flow_daytime_match(time_t recv_sec, int day_mask, int dayafter, int daybefore)
 	return (1);
 }
 
+/*
+ * Filter rules are compiled into a decision program when the configuration
+ * is loaded. Each distinct test in the rules (a predicate) is evaluated at
+ * most once per flow, however many rules share it. The rules that could
+ * match a flow are picked by jump tables on its protocol and on one of its
+ * ports, so rules for other protocols and ports are never looked at, and
+ * the tests that selected a rule are left out of its list of predicates.
+ * The candidates are then tried in order, with the usual last match and
+ * "quick" semantics.
+ *
+ * A rule's evaluation count is the number of flows that weren't stopped by
+ * an earlier quick rule, so rather than counting every rule for every flow,
+ * the program counts flows and where they stopped, and filter_prog_sync()
+ * works the evaluations out from those.
+ */
+
+/* Predicate kinds */
+#define FP_NEVER	0	/* Invalid test, such as a bad mask */
+#define FP_AGENT_ADDR	1
+#define FP_SRC_ADDR	2
+#define FP_DST_ADDR	3
+#define FP_IFNDX_IN	4
+#define FP_IFNDX_OUT	5
+#define FP_AF		6
+#define FP_SRC_PORT	7
+#define FP_DST_PORT	8
+#define FP_PROTOCOL	9
+#define FP_TOS		10
+#define FP_TCP_FLAGS	11
+#define FP_DAYTIME	12
+#define FP_ABSTIME	13
+
+struct filter_pred {
+	int kind;
+	int v[3];
+	struct xaddr addr, mask;	/* Network and its mask, for addresses */
+};
+
+/* A predicate that a rule requires to be true, or false if negated */
+struct filter_term {
+	u_int pred;
+	int negate;
+};
+
+struct filter_crule {
+	u_int first_term, num_terms;
+	int quick;
+	int never;			/* Can't match any flow */
+	int proto;			/* Required protocol, or -1 */
+	int port;			/* Required dispatch port, or -1 */
+};
+
+/* Most predicates that one rule can test */
+#define FILTER_MAX_TERMS	13
+
+/* Limit on the size of the candidate lists before port dispatch is dropped */
+#define FILTER_MAX_CANDIDATES	(4 * 1024 * 1024)
+
+struct filter_code {
+	u_int num_rules, num_preds, num_terms;
+	struct filter_pred *preds;
+	struct filter_term *terms;
+	struct filter_crule *rules;
+
+	/*
+	 * Candidate rules for each combination of protocol and port class.
+	 * Class 0 is protocols or ports that no rule requires.
+	 */
+	u_int32_t port_key;		/* FF_MATCH_{SRC,DST}_PORT, or 0 */
+	u_int num_proto_classes, num_port_classes;
+	u_int16_t proto_class[256];
+	u_int16_t *port_class;		/* 65536 entries, if port_key */
+	u_int32_t *cell_start, *cell_len;
+	u_int32_t *candidates;
+};
+
+/* A program and the rules that it counts matches in */
+struct filter_prog {
+	struct filter_code *code;
+	int is_copy;			/* Code belongs to another program */
+	struct filter_rule **rules;
+	u_int64_t flows;		/* Flows filtered since last sync */
+	u_int64_t *stops;		/* Flows stopped by each quick rule */
+	u_int32_t gen;			/* Predicate results are for this */
+	u_int32_t *pred_gen;
+	u_int8_t *pred_val;
+};
+
+static int
+filter_addr_match(const struct xaddr *host, const struct filter_pred *p)
+{
+	int i;
+
+	if (host->af != p->addr.af)
+		return (0);
+	switch (host->af) {
+	case AF_INET:
+		return ((host->v4.s_addr & p->mask.v4.s_addr) ==
+		    p->addr.v4.s_addr);
+	case AF_INET6:
+		for (i = 0; i < 4; i++) {
+			if ((host->addr32[i] & p->mask.addr32[i]) !=
+			    p->addr.addr32[i])
+				return (0);
+		}
+		return (host->scope_id == p->addr.scope_id);
+	default:
+		return (0);
+	}
+}
+
 static int
-flow_match(const struct filter_rule *rule,
+filter_pred_eval(const struct filter_pred *p,
     const struct store_flow_complete *flow)
 {
-	int m;
 	u_int tt;
+	int m;
 
-#define FRNEG(what) (rule->match.match_negate & FF_MATCH_##what)
-#define FRMATCH(what) (rule->match.match_what & FF_MATCH_##what)
-#define FRRETVAL(what) ((FRNEG(what) && m) || (!FRNEG(what) && !m))
-#define FRRET(what) do { if (FRRETVAL(what)) return (0); } while (0)
-
-	if (FRMATCH(AGENT_ADDR)) {
-		m = (addr_netmatch(&flow->agent_addr, &rule->match.agent_addr,
-		    rule->match.agent_masklen) == 0);
-		if ((FRNEG(AGENT_ADDR) && m) || (!FRNEG(AGENT_ADDR) && !m))
-			return (0);
+	switch (p->kind) {
+	case FP_AGENT_ADDR:
+		return (filter_addr_match(&flow->agent_addr, p));
+	case FP_SRC_ADDR:
+		return (filter_addr_match(&flow->src_addr, p));
+	case FP_DST_ADDR:
+		return (filter_addr_match(&flow->dst_addr, p));
+	case FP_IFNDX_IN:
+		return (ntohl(flow->ifndx.if_index_in) == (u_int32_t)p->v[0]);
+	case FP_IFNDX_OUT:
+		return (ntohl(flow->ifndx.if_index_out) == (u_int32_t)p->v[0]);
+	case FP_AF:
+		return (flow->src_addr.af == p->v[0] ||
+		    flow->dst_addr.af == p->v[0]);
+	case FP_SRC_PORT:
+		return (ntohs(flow->ports.src_port) == p->v[0]);
+	case FP_DST_PORT:
+		return (ntohs(flow->ports.dst_port) == p->v[0]);
+	case FP_PROTOCOL:
+		return (flow->pft.protocol == p->v[0]);
+	case FP_TOS:
+		return (flow->pft.tos == p->v[0]);
+	case FP_TCP_FLAGS:
+		return ((flow->pft.tcp_flags & p->v[0]) == p->v[1]);
+	case FP_DAYTIME:
+		return (flow_daytime_match(ntohl(flow->recv_time.recv_sec),
+		    p->v[0], p->v[1], p->v[2]));
+	case FP_ABSTIME:
+		tt = ntohl(flow->recv_time.recv_sec);
+		m = 1;
+		if (p->v[1] > 0)
+			m &= tt < (u_int)p->v[1];
+		if (p->v[0] > 0)
+			m &= tt > (u_int)p->v[0];
+		return (m);
+	default:
+		return (0);
 	}
+}
+
+/* Find a predicate in the program, or add it */
+static u_int
+filter_pred_intern(struct filter_code *code, u_int *preds_size,
+    const struct filter_pred *p)
+{
+	struct filter_pred *np;
+	u_int i;
 
-	if (FRMATCH(IFNDX_IN)) {
-		m = ntohl(flow->ifndx.if_index_in) == rule->match.ifndx_in;
-		FRRET(IFNDX_IN);
+	for (i = 0; i < code->num_preds; i++) {
+		if (memcmp(&code->preds[i], p, sizeof(*p)) == 0)
+			return (i);
 	}
+	if (code->num_preds == *preds_size) {
+		*preds_size = *preds_size == 0 ? 16 : *preds_size * 2;
+		if ((np = realloc(code->preds,
+		    *preds_size * sizeof(*np))) == NULL)
+			logerrx("%s: realloc failed", __func__);
+		code->preds = np;
+	}
+	code->preds[code->num_preds] = *p;
+	return (code->num_preds++);
+}
 
-	if (FRMATCH(IFNDX_OUT)) {
-		m = ntohl(flow->ifndx.if_index_out) == rule->match.ifndx_out;
-		FRRET(IFNDX_OUT);
+static void
+filter_pred_addr(struct filter_pred *p, int kind, const struct xaddr *addr,
+    int masklen)
+{
+	p->kind = kind;
+	p->addr.af = addr->af;
+	if (addr->af == AF_INET)
+		p->addr.v4 = addr->v4;
+	else if (addr->af == AF_INET6) {
+		p->addr.v6 = addr->v6;
+		p->addr.scope_id = addr->scope_id;
 	}
+	if (masklen < 0 || addr_netmask(addr->af, masklen, &p->mask) == -1) {
+		bzero(p, sizeof(*p));
+		p->kind = FP_NEVER;
+	}
+}
 
-	if (FRMATCH(AF)) {
-		m = flow->src_addr.af == rule->match.af ||
-		    flow->dst_addr.af == rule->match.af;
-		FRRET(AF);
+/* Add a rule's predicates to the program, leaving out the dispatched ones */
+static void
+filter_compile_rule(struct filter_code *code, struct filter_crule *cr,
+    const struct filter_rule *rule, u_int *preds_size, u_int *terms_size)
+{
+	const struct filter_match *fm = &rule->match;
+	struct filter_pred p[FILTER_MAX_TERMS];
+	struct filter_term *nt;
+	u_int32_t what;
+	int negate[FILTER_MAX_TERMS];
+	u_int i, n;
+
+#define FCPOS(what) \
+	((fm->match_what & FF_MATCH_##what) && \
+	    !(fm->match_negate & FF_MATCH_##what))
+#define FCNEW(what, k) do { \
+		bzero(&p[n], sizeof(p[n])); \
+		p[n].kind = (k); \
+		negate[n] = (fm->match_negate & FF_MATCH_##what) != 0; \
+	} while (0)
+
+	/* Cheap tests first */
+	n = 0;
+	what = fm->match_what;
+	if (FCPOS(PROTOCOL))
+		what &= ~FF_MATCH_PROTOCOL;
+	if (code->port_key != 0 && (fm->match_what & code->port_key) &&
+	    !(fm->match_negate & code->port_key))
+		what &= ~code->port_key;
+	if (what & FF_MATCH_PROTOCOL) {
+		FCNEW(PROTOCOL, FP_PROTOCOL);
+		p[n++].v[0] = fm->proto;
+	}
+	if (what & FF_MATCH_DST_PORT) {
+		FCNEW(DST_PORT, FP_DST_PORT);
+		p[n++].v[0] = fm->dst_port;
+	}
+	if (what & FF_MATCH_SRC_PORT) {
+		FCNEW(SRC_PORT, FP_SRC_PORT);
+		p[n++].v[0] = fm->src_port;
+	}
+	if (what & FF_MATCH_TOS) {
+		FCNEW(TOS, FP_TOS);
+		p[n++].v[0] = fm->tos;
+	}
+	if (what & FF_MATCH_TCP_FLAGS) {
+		FCNEW(TCP_FLAGS, FP_TCP_FLAGS);
+		p[n].v[0] = fm->tcp_flags_mask;
+		p[n++].v[1] = fm->tcp_flags_equals;
+	}
+	if (what & FF_MATCH_AF) {
+		FCNEW(AF, FP_AF);
+		p[n++].v[0] = fm->af;
+	}
+	if (what & FF_MATCH_IFNDX_IN) {
+		FCNEW(IFNDX_IN, FP_IFNDX_IN);
+		p[n++].v[0] = fm->ifndx_in;
+	}
+	if (what & FF_MATCH_IFNDX_OUT) {
+		FCNEW(IFNDX_OUT, FP_IFNDX_OUT);
+		p[n++].v[0] = fm->ifndx_out;
+	}
+	if (what & FF_MATCH_AGENT_ADDR) {
+		FCNEW(AGENT_ADDR, FP_AGENT_ADDR);
+		filter_pred_addr(&p[n++], FP_AGENT_ADDR, &fm->agent_addr,
+		    fm->agent_masklen);
+	}
+	if (what & FF_MATCH_SRC_ADDR) {
+		FCNEW(SRC_ADDR, FP_SRC_ADDR);
+		filter_pred_addr(&p[n++], FP_SRC_ADDR, &fm->src_addr,
+		    fm->src_masklen);
+	}
+	if (what & FF_MATCH_DST_ADDR) {
+		FCNEW(DST_ADDR, FP_DST_ADDR);
+		filter_pred_addr(&p[n++], FP_DST_ADDR, &fm->dst_addr,
+		    fm->dst_masklen);
+	}
+	if (what & FF_MATCH_DAYTIME) {
+		FCNEW(DAYTIME, FP_DAYTIME);
+		p[n].v[0] = fm->day_mask;
+		p[n].v[1] = fm->dayafter;
+		p[n++].v[2] = fm->daybefore;
+	}
+	if (what & FF_MATCH_ABSTIME) {
+		FCNEW(ABSTIME, FP_ABSTIME);
+		p[n].v[0] = fm->absafter;
+		p[n++].v[1] = fm->absbefore;
 	}
 
-	if (FRMATCH(SRC_ADDR)) {
-		m = (addr_netmatch(&flow->src_addr, &rule->match.src_addr,
-		    rule->match.src_masklen) == 0);
-		FRRET(SRC_ADDR);
+#undef FCPOS
+#undef FCNEW
+
+	cr->first_term = code->num_terms;
+	cr->num_terms = n;
+	for (i = 0; i < n; i++) {
+		if (code->num_terms == *terms_size) {
+			*terms_size = *terms_size == 0 ? 64 : *terms_size * 2;
+			if ((nt = realloc(code->terms,
+			    *terms_size * sizeof(*nt))) == NULL)
+				logerrx("%s: realloc failed", __func__);
+			code->terms = nt;
+		}
+		code->terms[code->num_terms].pred = filter_pred_intern(code,
+		    preds_size, &p[i]);
+		code->terms[code->num_terms].negate = negate[i];
+		code->num_terms++;
 	}
+}
 
-	if (FRMATCH(DST_ADDR)) {
-		m = (addr_netmatch(&flow->dst_addr, &rule->match.dst_addr,
-		    rule->match.dst_masklen) == 0);
-		FRRET(DST_ADDR);
+/* Append the rules that could match flows in a protocol and port class */
+static void
+filter_compile_cell(struct filter_code *code, u_int pc, u_int qc,
+    u_int *num_candidates, u_int *candidates_size)
+{
+	const struct filter_crule *cr;
+	u_int32_t *nc;
+	u_int i, cell;
+
+	cell = pc * code->num_port_classes + qc;
+	code->cell_start[cell] = *num_candidates;
+	for (i = 0; i < code->num_rules; i++) {
+		cr = &code->rules[i];
+		if (cr->never ||
+		    (cr->proto != -1 && code->proto_class[cr->proto] != pc) ||
+		    (cr->port != -1 && code->port_class[cr->port] != qc))
+			continue;
+		if (*num_candidates == *candidates_size) {
+			*candidates_size = *candidates_size == 0 ? 256 :
+			    *candidates_size * 2;
+			if ((nc = realloc(code->candidates,
+			    *candidates_size * sizeof(*nc))) == NULL)
+				logerrx("%s: realloc failed", __func__);
+			code->candidates = nc;
+		}
+		code->candidates[(*num_candidates)++] = i;
+		/* Nothing after an unconditional quick rule matters */
+		if (cr->quick && cr->num_terms == 0)
+			break;
 	}
+	code->cell_len[cell] = *num_candidates - code->cell_start[cell];
+}
 
-	if (FRMATCH(SRC_PORT)) {
-		m = (ntohs(flow->ports.src_port) == rule->match.src_port);
-		FRRET(SRC_PORT);
+static struct filter_prog *
+filter_prog_new(struct filter_code *code, int is_copy,
+    struct filter_list *list)
+{
+	struct filter_prog *prog;
+	struct filter_rule *fr;
+	u_int i;
+
+	if ((prog = calloc(1, sizeof(*prog))) == NULL)
+		logerrx("%s: calloc failed", __func__);
+	prog->code = code;
+	prog->is_copy = is_copy;
+	if ((prog->rules = calloc(code->num_rules + 1,
+	    sizeof(*prog->rules))) == NULL ||
+	    (prog->stops = calloc(code->num_rules + 1,
+	    sizeof(*prog->stops))) == NULL ||
+	    (prog->pred_gen = calloc(code->num_preds + 1,
+	    sizeof(*prog->pred_gen))) == NULL ||
+	    (prog->pred_val = calloc(code->num_preds + 1,
+	    sizeof(*prog->pred_val))) == NULL)
+		logerrx("%s: calloc failed", __func__);
+	i = 0;
+	TAILQ_FOREACH(fr, list, entry) {
+		if (i >= code->num_rules)
+			logerrx("%s: filter list doesn't match program",
+			    __func__);
+		prog->rules[i++] = fr;
 	}
+	if (i != code->num_rules)
+		logerrx("%s: filter list doesn't match program", __func__);
+	return (prog);
+}
 
-	if (FRMATCH(DST_PORT)) {
-		m = (ntohs(flow->ports.dst_port) == rule->match.dst_port);
-		FRRET(DST_PORT);
+/* Compile a filter list into a program that counts matches in its rules */
+struct filter_prog *
+filter_compile(struct filter_list *list)
+{
+	struct filter_code *code;
+	struct filter_crule *cr;
+	struct filter_rule *fr;
+	u_int i, n, pc, qc, num_ports, num_dst, num_src;
+	u_int preds_size, terms_size, num_candidates, candidates_size;
+	u_int8_t *seen;
+
+	if ((code = calloc(1, sizeof(*code))) == NULL)
+		logerrx("%s: calloc failed", __func__);
+	TAILQ_FOREACH(fr, list, entry)
+		code->num_rules++;
+	if ((code->rules = calloc(code->num_rules + 1,
+	    sizeof(*code->rules))) == NULL)
+		logerrx("%s: calloc failed", __func__);
+
+	/* Find the protocols and ports that rules require */
+	num_dst = num_src = 0;
+	i = 0;
+	TAILQ_FOREACH(fr, list, entry) {
+		cr = &code->rules[i++];
+		cr->quick = fr->quick;
+		cr->proto = cr->port = -1;
+#define FCPOS(what) \
+	((fr->match.match_what & FF_MATCH_##what) && \
+	    !(fr->match.match_negate & FF_MATCH_##what))
+		if (FCPOS(PROTOCOL)) {
+			if (fr->match.proto < 0 || fr->match.proto > 255)
+				cr->never = 1;
+			else
+				cr->proto = fr->match.proto;
+		}
+		if (FCPOS(DST_PORT)) {
+			if (fr->match.dst_port < 0 ||
+			    fr->match.dst_port > 65535)
+				cr->never = 1;
+			num_dst++;
+		}
+		if (FCPOS(SRC_PORT)) {
+			if (fr->match.src_port < 0 ||
+			    fr->match.src_port > 65535)
+				cr->never = 1;
+			num_src++;
+		}
+	}
+	code->num_proto_classes = 1;
+	for (i = 0; i < code->num_rules; i++) {
+		cr = &code->rules[i];
+		if (!cr->never && cr->proto != -1 &&
+		    code->proto_class[cr->proto] == 0)
+			code->proto_class[cr->proto] =
+			    code->num_proto_classes++;
 	}
 
-	if (FRMATCH(PROTOCOL)) {
-		m = (flow->pft.protocol == rule->match.proto);
-		FRRET(PROTOCOL);
+	/* Dispatch on whichever port more rules require */
+	if (num_dst != 0 || num_src != 0)
+		code->port_key = num_dst >= num_src ?
+		    FF_MATCH_DST_PORT : FF_MATCH_SRC_PORT;
+	code->num_port_classes = 1;
+	if (code->port_key != 0) {
+		if ((seen = calloc(65536, 1)) == NULL)
+			logerrx("%s: calloc failed", __func__);
+		num_ports = 0;
+		TAILQ_FOREACH(fr, list, entry) {
+			if (!(fr->match.match_what & code->port_key) ||
+			    (fr->match.match_negate & code->port_key))
+				continue;
+			n = code->port_key == FF_MATCH_DST_PORT ?
+			    fr->match.dst_port : fr->match.src_port;
+			if (n <= 65535 && !seen[n]) {
+				seen[n] = 1;
+				num_ports++;
+			}
+		}
+		free(seen);
+		if ((u_int64_t)code->num_proto_classes * (num_ports + 1) *
+		    code->num_rules > FILTER_MAX_CANDIDATES ||
+		    num_ports >= 0xffff)
+			code->port_key = 0;
 	}
+	if (code->port_key != 0) {
+		if ((code->port_class = calloc(65536,
+		    sizeof(*code->port_class))) == NULL)
+			logerrx("%s: calloc failed", __func__);
+		i = 0;
+		TAILQ_FOREACH(fr, list, entry) {
+			cr = &code->rules[i++];
+			if (!(fr->match.match_what & code->port_key) ||
+			    (fr->match.match_negate & code->port_key) ||
+			    cr->never)
+				continue;
+			cr->port = code->port_key == FF_MATCH_DST_PORT ?
+			    fr->match.dst_port : fr->match.src_port;
+			if (code->port_class[cr->port] == 0)
+				code->port_class[cr->port] =
+				    code->num_port_classes++;
+		}
+	}
+#undef FCPOS
 
-	if (FRMATCH(TOS)) {
-		m = (flow->pft.tos == rule->match.tos);
-		FRRET(TOS);
+	/* Each rule's remaining tests */
+	preds_size = terms_size = 0;
+	i = 0;
+	TAILQ_FOREACH(fr, list, entry) {
+		filter_compile_rule(code, &code->rules[i++], fr, &preds_size,
+		    &terms_size);
 	}
 
-	if (FRMATCH(TCP_FLAGS)) {
-		m = ((flow->pft.tcp_flags & rule->match.tcp_flags_mask) ==
-		    rule->match.tcp_flags_equals);
-		FRRET(TCP_FLAGS);
+	/* Candidate rules for each protocol and port class */
+	n = code->num_proto_classes * code->num_port_classes;
+	if ((code->cell_start = calloc(n, sizeof(*code->cell_start))) == NULL ||
+	    (code->cell_len = calloc(n, sizeof(*code->cell_len))) == NULL)
+		logerrx("%s: calloc failed (num %u)", __func__, n);
+	num_candidates = candidates_size = 0;
+	for (pc = 0; pc < code->num_proto_classes; pc++) {
+		for (qc = 0; qc < code->num_port_classes; qc++)
+			filter_compile_cell(code, pc, qc, &num_candidates,
+			    &candidates_size);
 	}
 
-	tt = ntohl(flow->recv_time.recv_sec);
+	logit(LOG_DEBUG, "%s: %u rules, %u predicates, %u protocol and %u "
+	    "%s port classes, %u candidates", __func__, code->num_rules,
+	    code->num_preds, code->num_proto_classes, code->num_port_classes,
+	    code->port_key == FF_MATCH_SRC_PORT ? "src" : "dst",
+	    num_candidates);
 
-	if (FRMATCH(DAYTIME)) {
-		m = flow_daytime_match(tt, rule->match.day_mask,
-		    rule->match.dayafter, rule->match.daybefore);
-		FRRET(DAYTIME);
-	}
-	if (FRMATCH(ABSTIME)) {
-		m = 1;
-		if (rule->match.absbefore > 0)
-			m &= tt < rule->match.absbefore;
-		if (rule->match.absafter > 0)
-			m &= tt > rule->match.absafter;
-		FRRET(ABSTIME);
-	}
+	return (filter_prog_new(code, 0, list));
+}
 
-#undef FRMATCH
-#undef FRNEG
-#undef FRRETVAL
-#undef FRRET
+/*
+ * Make a program for a copy of the list that "prog" was compiled from, so
+ * that it counts matches in the copy. It shares the original's code, so
+ * must be freed first.
+ */
+struct filter_prog *
+filter_prog_copy(struct filter_prog *prog, struct filter_list *copy)
+{
+	return (filter_prog_new(prog->code, 1, copy));
+}
 
-	return (1);
+/* Add the evaluations since the last sync to the rules' counters */
+void
+filter_prog_sync(struct filter_prog *prog)
+{
+	u_int64_t n;
+	u_int i;
+
+	n = prog->flows;
+	for (i = 0; i < prog->code->num_rules; i++) {
+		prog->rules[i]->evaluations += n;
+		n -= prog->stops[i];
+		prog->stops[i] = 0;
+	}
+	prog->flows = 0;
+}
+
+void
+filter_prog_free(struct filter_prog *prog)
+{
+	struct filter_code *code = prog->code;
+
+	if (!prog->is_copy) {
+		free(code->preds);
+		free(code->terms);
+		free(code->rules);
+		free(code->port_class);
+		free(code->cell_start);
+		free(code->cell_len);
+		free(code->candidates);
+		free(code);
+	}
+	free(prog->rules);
+	free(prog->stops);
+	free(prog->pred_gen);
+	free(prog->pred_val);
+	free(prog);
 }
 
 u_int
-filter_flow(struct store_flow_complete *flow, struct filter_list *filter)
+filter_flow(struct store_flow_complete *flow, struct filter_prog *prog)
 {
-	u_int action = FF_ACTION_ACCEPT;
+	const struct filter_code *code = prog->code;
+	const struct filter_crule *cr;
+	const struct filter_term *t, *end;
+	const u_int32_t *cand;
 	struct filter_rule *fr, *last_rule;
-	int i, m;
+	u_int action = FF_ACTION_ACCEPT;
+	u_int i, n, cell, p;
+	int m;
 
-	i = 0;
+	if (code->num_rules == 0)
+		return (action);
+
+	/* Forget the predicate results for the last flow */
+	if (++prog->gen == 0) {
+		bzero(prog->pred_gen, code->num_preds *
+		    sizeof(*prog->pred_gen));
+		prog->gen = 1;
+	}
+
+	cell = code->proto_class[flow->pft.protocol] * code->num_port_classes;
+	if (code->port_key == FF_MATCH_DST_PORT)
+		cell += code->port_class[ntohs(flow->ports.dst_port)];
+	else if (code->port_key == FF_MATCH_SRC_PORT)
+		cell += code->port_class[ntohs(flow->ports.src_port)];
+	cand = code->candidates + code->cell_start[cell];
+	n = code->cell_len[cell];
+
+	prog->flows++;
 	last_rule = NULL;
-	TAILQ_FOREACH(fr, filter, entry) {
-		m = flow_match(fr, flow);
-		fr->evaluations++;
+	for (i = 0; i < n; i++) {
+		cr = &code->rules[cand[i]];
+		m = 1;
+		end = code->terms + cr->first_term + cr->num_terms;
+		for (t = code->terms + cr->first_term; t < end; t++) {
+			p = t->pred;
+			if (prog->pred_gen[p] != prog->gen) {
+				prog->pred_val[p] = filter_pred_eval(
+				    &code->preds[p], flow);
+				prog->pred_gen[p] = prog->gen;
+			}
+			if (prog->pred_val[p] == t->negate) {
+				m = 0;
+				break;
+			}
+		}
+		fr = prog->rules[cand[i]];
 
 #ifdef FILTER_DEBUG
 		logit(LOG_DEBUG, "%s: match %s = %d action %d/%d", __func__,
@@ -326,8 +823,10 @@ filter_flow(struct store_flow_complete *flow, struct filter_list *filter)
 		if (m) {
 			fr->matches++;
 			last_rule = fr;
-			if (fr->quick)
+			if (cr->quick) {
+				prog->stops[cand[i]]++;
 				break;
+			}
 		}
 	}
 
@@ -350,3 +849,41 @@ filter_flow(struct store_flow_complete *flow, struct filter_list *filter)
 	return (action);
 }
 
+/*
+ * Make a private copy of a filter list with zeroed counters, so a worker
+ * thread can evaluate rules without sharing the counters with others.
+ */
+void
+filter_list_copy(struct filter_list *dst, struct filter_list *src)
+{
+	struct filter_rule *fr, *nfr;
+
+	TAILQ_INIT(dst);
+	TAILQ_FOREACH(fr, src, entry) {
+		if ((nfr = calloc(1, sizeof(*nfr))) == NULL)
+			logerrx("%s: calloc failed", __func__);
+		nfr->action = fr->action;
+		nfr->quick = fr->quick;
+		nfr->match = fr->match;
+		TAILQ_INSERT_TAIL(dst, nfr, entry);
+	}
+}
+
+/* Add the counters from a copy made by filter_list_copy() and free it */
+void
+filter_list_merge(struct filter_list *dst, struct filter_list *copy)
+{
+	struct filter_rule *fr, *cfr;
+
+	fr = TAILQ_FIRST(dst);
+	while ((cfr = TAILQ_FIRST(copy)) != NULL) {
+		if (fr != NULL) {
+			fr->evaluations += cfr->evaluations;
+			fr->matches += cfr->matches;
+			fr->wins += cfr->wins;
+			fr = TAILQ_NEXT(fr, entry);
+		}
+		TAILQ_REMOVE(copy, cfr, entry);
+		free(cfr);
+	}
+}
@@ -83,7 +83,17 @@ struct filter_rule {
 };
 TAILQ_HEAD(filter_list, filter_rule);
 
-u_int filter_flow(struct store_flow_complete *flow, struct filter_list *filter);
+/* A filter list compiled for matching, see filter.c */
+struct filter_prog;
+
+struct filter_prog *filter_compile(struct filter_list *list);
+struct filter_prog *filter_prog_copy(struct filter_prog *prog,
+    struct filter_list *copy);
+void filter_prog_sync(struct filter_prog *prog);
+void filter_prog_free(struct filter_prog *prog);
+u_int filter_flow(struct store_flow_complete *flow, struct filter_prog *prog);
 const char *format_rule(const struct filter_rule *rule);
+void filter_list_copy(struct filter_list *dst, struct filter_list *src);
+void filter_list_merge(struct filter_list *dst, struct filter_list *copy);
 
 #endif /* _FILTER_H */
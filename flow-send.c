@@ -0,0 +1,880 @@
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define PROGNAME	"flow-send"
+
+#include "flowd-common.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "flowd.h"
+#include "store.h"
+#include "netflow.h"
+
+RCSID("$Id$");
+
+/* Largest v.9 / IPFIX datagram that we will build; v.5 has its own limit */
+#define SEND_MAX_PACKET		1400
+#define SEND_BUF_SIZE		MAX(SEND_MAX_PACKET, NF5_MAXPACKET_SIZE)
+
+/* v.9 and IPFIX templates go in the first packet and then every this many */
+#define TEMPLATE_INTERVAL	64
+
+/* Datagrams handed to the kernel at once */
+#define SEND_BATCH		32
+
+/* Template IDs (and data flowset IDs) for each address family */
+#define TMPL_ID_INET		256
+#define TMPL_ID_INET6		257
+
+/* Exported packets are built for one address family each */
+#define SLOT_INET		0
+#define SLOT_INET6		1
+#define NUM_SLOTS		2
+
+/*
+ * The v.9 / IPFIX templates that we export; the information elements are
+ * numbered the same way in both. The flow times come first so that they
+ * are at the same offset in both templates.
+ */
+struct tmpl_field {
+	u_int16_t type, len;
+};
+static const struct tmpl_field tmpl_inet[] = {
+	{ NF9_FIRST_SWITCHED, 4 },	{ NF9_LAST_SWITCHED, 4 },
+	{ NF9_IN_BYTES, 8 },		{ NF9_IN_PACKETS, 8 },
+	{ NF9_IPV4_SRC_ADDR, 4 },	{ NF9_IPV4_DST_ADDR, 4 },
+	{ NF9_IPV4_NEXT_HOP, 4 },	{ NF9_INPUT_SNMP, 4 },
+	{ NF9_OUTPUT_SNMP, 4 },		{ NF9_SRC_AS, 4 },
+	{ NF9_DST_AS, 4 },		{ NF9_L4_SRC_PORT, 2 },
+	{ NF9_L4_DST_PORT, 2 },		{ NF9_IN_PROTOCOL, 1 },
+	{ NF9_TCP_FLAGS, 1 },		{ NF9_SRC_TOS, 1 },
+	{ NF9_SRC_MASK, 1 },		{ NF9_DST_MASK, 1 },
+};
+static const struct tmpl_field tmpl_inet6[] = {
+	{ NF9_FIRST_SWITCHED, 4 },	{ NF9_LAST_SWITCHED, 4 },
+	{ NF9_IN_BYTES, 8 },		{ NF9_IN_PACKETS, 8 },
+	{ NF9_IPV6_SRC_ADDR, 16 },	{ NF9_IPV6_DST_ADDR, 16 },
+	{ NF9_IPV6_NEXT_HOP, 16 },	{ NF9_INPUT_SNMP, 4 },
+	{ NF9_OUTPUT_SNMP, 4 },		{ NF9_SRC_AS, 4 },
+	{ NF9_DST_AS, 4 },		{ NF9_L4_SRC_PORT, 2 },
+	{ NF9_L4_DST_PORT, 2 },		{ NF9_IN_PROTOCOL, 1 },
+	{ NF9_TCP_FLAGS, 1 },		{ NF9_SRC_TOS, 1 },
+	{ NF9_IPV6_SRC_MASK, 1 },	{ NF9_IPV6_DST_MASK, 1 },
+};
+static const struct {
+	const struct tmpl_field *fields;
+	u_int nfields;
+	u_int16_t id;
+} templates[NUM_SLOTS] = {
+	{ tmpl_inet, sizeof(tmpl_inet) / sizeof(tmpl_inet[0]), TMPL_ID_INET },
+	{ tmpl_inet6, sizeof(tmpl_inet6) / sizeof(tmpl_inet6[0]),
+	    TMPL_ID_INET6 },
+};
+
+/*
+ * Flows are encoded once, when they are loaded, into packet bodies kept
+ * in one big arena. The flow times are stored relative to the time the
+ * flow was originally exported and are rebased onto our own uptime, along
+ * with the packet header, as each packet is sent.
+ */
+struct send_pkt {
+	size_t off;			/* Start of body in arena */
+	u_int16_t len;			/* Length of body */
+	u_int16_t nflows;
+	u_int slot;
+	u_int64_t t;			/* Original time (usec) or 0 if unknown */
+};
+
+struct send_state {
+	int version;
+	u_int max_flows;		/* Per packet */
+	u_int max_body;			/* Bytes of flow data per packet */
+	u_int32_t source_id;
+
+	/* Encoded packets */
+	u_int8_t *arena;
+	size_t arena_len, arena_alloc;
+	struct send_pkt *pkts;
+	u_int npkts, pkts_alloc;
+
+	/* Packets being filled, one per address family */
+	u_int8_t open_buf[NUM_SLOTS][SEND_BUF_SIZE];
+	u_int open_len[NUM_SLOTS], open_flows[NUM_SLOTS];
+	u_int64_t open_t[NUM_SLOTS];
+
+	/* Template flowset, prebuilt for v.9 and IPFIX */
+	u_int8_t tmpl_buf[512];
+	u_int tmpl_len;
+	u_int rec_len[NUM_SLOTS];
+
+	u_int32_t max_age;		/* Oldest flow time, ms before export */
+	u_int64_t nflows, nskipped;
+
+	/* Sequence numbers */
+	u_int32_t flow_seq, pkt_seq;
+};
+
+struct send_batch {
+	u_int8_t bufs[SEND_BATCH][SEND_BUF_SIZE];
+	struct iovec iov[SEND_BATCH];
+	u_int nflows[SEND_BATCH];
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr msgs[SEND_BATCH];
+#endif
+	u_int n;
+};
+
+struct send_stats {
+	u_int64_t packets, flows, bytes, errors;
+};
+
+static sig_atomic_t quit_flag = 0;
+
+static void
+sighand_quit(int signo)
+{
+	quit_flag = signo;
+	signal(signo, sighand_quit);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: %s [options] host port flow-log "
+	    "[flow-log ...]\n", PROGNAME);
+	fprintf(stderr, "This is %s version %s. Valid commandline options:\n",
+	    PROGNAME, PROGVER);
+	fprintf(stderr, "  -V version  Export NetFlow v.5, v.9 or IPFIX (10) (default: 5)\n");
+	fprintf(stderr, "  -r rate     Send at most 'rate' packets per second\n");
+	fprintf(stderr, "  -t factor   Follow the logged timing, sped up by 'factor'\n");
+	fprintf(stderr, "  -l loops    Send the flows 'loops' times, 0 = forever (default: 1)\n");
+	fprintf(stderr, "  -c num      Put at most 'num' flows in each packet\n");
+	fprintf(stderr, "  -s id       Set the v.9 source ID / IPFIX domain\n");
+	fprintf(stderr, "  -b bytes    Set the socket send buffer size\n");
+	fprintf(stderr, "  -d          Print debugging information\n");
+	fprintf(stderr, "  -h          Display this help\n");
+}
+
+/* Write the low "len" bytes of "v" in network byte order */
+static void
+put_be(u_int8_t *p, u_int64_t v, u_int len)
+{
+	while (len-- > 0) {
+		p[len] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+static u_int32_t
+get_be32(const u_int8_t *p)
+{
+	return ((u_int32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]);
+}
+
+/* Clamp a 64 bit counter to the 32 bits that NetFlow v.5 has */
+static u_int32_t
+clamp32(u_int64_t v)
+{
+	return (v > 0xffffffffULL ? 0xffffffff : v);
+}
+
+/* NetFlow v.5 has 16 bit AS numbers, use AS_TRANS for the rest */
+static u_int16_t
+clamp_as(u_int32_t as)
+{
+	return (as > 0xffff ? 23456 : as);
+}
+
+/* When the flow was originally received (or exported) in usec, or 0 */
+static u_int64_t
+flow_time(struct store_flow_complete *f, u_int32_t fields)
+{
+	if (fields & STORE_FIELD_RECV_TIME) {
+		return ((u_int64_t)ntohl(f->recv_time.recv_sec) * 1000000 +
+		    ntohl(f->recv_time.recv_usec));
+	}
+	if (fields & STORE_FIELD_AGENT_INFO) {
+		return ((u_int64_t)ntohl(f->ainfo.time_sec) * 1000000 +
+		    ntohl(f->ainfo.time_nanosec) / 1000);
+	}
+	return (0);
+}
+
+/*
+ * Flow start and finish times, relative (in ms, modulo 2^32) to the time
+ * that the flow was exported. They are zero if the log doesn't have them.
+ */
+static void
+flow_ages(struct send_state *ss, struct store_flow_complete *f,
+    u_int32_t fields, u_int32_t *start, u_int32_t *finish)
+{
+	u_int32_t uptime;
+
+	*start = *finish = 0;
+	if ((fields & STORE_FIELD_FLOW_TIMES) == 0 ||
+	    (fields & STORE_FIELD_AGENT_INFO) == 0)
+		return;
+	uptime = ntohl(f->ainfo.sys_uptime_ms);
+	*start = ntohl(f->ftimes.flow_start) - uptime;
+	*finish = ntohl(f->ftimes.flow_finish) - uptime;
+	/* Remember how far back we need the uptime to go */
+	if (-*start < 0x80000000U)
+		ss->max_age = MAX(ss->max_age, -*start);
+}
+
+/* Encode a flow as a NetFlow v.5 record */
+static void
+encode_v5(struct send_state *ss, struct store_flow_complete *f,
+    u_int32_t fields, u_int8_t *p)
+{
+	struct NF5_FLOW *nf = (struct NF5_FLOW *)p;
+	u_int32_t start, finish;
+
+	bzero(nf, sizeof(*nf));
+	memcpy(&nf->src_ip, &f->src_addr.v4, sizeof(nf->src_ip));
+	memcpy(&nf->dest_ip, &f->dst_addr.v4, sizeof(nf->dest_ip));
+	if (f->gateway_addr.af == AF_INET) {
+		memcpy(&nf->nexthop_ip, &f->gateway_addr.v4,
+		    sizeof(nf->nexthop_ip));
+	}
+	nf->if_index_in = htons(ntohl(f->ifndx.if_index_in));
+	nf->if_index_out = htons(ntohl(f->ifndx.if_index_out));
+	nf->flow_packets =
+	    htonl(clamp32(store_ntohll(f->packets.flow_packets)));
+	nf->flow_octets = htonl(clamp32(store_ntohll(f->octets.flow_octets)));
+	flow_ages(ss, f, fields, &start, &finish);
+	nf->flow_start = htonl(start);
+	nf->flow_finish = htonl(finish);
+	nf->src_port = f->ports.src_port;
+	nf->dest_port = f->ports.dst_port;
+	nf->tcp_flags = f->pft.tcp_flags;
+	nf->protocol = f->pft.protocol;
+	nf->tos = f->pft.tos;
+	nf->src_as = htons(clamp_as(ntohl(f->asinf.src_as)));
+	nf->dest_as = htons(clamp_as(ntohl(f->asinf.dst_as)));
+	nf->src_mask = f->asinf.src_mask;
+	nf->dst_mask = f->asinf.dst_mask;
+}
+
+/* Encode a flow as a record of one of our v.9 / IPFIX templates */
+static void
+encode_tmpl(struct send_state *ss, struct store_flow_complete *f,
+    u_int32_t fields, u_int slot, u_int8_t *p)
+{
+	const struct tmpl_field *tf;
+	u_int32_t start, finish;
+	u_int i, alen;
+
+	flow_ages(ss, f, fields, &start, &finish);
+	alen = slot == SLOT_INET ? 4 : 16;
+	for (i = 0; i < templates[slot].nfields; i++) {
+		tf = &templates[slot].fields[i];
+		switch (tf->type) {
+		case NF9_FIRST_SWITCHED:
+			put_be(p, start, tf->len);
+			break;
+		case NF9_LAST_SWITCHED:
+			put_be(p, finish, tf->len);
+			break;
+		case NF9_IN_BYTES:
+			put_be(p, store_ntohll(f->octets.flow_octets), tf->len);
+			break;
+		case NF9_IN_PACKETS:
+			put_be(p, store_ntohll(f->packets.flow_packets),
+			    tf->len);
+			break;
+		case NF9_IPV4_SRC_ADDR:
+		case NF9_IPV6_SRC_ADDR:
+			memcpy(p, &f->src_addr.xa, alen);
+			break;
+		case NF9_IPV4_DST_ADDR:
+		case NF9_IPV6_DST_ADDR:
+			memcpy(p, &f->dst_addr.xa, alen);
+			break;
+		case NF9_IPV4_NEXT_HOP:
+		case NF9_IPV6_NEXT_HOP:
+			if (f->gateway_addr.af == f->src_addr.af)
+				memcpy(p, &f->gateway_addr.xa, alen);
+			else
+				bzero(p, alen);
+			break;
+		case NF9_INPUT_SNMP:
+			put_be(p, ntohl(f->ifndx.if_index_in), tf->len);
+			break;
+		case NF9_OUTPUT_SNMP:
+			put_be(p, ntohl(f->ifndx.if_index_out), tf->len);
+			break;
+		case NF9_SRC_AS:
+			put_be(p, ntohl(f->asinf.src_as), tf->len);
+			break;
+		case NF9_DST_AS:
+			put_be(p, ntohl(f->asinf.dst_as), tf->len);
+			break;
+		case NF9_L4_SRC_PORT:
+			put_be(p, ntohs(f->ports.src_port), tf->len);
+			break;
+		case NF9_L4_DST_PORT:
+			put_be(p, ntohs(f->ports.dst_port), tf->len);
+			break;
+		case NF9_IN_PROTOCOL:
+			*p = f->pft.protocol;
+			break;
+		case NF9_TCP_FLAGS:
+			*p = f->pft.tcp_flags;
+			break;
+		case NF9_SRC_TOS:
+			*p = f->pft.tos;
+			break;
+		case NF9_SRC_MASK:
+		case NF9_IPV6_SRC_MASK:
+			*p = f->asinf.src_mask;
+			break;
+		case NF9_DST_MASK:
+		case NF9_IPV6_DST_MASK:
+			*p = f->asinf.dst_mask;
+			break;
+		}
+		p += tf->len;
+	}
+}
+
+/* Build the template flowset that precedes data when templates are due */
+static void
+build_templates(struct send_state *ss)
+{
+	const struct tmpl_field *tf;
+	u_int8_t *p = ss->tmpl_buf;
+	u_int i, j;
+
+	put_be(p, ss->version == 9 ? NF9_TEMPLATE_FLOWSET_ID :
+	    NF10_TEMPLATE_FLOWSET_ID, 2);
+	p += 4;
+	for (i = 0; i < NUM_SLOTS; i++) {
+		put_be(p, templates[i].id, 2);
+		put_be(p + 2, templates[i].nfields, 2);
+		p += 4;
+		ss->rec_len[i] = 0;
+		for (j = 0; j < templates[i].nfields; j++) {
+			tf = &templates[i].fields[j];
+			put_be(p, tf->type, 2);
+			put_be(p + 2, tf->len, 2);
+			p += 4;
+			ss->rec_len[i] += tf->len;
+		}
+	}
+	ss->tmpl_len = p - ss->tmpl_buf;
+	put_be(ss->tmpl_buf + 2, ss->tmpl_len, 2);
+}
+
+/* Move a filled packet body from its slot into the arena */
+static void
+finish_packet(struct send_state *ss, u_int slot)
+{
+	struct send_pkt *tmp;
+	u_int8_t *atmp;
+	size_t n;
+	u_int len;
+
+	if (ss->open_flows[slot] == 0)
+		return;
+	len = ss->open_len[slot];
+	if (ss->version != 5) {
+		/* Pad the flowset to a 32 bit boundary and set its length */
+		while (len & 3)
+			ss->open_buf[slot][len++] = 0;
+		put_be(ss->open_buf[slot] + 2, len, 2);
+	}
+
+	if (ss->npkts == ss->pkts_alloc) {
+		n = ss->pkts_alloc == 0 ? 1024 : ss->pkts_alloc * 2;
+		if ((tmp = realloc(ss->pkts, n * sizeof(*tmp))) == NULL)
+			logerrx("%s: realloc failed", __func__);
+		ss->pkts = tmp;
+		ss->pkts_alloc = n;
+	}
+	if (ss->arena_len + len > ss->arena_alloc) {
+		n = ss->arena_alloc == 0 ? 1024 * 1024 : ss->arena_alloc * 2;
+		if ((atmp = realloc(ss->arena, n)) == NULL)
+			logerrx("%s: realloc failed", __func__);
+		ss->arena = atmp;
+		ss->arena_alloc = n;
+	}
+	memcpy(ss->arena + ss->arena_len, ss->open_buf[slot], len);
+	ss->pkts[ss->npkts].off = ss->arena_len;
+	ss->pkts[ss->npkts].len = len;
+	ss->pkts[ss->npkts].nflows = ss->open_flows[slot];
+	ss->pkts[ss->npkts].slot = slot;
+	ss->pkts[ss->npkts].t = ss->open_t[slot];
+	ss->npkts++;
+	ss->arena_len += len;
+	ss->open_len[slot] = ss->open_flows[slot] = 0;
+}
+
+static void
+add_flow(struct send_state *ss, struct store_flow_complete *f)
+{
+	u_int32_t fields = ntohl(f->hdr.fields);
+	u_int slot, rlen, pad;
+
+	if (f->src_addr.af == AF_INET && f->dst_addr.af == AF_INET)
+		slot = SLOT_INET;
+	else if (f->src_addr.af == AF_INET6 && f->dst_addr.af == AF_INET6 &&
+	    ss->version != 5)
+		slot = SLOT_INET6;
+	else {
+		ss->nskipped++;
+		return;
+	}
+	if (ss->version == 5) {
+		rlen = sizeof(struct NF5_FLOW);
+		pad = 0;
+	} else {
+		rlen = ss->rec_len[slot];
+		pad = 3;
+	}
+
+	if (ss->open_flows[slot] == 0) {
+		/* v.9 and IPFIX bodies start with a data flowset header */
+		if (ss->version != 5) {
+			put_be(ss->open_buf[slot], templates[slot].id, 2);
+			ss->open_len[slot] = 4;
+		}
+		ss->open_t[slot] = flow_time(f, fields);
+	}
+	if (ss->version == 5)
+		encode_v5(ss, f, fields,
+		    ss->open_buf[slot] + ss->open_len[slot]);
+	else
+		encode_tmpl(ss, f, fields, slot,
+		    ss->open_buf[slot] + ss->open_len[slot]);
+	ss->open_len[slot] += rlen;
+	ss->open_flows[slot]++;
+	ss->nflows++;
+
+	/* Leave room for padding */
+	if (ss->open_flows[slot] == ss->max_flows ||
+	    ss->open_len[slot] + rlen + pad > ss->max_body)
+		finish_packet(ss, slot);
+}
+
+static void
+load_flows(struct send_state *ss, const char *path)
+{
+	struct store_flow_complete flow;
+	char ebuf[512];
+	int fd, r;
+
+	if (strcmp(path, "-") == 0)
+		fd = STDIN_FILENO;
+	else if ((fd = open(path, O_RDONLY)) == -1)
+		logerr("open(%s)", path);
+
+	for (;;) {
+		bzero(&flow, sizeof(flow));
+		r = store_get_flow(fd, &flow, ebuf, sizeof(ebuf));
+		if (r == STORE_ERR_EOF)
+			break;
+		else if (r != STORE_ERR_OK)
+			logerrx("%s: %s", path, ebuf);
+		add_flow(ss, &flow);
+	}
+	if (fd != STDIN_FILENO)
+		close(fd);
+}
+
+/* Assemble packet "sp" with a fresh header into "buf", returns its length */
+static u_int
+build_packet(struct send_state *ss, struct send_pkt *sp, u_int8_t *buf,
+    u_int32_t uptime, struct timeval *now)
+{
+	struct NF5_HEADER *nf5;
+	struct NF9_HEADER *nf9;
+	struct NF10_HEADER *nf10;
+	u_int8_t *body, *p;
+	u_int i, hlen, tlen, rlen, toff;
+
+	tlen = 0;
+	switch (ss->version) {
+	case 5:
+		hlen = sizeof(*nf5);
+		nf5 = (struct NF5_HEADER *)buf;
+		bzero(nf5, sizeof(*nf5));
+		nf5->c.version = htons(5);
+		nf5->c.flows = htons(sp->nflows);
+		nf5->uptime_ms = htonl(uptime);
+		nf5->time_sec = htonl(now->tv_sec);
+		nf5->time_nanosec = htonl(now->tv_usec * 1000);
+		nf5->flow_sequence = htonl(ss->flow_seq);
+		rlen = sizeof(struct NF5_FLOW);
+		toff = offsetof(struct NF5_FLOW, flow_start);
+		break;
+	case 9:
+		hlen = sizeof(*nf9);
+		if (ss->pkt_seq % TEMPLATE_INTERVAL == 0)
+			tlen = ss->tmpl_len;
+		nf9 = (struct NF9_HEADER *)buf;
+		nf9->c.version = htons(9);
+		nf9->c.flows = htons(sp->nflows + (tlen ? NUM_SLOTS : 0));
+		nf9->uptime_ms = htonl(uptime);
+		nf9->time_sec = htonl(now->tv_sec);
+		nf9->package_sequence = htonl(ss->pkt_seq);
+		nf9->source_id = htonl(ss->source_id);
+		rlen = ss->rec_len[sp->slot];
+		toff = 4;
+		break;
+	default:
+		hlen = sizeof(*nf10);
+		if (ss->pkt_seq % TEMPLATE_INTERVAL == 0)
+			tlen = ss->tmpl_len;
+		nf10 = (struct NF10_HEADER *)buf;
+		nf10->c.version = htons(10);
+		nf10->c.flows = htons(hlen + tlen + sp->len);
+		nf10->time_sec = htonl(now->tv_sec);
+		/* IPFIX counts data records, not messages */
+		nf10->package_sequence = htonl(ss->flow_seq);
+		nf10->source_id = htonl(ss->source_id);
+		rlen = ss->rec_len[sp->slot];
+		toff = 4;
+		break;
+	}
+	memcpy(buf + hlen, ss->tmpl_buf, tlen);
+	body = buf + hlen + tlen;
+	memcpy(body, ss->arena + sp->off, sp->len);
+
+	/* Rebase the flow times onto our uptime (both adjacent) */
+	for (i = 0, p = body + toff; i < sp->nflows; i++, p += rlen) {
+		put_be(p, get_be32(p) + uptime, 4);
+		put_be(p + 4, get_be32(p + 4) + uptime, 4);
+	}
+
+	ss->flow_seq += sp->nflows;
+	ss->pkt_seq++;
+	return (hlen + tlen + sp->len);
+}
+
+static void
+send_batch(int fd, struct send_batch *b, struct send_stats *st)
+{
+	u_int i, done;
+	int r;
+
+	for (done = 0; done < b->n;) {
+#ifdef HAVE_SENDMMSG
+		r = sendmmsg(fd, b->msgs + done, b->n - done, 0);
+#else
+		r = send(fd, b->iov[done].iov_base, b->iov[done].iov_len,
+		    0) == -1 ? -1 : 1;
+#endif
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			/* e.g. ECONNREFUSED from an earlier datagram */
+			if (st->errors++ == 0)
+				logit(LOG_WARNING, "send: %s", strerror(errno));
+			done++;
+			continue;
+		}
+		for (i = done; i < done + r; i++) {
+			st->packets++;
+			st->flows += b->nflows[i];
+			st->bytes += b->iov[i].iov_len;
+		}
+		done += r;
+	}
+	b->n = 0;
+}
+
+static u_int64_t
+usec_diff(struct timeval *start, struct timeval *end)
+{
+	return ((u_int64_t)(end->tv_sec - start->tv_sec) * 1000000 +
+	    end->tv_usec - start->tv_usec);
+}
+
+static void
+send_flows(struct send_state *ss, int fd, u_int64_t rate, double factor,
+    u_int loops, struct send_stats *st)
+{
+	struct send_batch *b;
+	struct send_pkt *sp;
+	struct timeval start, now;
+	struct timespec ts;
+	u_int64_t t0, due, elapsed, loop_start, sent;
+	u_int32_t uptime_base;
+	u_int i, loop;
+
+	if ((b = calloc(1, sizeof(*b))) == NULL)
+		logerrx("%s: calloc failed", __func__);
+	for (i = 0; i < SEND_BATCH; i++) {
+		b->iov[i].iov_base = b->bufs[i];
+#ifdef HAVE_SENDMMSG
+		b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+		b->msgs[i].msg_hdr.msg_iovlen = 1;
+#endif
+	}
+
+	/* The earliest time that any packet was seen, for -t */
+	for (t0 = 0, i = 0; i < ss->npkts; i++) {
+		if (ss->pkts[i].t != 0 && (t0 == 0 || ss->pkts[i].t < t0))
+			t0 = ss->pkts[i].t;
+	}
+	/* Pretend to have been up for long enough to cover the oldest flow */
+	uptime_base = ss->max_age + 1000;
+
+	gettimeofday(&start, NULL);
+	sent = 0;
+	for (loop = 0; quit_flag == 0 && (loops == 0 || loop < loops);
+	    loop++) {
+		gettimeofday(&now, NULL);
+		loop_start = usec_diff(&start, &now);
+		for (i = 0; quit_flag == 0 && i < ss->npkts;) {
+			sp = &ss->pkts[i];
+			due = 0;
+			if (rate != 0)
+				due = (sent * 1000000) / rate;
+			if (factor != 0 && sp->t != 0)
+				due = MAX(due, loop_start +
+				    (u_int64_t)((sp->t - t0) / factor));
+			gettimeofday(&now, NULL);
+			if ((elapsed = usec_diff(&start, &now)) < due) {
+				/* Ahead of schedule, get rid of what we have */
+				if (b->n > 0) {
+					send_batch(fd, b, st);
+					continue;
+				}
+				ts.tv_sec = (due - elapsed) / 1000000;
+				ts.tv_nsec = ((due - elapsed) % 1000000) * 1000;
+				nanosleep(&ts, NULL);
+				continue;
+			}
+			b->iov[b->n].iov_len = build_packet(ss, sp,
+			    b->bufs[b->n], uptime_base + elapsed / 1000, &now);
+			b->nflows[b->n] = sp->nflows;
+			if (++b->n == SEND_BATCH)
+				send_batch(fd, b, st);
+			sent++;
+			i++;
+		}
+	}
+	if (b->n > 0)
+		send_batch(fd, b, st);
+	free(b);
+}
+
+static int
+open_target(const char *host, const char *port, int bufsiz)
+{
+	struct addrinfo hints, *res, *ai;
+	int fd, r;
+
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	if ((r = getaddrinfo(host, port, &hints, &res)) != 0)
+		logerrx("%s port %s: %s", host, port, gai_strerror(r));
+	for (fd = -1, ai = res; ai != NULL; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype,
+		    ai->ai_protocol)) == -1)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd == -1)
+		logerr("Couldn't send to %s port %s", host, port);
+	if (bufsiz > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF,
+	    &bufsiz, sizeof(bufsiz)) == -1)
+		logit(LOG_WARNING, "setsockopt(SO_SNDBUF, %d): %s", bufsiz,
+		    strerror(errno));
+	return (fd);
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch, i, fd, debug, bufsiz;
+	extern char *optarg;
+	extern int optind;
+	struct send_state *ss;
+	struct send_stats st;
+	u_int64_t rate;
+	double factor, secs;
+	struct timeval start, end;
+	u_int loops, max_flows;
+	long count;
+	char *ep;
+
+	debug = bufsiz = 0;
+	rate = 0;
+	factor = 0;
+	loops = 1;
+	max_flows = 0;
+	if ((ss = calloc(1, sizeof(*ss))) == NULL) {
+		fprintf(stderr, "calloc failed\n");
+		exit(1);
+	}
+	ss->version = 5;
+
+	while ((ch = getopt(argc, argv, "V:b:c:dhl:r:s:t:")) != -1) {
+		switch (ch) {
+		case 'V':
+			if (strcmp(optarg, "ipfix") == 0)
+				ss->version = 10;
+			else
+				ss->version = atoi(optarg);
+			if (ss->version != 5 && ss->version != 9 &&
+			    ss->version != 10) {
+				fprintf(stderr, "Invalid -V value.\n");
+				usage();
+				exit(1);
+			}
+			break;
+		case 'b':
+			if ((bufsiz = atoi(optarg)) <= 0) {
+				fprintf(stderr, "Invalid -b value.\n");
+				usage();
+				exit(1);
+			}
+			break;
+		case 'c':
+			count = strtol(optarg, &ep, 10);
+			if (*optarg == '\0' || *ep != '\0' || count <= 0 ||
+			    count > 0xffff) {
+				fprintf(stderr, "Invalid -c value.\n");
+				usage();
+				exit(1);
+			}
+			max_flows = count;
+			break;
+		case 'd':
+			debug = 1;
+			break;
+		case 'h':
+			usage();
+			return (0);
+		case 'l':
+			loops = strtoul(optarg, &ep, 10);
+			if (*optarg == '\0' || *ep != '\0') {
+				fprintf(stderr, "Invalid -l value.\n");
+				usage();
+				exit(1);
+			}
+			break;
+		case 'r':
+			rate = strtoull(optarg, &ep, 10);
+			if (*optarg == '\0' || *ep != '\0' || rate == 0) {
+				fprintf(stderr, "Invalid -r value.\n");
+				usage();
+				exit(1);
+			}
+			break;
+		case 's':
+			ss->source_id = strtoul(optarg, &ep, 0);
+			if (*optarg == '\0' || *ep != '\0') {
+				fprintf(stderr, "Invalid -s value.\n");
+				usage();
+				exit(1);
+			}
+			break;
+		case 't':
+			factor = strtod(optarg, &ep);
+			if (*optarg == '\0' || *ep != '\0' || factor <= 0) {
+				fprintf(stderr, "Invalid -t value.\n");
+				usage();
+				exit(1);
+			}
+			break;
+		default:
+			usage();
+			exit(1);
+		}
+	}
+	loginit(PROGNAME, 1, debug);
+
+	if (argc - optind < 3) {
+		fprintf(stderr, "No target or logfile specified\n");
+		usage();
+		exit(1);
+	}
+
+	if (ss->version == 5) {
+		ss->max_flows = NF5_MAXFLOWS;
+		ss->max_body = NF5_MAXFLOWS * sizeof(struct NF5_FLOW);
+	} else {
+		build_templates(ss);
+		ss->max_flows = 0xffff;
+		ss->max_body = SEND_MAX_PACKET - ss->tmpl_len - MAX(
+		    sizeof(struct NF9_HEADER), sizeof(struct NF10_HEADER));
+	}
+	if (max_flows != 0)
+		ss->max_flows = MIN(ss->max_flows, max_flows);
+
+	for (i = optind + 2; i < argc; i++)
+		load_flows(ss, argv[i]);
+	for (i = 0; i < NUM_SLOTS; i++)
+		finish_packet(ss, i);
+	if (ss->npkts == 0)
+		logerrx("No flows to send");
+	logit(LOG_DEBUG, "Loaded %llu flows into %u packets, skipped %llu",
+	    (unsigned long long)ss->nflows, ss->npkts,
+	    (unsigned long long)ss->nskipped);
+	if (ss->nskipped > 0 && ss->version == 5)
+		logit(LOG_WARNING, "Skipped %llu IPv6 or incomplete flows",
+		    (unsigned long long)ss->nskipped);
+	else if (ss->nskipped > 0)
+		logit(LOG_WARNING, "Skipped %llu incomplete flows",
+		    (unsigned long long)ss->nskipped);
+
+	fd = open_target(argv[optind], argv[optind + 1], bufsiz);
+
+	signal(SIGINT, sighand_quit);
+	signal(SIGTERM, sighand_quit);
+
+	bzero(&st, sizeof(st));
+	gettimeofday(&start, NULL);
+	send_flows(ss, fd, rate, factor, loops, &st);
+	gettimeofday(&end, NULL);
+	secs = usec_diff(&start, &end) / 1000000.0;
+	if (secs <= 0)
+		secs = 0.000001;
+	close(fd);
+
+	logit(LOG_INFO, "Sent %llu packets (%llu flows, %llu bytes) in "
+	    "%.3f seconds, %llu errors", (unsigned long long)st.packets,
+	    (unsigned long long)st.flows, (unsigned long long)st.bytes, secs,
+	    (unsigned long long)st.errors);
+	logit(LOG_INFO, "%.0f packets/sec, %.0f flows/sec",
+	    st.packets / secs, st.flows / secs);
+
+	return (0);
+}
@@ -64,6 +64,13 @@
 # ifndef __packed
 #  define __packed		__attribute__((__packed__))
 # endif
+# ifndef __aligned
+#  define __aligned(x)		__attribute__((__aligned__(x)))
+# endif
+#else
+# ifndef __aligned
+#  define __aligned(x)
+# endif
 #endif
 
 /* Prototypes for absent friends */
@@ -84,6 +91,13 @@ void setproctitle(const char *, ...);
 int daemon(int nochdir, int noclose);
 #endif
 
+/* Per-thread storage for functions that return static buffers */
+#if defined(HAVE___THREAD)
+# define __tls			__thread
+#else
+# define __tls
+#endif
+
 #ifndef INFTIM
 # define INFTIM			(-1)
 #endif
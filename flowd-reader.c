@@ -51,6 +51,7 @@ usage(void)
 	fprintf(stderr, "  -v       Display all available flow information\n");
 	fprintf(stderr, "  -c       Return CSV output compatible with flow-import\n");
 	fprintf(stderr, "  -U       Report times in UTC rather than local time\n");
+	fprintf(stderr, "  -S       Scale up the counters of sampled flows\n");
 	fprintf(stderr, "  -h       Display this help\n");
 }
 
@@ -75,7 +76,7 @@ open_start_log(const char *path, int debug)
 int
 main(int argc, char **argv)
 {
-	int ch, i, fd, utc, r, verbose, debug, csv;
+	int ch, i, fd, utc, r, verbose, debug, csv, upscale;
 	extern char *optarg;
 	extern int optind;
 	struct store_flow_complete flow;
@@ -88,7 +89,7 @@ main(int argc, char **argv)
 	struct flowd_config filter_config;
 	struct store_v2_header hdr_v2;
 
-	utc = verbose = debug = read_legacy = csv = 0;
+	utc = verbose = debug = read_legacy = csv = upscale = 0;
 	ofile = ffile = NULL;
 	ofd = -1;
 	ffilef = NULL;
@@ -96,7 +97,7 @@ main(int argc, char **argv)
 
 	bzero(&filter_config, sizeof(filter_config));
 
-	while ((ch = getopt(argc, argv, "H:LUdf:ho:qvc")) != -1) {
+	while ((ch = getopt(argc, argv, "H:LSUdf:ho:qvc")) != -1) {
 		switch (ch) {
 		case 'h':
 			usage();
@@ -111,6 +112,9 @@ main(int argc, char **argv)
 		case 'L':
 			read_legacy = 1;
 			break;
+		case 'S':
+			upscale = 1;
+			break;
 		case 'U':
 			utc = 1;
 			break;
@@ -152,6 +156,8 @@ main(int argc, char **argv)
 		if (parse_config(ffile, ffilef, &filter_config, 1) != 0)
 			exit(1);
 		fclose(ffilef);
+		filter_config.filter_prog =
+		    filter_compile(&filter_config.filter_list);
 	}
 
 	if (ofile != NULL) {
@@ -219,8 +225,11 @@ main(int argc, char **argv)
 			    store_v2_flow_convert(&flow_v2, &flow) == -1)
 			    	logerrx("legacy flow conversion failed");
 
+			if (upscale)
+				store_flow_upscale(&flow);
+
 			if (ffile != NULL && filter_flow(&flow,
-			    &filter_config.filter_list) == FF_ACTION_DISCARD)
+			    filter_config.filter_prog) == FF_ACTION_DISCARD)
 				continue;
 			if (csv) {
 				store_format_flow_flowtools_csv(&flow, buf,
@@ -244,8 +253,10 @@ main(int argc, char **argv)
 	if (ofd != -1)
 		close(ofd);
 
-	if (ffile != NULL && debug)
+	if (ffile != NULL && debug) {
+		filter_prog_sync(filter_config.filter_prog);
 		dump_config(&filter_config, "final", 1);
+	}
 
 	return (0);
 }
@@ -17,9 +17,13 @@
 #include "flowd-common.h"
 
 #include <sys/types.h>
+#include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
+#include <stddef.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -30,16 +34,30 @@
 #include <stdio.h>
 #include <time.h>
 #include <poll.h>
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+#ifdef HAVE_SSSE3_DISPATCH
+# include <tmmintrin.h>
+#endif
 
 #include "sys-queue.h"
 #include "sys-tree.h"
 #include "flowd.h"
 #include "privsep.h"
 #include "netflow.h"
+#include "sflow.h"
 #include "store.h"
 #include "store-v2.h"
 #include "atomicio.h"
 #include "peer.h"
+#include "ring.h"
+#include "evloop.h"
+#include "capture.h"
+#include "crc32.h"
+#ifdef USE_IO_URING
+# include "uring.h"
+#endif
 
 RCSID("$Id$");
 
@@ -58,10 +76,6 @@ RCSID("$Id$");
 /* Prototype this (can't make it static because it only #ifdef DEBUG_UNKNOWN) */
 void dump_packet(const char *tag, const u_int8_t *p, int len);
 
-/* Unix domain socket error detection and reopen counters */
-static int logsock_first_error = 0;
-static int logsock_num_errors = 0;
-
 /* Flags set by signal handlers */
 static sig_atomic_t exit_flag = 0;
 static sig_atomic_t reconf_flag = 0;
@@ -71,93 +85,388 @@ static sig_atomic_t info_flag = 0;
 /* Input queue management */
 
 #define INPUT_MAX_PACKET_PER_FD		512
+#define INPUT_MAX_PACKET_SIZE		2048
 struct flow_packet {
-	TAILQ_ENTRY(flow_packet) entry;
 	struct timeval recv_time;
 	struct xaddr flow_source;
 	u_int len;
 	u_int8_t *packet;
 };
-TAILQ_HEAD(flow_packets, flow_packet);
 
-struct flow_packets input_queue = TAILQ_HEAD_INITIALIZER(input_queue);
+/*
+ * Fixed-size pool of packet descriptors and receive buffers. Free entries
+ * are kept on a stack so that recently used (cache-warm) buffers are
+ * handed out first. The pool bounds the amount of input we will hold;
+ * once it is empty we stop reading and leave datagrams in the kernel.
+ */
+struct packet_pool {
+	u_int size;			/* Number of packets in pool */
+	u_int nfree;			/* Number on freelist */
+	u_int high_water;		/* Most packets ever in use at once */
+	u_int64_t exhausted;		/* Reads stopped because pool empty */
+	size_t bufsize;			/* Size of each packet buffer */
+	struct flow_packet *packets;	/* Descriptors */
+	u_int8_t *slab;			/* Packet buffers */
+	struct flow_packet **freelist;
+#ifdef USE_IO_URING
+	struct uring *provider;		/* Free buffers belong to io_uring */
+#endif
+};
 
-/* Allocate a new packet (XXX: make this use a pool of preallocated entries) */
-static struct flow_packet
-*flow_packet_alloc(void)
-{
-	return (calloc(1, sizeof(struct flow_packet)));
-}
+/* Receive call statistics, reported on SIGUSR2 */
+struct recv_stats {
+	u_int64_t calls;	/* recvfrom/recvmmsg calls that returned data */
+	u_int64_t packets;	/* datagrams returned by those calls */
+	u_int64_t full;		/* recvmmsg calls that filled the vector */
+};
 
-/* Deallocate a flow packet (XXX: change to return entry to freelist) */
-static void
-flow_packet_dealloc(struct flow_packet *f)
-{
-	if (f->packet != NULL)
-		free(f->packet);
-	free(f);
-}
+/* Control message space for the receive timestamp and drop counter */
+union recv_cmsg {
+	struct cmsghdr hdr;
+	u_int8_t buf[CMSG_SPACE(sizeof(struct timeval)) +
+	    CMSG_SPACE(sizeof(u_int32_t))];
+};
+
+#ifdef HAVE_RECVMMSG
+/* Message vector for batched receives (see receive_batch()) */
+struct recv_vec {
+	u_int batch;
+	struct mmsghdr *msgs;
+	struct iovec *iov;
+	struct sockaddr_storage *from;
+	union recv_cmsg *ctl;
+	struct flow_packet **fps;
+};
+#endif
+
+/*
+ * Datagrams waiting to be forwarded to one "forward to" target. Each
+ * worker has its own queue per target, so that a slow target only ever
+ * costs us the datagrams that don't fit in its queue.
+ */
+#define FORWARD_QUEUE_LEN	512	/* Datagrams queued per target */
+#define FORWARD_BATCH		32	/* Send once this many are queued */
+
+struct fwd_queue {
+	struct forward_addr *fa;
+	u_int8_t *bufs;			/* FORWARD_QUEUE_LEN packet buffers */
+	struct iovec *iov;
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr *msgs;		/* One per buffer, for sendmmsg() */
+#endif
+	u_int head, depth;
+	u_int high_water;
+	u_int64_t sent, dropped, errors;
+};
+
+/* Output queue management */
+
+#define OUTPUT_INITIAL_QLEN	(1024*16)
+#define OUTPUT_MAX_QLEN		(1024*512) /* Must be 2^x multiple of initial */
+
+#ifdef USE_IO_URING
+/*
+ * Each provided buffer holds the recvmsg header, the source address, the
+ * receive timestamp and the datagram itself.
+ */
+#define URING_BUF_SIZE		(sizeof(struct io_uring_recvmsg_out) + \
+				 sizeof(struct sockaddr_storage) + \
+				 sizeof(union recv_cmsg) + \
+				 INPUT_MAX_PACKET_SIZE)
+#define URING_MAX_BUFS		32768
+#define URING_RX_ENTRIES	64
+#define URING_RX_CQ_ENTRIES	4096	/* Room for many datagrams per wakeup */
+#define URING_WR_ENTRIES	4
+#define URING_BGID		0
+#define URING_UD_CANCEL		((u_int64_t)-1)
+
+struct uring_listener {
+	struct listen_addr *la;
+	int armed;			/* Multishot receive is outstanding */
+};
+
+/*
+ * State for the io_uring backend, used in place of the event loop and
+ * synchronous writes when there is a single worker. Receives and log
+ * writes use separate rings, so that waiting for a write never has to
+ * deal with received packets.
+ */
+struct uring_state {
+	struct uring *rx, *wr;
+	struct msghdr msg;		/* Template for multishot recvmsg */
+	struct uring_listener *listeners;
+	u_int nlisteners;
+
+	/* Log write in flight and the output buffer it came from */
+	int busy;
+	int wfd;
+	off_t wstart;			/* File offset to rewind to on error */
+	u_int8_t *wbuf;
+	size_t walloc, wlen, woff;
+	u_int8_t *spare;		/* Free output buffer */
+	size_t spare_alloc;
+};
+#endif
+
+#ifdef PIPELINE_THREADS
+/* Fixed output buffers cycled between each decoder and the writer */
+#define PIPELINE_OUT_BUFS	32
+#define PIPELINE_OUT_BUFSIZE	(OUTPUT_INITIAL_QLEN * 4)
+
+struct out_buf {
+	u_int8_t *data;
+	size_t len;
+};
+#endif
+
+/*
+ * Everything needed to receive, decode and output flows. In the default
+ * single-threaded mode there is exactly one of these, driven directly by
+ * flowd_mainloop(). When "workers" is greater than one, each worker thread
+ * owns one of these along with its own listening sockets. Since the kernel
+ * steers each exporter to the same socket, each worker's peer state is
+ * a disjoint shard of the whole.
+ */
+struct worker {
+	u_int id;
+	struct flowd_config *conf;
+	struct peers *peers;
+	struct filter_prog *filter;	/* Filter rules used by this worker */
+	struct packet_pool pool;
+	struct recv_stats recv_stats;
+	struct evloop *ev;		/* Watches this worker's listeners */
+#ifdef USE_IO_URING
+	struct uring_state *ur;		/* io_uring backend, if in use */
+#endif
+#ifdef HAVE_RECVMMSG
+	struct recv_vec recv_vec;
+#endif
+	struct fwd_queue *fwd;		/* One per "forward to" target */
+	u_int nfwd;
+
+	/* Buffered output, flushed to the log file at the end of each loop */
+	u_int8_t *output_queue;
+	size_t output_queue_alloc;
+	size_t output_queue_offset;
+	size_t output_queue_max;
+	int log_fd, log_socket;
+
+	/* Unix domain socket error detection and reopen counters */
+	int logsock_first_error;
+	int logsock_num_errors;
+
+#ifdef WORKER_THREADS
+	pthread_t thread;
+	struct filter_list filter_copy;	/* Private copy with own counters */
+	struct filter_prog *filter_copy_prog;
+	int wake_sent;			/* Asked main thread to reopen logsock */
+#endif
+
+#ifdef PIPELINE_THREADS
+	/*
+	 * In pipeline mode, the worker's receive and decode stages run in
+	 * separate threads. Packets travel from the receiver to the decoder
+	 * on packet_ring and come back to the receiver's pool on free_ring.
+	 * Filled output buffers go to the writer thread on out_ring and
+	 * come back empty on ret_ring.
+	 */
+	pthread_t rx_thread;
+	struct doorbell rx_db, dec_db;
+	struct spsc_ring packet_ring, free_ring;
+	struct spsc_ring out_ring, ret_ring;
+	struct out_buf *out_bufs;
+	struct out_buf *cur_out;	/* Buffer being filled by decoder */
+	int rx_done;			/* Receiver has exited */
+#endif
+};
 
-/* Enqueue a flow packet in the input queue */
+static struct worker *workers = NULL;
+static u_int num_workers = 0;
+
+#ifdef WORKER_THREADS
+/* Keeps output from different workers' flushes from interleaving */
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Written to by the main thread to make workers exit */
+static int worker_stop_pipe[2] = { -1, -1 };
+
+/* Written to by workers to get the main thread's attention */
+static int worker_wake_pipe[2] = { -1, -1 };
+#endif
+
+#ifdef PIPELINE_THREADS
+/* Single writer thread shared by all pipelined workers */
+static pthread_t writer_thread;
+static struct doorbell writer_db;
+static int writer_done = 0;
+static u_int64_t writer_waits = 0;
+#endif
+
+/*
+ * (Re)initialise the packet pool with "size" entries of "bufsize" bytes.
+ * Must only be called when no packets are outstanding.
+ */
 static void
-flow_packet_enqueue(struct flow_packet *f)
+packet_pool_init(struct packet_pool *pool, u_int size, size_t bufsize)
 {
-	TAILQ_INSERT_TAIL(&input_queue, f, entry);
+	u_int i;
+
+	if (pool->size != 0 && pool->nfree != pool->size)
+		logerrx("%s: %u packets still in use", __func__,
+		    pool->size - pool->nfree);
+
+	free(pool->packets);
+	free(pool->slab);
+	free(pool->freelist);
+	bzero(pool, sizeof(*pool));
+
+	if ((pool->packets = calloc(size, sizeof(*pool->packets))) == NULL ||
+	    (pool->slab = calloc(size, bufsize)) == NULL ||
+	    (pool->freelist = calloc(size, sizeof(*pool->freelist))) == NULL)
+		logerrx("%s: calloc failed (size %u)", __func__, size);
+
+	pool->size = size;
+	pool->bufsize = bufsize;
+	for (i = 0; i < size; i++) {
+		pool->packets[i].packet = pool->slab + (i * bufsize);
+		/* Hand out low entries first */
+		pool->freelist[size - i - 1] = &pool->packets[i];
+	}
+	pool->nfree = size;
+	logit(LOG_DEBUG, "%s: %u packets", __func__, size);
 }
 
-/* Pull the first flow packet off the queue */
+/* Allocate a new packet from the pool, returns NULL if pool is empty */
 static struct flow_packet
-*flow_packet_dequeue(void)
+*flow_packet_alloc(struct packet_pool *pool)
 {
 	struct flow_packet *f;
+	u_int used;
+
+	if (pool->nfree == 0)
+		return (NULL);
+	f = pool->freelist[--pool->nfree];
+	used = pool->size - pool->nfree;
+	if (used > pool->high_water)
+		pool->high_water = used;
+	f->len = 0;
+	return (f);
+}
 
-	if ((f = TAILQ_FIRST(&input_queue)) != NULL)
-		TAILQ_REMOVE(&input_queue, f, entry);
+#ifdef USE_IO_URING
+/* Take the packet whose buffer the kernel picked from the provided ring */
+static struct flow_packet *
+flow_packet_claim(struct packet_pool *pool, u_int bid)
+{
+	struct flow_packet *f;
+	u_int used;
+
+	if (bid >= pool->size || pool->nfree == 0)
+		logerrx("%s: bad buffer id %u", __func__, bid);
+	f = &pool->packets[bid];
+	pool->nfree--;
+	used = pool->size - pool->nfree;
+	if (used > pool->high_water)
+		pool->high_water = used;
 	return (f);
 }
+#endif
 
-/* Output queue management */
+/* Return a flow packet to the pool */
+static void
+flow_packet_dealloc(struct packet_pool *pool, struct flow_packet *f)
+{
+#ifdef USE_IO_URING
+	u_int bid;
+
+	/* Hand the buffer straight back to the kernel */
+	if (pool->provider != NULL) {
+		bid = f - pool->packets;
+		f->packet = pool->slab + (bid * pool->bufsize);
+		uring_buf_add(pool->provider, f->packet, pool->bufsize, bid);
+		uring_buf_commit(pool->provider);
+		pool->nfree++;
+		return;
+	}
+#endif
+	if (pool->nfree >= pool->size)
+		logerrx("%s: pool overflow", __func__);
+	pool->freelist[pool->nfree++] = f;
+}
 
-#define OUTPUT_INITIAL_QLEN	(1024*16)
-#define OUTPUT_MAX_QLEN		(1024*512) /* Must be 2^x multiple of initial */
-u_int8_t *output_queue = NULL;
-size_t output_queue_alloc = 0;
-size_t output_queue_offset = 0;
+#ifdef PIPELINE_THREADS
+/* Make "ob" the buffer that output_flow_enqueue() fills */
+static void
+output_buf_use(struct worker *w, struct out_buf *ob)
+{
+	w->cur_out = ob;
+	w->output_queue = ob->data;
+	w->output_queue_alloc = w->output_queue_max = PIPELINE_OUT_BUFSIZE;
+	w->output_queue_offset = 0;
+}
+
+/*
+ * Pass the current output buffer to the writer thread and take an empty
+ * one in its place, waiting for the writer if none are free.
+ */
+static void
+output_buf_handoff(struct worker *w)
+{
+	struct out_buf *ob = w->cur_out;
+	int stalled = 0;
+
+	ob->len = w->output_queue_offset;
+	if (ring_push(&w->out_ring, ob) == -1)
+		logerrx("%s: output ring full", __func__);
+	while ((ob = ring_pop(&w->ret_ring)) == NULL) {
+		doorbell_arm(&w->dec_db);
+		if (ring_depth(&w->ret_ring) != 0) {
+			doorbell_disarm(&w->dec_db);
+			continue;
+		}
+		if (!stalled)
+			w->out_ring.stalls++;
+		stalled = 1;
+		doorbell_wait(&w->dec_db, -1);
+	}
+	output_buf_use(w, ob);
+}
+#endif /* PIPELINE_THREADS */
 
 /* Enqueue a flow for output, return 0 on success, -1 on queue full */
 static int
-output_flow_enqueue(u_int8_t *f, size_t len, int verbose)
+output_flow_enqueue(struct worker *w, u_int8_t *f, size_t len, int verbose)
 {
 	/* Force flush on overflow */
-	if (output_queue_offset + len > OUTPUT_MAX_QLEN) {
+	if (w->output_queue_offset + len > w->output_queue_max) {
 		logit(LOG_DEBUG, "%s: output queue full", __func__);
 		return (-1);
 	}
 
-	if (output_queue == NULL) {
-		output_queue_alloc = OUTPUT_INITIAL_QLEN;
-		if ((output_queue = malloc(output_queue_alloc)) == NULL) {
+	if (w->output_queue == NULL) {
+		w->output_queue_alloc = OUTPUT_INITIAL_QLEN;
+		if ((w->output_queue = malloc(w->output_queue_alloc)) == NULL) {
 			logerrx("Output queue allocation (%zu bytes) failed",
-			    output_queue_alloc);
+			    w->output_queue_alloc);
 		}
 		if (verbose) {
 			logit(LOG_DEBUG, "%s: initial allocation %zu", __func__,
-			    output_queue_alloc);
+			    w->output_queue_alloc);
 		}
 	}
-	
-	while (output_queue_offset + len > output_queue_alloc) {
+
+	while (w->output_queue_offset + len > w->output_queue_alloc) {
 		u_int8_t *tmp_q;
-		size_t tmp_len = output_queue_alloc << 1;
+		size_t tmp_len = w->output_queue_alloc << 1;
 
 		/* This should never happen if max = initial * 2^x */
-		if (tmp_len > OUTPUT_MAX_QLEN) {
+		if (tmp_len > w->output_queue_max) {
 			logit(LOG_DEBUG, "%s: oops, tmp_len (%zu) > "
-			    "OUTPUT_MAX_QLEN (%u)", __func__, tmp_len,
-			    OUTPUT_MAX_QLEN);
+			    "output_queue_max (%zu)", __func__, tmp_len,
+			    w->output_queue_max);
 			return (-1);
 		}
-		if ((tmp_q = realloc(output_queue, tmp_len)) == NULL) {
+		if ((tmp_q = realloc(w->output_queue, tmp_len)) == NULL) {
 			logit(LOG_DEBUG, "%s: realloc of %zu fail", __func__,
 			    tmp_len);
 			return (-1);
@@ -165,42 +474,163 @@ output_flow_enqueue(u_int8_t *f, size_t len, int verbose)
 		if (verbose) {
 			logit(LOG_DEBUG, "%s: increased output queue "
 			    "from %zuKB to %zuKB", __func__,
-			    output_queue_alloc >> 10, tmp_len >> 10);
+			    w->output_queue_alloc >> 10, tmp_len >> 10);
 		}
-		output_queue = tmp_q;
-		output_queue_alloc = tmp_len;
+		w->output_queue = tmp_q;
+		w->output_queue_alloc = tmp_len;
 	}
-	memcpy(output_queue + output_queue_offset, f, len);
-	output_queue_offset += len;
+	memcpy(w->output_queue + w->output_queue_offset, f, len);
+	w->output_queue_offset += len;
 	if (verbose) {
 		logit(LOG_DEBUG, "%s: offset %zu alloc %zu", __func__,
-		    output_queue_offset, output_queue_alloc);
+		    w->output_queue_offset, w->output_queue_alloc);
 	}
-	
+
 	return (0);
 }
 
+#ifdef USE_IO_URING
+/* Submit a write of whatever remains of the output buffer in flight */
+static void
+uring_write_submit(struct uring_state *us)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_get_sqe(us->wr)) == NULL)
+		logerrx("%s: submission queue full", __func__);
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = us->wfd;
+	sqe->addr = (u_int64_t)(uintptr_t)(us->wbuf + us->woff);
+	sqe->len = us->wlen - us->woff;
+	sqe->off = (u_int64_t)-1;	/* Use and update the file position */
+	if (uring_submit(us->wr, 0) == -1)
+		logerr("%s: io_uring_enter", __func__);
+	us->busy = 1;
+}
+
+/* Wait for the log write in flight (if any) to complete */
+static void
+uring_write_wait(struct uring_state *us)
+{
+	struct io_uring_cqe *cqe;
+	int res;
+
+	while (us->busy) {
+		if ((cqe = uring_peek_cqe(us->wr)) == NULL) {
+			if (uring_submit(us->wr, 1) == -1)
+				logerr("%s: io_uring_enter", __func__);
+			continue;
+		}
+		res = cqe->res;
+		uring_cqe_seen(us->wr);
+		if (res > 0 && (us->woff += res) < us->wlen) {
+			uring_write_submit(us);
+			continue;
+		}
+		if (res <= 0) {
+			/* Back out any partial flow record, as store_put_buf() */
+			if (us->wstart == -1)
+				logerrx("%s: corrupting failure on pipe",
+				    __func__);
+			if (lseek(us->wfd, us->wstart, SEEK_SET) == -1 ||
+			    ftruncate(us->wfd, us->wstart) == -1)
+				logerr("%s: corrupting failure on rewind",
+				    __func__);
+			logerrx("%s: exiting on write flow: %s", __func__,
+			    res == 0 ? "EOF" : strerror(-res));
+		}
+		us->busy = 0;
+		us->spare = us->wbuf;
+		us->spare_alloc = us->walloc;
+		us->wbuf = NULL;
+	}
+}
+
+/*
+ * Hand the output queue to the kernel to write in the background and
+ * carry on with the spare buffer, so decoding overlaps the log write.
+ */
+static void
+uring_write_start(struct worker *w)
+{
+	struct uring_state *us = w->ur;
+
+	uring_write_wait(us);
+	us->wfd = w->log_fd;
+	us->wstart = lseek(w->log_fd, 0, SEEK_CUR);
+	us->wbuf = w->output_queue;
+	us->walloc = w->output_queue_alloc;
+	us->wlen = w->output_queue_offset;
+	us->woff = 0;
+	w->output_queue = us->spare;
+	w->output_queue_alloc = us->spare_alloc;
+	w->output_queue_offset = 0;
+	us->spare = NULL;
+	us->spare_alloc = 0;
+	uring_write_submit(us);
+}
+#endif
+
+/* Wait until everything handed to output_flow_flush() is on disk */
+static void
+output_flow_sync(struct worker *w)
+{
+#ifdef USE_IO_URING
+	if (w->ur != NULL)
+		uring_write_wait(w->ur);
+#endif
+}
+
 static void
-output_flow_flush(int log_fd, int verbose)
+output_flow_flush(struct worker *w, int verbose)
 {
 	char ebuf[512];
+	int r;
 
-	if (log_fd == -1)
+	if (w->log_fd == -1)
 		return;
 
 	if (verbose) {
 		logit(LOG_DEBUG, "%s: flushing output queue len %zu", __func__,
-		    output_queue_offset);
+		    w->output_queue_offset);
 	}
 
-	if (output_queue_offset == 0)
+	if (w->output_queue_offset == 0)
 		return;
-	
-	if (store_put_buf(log_fd, output_queue, output_queue_offset, ebuf,
-	    sizeof(ebuf)) != STORE_ERR_OK)
+
+#ifdef PIPELINE_THREADS
+	if (w->conf->opts & FLOWD_OPT_PIPELINE) {
+		output_buf_handoff(w);
+		return;
+	}
+#endif
+#ifdef USE_IO_URING
+	if (w->ur != NULL) {
+		uring_write_start(w);
+		return;
+	}
+#endif
+
+#ifdef WORKER_THREADS
+	pthread_mutex_lock(&writer_lock);
+#endif
+	r = store_put_buf(w->log_fd, w->output_queue, w->output_queue_offset,
+	    ebuf, sizeof(ebuf));
+#ifdef WORKER_THREADS
+	pthread_mutex_unlock(&writer_lock);
+#endif
+	if (r != STORE_ERR_OK)
 		logerrx("%s: exiting on %s", __func__, ebuf);
 
-	output_queue_offset = 0;
+	w->output_queue_offset = 0;
+}
+
+/* Returns non-zero if errors on the log socket warrant reopening it */
+static int
+logsock_need_reopen(struct worker *w)
+{
+	return (w->logsock_num_errors > LOGSOCK_REOPEN_ERROR_COUNT &&
+	    time(NULL) > w->logsock_first_error + LOGSOCK_REOPEN_DELAY);
 }
 
 /* Signal handlers */
@@ -237,7 +667,7 @@ sighand_info(int signo)
 static const char *
 data_ntoa(const u_int8_t *p, int len)
 {
-	static char buf[2048];
+	static __tls char buf[2048];
 	char tmp[3];
 	int i;
 
@@ -263,18 +693,13 @@ dump_packet(const char *tag, const u_int8_t *p, int len)
 	}
 }
 
+/* Don't try to write a v.3 log on the end of a v.2 one */
 static int
-start_log(int monitor_fd)
+check_log(int fd)
 {
-	int fd;
 	off_t r;
 	char ebuf[512];
 
-	if ((fd = client_open_log(monitor_fd)) == -1)
-		logerrx("Logfile open failed, exiting");
-
-	/* Don't try to write a v.3 log on the end of a v.2 one */
-
 	r = lseek(fd, 0, SEEK_END);
 
 	/*
@@ -310,6 +735,17 @@ start_log(int monitor_fd)
 	return (-1);
 }
 
+static int
+start_log(int monitor_fd)
+{
+	int fd;
+
+	if ((fd = client_open_log(monitor_fd)) == -1)
+		logerrx("Logfile open failed, exiting");
+
+	return (check_log(fd));
+}
+
 static int
 start_socket(int monitor_fd)
 {
@@ -322,7 +758,7 @@ start_socket(int monitor_fd)
 
 static void
 process_flow(struct store_flow_complete *flow, struct flowd_config *conf,
-    int log_fd, int log_socket)
+    struct worker *w)
 {
 	char ebuf[512], fbuf[1024];
 	int flen;
@@ -340,7 +776,10 @@ process_flow(struct store_flow_complete *flow, struct flowd_config *conf,
 	flow->recv_time.recv_sec = htonl(flow->recv_time.recv_sec);
 	flow->recv_time.recv_usec = htonl(flow->recv_time.recv_usec);
 
-	filtres = filter_flow(flow, &conf->filter_list);
+	if (conf->opts & FLOWD_OPT_UPSCALE)
+		store_flow_upscale(flow);
+
+	filtres = filter_flow(flow, w->filter);
 	if (conf->opts & FLOWD_OPT_VERBOSE) {
 		char fmtbuf[1024];
 
@@ -357,45 +796,119 @@ process_flow(struct store_flow_complete *flow, struct flowd_config *conf,
 	    sizeof(fbuf), &flen, ebuf, sizeof(ebuf)) != STORE_ERR_OK)
 		logerrx("%s: exiting on %s", __func__, ebuf);
 
-	if (log_fd != -1 && output_flow_enqueue(fbuf, flen,
+	if (w->log_fd != -1 && output_flow_enqueue(w, fbuf, flen,
 	    conf->opts & FLOWD_OPT_VERBOSE) == -1) {
-		output_flow_flush(log_fd, conf->opts & FLOWD_OPT_VERBOSE);
+		output_flow_flush(w, conf->opts & FLOWD_OPT_VERBOSE);
 		/* Must not fail after flush */
-		if (output_flow_enqueue(fbuf, flen,
+		if (output_flow_enqueue(w, fbuf, flen,
 		    conf->opts & FLOWD_OPT_VERBOSE) == -1)
 			logerrx("%s: enqueue failed after flush", __func__);
 	}
 
 	/* Track failures to send on log socket so we can reopen it */
-	if (log_socket != -1 && send(log_socket, fbuf, flen, 0) == -1) {
-		if (logsock_num_errors > 0 &&
-		    (logsock_num_errors % 10) == 0) {
+	if (w->log_socket != -1 && send(w->log_socket, fbuf, flen, 0) == -1) {
+		if (w->logsock_num_errors > 0 &&
+		    (w->logsock_num_errors % 10) == 0) {
 			logit(LOG_WARNING, "log socket send: %s "
 			    "(num errors %d)", strerror(errno),
-			    logsock_num_errors);
+			    w->logsock_num_errors);
 		}
 		if (errno != ENOBUFS) {
-			if (logsock_first_error == 0)
-				logsock_first_error = time(NULL);
-			logsock_num_errors++;
+			if (w->logsock_first_error == 0)
+				w->logsock_first_error = time(NULL);
+			w->logsock_num_errors++;
 		}
 	} else {
 		/* Start to disregard errors after success */
-		if (logsock_num_errors > 0)
-			logsock_num_errors--;
-		if (logsock_num_errors == 0)
-			logsock_first_error = 0;
+		if (w->logsock_num_errors > 0)
+			w->logsock_num_errors--;
+		if (w->logsock_num_errors == 0)
+			w->logsock_first_error = 0;
 	}
 
 	/* XXX reopen log file on one failure, exit on multiple */
 }
 
+/*
+ * An exporter's clock when it sent a packet, corrected for its skew. The
+ * flows in the packet are timed relative to its uptime, except in IPFIX.
+ */
+struct export_clock {
+	int64_t export_ms;		/* Corrected, ms since the epoch */
+	int64_t skew_ms;
+	u_int32_t uptime_ms;
+	int has_uptime;
+};
+
+static void
+export_clock(struct export_clock *clk, struct peer_state *peer,
+    const struct timeval *tv, u_int32_t time_sec, u_int32_t time_nanosec,
+    u_int32_t uptime_ms, int has_uptime)
+{
+	int64_t recv_ms;
+
+	recv_ms = (int64_t)tv->tv_sec * 1000 + tv->tv_usec / 1000;
+	clk->export_ms = (int64_t)time_sec * 1000 + time_nanosec / 1000000;
+	clk->skew_ms = peer_skew(peer, recv_ms - clk->export_ms);
+	clk->export_ms += clk->skew_ms;
+	clk->uptime_ms = uptime_ms;
+	clk->has_uptime = has_uptime;
+}
+
+/*
+ * Correct an absolute time from a data record. The IPFIX flowStartSeconds
+ * and flowStartMilliseconds fields (and their flowEnd counterparts) are
+ * decoded into the same place; times in seconds fit in 32 bits, and times
+ * in milliseconds since 1970 don't.
+ */
+static u_int64_t
+abs_time_ms(u_int64_t t, int64_t skew_ms)
+{
+	if (t == 0)
+		return (0);
+	if (t <= 0xffffffffULL)
+		t *= 1000;
+	return (t + skew_ms);
+}
+
+/*
+ * Work out the absolute start and finish times of a flow from its packet's
+ * export clock, so that readers don't have to.
+ */
+static void
+flow_abs_times(struct store_flow_complete *flow,
+    const struct export_clock *clk)
+{
+	u_int64_t start, finish;
+
+	if ((flow->hdr.fields & STORE_FIELD_ABS_TIMES) != 0) {
+		start = abs_time_ms(store_ntohll(flow->atimes.flow_start_ms),
+		    clk->skew_ms);
+		finish = abs_time_ms(store_ntohll(flow->atimes.flow_finish_ms),
+		    clk->skew_ms);
+	} else if ((flow->hdr.fields & STORE_FIELD_FLOW_TIMES) != 0 &&
+	    clk->has_uptime) {
+		/* Flow times may be from before the uptime last wrapped */
+		start = clk->export_ms - (int32_t)(clk->uptime_ms -
+		    ntohl(flow->ftimes.flow_start));
+		finish = clk->export_ms - (int32_t)(clk->uptime_ms -
+		    ntohl(flow->ftimes.flow_finish));
+		flow->hdr.fields |= STORE_FIELD_ABS_TIMES;
+	} else
+		return;
+
+	flow->atimes.flow_start_ms = store_htonll(start);
+	flow->atimes.flow_finish_ms = store_htonll(finish);
+	flow->atimes.skew_ms = store_htonll(clk->skew_ms);
+}
+
 static void
 process_netflow_v1(struct flow_packet *fp, struct flowd_config *conf,
-    struct peer_state *peer, struct peers *peers, int log_fd, int log_socket)
+    struct peer_state *peer, struct worker *w)
 {
 	struct NF1_HEADER *nf1_hdr = (struct NF1_HEADER *)fp->packet;
 	struct NF1_FLOW *nf1_flow;
+	struct export_clock clk;
 	struct store_flow_complete flow;
 	size_t offset;
 	u_int i, nflows;
@@ -423,7 +936,10 @@ process_netflow_v1(struct flow_packet *fp, struct flowd_config *conf,
 	}
 
 	logit(LOG_DEBUG, "Valid netflow v.1 packet %d flows", nflows);
-	update_peer(peers, peer, nflows, 1);
+	update_peer(w->peers, peer, nflows, 1,
+	    &fp->recv_time);
+	export_clock(&clk, peer, &fp->recv_time, ntohl(nf1_hdr->time_sec),
+	    ntohl(nf1_hdr->time_nanosec), ntohl(nf1_hdr->uptime_ms), 1);
 
 	for (i = 0; i < nflows; i++) {
 		offset = NF1_PACKET_SIZE(i);
@@ -438,6 +954,8 @@ process_netflow_v1(struct flow_packet *fp, struct flowd_config *conf,
 		flow.hdr.fields &= ~STORE_FIELD_SRC_ADDR6;
 		flow.hdr.fields &= ~STORE_FIELD_DST_ADDR6;
 		flow.hdr.fields &= ~STORE_FIELD_GATEWAY_ADDR6;
+		flow.hdr.fields &= ~STORE_FIELD_SAMPLING;
+		flow.hdr.fields &= ~STORE_FIELD_ABS_TIMES;
 		flow.hdr.fields &= ~STORE_FIELD_AS_INFO;
 		flow.hdr.fields &= ~STORE_FIELD_FLOW_ENGINE_INFO;
 
@@ -476,20 +994,134 @@ process_netflow_v1(struct flow_packet *fp, struct flowd_config *conf,
 
 		flow.ftimes.flow_start = nf1_flow->flow_start;
 		flow.ftimes.flow_finish = nf1_flow->flow_finish;
+		flow_abs_times(&flow, &clk);
+
+		process_flow(&flow, conf, w);
+	}
+}
+
+/*
+ * Every field in a NetFlow v.5 record is either copied as-is or
+ * zero-extended in network byte order, so decoding a record is only a
+ * matter of moving bytes. Flows are built on "base", which holds the
+ * fields from the packet header and zeroes everywhere else.
+ */
+static void
+nf5_decode_flows(const struct NF5_FLOW *nf5_flow, u_int nflows,
+    const struct store_flow_complete *base, struct store_flow_complete *flows)
+{
+	u_int i;
+
+	for (i = 0; i < nflows; i++, nf5_flow++, flows++) {
+		memcpy(flows, base, sizeof(*flows));
+
+		flows->pft.tcp_flags = nf5_flow->tcp_flags;
+		flows->pft.protocol = nf5_flow->protocol;
+		flows->pft.tos = nf5_flow->tos;
+
+		flows->src_addr.v4.s_addr = nf5_flow->src_ip;
+		flows->dst_addr.v4.s_addr = nf5_flow->dest_ip;
+		flows->gateway_addr.v4.s_addr = nf5_flow->nexthop_ip;
+
+		flows->ports.src_port = nf5_flow->src_port;
+		flows->ports.dst_port = nf5_flow->dest_port;
+
+#define NTO64(a) (store_htonll(ntohl(a)))
+		flows->octets.flow_octets = NTO64(nf5_flow->flow_octets);
+		flows->packets.flow_packets = NTO64(nf5_flow->flow_packets);
+#undef NTO64
+
+		flows->ifndx.if_index_in = htonl(ntohs(nf5_flow->if_index_in));
+		flows->ifndx.if_index_out =
+		    htonl(ntohs(nf5_flow->if_index_out));
+
+		flows->ftimes.flow_start = nf5_flow->flow_start;
+		flows->ftimes.flow_finish = nf5_flow->flow_finish;
+
+		flows->asinf.src_as = htonl(ntohs(nf5_flow->src_as));
+		flows->asinf.dst_as = htonl(ntohs(nf5_flow->dest_as));
+		flows->asinf.src_mask = nf5_flow->src_mask;
+		flows->asinf.dst_mask = nf5_flow->dst_mask;
+	}
+}
 
-		process_flow(&flow, conf, log_fd, log_socket);
+#ifdef HAVE_SSSE3_DISPATCH
+/*
+ * As nf5_decode_flows(), but the 64 bytes of packed fields from "ports"
+ * to "asinf" are assembled with byte shuffles of the 48 byte record,
+ * merged with the header fields from "base" (ainfo lies in the middle).
+ */
+#define Z	-1	/* Shuffle index that produces a zero byte */
+__attribute__((__target__("ssse3"))) static void
+nf5_decode_flows_ssse3(const struct NF5_FLOW *nf5_flow, u_int nflows,
+    const struct store_flow_complete *base, struct store_flow_complete *flows)
+{
+	/* Record bytes 0-15, 16-31 and 32-47 are r0, r1 and r2 below */
+	const __m128i ports_r2 = _mm_setr_epi8(
+	    0, 1, 2, 3, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z);
+	const __m128i packets_r1 = _mm_setr_epi8(
+	    Z, Z, Z, Z, Z, Z, Z, Z, 0, 1, 2, 3, Z, Z, Z, Z);
+	const __m128i octets_r1 = _mm_setr_epi8(
+	    4, 5, 6, 7, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z);
+	const __m128i ifndx_r0 = _mm_setr_epi8(
+	    Z, Z, Z, Z, Z, Z, 12, 13, Z, Z, 14, 15, Z, Z, Z, Z);
+	const __m128i start_r1 = _mm_setr_epi8(
+	    Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, 8, 9, 10, 11);
+	const __m128i finish_r1 = _mm_setr_epi8(
+	    12, 13, 14, 15, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z);
+	const __m128i asinf_r2 = _mm_setr_epi8(
+	    Z, Z, Z, Z, Z, Z, 8, 9, Z, Z, 10, 11, 12, 13, Z, Z);
+	const u_int8_t *bp = (const u_int8_t *)&base->ports;
+	const __m128i b0 = _mm_loadu_si128((const __m128i *)bp);
+	const __m128i b1 = _mm_loadu_si128((const __m128i *)(bp + 16));
+	const __m128i b2 = _mm_loadu_si128((const __m128i *)(bp + 32));
+	const __m128i b3 = _mm_loadu_si128((const __m128i *)(bp + 48));
+	const size_t tail = offsetof(struct store_flow_complete, finf);
+	__m128i r0, r1, r2;
+	u_int8_t *fp;
+	u_int i;
+
+	for (i = 0; i < nflows; i++, nf5_flow++, flows++) {
+		memcpy(flows, base, offsetof(struct store_flow_complete, ports));
+		memcpy((u_int8_t *)flows + tail, (const u_int8_t *)base + tail,
+		    sizeof(*flows) - tail);
+
+		flows->pft.tcp_flags = nf5_flow->tcp_flags;
+		flows->pft.protocol = nf5_flow->protocol;
+		flows->pft.tos = nf5_flow->tos;
+
+		flows->src_addr.v4.s_addr = nf5_flow->src_ip;
+		flows->dst_addr.v4.s_addr = nf5_flow->dest_ip;
+		flows->gateway_addr.v4.s_addr = nf5_flow->nexthop_ip;
+
+		r0 = _mm_loadu_si128((const __m128i *)nf5_flow);
+		r1 = _mm_loadu_si128((const __m128i *)nf5_flow + 1);
+		r2 = _mm_loadu_si128((const __m128i *)nf5_flow + 2);
+		fp = (u_int8_t *)&flows->ports;
+		_mm_storeu_si128((__m128i *)fp, _mm_or_si128(b0,
+		    _mm_or_si128(_mm_shuffle_epi8(r2, ports_r2),
+		    _mm_shuffle_epi8(r1, packets_r1))));
+		_mm_storeu_si128((__m128i *)(fp + 16), _mm_or_si128(b1,
+		    _mm_or_si128(_mm_shuffle_epi8(r1, octets_r1),
+		    _mm_shuffle_epi8(r0, ifndx_r0))));
+		_mm_storeu_si128((__m128i *)(fp + 32), _mm_or_si128(b2,
+		    _mm_shuffle_epi8(r1, start_r1)));
+		_mm_storeu_si128((__m128i *)(fp + 48), _mm_or_si128(b3,
+		    _mm_or_si128(_mm_shuffle_epi8(r1, finish_r1),
+		    _mm_shuffle_epi8(r2, asinf_r2))));
 	}
 }
+#undef Z
+#endif /* HAVE_SSSE3_DISPATCH */
 
 static void
 process_netflow_v5(struct flow_packet *fp, struct flowd_config *conf,
-    struct peer_state *peer, struct peers *peers, int log_fd, int log_socket)
+    struct peer_state *peer, struct worker *w)
 {
 	struct NF5_HEADER *nf5_hdr = (struct NF5_HEADER *)fp->packet;
-	struct NF5_FLOW *nf5_flow;
-	struct store_flow_complete flow;
-	size_t offset;
-	u_int i, nflows;
+	struct store_flow_complete base, flows[NF5_MAXFLOWS];
+	struct export_clock clk;
+	u_int i, nflows, sampling;
 
 	if (fp->len < sizeof(*nf5_hdr)) {
 		peer->ninvalid++;
@@ -514,77 +1146,72 @@ process_netflow_v5(struct flow_packet *fp, struct flowd_config *conf,
 	}
 
 	logit(LOG_DEBUG, "Valid netflow v.5 packet %d flows", nflows);
-	update_peer(peers, peer, nflows, 5);
-
-	for (i = 0; i < nflows; i++) {
-		offset = NF5_PACKET_SIZE(i);
-		nf5_flow = (struct NF5_FLOW *)(fp->packet + offset);
-
-		bzero(&flow, sizeof(flow));
-
-		/* NB. These are converted to network byte order later */
-		flow.hdr.fields = STORE_FIELD_ALL;
-		/* flow.hdr.tag is set later */
-		flow.hdr.fields &= ~STORE_FIELD_TAG;
-		flow.hdr.fields &= ~STORE_FIELD_SRC_ADDR6;
-		flow.hdr.fields &= ~STORE_FIELD_DST_ADDR6;
-		flow.hdr.fields &= ~STORE_FIELD_GATEWAY_ADDR6;
-
-		flow.recv_time.recv_sec = fp->recv_time.tv_sec;
-		flow.recv_time.recv_usec = fp->recv_time.tv_usec;
-
-		flow.pft.tcp_flags = nf5_flow->tcp_flags;
-		flow.pft.protocol = nf5_flow->protocol;
-		flow.pft.tos = nf5_flow->tos;
-
-		memcpy(&flow.agent_addr, &fp->flow_source,
-		    sizeof(flow.agent_addr));
-
-		flow.src_addr.v4.s_addr = nf5_flow->src_ip;
-		flow.src_addr.af = AF_INET;
-		flow.dst_addr.v4.s_addr = nf5_flow->dest_ip;
-		flow.dst_addr.af = AF_INET;
-		flow.gateway_addr.v4.s_addr = nf5_flow->nexthop_ip;
-		flow.gateway_addr.af = AF_INET;
-
-		flow.ports.src_port = nf5_flow->src_port;
-		flow.ports.dst_port = nf5_flow->dest_port;
-
-#define NTO64(a) (store_htonll(ntohl(a)))
-		flow.octets.flow_octets = NTO64(nf5_flow->flow_octets);
-		flow.packets.flow_packets = NTO64(nf5_flow->flow_packets);
-#undef NTO64
-
-		flow.ifndx.if_index_in = htonl(ntohs(nf5_flow->if_index_in));
-		flow.ifndx.if_index_out = htonl(ntohs(nf5_flow->if_index_out));
-
-		flow.ainfo.sys_uptime_ms = nf5_hdr->uptime_ms;
-		flow.ainfo.time_sec = nf5_hdr->time_sec;
-		flow.ainfo.time_nanosec = nf5_hdr->time_nanosec;
-		flow.ainfo.netflow_version = nf5_hdr->c.version;
-
-		flow.ftimes.flow_start = nf5_flow->flow_start;
-		flow.ftimes.flow_finish = nf5_flow->flow_finish;
-
-		flow.asinf.src_as = htonl(ntohs(nf5_flow->src_as));
-		flow.asinf.dst_as = htonl(ntohs(nf5_flow->dest_as));
-		flow.asinf.src_mask = nf5_flow->src_mask;
-		flow.asinf.dst_mask = nf5_flow->dst_mask;
+	update_peer(w->peers, peer, nflows, 5,
+	    &fp->recv_time);
+	peer_sequence(w->peers, peer, 5,
+	    (nf5_hdr->engine_type << 8) | nf5_hdr->engine_id,
+	    ntohl(nf5_hdr->flow_sequence), nflows);
+
+	bzero(&base, sizeof(base));
+
+	/* NB. These are converted to network byte order later */
+	base.hdr.fields = STORE_FIELD_ALL;
+	/* flow.hdr.tag is set later */
+	base.hdr.fields &= ~STORE_FIELD_TAG;
+	base.hdr.fields &= ~STORE_FIELD_SRC_ADDR6;
+	base.hdr.fields &= ~STORE_FIELD_DST_ADDR6;
+	base.hdr.fields &= ~STORE_FIELD_GATEWAY_ADDR6;
+	base.hdr.fields &= ~STORE_FIELD_SAMPLING;
+	base.hdr.fields &= ~STORE_FIELD_ABS_TIMES;
+
+	base.recv_time.recv_sec = fp->recv_time.tv_sec;
+	base.recv_time.recv_usec = fp->recv_time.tv_usec;
+
+	memcpy(&base.agent_addr, &fp->flow_source, sizeof(base.agent_addr));
+
+	base.src_addr.af = AF_INET;
+	base.dst_addr.af = AF_INET;
+	base.gateway_addr.af = AF_INET;
+
+	base.ainfo.sys_uptime_ms = nf5_hdr->uptime_ms;
+	base.ainfo.time_sec = nf5_hdr->time_sec;
+	base.ainfo.time_nanosec = nf5_hdr->time_nanosec;
+	base.ainfo.netflow_version = nf5_hdr->c.version;
+
+	base.finf.engine_type = nf5_hdr->engine_type;
+	base.finf.engine_id = nf5_hdr->engine_id;
+	base.finf.flow_sequence = nf5_hdr->flow_sequence;
+
+	if ((sampling = ntohs(nf5_hdr->sampling_interval)) != 0) {
+		base.hdr.fields |= STORE_FIELD_SAMPLING;
+		base.samp.interval = htonl(sampling & 0x3fff);
+		base.samp.algorithm = sampling >> 14;
+	}
 
-		flow.finf.engine_type = nf5_hdr->engine_type;
-		flow.finf.engine_id = nf5_hdr->engine_id;
-		flow.finf.flow_sequence = nf5_hdr->flow_sequence;
+#ifdef HAVE_SSSE3_DISPATCH
+	if (__builtin_cpu_supports("ssse3"))
+		nf5_decode_flows_ssse3((struct NF5_FLOW *)(nf5_hdr + 1),
+		    nflows, &base, flows);
+	else
+#endif
+		nf5_decode_flows((struct NF5_FLOW *)(nf5_hdr + 1), nflows,
+		    &base, flows);
 
-		process_flow(&flow, conf, log_fd, log_socket);
+	export_clock(&clk, peer, &fp->recv_time, ntohl(nf5_hdr->time_sec),
+	    ntohl(nf5_hdr->time_nanosec), ntohl(nf5_hdr->uptime_ms), 1);
+	for (i = 0; i < nflows; i++) {
+		flow_abs_times(&flows[i], &clk);
+		process_flow(&flows[i], conf, w);
 	}
 }
 
 static void
 process_netflow_v7(struct flow_packet *fp, struct flowd_config *conf,
-    struct peer_state *peer, struct peers *peers, int log_fd, int log_socket)
+    struct peer_state *peer, struct worker *w)
 {
 	struct NF7_HEADER *nf7_hdr = (struct NF7_HEADER *)fp->packet;
 	struct NF7_FLOW *nf7_flow;
+	struct export_clock clk;
 	struct store_flow_complete flow;
 	size_t offset;
 	u_int i, nflows;
@@ -612,7 +1239,12 @@ process_netflow_v7(struct flow_packet *fp, struct flowd_config *conf,
 	}
 
 	logit(LOG_DEBUG, "Valid netflow v.7 packet %d flows", nflows);
-	update_peer(peers, peer, nflows, 7);
+	update_peer(w->peers, peer, nflows, 7,
+	    &fp->recv_time);
+	peer_sequence(w->peers, peer, 7, 0, ntohl(nf7_hdr->flow_sequence),
+	    nflows);
+	export_clock(&clk, peer, &fp->recv_time, ntohl(nf7_hdr->time_sec),
+	    ntohl(nf7_hdr->time_nanosec), ntohl(nf7_hdr->uptime_ms), 1);
 
 	for (i = 0; i < nflows; i++) {
 		offset = NF7_PACKET_SIZE(i);
@@ -627,6 +1259,8 @@ process_netflow_v7(struct flow_packet *fp, struct flowd_config *conf,
 		flow.hdr.fields &= ~STORE_FIELD_SRC_ADDR6;
 		flow.hdr.fields &= ~STORE_FIELD_DST_ADDR6;
 		flow.hdr.fields &= ~STORE_FIELD_GATEWAY_ADDR6;
+		flow.hdr.fields &= ~STORE_FIELD_SAMPLING;
+		flow.hdr.fields &= ~STORE_FIELD_ABS_TIMES;
 
 		/*
 		 * XXX: we can parse the (undocumented) flags1 and flags2
@@ -676,124 +1310,879 @@ process_netflow_v7(struct flow_packet *fp, struct flowd_config *conf,
 		flow.asinf.dst_mask = nf7_flow->dst_mask;
 
 		flow.finf.flow_sequence = nf7_hdr->flow_sequence;
+		flow_abs_times(&flow, &clk);
 
-		process_flow(&flow, conf, log_fd, log_socket);
+		process_flow(&flow, conf, w);
 	}
 }
 
-static int
-nf9_rec_to_flow(struct peer_nf9_record *rec, struct store_flow_complete *flow,
-    u_int8_t *data)
-{
-	/* XXX: use a table-based interpreter */
-	switch (rec->type) {
+/*
+ * Where each NetFlow v.9 / IPFIX field that we understand is stored in a
+ * struct store_flow_complete. The two protocols share field numbers for
+ * everything here, apart from the IPFIX-only selector ID and absolute flow
+ * times. The store keeps integers in network byte order, so a field shorter
+ * than its destination is copied into the low-order bytes and no swapping
+ * is needed.
+ */
+struct tmpl_field {
+	u_int16_t type;
+	u_int16_t off;			/* Offset in store_flow_complete */
+	u_int16_t size;			/* Maximum field length */
+	sa_family_t af;			/* Address fields only */
+	u_int32_t store_field;
+};
 
-/* Copy an int (possibly shorter than the target) keeping their LSBs aligned */
-#define BE_COPY(a) memcpy((u_char*)&a + (sizeof(a) - rec->len), data, rec->len);
+#define FLOW_OFF(f)	offsetof(struct store_flow_complete, f)
+#define FLOW_SIZE(f)	sizeof(((struct store_flow_complete *)NULL)->f)
 #define V9_FIELD(v9_field, store_field, flow_field) \
-	case v9_field: \
-		flow->hdr.fields |= STORE_FIELD_##store_field; \
-		BE_COPY(flow->flow_field); \
-		break
+	{ v9_field, FLOW_OFF(flow_field), FLOW_SIZE(flow_field), \
+	    0, STORE_FIELD_##store_field }
 #define V9_FIELD_ADDR(v9_field, store_field, flow_field, sub, family) \
-	case v9_field: \
-		flow->hdr.fields |= STORE_FIELD_##store_field; \
-		memcpy(&flow->flow_field.v##sub, data, rec->len); \
-		flow->flow_field.af = AF_##family; \
-		break
-
-	V9_FIELD(NF9_IN_BYTES, OCTETS, octets.flow_octets);
-	V9_FIELD(NF9_IN_PACKETS, PACKETS, packets.flow_packets);
-	V9_FIELD(NF9_IN_PROTOCOL, PROTO_FLAGS_TOS, pft.protocol);
-	V9_FIELD(NF9_SRC_TOS, PROTO_FLAGS_TOS, pft.tos);
-	V9_FIELD(NF9_TCP_FLAGS, PROTO_FLAGS_TOS, pft.tcp_flags);
-	V9_FIELD(NF9_L4_SRC_PORT, SRCDST_PORT, ports.src_port);
-	V9_FIELD(NF9_SRC_MASK, AS_INFO, asinf.src_mask);
-	V9_FIELD(NF9_INPUT_SNMP, IF_INDICES, ifndx.if_index_in);
-	V9_FIELD(NF9_L4_DST_PORT, SRCDST_PORT, ports.dst_port);
-	V9_FIELD(NF9_DST_MASK, AS_INFO, asinf.dst_mask);
-	V9_FIELD(NF9_OUTPUT_SNMP, IF_INDICES, ifndx.if_index_out);
-	V9_FIELD(NF9_SRC_AS, AS_INFO, asinf.src_as);
-	V9_FIELD(NF9_DST_AS, AS_INFO, asinf.dst_as);
-	V9_FIELD(NF9_LAST_SWITCHED, FLOW_TIMES, ftimes.flow_finish);
-	V9_FIELD(NF9_FIRST_SWITCHED, FLOW_TIMES, ftimes.flow_start);
-	V9_FIELD(NF9_IPV6_SRC_MASK, AS_INFO, asinf.src_mask);
-	V9_FIELD(NF9_IPV6_DST_MASK, AS_INFO, asinf.dst_mask);
-	V9_FIELD(NF9_ENGINE_TYPE, FLOW_ENGINE_INFO, finf.engine_type);
-	V9_FIELD(NF9_ENGINE_ID, FLOW_ENGINE_INFO, finf.engine_id);
-
-	V9_FIELD_ADDR(NF9_IPV4_SRC_ADDR, SRC_ADDR4, src_addr, 4, INET);
-	V9_FIELD_ADDR(NF9_IPV4_DST_ADDR, DST_ADDR4, dst_addr, 4, INET);
-	V9_FIELD_ADDR(NF9_IPV4_NEXT_HOP, GATEWAY_ADDR4, gateway_addr, 4, INET);
-
-	V9_FIELD_ADDR(NF9_IPV6_SRC_ADDR, SRC_ADDR6, src_addr, 6, INET6);
-	V9_FIELD_ADDR(NF9_IPV6_DST_ADDR, DST_ADDR6, dst_addr, 6, INET6);
-	V9_FIELD_ADDR(NF9_IPV6_NEXT_HOP, GATEWAY_ADDR6, gateway_addr, 6, INET6);
+	{ v9_field, FLOW_OFF(flow_field), FLOW_SIZE(flow_field.v##sub), \
+	    AF_##family, STORE_FIELD_##store_field }
+
+static const struct tmpl_field tmpl_fields[] = {
+	V9_FIELD(NF9_IN_BYTES, OCTETS, octets.flow_octets),
+	V9_FIELD(NF9_IN_PACKETS, PACKETS, packets.flow_packets),
+	V9_FIELD(NF9_IN_PROTOCOL, PROTO_FLAGS_TOS, pft.protocol),
+	V9_FIELD(NF9_SRC_TOS, PROTO_FLAGS_TOS, pft.tos),
+	V9_FIELD(NF9_TCP_FLAGS, PROTO_FLAGS_TOS, pft.tcp_flags),
+	V9_FIELD(NF9_L4_SRC_PORT, SRCDST_PORT, ports.src_port),
+	V9_FIELD(NF9_SRC_MASK, AS_INFO, asinf.src_mask),
+	V9_FIELD(NF9_INPUT_SNMP, IF_INDICES, ifndx.if_index_in),
+	V9_FIELD(NF9_L4_DST_PORT, SRCDST_PORT, ports.dst_port),
+	V9_FIELD(NF9_DST_MASK, AS_INFO, asinf.dst_mask),
+	V9_FIELD(NF9_OUTPUT_SNMP, IF_INDICES, ifndx.if_index_out),
+	V9_FIELD(NF9_SRC_AS, AS_INFO, asinf.src_as),
+	V9_FIELD(NF9_DST_AS, AS_INFO, asinf.dst_as),
+	V9_FIELD(NF9_LAST_SWITCHED, FLOW_TIMES, ftimes.flow_finish),
+	V9_FIELD(NF9_FIRST_SWITCHED, FLOW_TIMES, ftimes.flow_start),
+	V9_FIELD(NF9_IPV6_SRC_MASK, AS_INFO, asinf.src_mask),
+	V9_FIELD(NF9_IPV6_DST_MASK, AS_INFO, asinf.dst_mask),
+	V9_FIELD(NF9_ENGINE_TYPE, FLOW_ENGINE_INFO, finf.engine_type),
+	V9_FIELD(NF9_ENGINE_ID, FLOW_ENGINE_INFO, finf.engine_id),
+	V9_FIELD(NF9_SAMPLING_INTERVAL, SAMPLING, samp.interval),
+	V9_FIELD(NF9_SAMPLING_ALGORITHM, SAMPLING, samp.algorithm),
+	V9_FIELD(NF9_FLOW_SAMPLER_ID, SAMPLING, samp.sampler_id),
+	V9_FIELD(NF9_FLOW_SAMPLER_MODE, SAMPLING, samp.algorithm),
+	V9_FIELD(NF9_FLOW_SAMPLER_RANDOM_INTERVAL, SAMPLING, samp.interval),
+	V9_FIELD(NF10_SELECTOR_ID, SAMPLING, samp.sampler_id),
+	V9_FIELD(NF10_FLOW_START_SECONDS, ABS_TIMES, atimes.flow_start_ms),
+	V9_FIELD(NF10_FLOW_END_SECONDS, ABS_TIMES, atimes.flow_finish_ms),
+	V9_FIELD(NF10_FLOW_START_MILLISECONDS, ABS_TIMES,
+	    atimes.flow_start_ms),
+	V9_FIELD(NF10_FLOW_END_MILLISECONDS, ABS_TIMES, atimes.flow_finish_ms),
+
+	V9_FIELD_ADDR(NF9_IPV4_SRC_ADDR, SRC_ADDR4, src_addr, 4, INET),
+	V9_FIELD_ADDR(NF9_IPV4_DST_ADDR, DST_ADDR4, dst_addr, 4, INET),
+	V9_FIELD_ADDR(NF9_IPV4_NEXT_HOP, GATEWAY_ADDR4, gateway_addr, 4, INET),
+
+	V9_FIELD_ADDR(NF9_IPV6_SRC_ADDR, SRC_ADDR6, src_addr, 6, INET6),
+	V9_FIELD_ADDR(NF9_IPV6_DST_ADDR, DST_ADDR6, dst_addr, 6, INET6),
+	V9_FIELD_ADDR(NF9_IPV6_NEXT_HOP, GATEWAY_ADDR6, gateway_addr, 6, INET6),
+};
 
 #undef V9_FIELD
 #undef V9_FIELD_ADDR
-#undef BE_COPY
+#undef FLOW_SIZE
+#undef FLOW_OFF
+
+static const struct tmpl_field *
+tmpl_field_lookup(u_int type)
+{
+	u_int i;
+
+	for (i = 0; i < sizeof(tmpl_fields) / sizeof(tmpl_fields[0]); i++) {
+		if (tmpl_fields[i].type == type)
+			return (&tmpl_fields[i]);
 	}
-	return (0);
+	return (NULL);
 }
 
 static int
-nf9_check_rec_len(u_int type, u_int len)
+tmpl_check_rec(const struct peer_tmpl_record *rec, int varlen_ok)
 {
-	struct store_flow_complete t;
+	const struct tmpl_field *tf;
+
+	if (varlen_ok && rec->len == NF10_VARLEN)
+		return (1);
 
 	/* Sanity check */
-	if (len == 0 || len > 0x4000)
+	if (rec->len == 0 || rec->len > 0x4000)
 		return (0);
 
-	/* XXX: use a table-based interpreter */
-	switch (type) {
-#define V9_FIELD_LEN(v9_field, flow_field) \
-	case v9_field: \
-		return (len <= sizeof(t.flow_field));
-
-	V9_FIELD_LEN(NF9_IN_BYTES, octets.flow_octets);
-	V9_FIELD_LEN(NF9_IN_PACKETS, packets.flow_packets);
-	V9_FIELD_LEN(NF9_IN_PROTOCOL, pft.protocol);
-	V9_FIELD_LEN(NF9_SRC_TOS, pft.tos);
-	V9_FIELD_LEN(NF9_TCP_FLAGS, pft.tcp_flags);
-	V9_FIELD_LEN(NF9_L4_SRC_PORT, ports.src_port);
-	V9_FIELD_LEN(NF9_IPV4_SRC_ADDR, src_addr.v4);
-	V9_FIELD_LEN(NF9_SRC_MASK, asinf.src_mask);
-	V9_FIELD_LEN(NF9_INPUT_SNMP, ifndx.if_index_in);
-	V9_FIELD_LEN(NF9_L4_DST_PORT, ports.dst_port);
-	V9_FIELD_LEN(NF9_IPV4_DST_ADDR, dst_addr.v4);
-	V9_FIELD_LEN(NF9_DST_MASK, asinf.src_mask);
-	V9_FIELD_LEN(NF9_OUTPUT_SNMP, ifndx.if_index_out);
-	V9_FIELD_LEN(NF9_IPV4_NEXT_HOP, gateway_addr.v4);
-	V9_FIELD_LEN(NF9_SRC_AS, asinf.src_as);
-	V9_FIELD_LEN(NF9_DST_AS, asinf.dst_as);
-	V9_FIELD_LEN(NF9_LAST_SWITCHED, ftimes.flow_finish);
-	V9_FIELD_LEN(NF9_FIRST_SWITCHED, ftimes.flow_start);
-	V9_FIELD_LEN(NF9_IPV6_SRC_ADDR, src_addr.v6);
-	V9_FIELD_LEN(NF9_IPV6_DST_ADDR, dst_addr.v6);
-	V9_FIELD_LEN(NF9_IPV6_SRC_MASK, asinf.src_mask);
-	V9_FIELD_LEN(NF9_IPV6_DST_MASK, asinf.dst_mask);
-	V9_FIELD_LEN(NF9_ENGINE_TYPE, finf.engine_type);
-	V9_FIELD_LEN(NF9_ENGINE_ID, finf.engine_id);
-	V9_FIELD_LEN(NF9_IPV6_NEXT_HOP, gateway_addr.v6);
-
-#undef V9_FIELD_LEN
-	default:
+	if (rec->enterprise != 0 ||
+	    (tf = tmpl_field_lookup(rec->type)) == NULL)
 		return (1);
-	}
+	return (rec->len <= tf->size);
 }
 
-static int
-nf9_flowset_to_store(u_int8_t *pkt, size_t len, struct timeval *tv, 
-    struct xaddr *flow_source, struct NF9_HEADER *nf9_hdr,
-    struct peer_nf9_template *template, u_int32_t source_id,
-    struct store_flow_complete *flow)
+/*
+ * Decode the template field specifier at "offset" into "rec". IPFIX
+ * enterprise-specific fields are followed by their enterprise number.
+ * Returns the length of the specifier, or 0 if it runs past "len".
+ */
+static u_int
+tmpl_decode_rec(const u_int8_t *pkt, size_t len, u_int offset, u_int version,
+    struct peer_tmpl_record *rec)
 {
-	u_int offset, i;
+	const struct NF9_TEMPLATE_FLOWSET_RECORD *tmplr;
+	u_int32_t enterprise;
 
-	if (template->total_len > len)
-		return (-1);
+	if (offset + sizeof(*tmplr) > len)
+		return (0);
+	tmplr = (const struct NF9_TEMPLATE_FLOWSET_RECORD *)(pkt + offset);
+	rec->type = ntohs(tmplr->type);
+	rec->len = ntohs(tmplr->length);
+	rec->enterprise = 0;
+	if (version != 10 || (rec->type & NF10_ENTERPRISE) == 0)
+		return (sizeof(*tmplr));
+
+	if (offset + sizeof(*tmplr) + sizeof(enterprise) > len)
+		return (0);
+	memcpy(&enterprise, pkt + offset + sizeof(*tmplr), sizeof(enterprise));
+	rec->type &= ~NF10_ENTERPRISE;
+	rec->enterprise = ntohl(enterprise);
+	return (sizeof(*tmplr) + sizeof(enterprise));
+}
+
+/*
+ * Specialised decoders for common template layouts. These are chosen when
+ * a template's records match one exactly, and replace the generic program
+ * with straight-line copies at fixed offsets.
+ */
+
+/* Copy an int (possibly shorter than the target) keeping their LSBs aligned */
+#define FP_INT(flow_field, off, len) \
+	memcpy((u_int8_t *)&flow->flow_field + sizeof(flow->flow_field) - \
+	    (len), data + (off), (len))
+#define FP_ADDR(flow_field, sub, family, off) do { \
+		flow->flow_field.af = AF_##family; \
+		memcpy(&flow->flow_field.v##sub, data + (off), \
+		    sizeof(flow->flow_field.v##sub)); \
+	} while (0)
+
+/* IPv4 5-tuple with 32-bit counters and interfaces */
+static const struct peer_tmpl_record fp_compact4_recs[] = {
+	{ NF9_IPV4_SRC_ADDR, 4 },	{ NF9_IPV4_DST_ADDR, 4 },
+	{ NF9_LAST_SWITCHED, 4 },	{ NF9_FIRST_SWITCHED, 4 },
+	{ NF9_IN_BYTES, 4 },		{ NF9_IN_PACKETS, 4 },
+	{ NF9_INPUT_SNMP, 4 },		{ NF9_OUTPUT_SNMP, 4 },
+	{ NF9_L4_SRC_PORT, 2 },		{ NF9_L4_DST_PORT, 2 },
+	{ NF9_IN_PROTOCOL, 1 },		{ NF9_TCP_FLAGS, 1 },
+	{ NF9_IP_PROTOCOL_VERSION, 1 },	{ NF9_SRC_TOS, 1 },
+};
+
+static void
+fp_compact4(const u_int8_t *data, struct store_flow_complete *flow)
+{
+	FP_ADDR(src_addr, 4, INET, 0);
+	FP_ADDR(dst_addr, 4, INET, 4);
+	FP_INT(ftimes.flow_finish, 8, 4);
+	FP_INT(ftimes.flow_start, 12, 4);
+	FP_INT(octets.flow_octets, 16, 4);
+	FP_INT(packets.flow_packets, 20, 4);
+	FP_INT(ifndx.if_index_in, 24, 4);
+	FP_INT(ifndx.if_index_out, 28, 4);
+	FP_INT(ports.src_port, 32, 2);
+	FP_INT(ports.dst_port, 34, 2);
+	FP_INT(pft.protocol, 36, 1);
+	FP_INT(pft.tcp_flags, 37, 1);
+	FP_INT(pft.tos, 39, 1);
+}
+
+/* The same, for IPv6 */
+static const struct peer_tmpl_record fp_compact6_recs[] = {
+	{ NF9_IPV6_SRC_ADDR, 16 },	{ NF9_IPV6_DST_ADDR, 16 },
+	{ NF9_LAST_SWITCHED, 4 },	{ NF9_FIRST_SWITCHED, 4 },
+	{ NF9_IN_BYTES, 4 },		{ NF9_IN_PACKETS, 4 },
+	{ NF9_INPUT_SNMP, 4 },		{ NF9_OUTPUT_SNMP, 4 },
+	{ NF9_L4_SRC_PORT, 2 },		{ NF9_L4_DST_PORT, 2 },
+	{ NF9_IN_PROTOCOL, 1 },		{ NF9_TCP_FLAGS, 1 },
+	{ NF9_IP_PROTOCOL_VERSION, 1 },	{ NF9_SRC_TOS, 1 },
+};
+
+static void
+fp_compact6(const u_int8_t *data, struct store_flow_complete *flow)
+{
+	FP_ADDR(src_addr, 6, INET6, 0);
+	FP_ADDR(dst_addr, 6, INET6, 16);
+	FP_INT(ftimes.flow_finish, 32, 4);
+	FP_INT(ftimes.flow_start, 36, 4);
+	FP_INT(octets.flow_octets, 40, 4);
+	FP_INT(packets.flow_packets, 44, 4);
+	FP_INT(ifndx.if_index_in, 48, 4);
+	FP_INT(ifndx.if_index_out, 52, 4);
+	FP_INT(ports.src_port, 56, 2);
+	FP_INT(ports.dst_port, 58, 2);
+	FP_INT(pft.protocol, 60, 1);
+	FP_INT(pft.tcp_flags, 61, 1);
+	FP_INT(pft.tos, 63, 1);
+}
+
+/* Everything the store holds for IPv4, with 64-bit counters (flow-send) */
+static const struct peer_tmpl_record fp_full4_recs[] = {
+	{ NF9_FIRST_SWITCHED, 4 },	{ NF9_LAST_SWITCHED, 4 },
+	{ NF9_IN_BYTES, 8 },		{ NF9_IN_PACKETS, 8 },
+	{ NF9_IPV4_SRC_ADDR, 4 },	{ NF9_IPV4_DST_ADDR, 4 },
+	{ NF9_IPV4_NEXT_HOP, 4 },	{ NF9_INPUT_SNMP, 4 },
+	{ NF9_OUTPUT_SNMP, 4 },		{ NF9_SRC_AS, 4 },
+	{ NF9_DST_AS, 4 },		{ NF9_L4_SRC_PORT, 2 },
+	{ NF9_L4_DST_PORT, 2 },		{ NF9_IN_PROTOCOL, 1 },
+	{ NF9_TCP_FLAGS, 1 },		{ NF9_SRC_TOS, 1 },
+	{ NF9_SRC_MASK, 1 },		{ NF9_DST_MASK, 1 },
+};
+
+static void
+fp_full4(const u_int8_t *data, struct store_flow_complete *flow)
+{
+	FP_INT(ftimes.flow_start, 0, 4);
+	FP_INT(ftimes.flow_finish, 4, 4);
+	FP_INT(octets.flow_octets, 8, 8);
+	FP_INT(packets.flow_packets, 16, 8);
+	FP_ADDR(src_addr, 4, INET, 24);
+	FP_ADDR(dst_addr, 4, INET, 28);
+	FP_ADDR(gateway_addr, 4, INET, 32);
+	FP_INT(ifndx.if_index_in, 36, 4);
+	FP_INT(ifndx.if_index_out, 40, 4);
+	FP_INT(asinf.src_as, 44, 4);
+	FP_INT(asinf.dst_as, 48, 4);
+	FP_INT(ports.src_port, 52, 2);
+	FP_INT(ports.dst_port, 54, 2);
+	FP_INT(pft.protocol, 56, 1);
+	FP_INT(pft.tcp_flags, 57, 1);
+	FP_INT(pft.tos, 58, 1);
+	FP_INT(asinf.src_mask, 59, 1);
+	FP_INT(asinf.dst_mask, 60, 1);
+}
+
+/* The same, for IPv6 */
+static const struct peer_tmpl_record fp_full6_recs[] = {
+	{ NF9_FIRST_SWITCHED, 4 },	{ NF9_LAST_SWITCHED, 4 },
+	{ NF9_IN_BYTES, 8 },		{ NF9_IN_PACKETS, 8 },
+	{ NF9_IPV6_SRC_ADDR, 16 },	{ NF9_IPV6_DST_ADDR, 16 },
+	{ NF9_IPV6_NEXT_HOP, 16 },	{ NF9_INPUT_SNMP, 4 },
+	{ NF9_OUTPUT_SNMP, 4 },		{ NF9_SRC_AS, 4 },
+	{ NF9_DST_AS, 4 },		{ NF9_L4_SRC_PORT, 2 },
+	{ NF9_L4_DST_PORT, 2 },		{ NF9_IN_PROTOCOL, 1 },
+	{ NF9_TCP_FLAGS, 1 },		{ NF9_SRC_TOS, 1 },
+	{ NF9_IPV6_SRC_MASK, 1 },	{ NF9_IPV6_DST_MASK, 1 },
+};
+
+static void
+fp_full6(const u_int8_t *data, struct store_flow_complete *flow)
+{
+	FP_INT(ftimes.flow_start, 0, 4);
+	FP_INT(ftimes.flow_finish, 4, 4);
+	FP_INT(octets.flow_octets, 8, 8);
+	FP_INT(packets.flow_packets, 16, 8);
+	FP_ADDR(src_addr, 6, INET6, 24);
+	FP_ADDR(dst_addr, 6, INET6, 40);
+	FP_ADDR(gateway_addr, 6, INET6, 56);
+	FP_INT(ifndx.if_index_in, 72, 4);
+	FP_INT(ifndx.if_index_out, 76, 4);
+	FP_INT(asinf.src_as, 80, 4);
+	FP_INT(asinf.dst_as, 84, 4);
+	FP_INT(ports.src_port, 88, 2);
+	FP_INT(ports.dst_port, 90, 2);
+	FP_INT(pft.protocol, 92, 1);
+	FP_INT(pft.tcp_flags, 93, 1);
+	FP_INT(pft.tos, 94, 1);
+	FP_INT(asinf.src_mask, 95, 1);
+	FP_INT(asinf.dst_mask, 96, 1);
+}
+
+#undef FP_INT
+#undef FP_ADDR
+
+#define FP_ENTRY(name) \
+	{ #name, fp_##name##_recs, \
+	    sizeof(fp_##name##_recs) / sizeof(fp_##name##_recs[0]), fp_##name }
+
+static const struct tmpl_fastpath {
+	const char *name;
+	const struct peer_tmpl_record *recs;
+	u_int num_recs;
+	void (*decode)(const u_int8_t *, struct store_flow_complete *);
+} tmpl_fastpaths[] = {
+	FP_ENTRY(compact4),
+	FP_ENTRY(compact6),
+	FP_ENTRY(full4),
+	FP_ENTRY(full6),
+};
+
+#undef FP_ENTRY
+
+static const struct tmpl_fastpath *
+tmpl_fastpath_lookup(const struct peer_tmpl_record *recs, u_int num_recs)
+{
+	const struct tmpl_fastpath *fp;
+	u_int i, j;
+
+	for (i = 0; i < sizeof(tmpl_fastpaths) / sizeof(tmpl_fastpaths[0]);
+	    i++) {
+		fp = &tmpl_fastpaths[i];
+		if (fp->num_recs != num_recs)
+			continue;
+		for (j = 0; j < num_recs; j++) {
+			if (fp->recs[j].type != recs[j].type ||
+			    fp->recs[j].len != recs[j].len ||
+			    recs[j].enterprise != 0)
+				break;
+		}
+		if (j == num_recs)
+			return (fp);
+	}
+	return (NULL);
+}
+
+/*
+ * Compile a template's (already length-checked) records into the program
+ * that tmpl_decode() executes over each of its data records, and pick a
+ * specialised decoder if there is one for its layout
+ */
+static void
+tmpl_compile(struct peer_tmpl_prog *prog, const struct peer_tmpl_record *recs,
+    u_int num_recs)
+{
+	const struct tmpl_field *tf;
+	const struct tmpl_fastpath *fp;
+	struct peer_tmpl_op *op;
+	struct peer_tmpl_var *var;
+	u_int i, src, num_var;
+
+	/* Templates are resent periodically; keep counting across them */
+	if (prog->ops != NULL)
+		free(prog->ops);
+	if (prog->var != NULL)
+		free(prog->var);
+	prog->ops = NULL;
+	prog->var = NULL;
+	prog->num_ops = prog->num_var = prog->tail = 0;
+	prog->fields = 0;
+	prog->fast_name = NULL;
+	prog->fast = NULL;
+	if (num_recs == 0)
+		return;
+	if ((prog->ops = calloc(num_recs, sizeof(*prog->ops))) == NULL)
+		logerrx("%s: calloc failed (num %d)", __func__, num_recs);
+	for (i = num_var = 0; i < num_recs; i++) {
+		if (recs[i].len == NF10_VARLEN)
+			num_var++;
+	}
+	if (num_var != 0 &&
+	    (prog->var = calloc(num_var, sizeof(*prog->var))) == NULL)
+		logerrx("%s: calloc failed (num %d)", __func__, num_var);
+
+	/* Offsets are relative to the start of each fixed-length segment */
+	for (i = src = 0; i < num_recs; i++) {
+		tf = recs[i].enterprise != 0 ? NULL :
+		    tmpl_field_lookup(recs[i].type);
+		if (recs[i].len == NF10_VARLEN) {
+			var = &prog->var[prog->num_var++];
+			var->skip = src;
+			var->first_op = prog->num_ops;
+			if (tf != NULL) {
+				var->dst = tf->off;
+				var->size = tf->size;
+				var->af = tf->af;
+				var->store_field = tf->store_field;
+			}
+			src = 0;
+			continue;
+		}
+		if (tf == NULL) {
+			src += recs[i].len;
+			continue;
+		}
+		op = &prog->ops[prog->num_ops++];
+		op->src = src;
+		op->len = recs[i].len;
+		src += recs[i].len;
+		prog->fields |= tf->store_field;
+		if (tf->af != 0) {
+			op->dst = tf->off;
+			op->af = tf->af;
+			if (tf->af == AF_INET && op->len == tf->size)
+				op->op = PEER_TMPL_OP_ADDR4;
+			else if (tf->af == AF_INET6 && op->len == tf->size)
+				op->op = PEER_TMPL_OP_ADDR6;
+			else
+				op->op = PEER_TMPL_OP_ADDR;
+			continue;
+		}
+		/* Keep the LSBs of short fields aligned */
+		op->dst = tf->off + tf->size - op->len;
+		switch (op->len) {
+		case 1:
+			op->op = PEER_TMPL_OP_COPY1;
+			break;
+		case 2:
+			op->op = PEER_TMPL_OP_COPY2;
+			break;
+		case 4:
+			op->op = PEER_TMPL_OP_COPY4;
+			break;
+		case 8:
+			op->op = PEER_TMPL_OP_COPY8;
+			break;
+		default:
+			op->op = PEER_TMPL_OP_COPY;
+			break;
+		}
+	}
+	prog->tail = src;
+
+	if (num_var == 0 &&
+	    (fp = tmpl_fastpath_lookup(recs, num_recs)) != NULL) {
+		prog->fast_name = fp->name;
+		prog->fast = fp->decode;
+	}
+}
+
+/*
+ * Returns the length of a data record, which may contain variable-length
+ * fields, or 0 if it runs past "avail" bytes
+ */
+static u_int
+tmpl_record_len(const struct peer_tmpl_prog *prog, const u_int8_t *data,
+    u_int avail)
+{
+	u_int i, pos, len;
+
+	for (i = pos = 0; i < prog->num_var; i++) {
+		pos += prog->var[i].skip;
+		if (pos + 1 > avail)
+			return (0);
+		/* RFC 7011 s7: lengths of 255 or more use three octets */
+		if ((len = data[pos++]) == 255) {
+			if (pos + 2 > avail)
+				return (0);
+			len = (data[pos] << 8) | data[pos + 1];
+			pos += 2;
+		}
+		pos += len;
+	}
+	pos += prog->tail;
+	return (pos > avail ? 0 : pos);
+}
+
+static void
+tmpl_run(const struct peer_tmpl_op *op, const struct peer_tmpl_op *end,
+    const u_int8_t *data, u_int8_t *f)
+{
+	sa_family_t af;
+
+	for (; op < end; op++) {
+		switch (op->op) {
+		case PEER_TMPL_OP_COPY1:
+			f[op->dst] = data[op->src];
+			break;
+		case PEER_TMPL_OP_COPY2:
+			memcpy(f + op->dst, data + op->src, 2);
+			break;
+		case PEER_TMPL_OP_COPY4:
+			memcpy(f + op->dst, data + op->src, 4);
+			break;
+		case PEER_TMPL_OP_COPY8:
+			memcpy(f + op->dst, data + op->src, 8);
+			break;
+		case PEER_TMPL_OP_ADDR4:
+			af = AF_INET;
+			memcpy(f + op->dst + offsetof(struct xaddr, xa),
+			    data + op->src, 4);
+			memcpy(f + op->dst + offsetof(struct xaddr, af),
+			    &af, sizeof(af));
+			break;
+		case PEER_TMPL_OP_ADDR6:
+			af = AF_INET6;
+			memcpy(f + op->dst + offsetof(struct xaddr, xa),
+			    data + op->src, 16);
+			memcpy(f + op->dst + offsetof(struct xaddr, af),
+			    &af, sizeof(af));
+			break;
+		case PEER_TMPL_OP_ADDR:
+			af = op->af;
+			memcpy(f + op->dst + offsetof(struct xaddr, xa),
+			    data + op->src, op->len);
+			memcpy(f + op->dst + offsetof(struct xaddr, af),
+			    &af, sizeof(af));
+			break;
+		default:
+			memcpy(f + op->dst, data + op->src, op->len);
+			break;
+		}
+	}
+}
+
+/*
+ * Store a variable-length field that we understand, if its value fits.
+ * Returns 1 if it was stored, 0 if it was dropped.
+ */
+static int
+tmpl_run_var(const struct peer_tmpl_var *var, const u_int8_t *data,
+    u_int len, u_int8_t *f)
+{
+	sa_family_t af;
+
+	if (len == 0 || len > var->size)
+		return (0);
+	if (var->af == 0) {
+		memcpy(f + var->dst + var->size - len, data, len);
+		return (1);
+	}
+	if (len != var->size)
+		return (0);
+	af = var->af;
+	memcpy(f + var->dst + offsetof(struct xaddr, xa), data, len);
+	memcpy(f + var->dst + offsetof(struct xaddr, af), &af, sizeof(af));
+	return (1);
+}
+
+/*
+ * Decode a data record, which must already have been checked to be
+ * complete. Fields that we don't understand cost nothing here: the fixed
+ * ones were left out of the program when it was compiled, and variable-length
+ * ones are only read to find where the next segment starts.
+ */
+static void
+tmpl_decode(struct peer_tmpl_prog *prog, const u_int8_t *data,
+    struct store_flow_complete *flow)
+{
+	const struct peer_tmpl_op *op;
+	const struct peer_tmpl_var *var;
+	u_int8_t *f = (u_int8_t *)flow;
+	u_int i, len;
+
+	flow->hdr.fields |= prog->fields;
+	if (prog->fast != NULL) {
+		prog->fast(data, flow);
+		prog->nfast++;
+		return;
+	}
+	prog->ngeneric++;
+
+	op = prog->ops;
+	for (i = 0; i < prog->num_var; i++) {
+		var = &prog->var[i];
+		tmpl_run(op, prog->ops + var->first_op, data, f);
+		op = prog->ops + var->first_op;
+		data += var->skip;
+		if ((len = *data++) == 255) {
+			len = (data[0] << 8) | data[1];
+			data += 2;
+		}
+		if (var->size != 0 && tmpl_run_var(var, data, len, f))
+			flow->hdr.fields |= var->store_field;
+		data += len;
+	}
+	tmpl_run(op, prog->ops + prog->num_ops, data, f);
+}
+
+/* Install a parsed template, replacing any with the same ID */
+static struct peer_template *
+tmpl_store(struct peers *peers, struct peer_state *peer, u_int version,
+    u_int32_t source_id, u_int template_id, struct peer_tmpl_record *recs,
+    u_int num_recs, u_int total_len, u_int num_scopes)
+{
+	struct peer_template *template;
+
+	template = peer_find_template(peers, peer, version, source_id,
+	    template_id);
+	if (template == NULL) {
+		template = peer_new_template(peers, peer, version,
+		    source_id, template_id);
+	}
+
+	if (template->records != NULL)
+		free(template->records);
+
+	template->records = recs;
+	template->num_records = num_recs;
+	template->total_len = total_len;
+	template->num_scopes = num_scopes;
+	template->received = time(NULL);
+	/* Options data isn't decoded into flows, so has no program */
+	tmpl_compile(&template->prog, recs, num_scopes != 0 ? 0 : num_recs);
+	return (template);
+}
+
+/*
+ * Parse a NetFlow v.9 options template flowset or an IPFIX options template
+ * set. They differ in how the scope is given: NetFlow v.9 has the lengths
+ * in bytes of the scope and option fields and its own scope field types,
+ * whereas IPFIX counts the fields and uses ordinary information elements
+ * for both.
+ */
+static int
+process_options_template(u_int8_t *pkt, size_t len, struct peer_state *peer,
+    struct peers *peers, u_int version, u_int32_t source_id)
+{
+	struct NF9_OPTIONS_FLOWSET_HEADER *nf9h;
+	struct NF10_OPTIONS_FLOWSET_HEADER *nf10h;
+	struct NF9_TEMPLATE_FLOWSET_RECORD *tmplr;
+	struct peer_tmpl_record *recs;
+	u_int i, count, hlen, n, num_scopes, offset, template_id, total_size;
+	const char *why;
+
+	logit(LOG_DEBUG, "netflow v.%u options template set from %s/0x%x "
+	    "(len %zd)", version, addr_ntop_buf(&peer->from), source_id, len);
+
+	hlen = version == 9 ? sizeof(*nf9h) : sizeof(*nf10h);
+	for (offset = sizeof(struct NF9_FLOWSET_HEADER_COMMON); offset < len;) {
+		/* Anything too short for a template header is padding */
+		if (len - offset < hlen)
+			break;
+		if (version == 9) {
+			nf9h = (struct NF9_OPTIONS_FLOWSET_HEADER *)
+			    (pkt + offset);
+			template_id = ntohs(nf9h->template_id);
+			num_scopes = ntohs(nf9h->scope_length) / sizeof(*tmplr);
+			count = num_scopes +
+			    ntohs(nf9h->option_length) / sizeof(*tmplr);
+		} else {
+			nf10h = (struct NF10_OPTIONS_FLOWSET_HEADER *)
+			    (pkt + offset);
+			template_id = ntohs(nf10h->template_id);
+			count = ntohs(nf10h->count);
+			num_scopes = ntohs(nf10h->scope_count);
+		}
+		offset += hlen;
+
+		logit(LOG_DEBUG, " Contains options template 0x%08x/0x%04x "
+		    "with %d records, %d scope (offset %d):", source_id,
+		    template_id, count, num_scopes, offset);
+
+		recs = NULL;
+		/* v.9 lengths are in bytes and must hold whole records */
+		if (version == 9 &&
+		    (ntohs(nf9h->scope_length) % sizeof(*tmplr) != 0 ||
+		    ntohs(nf9h->option_length) % sizeof(*tmplr) != 0)) {
+			why = "bad scope";
+			goto bad;
+		}
+		if (num_scopes == 0 || num_scopes > count) {
+			why = "bad scope";
+			goto bad;
+		}
+		if ((recs = calloc(count, sizeof(*recs))) == NULL)
+			logerrx("%s: calloc failed (num %d)", __func__, count);
+
+		total_size = 0;
+		for (i = 0; i < count; i++) {
+			why = "short";
+			n = tmpl_decode_rec(pkt, len, offset, version, &recs[i]);
+			if (n == 0)
+				goto bad;
+			offset += n;
+			why = "invalid field length in";
+			if (version == 10 && recs[i].len == NF10_VARLEN)
+				total_size++;
+			else if (recs[i].len == 0 || recs[i].len > 0x4000)
+				goto bad;
+			else
+				total_size += recs[i].len;
+			why = "too large";
+			if (total_size > peers->max_template_len)
+				goto bad;
+		}
+
+		tmpl_store(peers, peer, version, source_id, template_id, recs,
+		    count, total_size, num_scopes);
+	}
+
+	return (0);
+
+ bad:
+	if (recs != NULL)
+		free(recs);
+	peer->ninvalid++;
+	logit(LOG_WARNING, "%s netflow v.%u options template 0x%08x/0x%04x "
+	    "from %s", why, version, source_id, template_id,
+	    addr_ntop_buf(&peer->from));
+	/* XXX ratelimit */
+	return (-1);
+}
+
+/* Read an unsigned integer field, which might be shorter than usual */
+static u_int64_t
+opt_uint(const u_int8_t *p, u_int len)
+{
+	u_int64_t v;
+
+	if (len > sizeof(v))
+		return (0);
+	for (v = 0; len > 0; len--)
+		v = (v << 8) | *p++;
+	return (v);
+}
+
+/*
+ * Decode an options data record into a sampler. Returns the length of the
+ * record, or 0 if it runs past "avail" bytes. Records that don't describe a
+ * sampler are left with an interval of 0.
+ */
+static u_int
+options_to_sampler(const struct peer_template *template, const u_int8_t *data,
+    u_int avail, struct peer_sampler *sampler)
+{
+	const struct peer_tmpl_record *rec;
+	u_int i, pos, len, scope;
+	u_int64_t v, interval, pkt_interval, pkt_space, size, population;
+
+	bzero(sampler, sizeof(*sampler));
+	interval = pkt_interval = pkt_space = size = population = 0;
+	for (i = pos = 0; i < template->num_records; i++) {
+		rec = &template->records[i];
+		if ((len = rec->len) == NF10_VARLEN) {
+			if (pos + 1 > avail)
+				return (0);
+			if ((len = data[pos++]) == 255) {
+				if (pos + 2 > avail)
+					return (0);
+				len = (data[pos] << 8) | data[pos + 1];
+				pos += 2;
+			}
+		}
+		if (pos + len > avail)
+			return (0);
+		v = opt_uint(data + pos, len);
+		pos += len;
+
+		scope = i < template->num_scopes;
+		if (rec->enterprise != 0)
+			continue;
+		if (template->key.version == 9 && scope) {
+			if (rec->type == NF9_SCOPE_INTERFACE &&
+			    sampler->scope == PEER_SAMPLER_SOURCE) {
+				sampler->scope = PEER_SAMPLER_IFINDEX;
+				sampler->id = v;
+			}
+			continue;
+		}
+		switch (rec->type) {
+		case NF10_INPUT_SNMP:
+			if (scope && sampler->scope == PEER_SAMPLER_SOURCE) {
+				sampler->scope = PEER_SAMPLER_IFINDEX;
+				sampler->id = v;
+			}
+			break;
+		case NF9_FLOW_SAMPLER_ID:
+		case NF10_SELECTOR_ID:
+			sampler->scope = PEER_SAMPLER_ID;
+			sampler->id = v;
+			break;
+		case NF9_SAMPLING_INTERVAL:
+		case NF9_FLOW_SAMPLER_RANDOM_INTERVAL:
+			interval = v;
+			break;
+		case NF9_SAMPLING_ALGORITHM:
+		case NF9_FLOW_SAMPLER_MODE:
+			sampler->algorithm = v;
+			break;
+		case NF10_SELECTOR_ALGORITHM:
+			/* RFC 5477: systematic count/time, n-out-of-N, uniform */
+			if (v == 1 || v == 2)
+				sampler->algorithm =
+				    STORE_SAMPLING_DETERMINISTIC;
+			else if (v == 3 || v == 4)
+				sampler->algorithm = STORE_SAMPLING_RANDOM;
+			break;
+		case NF10_SAMPLING_PACKET_INTERVAL:
+			pkt_interval = v;
+			break;
+		case NF10_SAMPLING_PACKET_SPACE:
+			pkt_space = v;
+			break;
+		case NF10_SAMPLING_SIZE:
+			size = v;
+			break;
+		case NF10_SAMPLING_POPULATION:
+			population = v;
+			break;
+		}
+	}
+
+	/* PSAMP selectors say how many packets they take out of how many */
+	if (interval == 0 && pkt_interval != 0)
+		interval = (pkt_interval + pkt_space) / pkt_interval;
+	if (interval == 0 && size != 0)
+		interval = population / size;
+	sampler->interval = interval > 0xffffffff ? 0xffffffff : interval;
+
+	return (pos);
+}
+
+/*
+ * Learn the samplers described by an options data flowset, counting its
+ * records in "num_records" if it isn't NULL
+ */
+static int
+process_options_data(u_int8_t *pkt, size_t len, struct peer_state *peer,
+    struct peer_template *template, u_int *num_records)
+{
+	struct peer_sampler sampler;
+	u_int offset, rlen, n;
+
+	/* Anything shorter than the smallest possible record is padding */
+	for (n = 0, offset = sizeof(struct NF9_DATA_FLOWSET_HEADER);
+	    len - offset >= template->total_len; offset += rlen, n++) {
+		if ((rlen = options_to_sampler(template, pkt + offset,
+		    len - offset, &sampler)) == 0) {
+			peer->ninvalid++;
+			logit(LOG_WARNING, "truncated netflow v.%u options "
+			    "data record from %s", template->key.version,
+			    addr_ntop_buf(&peer->from));
+			/* XXX ratelimit */
+			return (-1);
+		}
+		if (sampler.interval != 0)
+			peer_set_sampler(template->source, &sampler);
+	}
+	if (num_records != NULL)
+		*num_records = n;
+
+	return (0);
+}
+
+/*
+ * Fill in how a flow was sampled from the sampler tables of its source,
+ * unless the data record said so itself
+ */
+static void
+flow_sampling(struct peer_tmpl_source *source, struct store_flow_complete *flow)
+{
+	const struct peer_sampler *sampler = NULL;
+
+	if (flow->hdr.fields & STORE_FIELD_SAMPLING) {
+		if (flow->samp.interval != 0)
+			return;
+		sampler = peer_find_sampler(source, PEER_SAMPLER_ID,
+		    store_ntohll(flow->samp.sampler_id));
+	}
+	if (sampler == NULL && (flow->hdr.fields & STORE_FIELD_IF_INDICES))
+		sampler = peer_find_sampler(source, PEER_SAMPLER_IFINDEX,
+		    ntohl(flow->ifndx.if_index_in));
+	if (sampler == NULL)
+		sampler = peer_find_sampler(source, PEER_SAMPLER_SOURCE, 0);
+	if (sampler == NULL)
+		return;
+
+	flow->hdr.fields |= STORE_FIELD_SAMPLING;
+	flow->samp.interval = htonl(sampler->interval);
+	if (flow->samp.algorithm == STORE_SAMPLING_UNKNOWN)
+		flow->samp.algorithm = sampler->algorithm;
+}
+
+static void
+nf9_flowset_to_store(u_int8_t *pkt, struct timeval *tv,
+    struct xaddr *flow_source, struct NF9_HEADER *nf9_hdr,
+    struct peer_template *template, u_int32_t source_id,
+    struct store_flow_complete *flow)
+{
+#ifdef DEBUG_NF9
+	u_int offset, i;
+#endif
 
 	bzero(flow, sizeof(*flow));
 
@@ -808,17 +2197,16 @@ nf9_flowset_to_store(u_int8_t *pkt, size_t len, struct timeval *tv,
 	flow->recv_time.recv_usec = tv->tv_usec;
 	memcpy(&flow->agent_addr, flow_source, sizeof(flow->agent_addr));
 
+#ifdef DEBUG_NF9
 	offset = 0;
 	for (i = 0; i < template->num_records; i++) {
-#ifdef DEBUG_NF9
 		logit(LOG_DEBUG, "    record %d: type %d len %d: %s",
 		    i, template->records[i].type, template->records[i].len,
 		    data_ntoa(pkt + offset, template->records[i].len));
-#endif
-		nf9_rec_to_flow(&template->records[i], flow, pkt + offset);
 		offset += template->records[i].len;
 	}
-	return (0);
+#endif
+	tmpl_decode(&template->prog, pkt, flow);
 }
 
 static int
@@ -827,10 +2215,8 @@ process_netflow_v9_template(u_int8_t *pkt, size_t len, struct peer_state *peer,
 {
 	struct NF9_FLOWSET_HEADER_COMMON *template_header;
 	struct NF9_TEMPLATE_FLOWSET_HEADER *tmplh;
-	struct NF9_TEMPLATE_FLOWSET_RECORD *tmplr;
-	u_int i, count, offset, template_id, total_size;
-	struct peer_nf9_record *recs;
-	struct peer_nf9_template *template;
+	u_int i, count, n, offset, template_id, total_size;
+	struct peer_tmpl_record *recs;
 
 	logit(LOG_DEBUG, "netflow v.9 template flowset from source 0x%x "
 	    "(len %zd)", source_id, len);
@@ -854,6 +2240,9 @@ process_netflow_v9_template(u_int8_t *pkt, size_t len, struct peer_state *peer,
 	    addr_ntop_buf(&peer->from), source_id, len);
 
 	for (offset = sizeof(*template_header); offset < len;) {
+		/* Anything too short for a template header is padding */
+		if (len - offset < sizeof(*tmplh))
+			break;
 		tmplh = (struct NF9_TEMPLATE_FLOWSET_HEADER *)(pkt + offset);
 
 		template_id = ntohs(tmplh->template_id);
@@ -869,7 +2258,8 @@ process_netflow_v9_template(u_int8_t *pkt, size_t len, struct peer_state *peer,
 
 		total_size = 0;
 		for (i = 0; i < count; i++) {
-			if (offset >= len) {
+			if ((n = tmpl_decode_rec(pkt, len, offset, 9,
+			    &recs[i])) == 0) {
 				free(recs);
 				peer->ninvalid++;
 				logit(LOG_WARNING, "short netflow v.9 flowset "
@@ -879,11 +2269,7 @@ process_netflow_v9_template(u_int8_t *pkt, size_t len, struct peer_state *peer,
 				/* XXX ratelimit */
 				return (-1);
 			}
-			tmplr = (struct NF9_TEMPLATE_FLOWSET_RECORD *)
-			    (pkt + offset);
-			recs[i].type = ntohs(tmplr->type);
-			recs[i].len = ntohs(tmplr->length);
-			offset += sizeof(*tmplr);
+			offset += n;
 #ifdef DEBUG_NF9
 			logit(LOG_DEBUG, "  record %d: type %d len %d",
 			    i, recs[i].type, recs[i].len);
@@ -900,7 +2286,7 @@ process_netflow_v9_template(u_int8_t *pkt, size_t len, struct peer_state *peer,
 				/* XXX ratelimit */
 				return (-1);
 			}
-			if (!nf9_check_rec_len(recs[i].type, recs[i].len)) {
+			if (!tmpl_check_rec(&recs[i], 0)) {
 				peer->ninvalid++;
 				logit(LOG_WARNING, "Invalid field length in "
 				    "netflow v.9 flowset template %d from "
@@ -914,30 +2300,21 @@ process_netflow_v9_template(u_int8_t *pkt, size_t len, struct peer_state *peer,
 			/* XXX kill existing template on error! */
 		}
 	
-		template = peer_nf9_find_template(peer, source_id, template_id);
-		if (template == NULL) {
-			template = peer_nf9_new_template(peer, peers,
-			    source_id, template_id);
-		}
-	
-		if (template->records != NULL)
-			free(template->records);
-	
-		template->records = recs;
-		template->num_records = i;
-		template->total_len = total_size;
+		tmpl_store(peers, peer, 9, source_id, template_id, recs, i,
+		    total_size, 0);
 	}
 
 	return (0);
 }
 
 static int
-process_netflow_v9_data(u_int8_t *pkt, size_t len, struct timeval *tv, 
-    struct peer_state *peer, u_int32_t source_id, struct NF9_HEADER *nf9_hdr,
-    struct flowd_config *conf, int log_fd, int log_socket, u_int *num_flows)
+process_netflow_v9_data(u_int8_t *pkt, size_t len, struct timeval *tv,
+    const struct export_clock *clk, struct peer_state *peer,
+    u_int32_t source_id, struct NF9_HEADER *nf9_hdr,
+    struct flowd_config *conf, struct worker *w, u_int *num_flows)
 {
-	struct store_flow_complete *flows;
-	struct peer_nf9_template *template;
+	struct store_flow_complete flow;
+	struct peer_template *template;
 	struct NF9_DATA_FLOWSET_HEADER *dath;
 	u_int flowset_id, i, offset, num_flowsets;
 
@@ -957,7 +2334,7 @@ process_netflow_v9_data(u_int8_t *pkt, size_t len, struct timeval *tv,
 
 	flowset_id = ntohs(dath->c.flowset_id);
 
-	if ((template = peer_nf9_find_template(peer, source_id,
+	if ((template = peer_find_template(w->peers, peer, 9, source_id,
 	    flowset_id)) == NULL) {
 	    	peer->no_template++;
 		logit(LOG_DEBUG, "netflow v.9 data flowset without template "
@@ -969,8 +2346,17 @@ process_netflow_v9_data(u_int8_t *pkt, size_t len, struct timeval *tv,
 	if (template->records == NULL)
 		logerrx("%s: template->records == NULL", __func__);
 
+	if (template->num_scopes != 0)
+		return (process_options_data(pkt, len, peer, template,
+		    NULL));
+
+	/*
+	 * Work out how many complete records the flowset holds before
+	 * decoding any, so each can be passed on as soon as it is decoded
+	 */
 	offset = sizeof(*dath);
-	num_flowsets = (len - offset) / template->total_len;
+	num_flowsets = template->total_len == 0 ? 0 :
+	    (len - offset) / template->total_len;
 
 	if (num_flowsets == 0 || num_flowsets > 0x4000) {
 		logit(LOG_WARNING, "invalid netflow v.9 data flowset "
@@ -979,39 +2365,27 @@ process_netflow_v9_data(u_int8_t *pkt, size_t len, struct timeval *tv,
 		return (-1);
 	}
 
-	if ((flows = calloc(num_flowsets, sizeof(*flows))) == NULL)
-		logerrx("%s: calloc failed (num %d)", __func__, num_flowsets);
-
 	for (i = 0; i < num_flowsets; i++) {
-		if (nf9_flowset_to_store(pkt + offset, template->total_len, tv,
-		    &peer->from, nf9_hdr, template, source_id, 
-		    &flows[i]) == -1) {
-			peer->ninvalid++;
-			free(flows);
-			logit(LOG_WARNING, "invalid netflow v.9 data flowset "
-			    "from %s", addr_ntop_buf(&peer->from));
-			/* XXX ratelimit */
-			return (-1);
-		}
-
+		nf9_flowset_to_store(pkt + offset, tv, &peer->from,
+		    nf9_hdr, template, source_id, &flow);
+		if (template->source->num_samplers != 0)
+			flow_sampling(template->source, &flow);
+		flow_abs_times(&flow, clk);
+		process_flow(&flow, conf, w);
 		offset += template->total_len;
 	}
 	*num_flows = i;
 
-	for (i = 0; i < *num_flows; i++)
-		process_flow(&flows[i], conf, log_fd, log_socket);
-
-	free(flows);
-
 	return (0);
 }
 
 static void
 process_netflow_v9(struct flow_packet *fp, struct flowd_config *conf,
-    struct peer_state *peer, struct peers *peers, int log_fd, int log_socket)
+    struct peer_state *peer, struct worker *w)
 {
 	struct NF9_HEADER *nf9_hdr = (struct NF9_HEADER *)fp->packet;
 	struct NF9_FLOWSET_HEADER_COMMON *flowset;
+	struct export_clock clk;
 	u_int32_t i, count, flowset_id, flowset_len, flowset_flows;
 	u_int32_t offset, source_id, total_flows;
 
@@ -1031,6 +2405,12 @@ process_netflow_v9(struct flow_packet *fp, struct flowd_config *conf,
 	logit(LOG_DEBUG, "netflow v.9 packet (len %d) %d recs, source 0x%08x",
 	    fp->len, count, source_id);
 
+	/* The NetFlow v.9 sequence number counts packets */
+	peer_sequence(w->peers, peer, 9, source_id,
+	    ntohl(nf9_hdr->package_sequence), 1);
+	export_clock(&clk, peer, &fp->recv_time, ntohl(nf9_hdr->time_sec), 0,
+	    ntohl(nf9_hdr->uptime_ms), 1);
+
 #ifdef DEBUG_NF9
 	dump_packet(__func__, fp->packet, fp->len);
 #endif
@@ -1067,7 +2447,8 @@ process_netflow_v9(struct flow_packet *fp, struct flowd_config *conf,
 		 * the packet before we pass it to the flowset-specific
 		 * handlers below.
 		 */
-		if (offset + flowset_len > fp->len) {
+		if (offset + flowset_len > fp->len ||
+		    flowset_len < sizeof(*flowset)) {
 			peer->ninvalid++;
 			logit(LOG_WARNING,
 			    "short netflow v.9 flowset length %d bytes from %s",
@@ -1078,12 +2459,13 @@ process_netflow_v9(struct flow_packet *fp, struct flowd_config *conf,
 		switch (flowset_id) {
 		case NF9_TEMPLATE_FLOWSET_ID:
 			if (process_netflow_v9_template(fp->packet + offset,
-			    flowset_len, peer, peers, source_id) != 0)
+			    flowset_len, peer, w->peers, source_id) != 0)
 				return;
 			break;
 		case NF9_OPTIONS_FLOWSET_ID:
-			/* XXX: implement this (maybe) */
-			logit(LOG_DEBUG, "netflow v.9 options flowset");
+			if (process_options_template(fp->packet + offset,
+			    flowset_len, peer, w->peers, 9, source_id) != 0)
+				return;
 			break;
 		default:
 			if (flowset_id < NF9_MIN_RECORD_FLOWSET_ID) {
@@ -1095,9 +2477,8 @@ process_netflow_v9(struct flow_packet *fp, struct flowd_config *conf,
 				break;
 			}
 			if (process_netflow_v9_data(fp->packet + offset,
-			    flowset_len, &fp->recv_time, peer, source_id,
-			    nf9_hdr, conf, log_fd, log_socket,
-			    &flowset_flows) != 0)
+			    flowset_len, &fp->recv_time, &clk, peer,
+			    source_id, nf9_hdr, conf, w, &flowset_flows) != 0)
 				return;
 			total_flows += flowset_flows;
 			break;
@@ -1110,122 +2491,19 @@ process_netflow_v9(struct flow_packet *fp, struct flowd_config *conf,
 
 	/* Don't update peer unless we actually receive data from it */
 	if (total_flows > 0)
-		update_peer(peers, peer, total_flows, 9);
-}
-
-static int
-nf10_rec_to_flow(struct peer_nf10_record *rec, struct store_flow_complete *flow,
-    u_int8_t *data)
-{
-	/* XXX: use a table-based interpreter */
-	switch (rec->type) {
-
-/* Copy an int (possibly shorter than the target) keeping their LSBs aligned */
-#define BE_COPY(a) memcpy((u_char*)&a + (sizeof(a) - rec->len), data, rec->len);
-#define V10_FIELD(v10_field, store_field, flow_field) \
-	case v10_field: \
-		flow->hdr.fields |= STORE_FIELD_##store_field; \
-		BE_COPY(flow->flow_field); \
-		break
-#define V10_FIELD_ADDR(v10_field, store_field, flow_field, sub, family) \
-	case v10_field: \
-		flow->hdr.fields |= STORE_FIELD_##store_field; \
-		memcpy(&flow->flow_field.v##sub, data, rec->len); \
-		flow->flow_field.af = AF_##family; \
-		break
-
-	V10_FIELD(NF10_IN_BYTES, OCTETS, octets.flow_octets);
-	V10_FIELD(NF10_IN_PACKETS, PACKETS, packets.flow_packets);
-	V10_FIELD(NF10_IN_PROTOCOL, PROTO_FLAGS_TOS, pft.protocol);
-	V10_FIELD(NF10_SRC_TOS, PROTO_FLAGS_TOS, pft.tos);
-	V10_FIELD(NF10_TCP_FLAGS, PROTO_FLAGS_TOS, pft.tcp_flags);
-	V10_FIELD(NF10_L4_SRC_PORT, SRCDST_PORT, ports.src_port);
-	V10_FIELD(NF10_SRC_MASK, AS_INFO, asinf.src_mask);
-	V10_FIELD(NF10_INPUT_SNMP, IF_INDICES, ifndx.if_index_in);
-	V10_FIELD(NF10_L4_DST_PORT, SRCDST_PORT, ports.dst_port);
-	V10_FIELD(NF10_DST_MASK, AS_INFO, asinf.dst_mask);
-	V10_FIELD(NF10_OUTPUT_SNMP, IF_INDICES, ifndx.if_index_out);
-	V10_FIELD(NF10_SRC_AS, AS_INFO, asinf.src_as);
-	V10_FIELD(NF10_DST_AS, AS_INFO, asinf.dst_as);
-	V10_FIELD(NF10_LAST_SWITCHED, FLOW_TIMES, ftimes.flow_finish);
-	V10_FIELD(NF10_FIRST_SWITCHED, FLOW_TIMES, ftimes.flow_start);
-	V10_FIELD(NF10_IPV6_SRC_MASK, AS_INFO, asinf.src_mask);
-	V10_FIELD(NF10_IPV6_DST_MASK, AS_INFO, asinf.dst_mask);
-	V10_FIELD(NF10_ENGINE_TYPE, FLOW_ENGINE_INFO, finf.engine_type);
-	V10_FIELD(NF10_ENGINE_ID, FLOW_ENGINE_INFO, finf.engine_id);
-
-	V10_FIELD_ADDR(NF10_IPV4_SRC_ADDR, SRC_ADDR4, src_addr, 4, INET);
-	V10_FIELD_ADDR(NF10_IPV4_DST_ADDR, DST_ADDR4, dst_addr, 4, INET);
-	V10_FIELD_ADDR(NF10_IPV4_NEXT_HOP, GATEWAY_ADDR4, gateway_addr, 4, INET);
-
-	V10_FIELD_ADDR(NF10_IPV6_SRC_ADDR, SRC_ADDR6, src_addr, 6, INET6);
-	V10_FIELD_ADDR(NF10_IPV6_DST_ADDR, DST_ADDR6, dst_addr, 6, INET6);
-	V10_FIELD_ADDR(NF10_IPV6_NEXT_HOP, GATEWAY_ADDR6, gateway_addr, 6, INET6);
-
-#undef V10_FIELD
-#undef V10_FIELD_ADDR
-#undef BE_COPY
-	}
-	return (0);
-}
-
-static int
-nf10_check_rec_len(u_int type, u_int len)
-{
-	struct store_flow_complete t;
-
-	/* Sanity check */
-	if (len == 0 || len > 0x4000)
-		return (0);
-
-	/* XXX: use a table-based interpreter */
-	switch (type) {
-#define V10_FIELD_LEN(v10_field, flow_field) \
-	case v10_field: \
-		return (len <= sizeof(t.flow_field));
-
-	V10_FIELD_LEN(NF10_IN_BYTES, octets.flow_octets);
-	V10_FIELD_LEN(NF10_IN_PACKETS, packets.flow_packets);
-	V10_FIELD_LEN(NF10_IN_PROTOCOL, pft.protocol);
-	V10_FIELD_LEN(NF10_SRC_TOS, pft.tos);
-	V10_FIELD_LEN(NF10_TCP_FLAGS, pft.tcp_flags);
-	V10_FIELD_LEN(NF10_L4_SRC_PORT, ports.src_port);
-	V10_FIELD_LEN(NF10_IPV4_SRC_ADDR, src_addr.v4);
-	V10_FIELD_LEN(NF10_SRC_MASK, asinf.src_mask);
-	V10_FIELD_LEN(NF10_INPUT_SNMP, ifndx.if_index_in);
-	V10_FIELD_LEN(NF10_L4_DST_PORT, ports.dst_port);
-	V10_FIELD_LEN(NF10_IPV4_DST_ADDR, dst_addr.v4);
-	V10_FIELD_LEN(NF10_DST_MASK, asinf.src_mask);
-	V10_FIELD_LEN(NF10_OUTPUT_SNMP, ifndx.if_index_out);
-	V10_FIELD_LEN(NF10_IPV4_NEXT_HOP, gateway_addr.v4);
-	V10_FIELD_LEN(NF10_SRC_AS, asinf.src_as);
-	V10_FIELD_LEN(NF10_DST_AS, asinf.dst_as);
-	V10_FIELD_LEN(NF10_LAST_SWITCHED, ftimes.flow_finish);
-	V10_FIELD_LEN(NF10_FIRST_SWITCHED, ftimes.flow_start);
-	V10_FIELD_LEN(NF10_IPV6_SRC_ADDR, src_addr.v6);
-	V10_FIELD_LEN(NF10_IPV6_DST_ADDR, dst_addr.v6);
-	V10_FIELD_LEN(NF10_IPV6_SRC_MASK, asinf.src_mask);
-	V10_FIELD_LEN(NF10_IPV6_DST_MASK, asinf.dst_mask);
-	V10_FIELD_LEN(NF10_ENGINE_TYPE, finf.engine_type);
-	V10_FIELD_LEN(NF10_ENGINE_ID, finf.engine_id);
-	V10_FIELD_LEN(NF10_IPV6_NEXT_HOP, gateway_addr.v6);
-
-#undef V10_FIELD_LEN
-	default:
-		return (1);
-	}
+		update_peer(w->peers, peer, total_flows, 9,
+		    &fp->recv_time);
 }
 
-static int
-nf10_flowset_to_store(u_int8_t *pkt, size_t len, struct timeval *tv,
+static void
+nf10_flowset_to_store(u_int8_t *pkt, struct timeval *tv,
     struct xaddr *flow_source, struct NF10_HEADER *nf10_hdr,
-    struct peer_nf10_template *template, u_int32_t source_id,
+    struct peer_template *template, u_int32_t source_id,
     struct store_flow_complete *flow)
 {
+#ifdef DEBUG_NF10
 	u_int offset, i;
-
-	if (template->total_len > len)
-		return (-1);
+#endif
 
 	bzero(flow, sizeof(*flow));
 
@@ -1240,17 +2518,21 @@ nf10_flowset_to_store(u_int8_t *pkt, size_t len, struct timeval *tv,
 	flow->recv_time.recv_usec = tv->tv_usec;
 	memcpy(&flow->agent_addr, flow_source, sizeof(flow->agent_addr));
 
+#ifdef DEBUG_NF10
 	offset = 0;
 	for (i = 0; i < template->num_records; i++) {
-#ifdef DEBUG_NF10
+		if (template->records[i].len == NF10_VARLEN) {
+			logit(LOG_DEBUG, "    record %d: type %d varlen",
+			    i, template->records[i].type);
+			break;
+		}
 		logit(LOG_DEBUG, "    record %d: type %d len %d: %s",
 		    i, template->records[i].type, template->records[i].len,
 		    data_ntoa(pkt + offset, template->records[i].len));
-#endif
-		nf10_rec_to_flow(&template->records[i], flow, pkt + offset);
 		offset += template->records[i].len;
 	}
-	return (0);
+#endif
+	tmpl_decode(&template->prog, pkt, flow);
 }
 
 static int
@@ -1259,10 +2541,8 @@ process_netflow_v10_template(u_int8_t *pkt, size_t len, struct peer_state *peer,
 {
 	struct NF10_FLOWSET_HEADER_COMMON *template_header;
 	struct NF10_TEMPLATE_FLOWSET_HEADER *tmplh;
-	struct NF10_TEMPLATE_FLOWSET_RECORD *tmplr;
-	u_int i, count, offset, template_id, total_size;
-	struct peer_nf10_record *recs;
-	struct peer_nf10_template *template;
+	u_int i, count, n, offset, template_id, total_size;
+	struct peer_tmpl_record *recs;
 
 	logit(LOG_DEBUG, "netflow v.9 template flowset from source 0x%x "
 	    "(len %zd)", source_id, len);
@@ -1286,6 +2566,9 @@ process_netflow_v10_template(u_int8_t *pkt, size_t len, struct peer_state *peer,
 	    addr_ntop_buf(&peer->from), source_id, len);
 
 	for (offset = sizeof(*template_header); offset < len;) {
+		/* Anything too short for a template header is padding */
+		if (len - offset < sizeof(*tmplh))
+			break;
 		tmplh = (struct NF10_TEMPLATE_FLOWSET_HEADER *)(pkt + offset);
 
 		template_id = ntohs(tmplh->template_id);
@@ -1301,9 +2584,10 @@ process_netflow_v10_template(u_int8_t *pkt, size_t len, struct peer_state *peer,
 
 		total_size = 0;
 		for (i = 0; i < count; i++) {
-			if (offset >= len) {
+			if ((n = tmpl_decode_rec(pkt, len, offset, 10,
+			    &recs[i])) == 0) {
 				peer->ninvalid++;
-				logit(LOG_WARNING, "short netflow v.9 flowset "
+				logit(LOG_WARNING, "short netflow v.10 "
 				    "template 0x%08x/0x%04x %zd bytes from %s",
 				    source_id, template_id, len,
 				    addr_ntop_buf(&peer->from));
@@ -1311,18 +2595,15 @@ process_netflow_v10_template(u_int8_t *pkt, size_t len, struct peer_state *peer,
 				/* XXX ratelimit */
 				return (-1);
 			}
-			tmplr = (struct NF10_TEMPLATE_FLOWSET_RECORD *)
-			    (pkt + offset);
-			recs[i].type = ntohs(tmplr->type);
-			recs[i].len = ntohs(tmplr->length);
-			offset += sizeof(*tmplr);
-			if (recs[i].type & NF10_ENTERPRISE)
-				offset += sizeof(u_int32_t);	/* XXX -- ? */
+			offset += n;
 #ifdef DEBUG_NF10
-			logit(LOG_DEBUG, "  record %d: type %d len %d",
-			    i, recs[i].type, recs[i].len);
+			logit(LOG_DEBUG, "  record %d: type %d len %d "
+			    "enterprise %u", i, recs[i].type, recs[i].len,
+			    recs[i].enterprise);
 #endif
-			total_size += recs[i].len;
+			/* Variable-length fields take at least one byte */
+			total_size += recs[i].len == NF10_VARLEN ?
+			    1 : recs[i].len;
 			if (total_size > peers->max_template_len) {
 				free(recs);
 				peer->ninvalid++;
@@ -1334,7 +2615,7 @@ process_netflow_v10_template(u_int8_t *pkt, size_t len, struct peer_state *peer,
 				/* XXX ratelimit */
 				return (-1);
 			}
-			if (!nf10_check_rec_len(recs[i].type, recs[i].len)) {
+			if (!tmpl_check_rec(&recs[i], 1)) {
 				peer->ninvalid++;
 				logit(LOG_WARNING, "Invalid field length in "
 				    "netflow v. flowset template %d from "
@@ -1348,18 +2629,8 @@ process_netflow_v10_template(u_int8_t *pkt, size_t len, struct peer_state *peer,
 			/* XXX kill existing template on error! */
 		}
 
-		template = peer_nf10_find_template(peer, source_id, template_id);
-		if (template == NULL) {
-			template = peer_nf10_new_template(peer, peers,
-			    source_id, template_id);
-		}
-
-		if (template->records != NULL)
-			free(template->records);
-
-		template->records = recs;
-		template->num_records = i;
-		template->total_len = total_size;
+		tmpl_store(peers, peer, 10, source_id, template_id, recs, i,
+		    total_size, 0);
 	}
 
 	return (0);
@@ -1367,15 +2638,18 @@ process_netflow_v10_template(u_int8_t *pkt, size_t len, struct peer_state *peer,
 
 static int
 process_netflow_v10_data(u_int8_t *pkt, size_t len, struct timeval *tv,
-    struct peer_state *peer, u_int32_t source_id, struct NF10_HEADER *nf10_hdr,
-    struct flowd_config *conf, int log_fd, int log_socket, u_int *num_flows)
+    const struct export_clock *clk, struct peer_state *peer,
+    u_int32_t source_id, struct NF10_HEADER *nf10_hdr,
+    struct flowd_config *conf, struct worker *w, u_int *num_flows,
+    u_int *num_records)
 {
-	struct store_flow_complete *flows;
-	struct peer_nf10_template *template;
+	struct store_flow_complete flow;
+	struct peer_template *template;
 	struct NF10_DATA_FLOWSET_HEADER *dath;
-	u_int flowset_id, i, offset, num_flowsets;
+	u_int flowset_id, i, offset, num_flowsets, o, rlen;
 
 	*num_flows = 0;
+	*num_records = 0;
 
 	logit(LOG_DEBUG, "netflow v.10 data flowset (len %zd) source 0x%08x",
 	    len, source_id);
@@ -1391,20 +2665,53 @@ process_netflow_v10_data(u_int8_t *pkt, size_t len, struct timeval *tv,
 
 	flowset_id = ntohs(dath->c.flowset_id);
 
-	if ((template = peer_nf10_find_template(peer, source_id,
+	if ((template = peer_find_template(w->peers, peer, 10, source_id,
 	    flowset_id)) == NULL) {
 		peer->no_template++;
 		logit(LOG_DEBUG, "netflow v.10 data flowset without template "
 		    "%s/0x%08x/0x%04x", addr_ntop_buf(&peer->from), source_id,
 		    flowset_id);
+		/* Its records can't be counted for sequence tracking */
+		*num_records = PEER_SEQ_UNKNOWN;
 		return (0);
 	}
 
 	if (template->records == NULL)
 		logerrx("%s: template->records == NULL", __func__);
 
+	if (template->num_scopes != 0)
+		return (process_options_data(pkt, len, peer, template,
+		    num_records));
+
+	/*
+	 * Work out how many complete records the flowset holds before
+	 * decoding any, so each can be passed on as soon as it is decoded
+	 */
 	offset = sizeof(*dath);
-	num_flowsets = (len - offset) / template->total_len;
+	if (template->prog.num_var == 0) {
+		num_flowsets = template->total_len == 0 ? 0 :
+		    (len - offset) / template->total_len;
+	} else {
+		/*
+		 * Records with variable-length fields must be walked to
+		 * count them. Anything shorter than the smallest possible
+		 * record is padding, but a record that starts and is then
+		 * cut short invalidates the flowset.
+		 */
+		for (num_flowsets = 0, o = offset;
+		    len - o >= template->total_len; num_flowsets++) {
+			if ((rlen = tmpl_record_len(&template->prog, pkt + o,
+			    len - o)) == 0) {
+				peer->ninvalid++;
+				logit(LOG_WARNING, "truncated netflow v.10 "
+				    "data record from %s",
+				    addr_ntop_buf(&peer->from));
+				/* XXX ratelimit */
+				return (-1);
+			}
+			o += rlen;
+		}
+	}
 
 	if (num_flowsets == 0 || num_flowsets > 0x4000) {
 		logit(LOG_WARNING, "invalid netflow v.10 data flowset "
@@ -1413,41 +2720,33 @@ process_netflow_v10_data(u_int8_t *pkt, size_t len, struct timeval *tv,
 		return (-1);
 	}
 
-	if ((flows = calloc(num_flowsets, sizeof(*flows))) == NULL)
-		logerrx("%s: calloc failed (num %d)", __func__, num_flowsets);
-
 	for (i = 0; i < num_flowsets; i++) {
-		if (nf10_flowset_to_store(pkt + offset, template->total_len, tv,
-		    &peer->from, nf10_hdr, template, source_id,
-		    &flows[i]) == -1) {
-			peer->ninvalid++;
-			free(flows);
-			logit(LOG_WARNING, "invalid netflow v.10 data flowset "
-			    "from %s", addr_ntop_buf(&peer->from));
-			/* XXX ratelimit */
-			return (-1);
-		}
-
-		offset += template->total_len;
+		nf10_flowset_to_store(pkt + offset, tv, &peer->from,
+		    nf10_hdr, template, source_id, &flow);
+		if (template->source->num_samplers != 0)
+			flow_sampling(template->source, &flow);
+		flow_abs_times(&flow, clk);
+		process_flow(&flow, conf, w);
+		if (template->prog.num_var == 0)
+			offset += template->total_len;
+		else
+			offset += tmpl_record_len(&template->prog,
+			    pkt + offset, len - offset);
 	}
-	*num_flows = i;
-
-	for (i = 0; i < *num_flows; i++)
-		process_flow(&flows[i], conf, log_fd, log_socket);
-
-	free(flows);
+	*num_flows = *num_records = i;
 
 	return (0);
 }
 
 static void
 process_netflow_v10(struct flow_packet *fp, struct flowd_config *conf,
-    struct peer_state *peer, struct peers *peers, int log_fd, int log_socket)
+    struct peer_state *peer, struct worker *w)
 {
 	struct NF10_HEADER *nf10_hdr = (struct NF10_HEADER *)fp->packet;
 	struct NF10_FLOWSET_HEADER_COMMON *flowset;
+	struct export_clock clk;
 	u_int32_t i, pktlen, flowset_id, flowset_len, flowset_flows;
-	u_int32_t offset, source_id, total_flows;
+	u_int32_t offset, source_id, total_flows, flowset_recs, total_recs;
 
 	if (fp->len < sizeof(*nf10_hdr)) {
 		peer->ninvalid++;
@@ -1470,8 +2769,12 @@ process_netflow_v10(struct flow_packet *fp, struct flowd_config *conf,
 	dump_packet(__func__, fp->packet, fp->len);
 #endif
 
+	/* IPFIX flows don't have times relative to the exporter's uptime */
+	export_clock(&clk, peer, &fp->recv_time, ntohl(nf10_hdr->time_sec), 0,
+	    0, 0);
+
 	offset = sizeof(*nf10_hdr);
-	total_flows = 0;
+	total_flows = total_recs = 0;
 
 	for (i = 0;; i++) {
 		/* Make sure we don't run off the end of the flow */
@@ -1502,7 +2805,8 @@ process_netflow_v10(struct flow_packet *fp, struct flowd_config *conf,
 		 * the packet before we pass it to the flowset-specific
 		 * handlers below.
 		 */
-		if (offset + flowset_len > fp->len) {
+		if (offset + flowset_len > fp->len ||
+		    flowset_len < sizeof(*flowset)) {
 			peer->ninvalid++;
 			logit(LOG_WARNING,
 			    "short netflow v.10 flowset length %d bytes from %s",
@@ -1513,12 +2817,13 @@ process_netflow_v10(struct flow_packet *fp, struct flowd_config *conf,
 		switch (flowset_id) {
 		case NF10_TEMPLATE_FLOWSET_ID:
 			if (process_netflow_v10_template(fp->packet + offset,
-			    flowset_len, peer, peers, source_id) != 0)
+			    flowset_len, peer, w->peers, source_id) != 0)
 				return;
 			break;
 		case NF10_OPTIONS_FLOWSET_ID:
-			/* XXX: implement this (maybe) */
-			logit(LOG_DEBUG, "netflow v.10 options flowset");
+			if (process_options_template(fp->packet + offset,
+			    flowset_len, peer, w->peers, 10, source_id) != 0)
+				return;
 			break;
 		default:
 			if (flowset_id < NF10_MIN_RECORD_FLOWSET_ID) {
@@ -1530,11 +2835,15 @@ process_netflow_v10(struct flow_packet *fp, struct flowd_config *conf,
 				break;
 			}
 			if (process_netflow_v10_data(fp->packet + offset,
-			    flowset_len, &fp->recv_time, peer, source_id,
-			    nf10_hdr, conf, log_fd, log_socket,
-			    &flowset_flows) != 0)
+			    flowset_len, &fp->recv_time, &clk, peer,
+			    source_id, nf10_hdr, conf, w, &flowset_flows,
+			    &flowset_recs) != 0)
 				return;
 			total_flows += flowset_flows;
+			if (flowset_recs == PEER_SEQ_UNKNOWN)
+				total_recs = PEER_SEQ_UNKNOWN;
+			else if (total_recs != PEER_SEQ_UNKNOWN)
+				total_recs += flowset_recs;
 			break;
 		}
 		offset += flowset_len;
@@ -1542,127 +2851,502 @@ process_netflow_v10(struct flow_packet *fp, struct flowd_config *conf,
 			break;
 	}
 
+	/* The IPFIX sequence number counts data records */
+	peer_sequence(w->peers, peer, 10, source_id,
+	    ntohl(nf10_hdr->package_sequence), total_recs);
+
 	/* Don't update peer unless we actually receive data from it */
 	if (total_flows > 0)
-		update_peer(peers, peer, total_flows, 10);
+		update_peer(w->peers, peer, total_flows, 10,
+		    &fp->recv_time);
 }
 
-static int
-receive_packet(struct flowd_config *conf, struct peers *peers, int net_fd)
+/*
+ * Decode the "len" bytes of packet header in an sFlow raw packet header
+ * record, down to the transport layer. Packets that aren't IP are left
+ * without addresses.
+ */
+static void
+sflow_decode_header(const struct SFLOW5_RAW_HEADER_RECORD *rh, u_int len,
+    struct store_flow_complete *flow)
 {
-	struct sockaddr_storage from;
-	struct peer_state *peer;
-	socklen_t fromlen;
-	u_int8_t buf[2048];
-	ssize_t len;
-	struct xaddr flow_source;
-	struct flow_packet *fp;
-	struct forward_addr *fa;
+	const u_int8_t *p = (const u_int8_t *)(rh + 1);
+	u_int etype, hlen, nxt, i, l2len, l4;
+	u_int64_t iplen, frame_len;
 
-	if ((fp = flow_packet_alloc()) == NULL) {
-		logit(LOG_WARNING, "flow packet metadata alloc failed");
-		return (0);
+	switch (ntohl(rh->protocol)) {
+	case SFLOW5_HEADER_ETHERNET:
+		if (len < 14)
+			return;
+		etype = (p[12] << 8) | p[13];
+		p += 14;
+		len -= 14;
+		/* Skip up to two VLAN tags */
+		for (i = 0; i < 2 && (etype == ETHERTYPE_VLAN ||
+		    etype == ETHERTYPE_QINQ); i++) {
+			if (len < 4)
+				return;
+			etype = (p[2] << 8) | p[3];
+			p += 4;
+			len -= 4;
+		}
+		break;
+	case SFLOW5_HEADER_IPV4:
+		etype = ETHERTYPE_IP;
+		break;
+	case SFLOW5_HEADER_IPV6:
+		etype = ETHERTYPE_IPV6;
+		break;
+	default:
+		return;
 	}
+	l2len = p - (const u_int8_t *)(rh + 1);
 
- retry:
-	fromlen = sizeof(from);
-	if ((len = recvfrom(net_fd, buf, sizeof(buf), 0,
-	    (struct sockaddr *)&from, &fromlen)) < 0) {
-		if (errno == EINTR)
-			goto retry;
-		if (errno != EAGAIN)
-			logit(LOG_WARNING, "recvfrom(fd = %d)", net_fd);
-		/* XXX ratelimit errors */
-		flow_packet_dealloc(fp);
-		return (0);
+	l4 = 1;
+	switch (etype) {
+	case ETHERTYPE_IP:
+		if (len < 20 || (p[0] >> 4) != 4 ||
+		    (hlen = (p[0] & 0xf) * 4) < 20)
+			return;
+		iplen = (p[2] << 8) | p[3];
+		flow->pft.tos = p[1];
+		nxt = p[9];
+		/* Only the first fragment has the transport header */
+		if ((((p[6] << 8) | p[7]) & 0x1fff) != 0)
+			l4 = 0;
+		flow->src_addr.af = flow->dst_addr.af = AF_INET;
+		memcpy(&flow->src_addr.v4, p + 12, sizeof(flow->src_addr.v4));
+		memcpy(&flow->dst_addr.v4, p + 16, sizeof(flow->dst_addr.v4));
+		break;
+	case ETHERTYPE_IPV6:
+		if (len < 40 || (p[0] >> 4) != 6)
+			return;
+		iplen = ((p[4] << 8) | p[5]) + 40;
+		flow->pft.tos = ((p[0] & 0xf) << 4) | (p[1] >> 4);
+		nxt = p[6];
+		flow->src_addr.af = flow->dst_addr.af = AF_INET6;
+		memcpy(&flow->src_addr.v6, p + 8, sizeof(flow->src_addr.v6));
+		memcpy(&flow->dst_addr.v6, p + 24, sizeof(flow->dst_addr.v6));
+		/* Skip extension headers to find the transport header */
+		for (hlen = 40; l4 && (nxt == IPPROTO_HOPOPTS ||
+		    nxt == IPPROTO_ROUTING || nxt == IPPROTO_DSTOPTS ||
+		    nxt == IPPROTO_FRAGMENT);) {
+			if (len < hlen + 8) {
+				l4 = 0;
+				break;
+			}
+			if (nxt == IPPROTO_FRAGMENT) {
+				if ((((p[hlen + 2] << 8) | p[hlen + 3]) &
+				    0xfff8) != 0)
+					l4 = 0;
+				i = 8;
+			} else
+				i = (p[hlen + 1] + 1) * 8;
+			nxt = p[hlen];
+			hlen += i;
+		}
+		break;
+	default:
+		return;
+	}
+	flow->pft.protocol = nxt;
+
+	if (l4 && len >= hlen + 4) {
+		p += hlen;
+		len -= hlen;
+		switch (nxt) {
+		case IPPROTO_TCP:
+			if (len >= 14)
+				flow->pft.tcp_flags = p[13];
+			/* FALLTHROUGH */
+		case IPPROTO_UDP:
+			memcpy(&flow->ports.src_port, p, 2);
+			memcpy(&flow->ports.dst_port, p + 2, 2);
+			break;
+		case IPPROTO_ICMP:
+		case IPPROTO_ICMPV6:
+			/* ICMP type and code go in the destination port */
+			memcpy(&flow->ports.dst_port, p, 2);
+			break;
+		}
 	}
-	fp->len = len;
-	gettimeofday(&fp->recv_time, NULL);
 
-	if (addr_sa_to_xaddr((struct sockaddr *)&from, fromlen,
-	    &fp->flow_source) == -1) {
-		logit(LOG_WARNING, "Invalid agent address");
-		flow_packet_dealloc(fp);
-		return (1);
+	/*
+	 * Prefer the length from the IP header, but fall back to the frame
+	 * length for packets that don't have one (e.g. TSO)
+	 */
+	frame_len = ntohl(rh->frame_length);
+	if (iplen == 0 && frame_len > (u_int64_t)ntohl(rh->stripped) + l2len)
+		iplen = frame_len - ntohl(rh->stripped) - l2len;
+	flow->octets.flow_octets = store_htonll(iplen);
+}
+
+/* Read a 32 bit XDR word, which needn't be aligned in the packet */
+static u_int32_t
+sflow_get32(const u_int8_t *p)
+{
+	u_int32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return (ntohl(v));
+}
+
+/* Decode an sFlow address, returning its encoded length or -1 if invalid */
+static int
+sflow_decode_addr(const u_int8_t *p, size_t len, struct xaddr *addr)
+{
+	if (len < 4)
+		return (-1);
+	switch (sflow_get32(p)) {
+	case SFLOW5_ADDR_IP4:
+		if (len < 4 + sizeof(addr->v4))
+			return (-1);
+		addr->af = AF_INET;
+		memcpy(&addr->v4, p + 4, sizeof(addr->v4));
+		return (4 + sizeof(addr->v4));
+	case SFLOW5_ADDR_IP6:
+		if (len < 4 + sizeof(addr->v6))
+			return (-1);
+		addr->af = AF_INET6;
+		memcpy(&addr->v6, p + 4, sizeof(addr->v6));
+		return (4 + sizeof(addr->v6));
+	case 0:
+		/* Unknown address type, leave it unset */
+		return (4);
+	default:
+		return (-1);
 	}
+}
 
-	if ((peer = find_peer(peers, &fp->flow_source)) == NULL)
-		peer = new_peer(peers, conf, &fp->flow_source);
-	if (peer == NULL) {
-		logit(LOG_DEBUG, "packet from unauthorised agent %s",
-		    addr_ntop_buf(&fp->flow_source));
-		flow_packet_dealloc(fp);
-		return (1);
+/*
+ * Decode one sFlow flow sample into a flow, starting from the fields
+ * taken from the datagram header in "base". Returns the number of flows
+ * produced (samples of non-IP packets don't produce one) or -1 if the
+ * sample is invalid.
+ */
+static int
+process_sflow_flow_sample(const u_int8_t *pkt, size_t len, u_int format,
+    const struct store_flow_complete *base, struct flowd_config *conf,
+    struct worker *w)
+{
+	const struct SFLOW5_FLOW_SAMPLE_HEADER *fs;
+	const struct SFLOW5_FLOW_SAMPLE_EXPANDED_HEADER *xfs;
+	const struct SFLOW5_DATA_HEADER *rec;
+	const struct SFLOW5_RAW_HEADER_RECORD *rh;
+	const struct SFLOW5_SAMPLED_IPV4_RECORD *ip4;
+	const struct SFLOW5_SAMPLED_IPV6_RECORD *ip6;
+	const struct SFLOW5_EXTENDED_GATEWAY_AS *gw;
+	const u_int8_t *p;
+	struct store_flow_complete flow;
+	struct xaddr nexthop;
+	u_int32_t i, j, nrecs, nsegs, seglen, rate, rlen, in, out, dst_as;
+	u_int64_t sampler_id;
+	size_t offset;
+	int alen;
+
+	memcpy(&flow, base, sizeof(flow));
+
+	if (format == SFLOW5_FLOW_SAMPLE) {
+		if (len < sizeof(*fs))
+			return (-1);
+		fs = (const struct SFLOW5_FLOW_SAMPLE_HEADER *)pkt;
+		flow.finf.flow_sequence = fs->sequence;
+		sampler_id = ((u_int64_t)(ntohl(fs->source_id) >> 24) << 32) |
+		    (ntohl(fs->source_id) & 0xffffff);
+		rate = ntohl(fs->sampling_rate);
+		in = ntohl(fs->input);
+		out = ntohl(fs->output);
+		if (SFLOW5_IF_FORMAT(in) == SFLOW5_IF_INDEX)
+			flow.ifndx.if_index_in = htonl(SFLOW5_IF_VALUE(in));
+		if (SFLOW5_IF_FORMAT(out) == SFLOW5_IF_INDEX)
+			flow.ifndx.if_index_out = htonl(SFLOW5_IF_VALUE(out));
+		nrecs = ntohl(fs->num_records);
+		offset = sizeof(*fs);
+	} else {
+		if (len < sizeof(*xfs))
+			return (-1);
+		xfs = (const struct SFLOW5_FLOW_SAMPLE_EXPANDED_HEADER *)pkt;
+		flow.finf.flow_sequence = xfs->sequence;
+		sampler_id = ((u_int64_t)ntohl(xfs->source_id_type) << 32) |
+		    ntohl(xfs->source_id_index);
+		rate = ntohl(xfs->sampling_rate);
+		if (ntohl(xfs->input_format) == SFLOW5_IF_INDEX)
+			flow.ifndx.if_index_in = xfs->input;
+		if (ntohl(xfs->output_format) == SFLOW5_IF_INDEX)
+			flow.ifndx.if_index_out = xfs->output;
+		nrecs = ntohl(xfs->num_records);
+		offset = sizeof(*xfs);
 	}
 
-	if (fp->len < sizeof(struct NF_HEADER_COMMON)) {
-		peer->ninvalid++;
-		logit(LOG_WARNING, "short packet %d bytes from %s", fp->len,
-		    addr_ntop_buf(&flow_source));
-		flow_packet_dealloc(fp);
-		return (1);
+	for (i = 0; i < nrecs; i++) {
+		if (len - offset < sizeof(*rec))
+			return (-1);
+		rec = (const struct SFLOW5_DATA_HEADER *)(pkt + offset);
+		rlen = ntohl(rec->length);
+		offset += sizeof(*rec);
+		if (rlen > len - offset || (rlen & 3) != 0)
+			return (-1);
+		p = pkt + offset;
+		offset += rlen;
+
+		switch (ntohl(rec->format)) {
+		case SFLOW5_RAW_HEADER:
+			if (rlen < sizeof(*rh))
+				return (-1);
+			rh = (const struct SFLOW5_RAW_HEADER_RECORD *)p;
+			if (ntohl(rh->header_length) > rlen - sizeof(*rh))
+				return (-1);
+			sflow_decode_header(rh, ntohl(rh->header_length),
+			    &flow);
+			break;
+		case SFLOW5_SAMPLED_IPV4:
+			if (rlen < sizeof(*ip4))
+				return (-1);
+			ip4 = (const struct SFLOW5_SAMPLED_IPV4_RECORD *)p;
+			flow.src_addr.af = flow.dst_addr.af = AF_INET;
+			flow.src_addr.v4.s_addr = ip4->src_ip;
+			flow.dst_addr.v4.s_addr = ip4->dst_ip;
+			flow.pft.protocol = ntohl(ip4->protocol);
+			flow.pft.tos = ntohl(ip4->tos);
+			flow.pft.tcp_flags = ntohl(ip4->tcp_flags);
+			flow.ports.src_port = htons(ntohl(ip4->src_port));
+			flow.ports.dst_port = htons(ntohl(ip4->dst_port));
+			flow.octets.flow_octets =
+			    store_htonll(ntohl(ip4->length));
+			break;
+		case SFLOW5_SAMPLED_IPV6:
+			if (rlen < sizeof(*ip6))
+				return (-1);
+			ip6 = (const struct SFLOW5_SAMPLED_IPV6_RECORD *)p;
+			flow.src_addr.af = flow.dst_addr.af = AF_INET6;
+			memcpy(&flow.src_addr.v6, ip6->src_ip,
+			    sizeof(flow.src_addr.v6));
+			memcpy(&flow.dst_addr.v6, ip6->dst_ip,
+			    sizeof(flow.dst_addr.v6));
+			flow.pft.protocol = ntohl(ip6->protocol);
+			flow.pft.tos = ntohl(ip6->priority);
+			flow.pft.tcp_flags = ntohl(ip6->tcp_flags);
+			flow.ports.src_port = htons(ntohl(ip6->src_port));
+			flow.ports.dst_port = htons(ntohl(ip6->dst_port));
+			flow.octets.flow_octets =
+			    store_htonll(ntohl(ip6->length));
+			break;
+		case SFLOW5_EXTENDED_ROUTER:
+			bzero(&nexthop, sizeof(nexthop));
+			if ((alen = sflow_decode_addr(p, rlen,
+			    &nexthop)) == -1 ||
+			    rlen - alen < 2 * sizeof(u_int32_t))
+				return (-1);
+			memcpy(&flow.gateway_addr, &nexthop, sizeof(nexthop));
+			flow.asinf.src_mask = sflow_get32(p + alen);
+			flow.asinf.dst_mask = sflow_get32(p + alen + 4);
+			flow.hdr.fields |= STORE_FIELD_AS_INFO;
+			if (nexthop.af == AF_INET)
+				flow.hdr.fields |= STORE_FIELD_GATEWAY_ADDR4;
+			else if (nexthop.af == AF_INET6)
+				flow.hdr.fields |= STORE_FIELD_GATEWAY_ADDR6;
+			break;
+		case SFLOW5_EXTENDED_GATEWAY:
+			if ((alen = sflow_decode_addr(p, rlen,
+			    &nexthop)) == -1 ||
+			    rlen - alen < sizeof(*gw))
+				return (-1);
+			gw = (const struct SFLOW5_EXTENDED_GATEWAY_AS *)
+			    (p + alen);
+			/* The destination AS is the last in the path */
+			dst_as = 0;
+			nsegs = ntohl(gw->num_segments);
+			p += alen + sizeof(*gw);
+			rlen -= alen + sizeof(*gw);
+			for (j = 0; j < nsegs; j++) {
+				if (rlen < 8 ||
+				    (seglen = sflow_get32(p + 4)) > (rlen - 8) / 4)
+					return (-1);
+				/* Kept in network byte order, as in the flow */
+				if (seglen > 0)
+					memcpy(&dst_as, p + 8 + (seglen - 1) * 4,
+					    sizeof(dst_as));
+				p += 8 + seglen * 4;
+				rlen -= 8 + seglen * 4;
+			}
+			flow.asinf.src_as = gw->src_as;
+			flow.asinf.dst_as = dst_as;
+			flow.hdr.fields |= STORE_FIELD_AS_INFO;
+			break;
+		}
 	}
 
-	if ((fp->packet = malloc(fp->len)) == NULL) {
-		logit(LOG_WARNING, "flow packet alloc failed (len %d)",
-		    fp->len);
-		flow_packet_dealloc(fp);
+	/* Only samples of IP packets make flows */
+	if (flow.src_addr.af == AF_INET)
+		flow.hdr.fields |= STORE_FIELD_SRC_ADDR4 | STORE_FIELD_DST_ADDR4;
+	else if (flow.src_addr.af == AF_INET6)
+		flow.hdr.fields |= STORE_FIELD_SRC_ADDR6 | STORE_FIELD_DST_ADDR6;
+	else
 		return (0);
-	}
-	memcpy(fp->packet, buf, fp->len);
-	flow_packet_enqueue(fp);
 
-	TAILQ_FOREACH(fa, &conf->forward_addrs, entry) {
-		logit(LOG_DEBUG, "Forwarding packet to %s", addr_ntop_buf(&fa->addr));
-		send(fa->fd, fp->packet, fp->len, 0);
+	if (rate != 0) {
+		flow.hdr.fields |= STORE_FIELD_SAMPLING;
+		flow.samp.sampler_id = store_htonll(sampler_id);
+		flow.samp.interval = htonl(rate);
+		flow.samp.algorithm = STORE_SAMPLING_RANDOM;
 	}
 
+	process_flow(&flow, conf, w);
+
 	return (1);
 }
 
 static void
-receive_many(struct flowd_config *conf, struct peers *peers, int net_fd)
+process_sflow(struct flow_packet *fp, struct flowd_config *conf,
+    struct peer_state *peer, struct worker *w)
 {
-	int i;
+	struct SFLOW5_HEADER *sf_hdr = (struct SFLOW5_HEADER *)fp->packet;
+	struct SFLOW5_HEADER_TAIL *sf_tail;
+	struct SFLOW5_DATA_HEADER *sample;
+	struct store_flow_complete base;
+	struct xaddr agent;
+	u_int32_t i, nsamples, format, sample_len, total_flows;
+	size_t offset;
+	int alen, r;
 
-	for (i = 0; i < INPUT_MAX_PACKET_PER_FD; i++) {
-		if (receive_packet(conf, peers, net_fd) == 0) {
-			logit(LOG_DEBUG, "Received max number of packets "
-			    "(%d) on fd %d", INPUT_MAX_PACKET_PER_FD, net_fd);
+	if (fp->len < sizeof(*sf_hdr)) {
+		peer->ninvalid++;
+		logit(LOG_WARNING, "short sflow header %d bytes from %s",
+		    fp->len, addr_ntop_buf(&fp->flow_source));
+		return;
+	}
+	if (ntohl(sf_hdr->version) != SFLOW5_VERSION) {
+		logit(LOG_INFO, "Unsupported sflow version %u from %s",
+		    ntohl(sf_hdr->version), addr_ntop_buf(&fp->flow_source));
+		return;
+	}
+
+	bzero(&base, sizeof(base));
+	bzero(&agent, sizeof(agent));
+	if ((alen = sflow_decode_addr(fp->packet + sizeof(*sf_hdr),
+	    fp->len - sizeof(*sf_hdr), &agent)) == -1 ||
+	    fp->len < sizeof(*sf_hdr) + alen + sizeof(*sf_tail)) {
+		peer->ninvalid++;
+		logit(LOG_WARNING, "short sflow v.5 header %d bytes from %s",
+		    fp->len, addr_ntop_buf(&fp->flow_source));
+		return;
+	}
+	memcpy(&base.agent_addr, &agent, sizeof(agent));
+	offset = sizeof(*sf_hdr) + alen;
+	sf_tail = (struct SFLOW5_HEADER_TAIL *)(fp->packet + offset);
+	offset += sizeof(*sf_tail);
+	nsamples = ntohl(sf_tail->num_samples);
+
+	logit(LOG_DEBUG, "sflow v.5 packet (len %d) %u samples, agent %s/%u",
+	    fp->len, nsamples, addr_ntop_buf(&agent),
+	    ntohl(sf_tail->sub_agent_id));
+
+	/* The sFlow sequence number counts datagrams from each sub-agent */
+	peer_sequence(w->peers, peer, STORE_VERSION_SFLOW | 5,
+	    ntohl(sf_tail->sub_agent_id), ntohl(sf_tail->sequence), 1);
+
+	/* Fall back to the sender for agents that don't give an address */
+	if (base.agent_addr.af == 0)
+		memcpy(&base.agent_addr, &fp->flow_source,
+		    sizeof(base.agent_addr));
+
+	/*
+	 * These fields are common to every flow in the datagram. sFlow
+	 * agents don't send their wall clock time, so the receive time
+	 * stands in for it, with no skew. Each flow is a single sampled
+	 * packet, seen at the agent uptime in the datagram header.
+	 */
+	base.hdr.fields = STORE_FIELD_RECV_TIME | STORE_FIELD_PROTO_FLAGS_TOS |
+	    STORE_FIELD_AGENT_ADDR | STORE_FIELD_SRCDST_PORT |
+	    STORE_FIELD_PACKETS | STORE_FIELD_OCTETS | STORE_FIELD_IF_INDICES |
+	    STORE_FIELD_AGENT_INFO | STORE_FIELD_FLOW_TIMES |
+	    STORE_FIELD_FLOW_ENGINE_INFO | STORE_FIELD_ABS_TIMES |
+	    STORE_FIELD_CRC32;
+	base.recv_time.recv_sec = fp->recv_time.tv_sec;
+	base.recv_time.recv_usec = fp->recv_time.tv_usec;
+	base.packets.flow_packets = store_htonll(1);
+	base.ainfo.sys_uptime_ms = sf_tail->uptime_ms;
+	base.ainfo.time_sec = htonl(fp->recv_time.tv_sec);
+	base.ainfo.time_nanosec = htonl(fp->recv_time.tv_usec * 1000);
+	base.ainfo.netflow_version = htons(STORE_VERSION_SFLOW | 5);
+	base.ftimes.flow_start = base.ftimes.flow_finish = sf_tail->uptime_ms;
+	base.atimes.flow_start_ms = base.atimes.flow_finish_ms = store_htonll(
+	    (u_int64_t)fp->recv_time.tv_sec * 1000 +
+	    fp->recv_time.tv_usec / 1000);
+	base.finf.source_id = sf_tail->sub_agent_id;
+
+	total_flows = 0;
+	for (i = 0; i < nsamples; i++) {
+		if (fp->len - offset < sizeof(*sample)) {
+			peer->ninvalid++;
+			logit(LOG_WARNING, "short sflow v.5 sample header "
+			    "%d bytes from %s", fp->len,
+			    addr_ntop_buf(&fp->flow_source));
 			return;
 		}
+		sample = (struct SFLOW5_DATA_HEADER *)(fp->packet + offset);
+		format = ntohl(sample->format);
+		sample_len = ntohl(sample->length);
+		offset += sizeof(*sample);
+		if (sample_len > fp->len - offset || (sample_len & 3) != 0) {
+			peer->ninvalid++;
+			logit(LOG_WARNING, "short sflow v.5 sample length %u "
+			    "bytes from %s", sample_len,
+			    addr_ntop_buf(&fp->flow_source));
+			return;
+		}
+
+		switch (format) {
+		case SFLOW5_FLOW_SAMPLE:
+		case SFLOW5_FLOW_SAMPLE_EXPANDED:
+			if ((r = process_sflow_flow_sample(fp->packet + offset,
+			    sample_len, format, &base, conf, w)) == -1) {
+				peer->ninvalid++;
+				logit(LOG_WARNING, "Invalid sflow v.5 flow "
+				    "sample from %s",
+				    addr_ntop_buf(&fp->flow_source));
+				return;
+			}
+			total_flows += r;
+			break;
+		default:
+			/* Counter samples and enterprise formats */
+			break;
+		}
+		offset += sample_len;
 	}
+
+	/* Don't update peer unless we actually receive data from it */
+	if (total_flows > 0)
+		update_peer(w->peers, peer, total_flows,
+		    STORE_VERSION_SFLOW | 5, &fp->recv_time);
 }
 
 static void
 process_packet(struct flow_packet *fp, struct flowd_config *conf,
-    struct peers *peers, int log_fd, int log_socket)
+    struct peer_state *peer, struct worker *w)
 {
-	struct peer_state *peer;
 	struct NF_HEADER_COMMON *hdr = (struct NF_HEADER_COMMON *)fp->packet;
 
-	if ((peer = find_peer(peers, &fp->flow_source)) == NULL) {
-		logit(LOG_WARNING, "flow source %s was expired between "
-		    "between flow packet reception and processing", 
-		    addr_ntop_buf(&fp->flow_source));
-		return;
-	}
-
 	switch (ntohs(hdr->version)) {
+	case 0:
+		/* sFlow has a 32 bit version number */
+		process_sflow(fp, conf, peer, w);
+		break;
 	case 1:
-		process_netflow_v1(fp, conf, peer, peers, log_fd, log_socket);
+		process_netflow_v1(fp, conf, peer, w);
 		break;
 	case 5:
-		process_netflow_v5(fp, conf, peer, peers, log_fd, log_socket);
+		process_netflow_v5(fp, conf, peer, w);
 		break;
 	case 7:
-		process_netflow_v7(fp, conf, peer, peers, log_fd, log_socket);
+		process_netflow_v7(fp, conf, peer, w);
 		break;
 	case 9:
-		process_netflow_v9(fp, conf, peer, peers, log_fd, log_socket);
+		process_netflow_v9(fp, conf, peer, w);
 		break;
 	case 10:
-		process_netflow_v10(fp, conf, peer, peers, log_fd, log_socket);
+		process_netflow_v10(fp, conf, peer, w);
 		break;
 	default:
 		logit(LOG_INFO, "Unsupported netflow version %u from %s",
@@ -1674,79 +3358,1814 @@ process_packet(struct flow_packet *fp, struct flowd_config *conf,
 	}
 }
 
+/*
+ * Release a packet once it has been processed. In pipeline mode the packet
+ * pool belongs to the receiver thread, so the packet is passed back to it.
+ */
 static void
-process_input_queue(struct flowd_config *conf, struct peers *peers,
-    int log_fd, int log_socket)
+packet_done(struct worker *w, struct flow_packet *fp)
 {
-	struct flow_packet *fp;
+#ifdef PIPELINE_THREADS
+	if (w->conf->opts & FLOWD_OPT_PIPELINE) {
+		if (ring_push(&w->free_ring, fp) == -1)
+			logerrx("%s: free ring full", __func__);
+		return;
+	}
+#endif
+	flow_packet_dealloc(&w->pool, fp);
+}
+
+/* Set up a queue for each forwarding target */
+static void
+forward_init(struct worker *w)
+{
+	struct forward_addr *fa;
+	struct fwd_queue *q;
+	u_int i;
 
-	while ((fp = flow_packet_dequeue()) != NULL) {
-		process_packet(fp, conf, peers, log_fd, log_socket);
-		flow_packet_dealloc(fp);
+	w->nfwd = 0;
+	TAILQ_FOREACH(fa, &w->conf->forward_addrs, entry)
+		w->nfwd++;
+	if (w->nfwd == 0)
+		return;
+	if ((w->fwd = calloc(w->nfwd, sizeof(*w->fwd))) == NULL)
+		logerrx("%s: calloc failed", __func__);
+
+	q = w->fwd;
+	TAILQ_FOREACH(fa, &w->conf->forward_addrs, entry) {
+		q->fa = fa;
+		if ((q->bufs = calloc(FORWARD_QUEUE_LEN,
+		    INPUT_MAX_PACKET_SIZE)) == NULL ||
+		    (q->iov = calloc(FORWARD_QUEUE_LEN,
+		    sizeof(*q->iov))) == NULL)
+			logerrx("%s: calloc failed", __func__);
+#ifdef HAVE_SENDMMSG
+		if ((q->msgs = calloc(FORWARD_QUEUE_LEN,
+		    sizeof(*q->msgs))) == NULL)
+			logerrx("%s: calloc failed", __func__);
+#endif
+		for (i = 0; i < FORWARD_QUEUE_LEN; i++) {
+			q->iov[i].iov_base = q->bufs +
+			    (i * INPUT_MAX_PACKET_SIZE);
+#ifdef HAVE_SENDMMSG
+			q->msgs[i].msg_hdr.msg_iov = &q->iov[i];
+			q->msgs[i].msg_hdr.msg_iovlen = 1;
+#endif
+		}
+		q++;
 	}
 }
 
+/* Discard the forwarding queues, before the targets are replaced */
 static void
-init_pfd(struct flowd_config *conf, struct pollfd **pfdp, int mfd, int *num_fds)
+forward_free(struct worker *w)
 {
-	struct pollfd *pfd = *pfdp;
-	struct listen_addr *la;
-	int i;
+	u_int i;
+
+	for (i = 0; i < w->nfwd; i++) {
+		free(w->fwd[i].bufs);
+		free(w->fwd[i].iov);
+#ifdef HAVE_SENDMMSG
+		free(w->fwd[i].msgs);
+#endif
+	}
+	free(w->fwd);
+	w->fwd = NULL;
+	w->nfwd = 0;
+}
 
-	logit(LOG_DEBUG, "%s: entering (num_fds = %d)", __func__, *num_fds);
+/*
+ * Send as much of a forwarding queue as the target's socket will take
+ * without blocking. Whatever is left is retried on the next flush.
+ */
+static void
+forward_send(struct fwd_queue *q)
+{
+	int n, r;
+
+	while (q->depth > 0) {
+		/* The queue is a ring; send up to the end of the array */
+		n = MIN(q->depth, FORWARD_QUEUE_LEN - q->head);
+#ifdef HAVE_SENDMMSG
+		r = sendmmsg(q->fa->fd, &q->msgs[q->head], n, MSG_DONTWAIT);
+#else
+		r = send(q->fa->fd, q->iov[q->head].iov_base,
+		    q->iov[q->head].iov_len, MSG_DONTWAIT) == -1 ? -1 : 1;
+#endif
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			/*
+			 * E.g. an ICMP unreachable from an earlier datagram.
+			 * Drop this one rather than retrying it forever.
+			 */
+			q->errors++;
+			r = 1;
+		} else
+			q->sent += r;
+		q->head = (q->head + r) % FORWARD_QUEUE_LEN;
+		q->depth -= r;
+	}
+}
 
-	if (pfd != NULL)
-		free(pfd);
+/* Queue a copy of a received datagram for each forwarding target */
+static void
+forward_enqueue(struct worker *w, struct flow_packet *fp)
+{
+	struct fwd_queue *q;
+	u_int i, slot;
+
+	for (i = 0; i < w->nfwd; i++) {
+		q = &w->fwd[i];
+		if (q->depth == FORWARD_QUEUE_LEN) {
+			forward_send(q);
+			if (q->depth == FORWARD_QUEUE_LEN) {
+				q->dropped++;
+				continue;
+			}
+		}
+		slot = (q->head + q->depth) % FORWARD_QUEUE_LEN;
+		memcpy(q->iov[slot].iov_base, fp->packet, fp->len);
+		q->iov[slot].iov_len = fp->len;
+		if (++q->depth > q->high_water)
+			q->high_water = q->depth;
+		if (q->depth >= FORWARD_BATCH)
+			forward_send(q);
+	}
+}
 
-	*num_fds = 1; /* fd to monitor */
+/* Send whatever is queued for the forwarding targets */
+static void
+forward_flush(struct worker *w)
+{
+	u_int i;
 
-	/* Count socks */
-	TAILQ_FOREACH(la, &conf->listen_addrs, entry)
-		(*num_fds)++;
+	for (i = 0; i < w->nfwd; i++)
+		forward_send(&w->fwd[i]);
+}
 
-	if ((pfd = calloc((*num_fds) + 1, sizeof(*pfd))) == NULL) {
-		logerrx("%s: calloc failed (num %d)",
-		    __func__, *num_fds + 1);
+/* Log statistics on forwarding to each target */
+static void
+dump_forward_stats(struct worker *w)
+{
+	struct fwd_queue *q;
+	u_int i;
+
+	for (i = 0; i < w->nfwd; i++) {
+		q = &w->fwd[i];
+		logit(LOG_INFO, "Worker %u forward to [%s]:%d: sent:%llu "
+		    "queued:%u high water:%u dropped:%llu errors:%llu", w->id,
+		    addr_ntop_buf(&q->fa->addr), q->fa->port,
+		    (unsigned long long)q->sent, q->depth, q->high_water,
+		    (unsigned long long)q->dropped,
+		    (unsigned long long)q->errors);
 	}
+}
 
-	pfd[0].fd = mfd;
-	pfd[0].events = POLLIN;
+/*
+ * Handle a datagram from a known source address. Packets from agents that
+ * are not permitted are discarded. Others are queued for forwarding, if
+ * any targets are configured, and decoded in the receive buffer. Takes
+ * ownership of "fp".
+ */
+static void
+packet_accept(struct worker *w, struct flow_packet *fp)
+{
+	struct flowd_config *conf = w->conf;
+	struct peer_state *peer;
 
-	i = 1;
-	TAILQ_FOREACH(la, &conf->listen_addrs, entry) {
-		pfd[i].fd = la->fd;
-		pfd[i].events = POLLIN;
-		i++;
+	if ((peer = find_peer(w->peers, &fp->flow_source)) == NULL)
+		peer = new_peer(w->peers, conf, &fp->flow_source,
+		    &fp->recv_time);
+	if (peer == NULL) {
+		logit(LOG_DEBUG, "packet from unauthorised agent %s",
+		    addr_ntop_buf(&fp->flow_source));
+		packet_done(w, fp);
+		return;
 	}
 
-	*pfdp = pfd;
+	if (fp->len < sizeof(struct NF_HEADER_COMMON)) {
+		peer->ninvalid++;
+		logit(LOG_WARNING, "short packet %d bytes from %s", fp->len,
+		    addr_ntop_buf(&fp->flow_source));
+		packet_done(w, fp);
+		return;
+	}
 
-	logit(LOG_DEBUG, "%s: done (num_fds = %d)", __func__, *num_fds);
+	if (w->nfwd > 0)
+		forward_enqueue(w, fp);
+	process_packet(fp, conf, peer, w);
+	packet_done(w, fp);
 }
 
+/*
+ * Accept a datagram that has been read into "fp" from a listening socket.
+ * In pipeline mode, everything past recording the source address is left
+ * to the decoder thread. Takes ownership of "fp".
+ */
 static void
-flowd_mainloop(struct flowd_config *conf, struct peers *peers, int monitor_fd)
+receive_accept(struct worker *w, struct flow_packet *fp,
+    struct sockaddr *from, socklen_t fromlen)
 {
-	int i, log_fd, log_socket, num_fds = 0;
-	struct listen_addr *la;
-	struct pollfd *pfd = NULL;
+	if (addr_sa_to_xaddr(from, fromlen, &fp->flow_source) == -1) {
+		logit(LOG_WARNING, "Invalid agent address");
+		flow_packet_dealloc(&w->pool, fp);
+		return;
+	}
 
-	init_pfd(conf, &pfd, monitor_fd, &num_fds);
+#ifdef PIPELINE_THREADS
+	if (w->conf->opts & FLOWD_OPT_PIPELINE) {
+		/* Can't fail: the ring has a slot for every pool entry */
+		if (ring_push(&w->packet_ring, fp) == -1)
+			logerrx("%s: packet ring full", __func__);
+		return;
+	}
+#endif
+
+	packet_accept(w, fp);
+}
+
+/*
+ * Fetch a listener's receive buffer size in the units that SO_RCVBUF is
+ * set in. Linux doubles the requested size to allow for its bookkeeping
+ * and reports the doubled figure back.
+ */
+static int
+listener_rcvbuf(struct listen_addr *la, int *size)
+{
+	socklen_t slen;
+
+	slen = sizeof(*size);
+	if (getsockopt(la->fd, SOL_SOCKET, SO_RCVBUF, size, &slen) == -1)
+		return (-1);
+#ifdef __linux__
+	*size /= 2;
+#endif
+	return (0);
+}
+
+/*
+ * The kernel has dropped datagrams on this listener because its receive
+ * buffer was full. Double the buffer, up to the configured limit, at
+ * most once a second.
+ */
+static void
+listener_grow(struct worker *w, struct listen_addr *la)
+{
+	int cur, want, now;
+	time_t t;
+
+	if (la->rcvbuf_capped || (t = time(NULL)) == la->rcvbuf_grown)
+		return;
+	la->rcvbuf_grown = t;
+
+	if (listener_rcvbuf(la, &cur) == -1) {
+		logit(LOG_WARNING, "%s: getsockopt(SO_RCVBUF): %s", __func__,
+		    strerror(errno));
+		return;
+	}
+	if ((size_t)cur >= w->conf->rcvbuf_max) {
+		la->rcvbuf_capped = 1;
+		return;
+	}
+	want = MIN((size_t)cur * 2, w->conf->rcvbuf_max);
+	if (setsockopt(la->fd, SOL_SOCKET, SO_RCVBUF, &want,
+	    sizeof(want)) == -1 || listener_rcvbuf(la, &now) == -1 ||
+	    now <= cur) {
+		logit(LOG_WARNING, "Listener [%s]:%d receive buffer can't "
+		    "grow past %d", addr_ntop_buf(&la->addr), la->port, cur);
+		la->rcvbuf_capped = 1;
+		return;
+	}
+	logit(LOG_INFO, "Listener [%s]:%d dropped datagrams, receive "
+	    "buffer raised from %d to %d", addr_ntop_buf(&la->addr), la->port,
+	    cur, now);
+}
+
+/*
+ * Pick out the control messages that the kernel attached to a datagram:
+ * its receive time (falling back to the current time if there is none)
+ * and the running count of datagrams dropped on the listener.
+ */
+static void
+recv_control(struct worker *w, struct listen_addr *la, struct msghdr *msg,
+    struct timeval *tv)
+{
+	struct cmsghdr *cmsg;
+#ifdef SO_RXQ_OVFL
+	u_int32_t ovfl;
+#endif
+	int have_tv = 0;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+	    cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET)
+			continue;
+#ifdef SO_TIMESTAMP
+		if (cmsg->cmsg_type == SCM_TIMESTAMP &&
+		    cmsg->cmsg_len >= CMSG_LEN(sizeof(*tv))) {
+			memcpy(tv, CMSG_DATA(cmsg), sizeof(*tv));
+			have_tv = 1;
+		}
+#endif
+#ifdef SO_RXQ_OVFL
+		/* Only present once something has been dropped */
+		if (cmsg->cmsg_type == SO_RXQ_OVFL &&
+		    cmsg->cmsg_len >= CMSG_LEN(sizeof(ovfl))) {
+			memcpy(&ovfl, CMSG_DATA(cmsg), sizeof(ovfl));
+			if (ovfl == la->drops_seen)
+				continue;
+			la->drops += (u_int32_t)(ovfl - la->drops_seen);
+			la->drops_seen = ovfl;
+			if (w->conf->rcvbuf_max != 0)
+				listener_grow(w, la);
+		}
+#endif
+	}
+	if (!have_tv)
+		gettimeofday(tv, NULL);
+}
+
+static int
+receive_packet(struct worker *w, struct listen_addr *la)
+{
+	struct sockaddr_storage from;
+	union recv_cmsg ctl;
+	struct msghdr msg;
+	struct iovec iov;
+	struct flow_packet *fp;
+	ssize_t len;
+
+	/* Leave datagrams in the socket buffer until we have room for them */
+	if ((fp = flow_packet_alloc(&w->pool)) == NULL) {
+		w->pool.exhausted++;
+		return (0);
+	}
+	iov.iov_base = fp->packet;
+	iov.iov_len = INPUT_MAX_PACKET_SIZE;
+ retry:
+	bzero(&msg, sizeof(msg));
+	msg.msg_name = &from;
+	msg.msg_namelen = sizeof(from);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = &ctl;
+	msg.msg_controllen = sizeof(ctl);
+	if ((len = recvmsg(la->fd, &msg, 0)) < 0) {
+		if (errno == EINTR)
+			goto retry;
+		if (errno != EAGAIN)
+			logit(LOG_WARNING, "recvmsg(fd = %d)", la->fd);
+		/* XXX ratelimit errors */
+		flow_packet_dealloc(&w->pool, fp);
+		return (0);
+	}
+	fp->len = len;
+	recv_control(w, la, &msg, &fp->recv_time);
+	w->recv_stats.calls++;
+	w->recv_stats.packets++;
+
+	receive_accept(w, fp, (struct sockaddr *)&from, msg.msg_namelen);
+
+	return (1);
+}
+
+#ifdef HAVE_RECVMMSG
+/*
+ * Set up (or resize) the message vector used by receive_batch(). The vector
+ * is kept between calls; it only changes when the batch size does.
+ */
+static void
+recv_batch_init(struct recv_vec *rv, u_int batch)
+{
+	u_int i;
+
+	if (rv->batch == batch)
+		return;
+
+	free(rv->msgs);
+	free(rv->iov);
+	free(rv->from);
+	free(rv->ctl);
+	free(rv->fps);
+
+	rv->batch = batch;
+	if ((rv->msgs = calloc(batch, sizeof(*rv->msgs))) == NULL ||
+	    (rv->iov = calloc(batch, sizeof(*rv->iov))) == NULL ||
+	    (rv->from = calloc(batch, sizeof(*rv->from))) == NULL ||
+	    (rv->ctl = calloc(batch, sizeof(*rv->ctl))) == NULL ||
+	    (rv->fps = calloc(batch, sizeof(*rv->fps))) == NULL)
+		logerrx("%s: calloc failed (batch %u)", __func__, batch);
+
+	for (i = 0; i < batch; i++) {
+		rv->iov[i].iov_len = INPUT_MAX_PACKET_SIZE;
+		rv->msgs[i].msg_hdr.msg_iov = &rv->iov[i];
+		rv->msgs[i].msg_hdr.msg_iovlen = 1;
+		rv->msgs[i].msg_hdr.msg_name = &rv->from[i];
+		rv->msgs[i].msg_hdr.msg_control = &rv->ctl[i];
+	}
+	logit(LOG_DEBUG, "%s: receive batch size %u", __func__, batch);
+}
+
+/*
+ * Pull up to "max" datagrams from the socket using as few recvmmsg()
+ * calls as possible. Datagrams are received directly into packet pool
+ * buffers. Returns the number of datagrams read; a short count means
+ * that the socket has been drained or that the packet pool is empty.
+ */
+static int
+receive_batch(struct worker *w, struct listen_addr *la, int max)
+{
+	struct recv_vec *rv = &w->recv_vec;
+	int i, n, vlen, total;
+
+	recv_batch_init(rv, w->conf->recv_batch);
+
+	for (total = 0; total < max;) {
+		vlen = MIN(max - total, (int)rv->batch);
+		/* Don't read more than the packet pool can hold */
+		if (w->pool.nfree == 0) {
+			w->pool.exhausted++;
+			return (total);
+		}
+		vlen = MIN(vlen, (int)w->pool.nfree);
+		for (i = 0; i < vlen; i++) {
+			rv->fps[i] = flow_packet_alloc(&w->pool);
+			rv->iov[i].iov_base = rv->fps[i]->packet;
+			rv->msgs[i].msg_hdr.msg_namelen = sizeof(rv->from[i]);
+			rv->msgs[i].msg_hdr.msg_controllen =
+			    sizeof(rv->ctl[i]);
+			rv->msgs[i].msg_hdr.msg_flags = 0;
+		}
+		if ((n = recvmmsg(la->fd, rv->msgs, vlen, MSG_DONTWAIT,
+		    NULL)) < 0) {
+			n = errno;
+			for (i = vlen - 1; i >= 0; i--)
+				flow_packet_dealloc(&w->pool, rv->fps[i]);
+			if (n == EINTR)
+				continue;
+			if (n != EAGAIN)
+				logit(LOG_WARNING, "recvmmsg(fd = %d)", la->fd);
+			/* XXX ratelimit errors */
+			return (total);
+		}
+		w->recv_stats.calls++;
+		w->recv_stats.packets += n;
+		if (n == vlen)
+			w->recv_stats.full++;
+
+		/* Return unused buffers, most recently allocated first */
+		for (i = vlen - 1; i >= n; i--)
+			flow_packet_dealloc(&w->pool, rv->fps[i]);
+		for (i = 0; i < n; i++) {
+			rv->fps[i]->len = rv->msgs[i].msg_len;
+			recv_control(w, la, &rv->msgs[i].msg_hdr,
+			    &rv->fps[i]->recv_time);
+			receive_accept(w, rv->fps[i],
+			    (struct sockaddr *)&rv->from[i],
+			    rv->msgs[i].msg_hdr.msg_namelen);
+		}
+		total += n;
+		if (n < vlen)
+			break;
+	}
+	return (total);
+}
+#endif /* HAVE_RECVMMSG */
+
+/*
+ * Read datagrams from a listening socket. Returns non-zero if we stopped
+ * before the socket was drained, because we hit the per-socket limit or
+ * ran out of packet buffers.
+ */
+static int
+receive_many(struct worker *w, struct listen_addr *la)
+{
+	int i;
+
+#ifdef HAVE_RECVMMSG
+	if (w->conf->recv_batch > 1) {
+		if (receive_batch(w, la, INPUT_MAX_PACKET_PER_FD) ==
+		    INPUT_MAX_PACKET_PER_FD) {
+			logit(LOG_DEBUG, "Received max number of packets "
+			    "(%d) on fd %d", INPUT_MAX_PACKET_PER_FD, la->fd);
+			return (1);
+		}
+		return (w->pool.nfree == 0);
+	}
+#endif
+
+	for (i = 0; i < INPUT_MAX_PACKET_PER_FD; i++) {
+		if (receive_packet(w, la) == 0)
+			return (w->pool.nfree == 0);
+	}
+	logit(LOG_DEBUG, "Received max number of packets (%d) on fd %d",
+	    INPUT_MAX_PACKET_PER_FD, la->fd);
+	return (1);
+}
+
+/* Read from a listener reported ready by the worker's event loop */
+static void
+receive_ready(struct worker *w, struct listen_addr *la)
+{
+	/* Edge triggered, so we must come back if there is more to read */
+	if (receive_many(w, la))
+		evloop_again(w->ev, la);
+}
+
+#ifdef USE_IO_URING
+/* Start a multishot receive on each listener that doesn't have one */
+static void
+uring_arm(struct worker *w)
+{
+	struct uring_state *us = w->ur;
+	struct io_uring_sqe *sqe;
+	u_int i;
+
+	/* A receive started now would fail at once for want of buffers */
+	if (w->pool.nfree == 0)
+		return;
+	for (i = 0; i < us->nlisteners; i++) {
+		if (us->listeners[i].armed)
+			continue;
+		if ((sqe = uring_get_sqe(us->rx)) == NULL)
+			break;
+		sqe->opcode = IORING_OP_RECVMSG;
+		sqe->fd = us->listeners[i].la->fd;
+		sqe->addr = (u_int64_t)(uintptr_t)&us->msg;
+		sqe->len = 1;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BGID;
+		sqe->user_data = i;
+		us->listeners[i].armed = 1;
+	}
+	if (uring_submit(us->rx, 0) == -1)
+		logerr("%s: io_uring_enter", __func__);
+	/* Data already queued is received during submission, unannounced */
+	if (uring_peek_cqe(us->rx) != NULL)
+		evloop_again(w->ev, us);
+}
+
+/* Process datagrams delivered by the multishot receives */
+static void
+uring_receive(struct worker *w)
+{
+	struct uring_state *us = w->ur;
+	struct io_uring_recvmsg_out *out;
+	struct io_uring_cqe *cqe;
+	struct flow_packet *fp;
+	struct msghdr msg;
+	u_int64_t ud;
+	u_int32_t flags;
+	u_int n = 0;
+	int res;
+
+	bzero(&msg, sizeof(msg));
+	while ((cqe = uring_peek_cqe(us->rx)) != NULL) {
+		ud = cqe->user_data;
+		res = cqe->res;
+		flags = cqe->flags;
+		uring_cqe_seen(us->rx);
+
+		if (ud == URING_UD_CANCEL || ud >= us->nlisteners)
+			continue;
+		/* The kernel ends a multishot request on any error */
+		if ((flags & IORING_CQE_F_MORE) == 0)
+			us->listeners[ud].armed = 0;
+		if (res < 0) {
+			if (res == -ENOBUFS)
+				w->pool.exhausted++;
+			else if (res != -ECANCELED) {
+				logit(LOG_WARNING, "recvmsg(fd = %d): %s",
+				    us->listeners[ud].la->fd, strerror(-res));
+			}
+			continue;
+		}
+		if ((flags & IORING_CQE_F_BUFFER) == 0)
+			continue;
+
+		fp = flow_packet_claim(&w->pool,
+		    flags >> IORING_CQE_BUFFER_SHIFT);
+		out = (struct io_uring_recvmsg_out *)fp->packet;
+		msg.msg_control = (u_int8_t *)(out + 1) + us->msg.msg_namelen;
+		msg.msg_controllen = MIN(out->controllen,
+		    us->msg.msg_controllen);
+		fp->packet = (u_int8_t *)msg.msg_control +
+		    us->msg.msg_controllen;
+		fp->len = MIN(out->payloadlen, INPUT_MAX_PACKET_SIZE);
+		recv_control(w, us->listeners[ud].la, &msg,
+		    &fp->recv_time);
+		n++;
+		receive_accept(w, fp, (struct sockaddr *)(out + 1),
+		    MIN(out->namelen, us->msg.msg_namelen));
+	}
+	if (n > 0) {
+		w->recv_stats.calls++;
+		w->recv_stats.packets += n;
+	}
+}
+
+/* Stop receiving on all listeners, so that they may be closed */
+static void
+uring_cancel(struct worker *w)
+{
+	struct uring_state *us = w->ur;
+	struct io_uring_sqe *sqe;
+	u_int i;
+
+	for (;;) {
+		for (i = 0; i < us->nlisteners; i++) {
+			if (!us->listeners[i].armed)
+				continue;
+			if ((sqe = uring_get_sqe(us->rx)) == NULL)
+				break;
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = i;
+			sqe->user_data = URING_UD_CANCEL;
+		}
+		for (i = 0; i < us->nlisteners; i++) {
+			if (us->listeners[i].armed)
+				break;
+		}
+		if (i == us->nlisteners)
+			break;
+		if (uring_submit(us->rx, 1) == -1)
+			logerr("%s: io_uring_enter", __func__);
+		uring_receive(w);
+	}
+	us->nlisteners = 0;
+}
+
+/* Build the list of listeners to receive on, from the configuration */
+static void
+uring_listeners_init(struct flowd_config *conf, struct worker *w)
+{
+	struct uring_state *us = w->ur;
+	struct listen_addr *la;
+	u_int n = 0;
+
+	TAILQ_FOREACH(la, &conf->listen_addrs, entry) {
+		if (la->worker == w->id && la->fd != -1)
+			n++;
+	}
+	free(us->listeners);
+	if ((us->listeners = calloc(MAX(n, 1),
+	    sizeof(*us->listeners))) == NULL)
+		logerrx("%s: calloc failed", __func__);
+	us->nlisteners = 0;
+	TAILQ_FOREACH(la, &conf->listen_addrs, entry) {
+		if (la->worker == w->id && la->fd != -1)
+			us->listeners[us->nlisteners++].la = la;
+	}
+}
+#endif
+
+/* Log statistics on receive calls and packet pool usage */
+static void
+dump_recv_stats(struct worker *w)
+{
+	struct recv_stats *rs = &w->recv_stats;
+	struct listen_addr *la;
+	u_int64_t avg;
+	int rcvbuf;
+
+	/* Average fill in hundredths of a datagram */
+	avg = rs->calls == 0 ? 0 : (rs->packets * 100) / rs->calls;
+	logit(LOG_INFO, "Worker %u receive: batch size %u calls:%llu "
+	    "packets:%llu full:%llu average fill:%llu.%02llu", w->id,
+	    w->conf->recv_batch, (unsigned long long)rs->calls,
+	    (unsigned long long)rs->packets, (unsigned long long)rs->full,
+	    (unsigned long long)(avg / 100), (unsigned long long)(avg % 100));
+	logit(LOG_INFO, "Worker %u packet pool: %u of %u in use, "
+	    "high water %u, exhausted %llu", w->id,
+	    w->pool.size - w->pool.nfree, w->pool.size, w->pool.high_water,
+	    (unsigned long long)w->pool.exhausted);
+	TAILQ_FOREACH(la, &w->conf->listen_addrs, entry) {
+		if (la->worker != w->id || la->fd == -1)
+			continue;
+		if (listener_rcvbuf(la, &rcvbuf) == -1)
+			rcvbuf = -1;
+		logit(LOG_INFO, "Worker %u listener [%s]:%d: kernel drops "
+		    "%llu, receive buffer %d", w->id, addr_ntop_buf(&la->addr),
+		    la->port, (unsigned long long)la->drops, rcvbuf);
+	}
+}
+
+#ifdef WORKER_THREADS
+/*
+ * Wait for a worker thread's listeners and read from those that are
+ * ready. Returns -1 if the main thread has asked the worker to stop.
+ */
+static int
+worker_receive(struct worker *w)
+{
+	struct ev_event ev[EV_MAX_EVENTS];
+	int i, n, stop = 0;
+
+	n = evloop_wait(w->ev, ev, EV_MAX_EVENTS);
+	for (i = 0; i < n; i++) {
+		if (ev[i].type != EV_READ)
+			continue;
+		if (ev[i].arg == worker_stop_pipe)
+			stop = 1;
+		else
+			receive_ready(w, ev[i].arg);
+	}
+	return (stop ? -1 : 0);
+}
+#endif
+
+/* Add (or remove) a worker's listening sockets to its event loop or ring */
+static void
+listeners_register(struct flowd_config *conf, struct worker *w, int add)
+{
+	struct listen_addr *la;
+
+#ifdef USE_IO_URING
+	if (w->ur != NULL) {
+		if (!add)
+			uring_cancel(w);
+		else {
+			uring_listeners_init(conf, w);
+			uring_arm(w);
+		}
+		return;
+	}
+#endif
+	TAILQ_FOREACH(la, &conf->listen_addrs, entry) {
+		if (la->worker != w->id || la->fd == -1)
+			continue;
+		if (!add)
+			evloop_del(w->ev, la->fd, la);
+		else if (evloop_add(w->ev, la->fd, la) == -1)
+			logerr("%s: evloop_add(fd = %d)", __func__, la->fd);
+	}
+}
+
+#ifdef USE_IO_URING
+/*
+ * Switch the worker over to receiving through io_uring, with the packet
+ * pool registered as provided buffers. Returns -1, leaving the worker as
+ * it was, if the kernel lacks anything we need.
+ */
+static int
+uring_init(struct flowd_config *conf, struct worker *w)
+{
+	struct uring_state *us;
+	struct io_uring_cqe *cqe;
+	u_int i, nbufs, entries;
+	int saved_errno;
+
+	if ((us = calloc(1, sizeof(*us))) == NULL)
+		logerrx("%s: calloc failed", __func__);
+	nbufs = MIN(w->pool.size, URING_MAX_BUFS);
+	for (entries = 1; entries < nbufs; entries <<= 1)
+		;
+	if ((us->rx = uring_new(URING_RX_ENTRIES, URING_RX_CQ_ENTRIES)) == NULL ||
+	    (us->wr = uring_new(URING_WR_ENTRIES, 0)) == NULL ||
+	    uring_buf_ring_init(us->rx, entries, URING_BGID) == -1)
+		goto fail;
+	/* Log writes rely on the kernel keeping track of the file offset */
+	if ((us->wr->features & IORING_FEAT_RW_CUR_POS) == 0) {
+		errno = EOPNOTSUPP;
+		goto fail;
+	}
+	us->msg.msg_namelen = sizeof(struct sockaddr_storage);
+	us->msg.msg_controllen = sizeof(union recv_cmsg);
+
+	listeners_register(conf, w, 0);
+	packet_pool_init(&w->pool, nbufs, URING_BUF_SIZE);
+	for (i = 0; i < nbufs; i++) {
+		uring_buf_add(us->rx, w->pool.packets[i].packet,
+		    w->pool.bufsize, i);
+	}
+	uring_buf_commit(us->rx);
+	w->pool.provider = us->rx;
+	w->ur = us;
+	listeners_register(conf, w, 1);
+
+	/* Kernels without multishot recvmsg fail it straight away */
+	if ((cqe = uring_peek_cqe(us->rx)) != NULL && cqe->res == -EINVAL) {
+		w->ur = NULL;
+		uring_free(us->rx);
+		us->rx = NULL;
+		packet_pool_init(&w->pool, conf->packet_pool,
+		    INPUT_MAX_PACKET_SIZE);
+		listeners_register(conf, w, 1);
+		errno = EINVAL;
+		goto fail;
+	}
+	if (evloop_add(w->ev, us->rx->fd, us) == -1)
+		logerr("%s: evloop_add", __func__);
+	logit(LOG_INFO, "Receiving with io_uring, %u buffers", nbufs);
+	return (0);
+
+ fail:
+	saved_errno = errno;
+	if (us->rx != NULL)
+		uring_free(us->rx);
+	if (us->wr != NULL)
+		uring_free(us->wr);
+	free(us->listeners);
+	free(us);
+	errno = saved_errno;
+	return (-1);
+}
+#endif
+
+#ifdef PIPELINE_THREADS
+/* Set up the rings, doorbells and output buffers used in pipeline mode */
+static void
+pipeline_init(struct flowd_config *conf)
+{
+	struct worker *w;
+	u_int i, j;
+
+	doorbell_init(&writer_db);
+	for (i = 0; i < num_workers; i++) {
+		w = &workers[i];
+		doorbell_init(&w->rx_db);
+		doorbell_init(&w->dec_db);
+		ring_init(&w->packet_ring, w->pool.size, &w->dec_db);
+		ring_init(&w->free_ring, w->pool.size, &w->rx_db);
+		ring_init(&w->out_ring, PIPELINE_OUT_BUFS, &writer_db);
+		ring_init(&w->ret_ring, PIPELINE_OUT_BUFS, &w->dec_db);
+
+		if ((w->out_bufs = calloc(PIPELINE_OUT_BUFS,
+		    sizeof(*w->out_bufs))) == NULL)
+			logerrx("%s: calloc failed", __func__);
+		for (j = 0; j < PIPELINE_OUT_BUFS; j++) {
+			if ((w->out_bufs[j].data =
+			    malloc(PIPELINE_OUT_BUFSIZE)) == NULL)
+				logerrx("%s: malloc failed", __func__);
+			if (j > 0 && ring_push(&w->ret_ring,
+			    &w->out_bufs[j]) == -1)
+				logerrx("%s: ring_push failed", __func__);
+		}
+		output_buf_use(w, &w->out_bufs[0]);
+	}
+}
+
+/* Receive stage: read datagrams and pass them to the decoder */
+static void *
+receiver_main(void *arg)
+{
+	struct worker *w = (struct worker *)arg;
+	struct flow_packet *fp;
+
+	for (;;) {
+		/* Reclaim packets that the decoder has finished with */
+		while ((fp = ring_pop(&w->free_ring)) != NULL)
+			flow_packet_dealloc(&w->pool, fp);
+
+		/* Decoder has everything; wait for it instead of the network */
+		if (w->pool.nfree == 0) {
+			doorbell_arm(&w->rx_db);
+			if (ring_depth(&w->free_ring) != 0) {
+				doorbell_disarm(&w->rx_db);
+				continue;
+			}
+			w->packet_ring.stalls++;
+			if (doorbell_wait(&w->rx_db, worker_stop_pipe[0]))
+				break;
+			continue;
+		}
+
+		if (worker_receive(w) == -1)
+			break;
+	}
+
+	return (NULL);
+}
+
+/*
+ * Decode stage: process packets from the receiver and fill output buffers
+ * for the writer. Exits once the receiver has stopped and every packet it
+ * passed on has been processed.
+ */
+static void *
+decoder_main(void *arg)
+{
+	struct worker *w = (struct worker *)arg;
+	struct flow_packet *fp;
+	char c = 0;
+
+	for (;;) {
+		while ((fp = ring_pop(&w->packet_ring)) != NULL)
+			packet_accept(w, fp);
+		forward_flush(w);
+
+		/* Input has run dry, so hand what we have to the writer */
+		output_flow_flush(w, w->conf->opts & FLOWD_OPT_VERBOSE);
+
+		if (w->log_socket != -1 && !w->wake_sent &&
+		    logsock_need_reopen(w)) {
+			w->wake_sent = 1;
+			if (write(worker_wake_pipe[1], &c, 1) == -1 &&
+			    errno != EAGAIN)
+				logerr("%s: write", __func__);
+		}
+
+		doorbell_arm(&w->dec_db);
+		if (ring_depth(&w->packet_ring) != 0) {
+			doorbell_disarm(&w->dec_db);
+			continue;
+		}
+		if (__atomic_load_n(&w->rx_done, __ATOMIC_ACQUIRE)) {
+			doorbell_disarm(&w->dec_db);
+			break;
+		}
+		w->packet_ring.waits++;
+		doorbell_wait(&w->dec_db, -1);
+	}
+
+	return (NULL);
+}
+
+/* Write stage: append filled output buffers to the log file */
+static void *
+writer_main(void *arg)
+{
+	struct out_buf *ob;
+	struct worker *w;
+	char ebuf[512];
+	u_int i, n;
+
+	for (;;) {
+		for (i = n = 0; i < num_workers; i++) {
+			w = &workers[i];
+			while ((ob = ring_pop(&w->out_ring)) != NULL) {
+				if (w->log_fd != -1 && store_put_buf(w->log_fd,
+				    (char *)ob->data, ob->len, ebuf,
+				    sizeof(ebuf)) != STORE_ERR_OK)
+					logerrx("%s: exiting on %s", __func__,
+					    ebuf);
+				ob->len = 0;
+				if (ring_push(&w->ret_ring, ob) == -1)
+					logerrx("%s: return ring full",
+					    __func__);
+				n++;
+			}
+		}
+		if (n != 0)
+			continue;
+
+		doorbell_arm(&writer_db);
+		for (i = 0; i < num_workers; i++) {
+			if (ring_depth(&workers[i].out_ring) != 0)
+				break;
+		}
+		if (i < num_workers) {
+			doorbell_disarm(&writer_db);
+			continue;
+		}
+		if (__atomic_load_n(&writer_done, __ATOMIC_ACQUIRE)) {
+			doorbell_disarm(&writer_db);
+			break;
+		}
+		writer_waits++;
+		doorbell_wait(&writer_db, -1);
+	}
+
+	return (NULL);
+}
+
+/* Start the receiver, decoder and writer threads */
+static void
+pipeline_start(struct flowd_config *conf)
+{
+	struct worker *w;
+	sigset_t all, old;
+	u_int i;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	writer_done = 0;
+	if ((errno = pthread_create(&writer_thread, NULL,
+	    writer_main, NULL)) != 0)
+		logerr("%s: pthread_create", __func__);
+	for (i = 0; i < num_workers; i++) {
+		w = &workers[i];
+		/* The packet pool may have been resized by a reconfigure */
+		if (w->packet_ring.mask + 1 < w->pool.size) {
+			free(w->packet_ring.slots);
+			free(w->free_ring.slots);
+			ring_init(&w->packet_ring, w->pool.size, &w->dec_db);
+			ring_init(&w->free_ring, w->pool.size, &w->rx_db);
+		}
+		filter_list_copy(&w->filter_copy, &conf->filter_list);
+		w->filter_copy_prog = filter_prog_copy(conf->filter_prog,
+		    &w->filter_copy);
+		w->filter = w->filter_copy_prog;
+		w->wake_sent = 0;
+		w->rx_done = 0;
+		if ((errno = pthread_create(&w->thread, NULL,
+		    decoder_main, w)) != 0 ||
+		    (errno = pthread_create(&w->rx_thread, NULL,
+		    receiver_main, w)) != 0)
+			logerr("%s: pthread_create", __func__);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * Stop the pipeline threads, front to back, so that every packet already
+ * received is decoded and written before we return.
+ */
+static void
+pipeline_stop(struct flowd_config *conf)
+{
+	struct flow_packet *fp;
+	struct worker *w;
+	u_int i;
+	char c = 0;
+
+	if (atomicio(vwrite, worker_stop_pipe[1], &c, 1) != 1)
+		logerr("%s: write", __func__);
+	for (i = 0; i < num_workers; i++) {
+		w = &workers[i];
+		if ((errno = pthread_join(w->rx_thread, NULL)) != 0)
+			logerr("%s: pthread_join", __func__);
+	}
+	if (atomicio(read, worker_stop_pipe[0], &c, 1) != 1)
+		logerr("%s: read", __func__);
+
+	for (i = 0; i < num_workers; i++) {
+		w = &workers[i];
+		__atomic_store_n(&w->rx_done, 1, __ATOMIC_RELEASE);
+		doorbell_ring(&w->dec_db);
+	}
+	for (i = 0; i < num_workers; i++) {
+		w = &workers[i];
+		if ((errno = pthread_join(w->thread, NULL)) != 0)
+			logerr("%s: pthread_join", __func__);
+		filter_prog_sync(w->filter_copy_prog);
+		filter_prog_free(w->filter_copy_prog);
+		w->filter_copy_prog = NULL;
+		filter_list_merge(&conf->filter_list, &w->filter_copy);
+		w->filter = conf->filter_prog;
+	}
+
+	__atomic_store_n(&writer_done, 1, __ATOMIC_RELEASE);
+	doorbell_ring(&writer_db);
+	if ((errno = pthread_join(writer_thread, NULL)) != 0)
+		logerr("%s: pthread_join", __func__);
+
+	/* Return spent packets to their pools */
+	for (i = 0; i < num_workers; i++) {
+		w = &workers[i];
+		while ((fp = ring_pop(&w->free_ring)) != NULL)
+			flow_packet_dealloc(&w->pool, fp);
+	}
+}
+
+/* Log statistics on the pipeline rings */
+static void
+dump_pipeline_stats(struct worker *w)
+{
+	logit(LOG_INFO, "Worker %u packet ring: depth %u high water %u "
+	    "pushes %llu stalls %llu waits %llu", w->id,
+	    ring_depth(&w->packet_ring), w->packet_ring.high_water,
+	    (unsigned long long)w->packet_ring.pushes,
+	    (unsigned long long)w->packet_ring.stalls,
+	    (unsigned long long)w->packet_ring.waits);
+	logit(LOG_INFO, "Worker %u output ring: depth %u high water %u "
+	    "pushes %llu stalls %llu", w->id,
+	    ring_depth(&w->out_ring), w->out_ring.high_water,
+	    (unsigned long long)w->out_ring.pushes,
+	    (unsigned long long)w->out_ring.stalls);
+}
+#endif /* PIPELINE_THREADS */
+
+/* Set up ingest state for each worker (or just one if not threaded) */
+static void
+workers_init(struct flowd_config *conf)
+{
+	struct worker *w;
+	u_int i;
+
+	num_workers = conf->workers;
+	if ((workers = calloc(num_workers, sizeof(*workers))) == NULL)
+		logerrx("%s: calloc failed (num %u)", __func__, num_workers);
+
+	for (i = 0; i < num_workers; i++) {
+		w = &workers[i];
+		w->id = i;
+		w->conf = conf;
+		w->filter = conf->filter_prog;
+		w->log_fd = w->log_socket = -1;
+		w->output_queue_max = OUTPUT_MAX_QLEN;
+		forward_init(w);
+		packet_pool_init(&w->pool, conf->packet_pool,
+		    INPUT_MAX_PACKET_SIZE);
+
+		if ((w->peers = calloc(1, sizeof(*w->peers))) == NULL)
+			logerrx("%s: calloc failed", __func__);
+		w->peers->max_peers = DEFAULT_MAX_PEERS;
+		w->peers->max_templates = DEFAULT_MAX_TEMPLATES;
+		w->peers->max_sources = DEFAULT_MAX_SOURCES;
+		w->peers->max_template_len = DEFAULT_MAX_TEMPLATE_LEN;
+		TAILQ_INIT(&w->peers->peer_list);
+
+		if ((w->ev = evloop_new()) == NULL)
+			logerr("%s: evloop_new", __func__);
+		listeners_register(conf, w, 1);
+	}
+
+#ifdef PIPELINE_THREADS
+	if (conf->opts & FLOWD_OPT_PIPELINE)
+		pipeline_init(conf);
+#endif
+#ifdef WORKER_THREADS
+	if (num_workers > 1 || (conf->opts & FLOWD_OPT_PIPELINE)) {
+		if (pipe(worker_stop_pipe) == -1 ||
+		    pipe(worker_wake_pipe) == -1)
+			logerr("%s: pipe", __func__);
+		/* Workers must never block trying to wake us */
+		if (fcntl(worker_wake_pipe[0], F_SETFL, O_NONBLOCK) == -1 ||
+		    fcntl(worker_wake_pipe[1], F_SETFL, O_NONBLOCK) == -1)
+			logerr("%s: fcntl", __func__);
+		for (i = 0; i < num_workers; i++) {
+			if (evloop_add(workers[i].ev, worker_stop_pipe[0],
+			    worker_stop_pipe) == -1)
+				logerr("%s: evloop_add", __func__);
+		}
+		logit(LOG_INFO, "Starting %u worker threads%s", num_workers,
+		    (conf->opts & FLOWD_OPT_PIPELINE) ? " (pipelined)" : "");
+	}
+#endif
+}
+
+#ifdef WORKER_THREADS
+static void *
+worker_main(void *arg)
+{
+	struct worker *w = (struct worker *)arg;
+	struct flowd_config *conf = w->conf;
+	char c = 0;
+
+	while (worker_receive(w) == 0) {
+		forward_flush(w);
+		output_flow_flush(w, conf->opts & FLOWD_OPT_VERBOSE);
+
+		if (w->log_socket != -1 && !w->wake_sent &&
+		    logsock_need_reopen(w)) {
+			w->wake_sent = 1;
+			if (write(worker_wake_pipe[1], &c, 1) == -1 &&
+			    errno != EAGAIN)
+				logerr("%s: write", __func__);
+		}
+	}
+
+	return (NULL);
+}
+
+/* Start all worker threads. Signals are left to the main thread */
+static void
+workers_start(struct flowd_config *conf)
+{
+	struct worker *w;
+	sigset_t all, old;
+	u_int i;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (i = 0; i < num_workers; i++) {
+		w = &workers[i];
+		filter_list_copy(&w->filter_copy, &conf->filter_list);
+		w->filter_copy_prog = filter_prog_copy(conf->filter_prog,
+		    &w->filter_copy);
+		w->filter = w->filter_copy_prog;
+		w->wake_sent = 0;
+		if ((errno = pthread_create(&w->thread, NULL,
+		    worker_main, w)) != 0)
+			logerr("%s: pthread_create", __func__);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * Stop all worker threads and fold their filter counters back into the
+ * configuration. Once this returns, the main thread may safely inspect
+ * or modify all worker state.
+ */
+static void
+workers_stop(struct flowd_config *conf)
+{
+	struct worker *w;
+	u_int i;
+	char c = 0;
+
+	if (atomicio(vwrite, worker_stop_pipe[1], &c, 1) != 1)
+		logerr("%s: write", __func__);
+	for (i = 0; i < num_workers; i++) {
+		w = &workers[i];
+		if ((errno = pthread_join(w->thread, NULL)) != 0)
+			logerr("%s: pthread_join", __func__);
+		filter_prog_sync(w->filter_copy_prog);
+		filter_prog_free(w->filter_copy_prog);
+		w->filter_copy_prog = NULL;
+		filter_list_merge(&conf->filter_list, &w->filter_copy);
+		w->filter = conf->filter_prog;
+	}
+	if (atomicio(read, worker_stop_pipe[0], &c, 1) != 1)
+		logerr("%s: read", __func__);
+}
+
+/* Start whichever kind of worker threads the configuration calls for */
+static void
+threads_start(struct flowd_config *conf)
+{
+#ifdef PIPELINE_THREADS
+	if (conf->opts & FLOWD_OPT_PIPELINE) {
+		pipeline_start(conf);
+		return;
+	}
+#endif
+	workers_start(conf);
+}
+
+static void
+threads_stop(struct flowd_config *conf)
+{
+#ifdef PIPELINE_THREADS
+	if (conf->opts & FLOWD_OPT_PIPELINE) {
+		pipeline_stop(conf);
+		return;
+	}
+#endif
+	workers_stop(conf);
+}
+#endif /* WORKER_THREADS */
+
+/*
+ * NetFlow v.9 / IPFIX template cache. A restarted collector would otherwise
+ * discard data until each exporter next sends its templates, which can take
+ * many minutes, so the templates and samplers of every source are written
+ * to a file periodically and on exit, and read back at startup. The child
+ * keeps the file open, as the monitor is gone by the time it exits.
+ *
+ * The file is a header followed by a record for each source: its templates
+ * and then its samplers. Everything is in network byte order. Sources are
+ * written least recently used first, so that loading them in order
+ * recreates the LRU lists.
+ */
+#define TMPL_CACHE_MAGIC	0x464c5443	/* "FLTC" */
+#define TMPL_CACHE_VERSION	1
+#define TMPL_CACHE_MAX_SIZE	(64 * 1024 * 1024)
+
+struct tmpl_cache_header {
+	u_int32_t magic, version;
+	u_int32_t workers;		/* Number of workers that saved it */
+	u_int32_t length;		/* Bytes after the header */
+	u_int32_t crc;			/* Of those bytes */
+	u_int64_t saved;
+} __packed;
+struct tmpl_cache_source {
+	u_int8_t af;			/* 4 or 6 */
+	u_int8_t version;		/* 9 or 10 */
+	u_int8_t worker;
+	u_int8_t pad;
+	u_int8_t addr[16];
+	u_int32_t scope_id;
+	u_int32_t source_id;
+	u_int16_t num_templates, num_samplers;
+} __packed;
+struct tmpl_cache_template {
+	u_int64_t received;
+	u_int16_t template_id, num_records, num_scopes, pad;
+	u_int32_t total_len;
+	/* Followed by num_records x struct tmpl_cache_record */
+} __packed;
+struct tmpl_cache_record {
+	u_int16_t type, len;
+	u_int32_t enterprise;
+} __packed;
+struct tmpl_cache_sampler {
+	u_int64_t id;
+	u_int32_t interval;
+	u_int8_t scope, algorithm;
+	u_int16_t pad;
+} __packed;
+
+struct tmpl_cache_buf {
+	u_int8_t *data;
+	size_t len, size;
+};
+
+static void
+tmpl_cache_put(struct tmpl_cache_buf *b, const void *p, size_t len)
+{
+	u_int8_t *n;
+
+	if (b->len + len > b->size) {
+		do {
+			b->size = b->size == 0 ? 4096 : b->size * 2;
+		} while (b->len + len > b->size);
+		if ((n = realloc(b->data, b->size)) == NULL)
+			logerrx("%s: realloc failed (size %zu)", __func__,
+			    b->size);
+		b->data = n;
+	}
+	memcpy(b->data + b->len, p, len);
+	b->len += len;
+}
+
+/* Append a source's unexpired templates and its samplers */
+static u_int
+tmpl_cache_put_source(struct tmpl_cache_buf *b, u_int worker,
+    struct peer_tmpl_source *source, time_t oldest)
+{
+	struct peer_state *peer = source->key.peer;
+	struct peer_template *template;
+	struct tmpl_cache_source cs;
+	struct tmpl_cache_template ct;
+	struct tmpl_cache_record cr;
+	struct tmpl_cache_sampler csa;
+	size_t start;
+	u_int i, n;
+
+	bzero(&cs, sizeof(cs));
+	cs.af = peer->from.af == AF_INET ? 4 : 6;
+	cs.version = source->key.version;
+	cs.worker = worker;
+	if (peer->from.af == AF_INET)
+		memcpy(cs.addr, &peer->from.v4, sizeof(peer->from.v4));
+	else
+		memcpy(cs.addr, &peer->from.v6, sizeof(peer->from.v6));
+	cs.scope_id = htonl(peer->from.scope_id);
+	cs.source_id = htonl(source->key.source_id);
+	start = b->len;
+	tmpl_cache_put(b, &cs, sizeof(cs));
+
+	n = 0;
+	TAILQ_FOREACH_REVERSE(template, &source->templates, peer_template_list,
+	    lp) {
+		if (template->received < oldest)
+			continue;
+		bzero(&ct, sizeof(ct));
+		ct.received = store_htonll(template->received);
+		ct.template_id = htons(template->key.template_id);
+		ct.num_records = htons(template->num_records);
+		ct.num_scopes = htons(template->num_scopes);
+		ct.total_len = htonl(template->total_len);
+		tmpl_cache_put(b, &ct, sizeof(ct));
+		for (i = 0; i < template->num_records; i++) {
+			cr.type = htons(template->records[i].type);
+			cr.len = htons(template->records[i].len);
+			cr.enterprise = htonl(template->records[i].enterprise);
+			tmpl_cache_put(b, &cr, sizeof(cr));
+		}
+		n++;
+	}
+	/* Samplers are no use without templates to decode flows with */
+	if (n == 0) {
+		b->len = start;
+		return (0);
+	}
+	for (i = 0; i < source->num_samplers; i++) {
+		bzero(&csa, sizeof(csa));
+		csa.id = store_htonll(source->samplers[i].id);
+		csa.interval = htonl(source->samplers[i].interval);
+		csa.scope = source->samplers[i].scope;
+		csa.algorithm = source->samplers[i].algorithm;
+		tmpl_cache_put(b, &csa, sizeof(csa));
+	}
+	cs.num_templates = htons(n);
+	cs.num_samplers = htons(source->num_samplers);
+	memcpy(b->data + start, &cs, sizeof(cs));
+	return (n);
+}
+
+/*
+ * Write the template state of all workers to the cache. This must only be
+ * called while the worker threads are stopped.
+ */
+static void
+tmpl_cache_save(struct flowd_config *conf, int fd)
+{
+	struct tmpl_cache_header h;
+	struct tmpl_cache_buf b;
+	struct peer_state *peer;
+	struct peer_tmpl_source *source;
+	time_t now;
+	u_int n, ntemplates;
+
+	now = time(NULL);
+	bzero(&b, sizeof(b));
+	bzero(&h, sizeof(h));
+	tmpl_cache_put(&b, &h, sizeof(h));
+	ntemplates = 0;
+	for (n = 0; n < num_workers; n++) {
+		TAILQ_FOREACH_REVERSE(peer, &workers[n].peers->peer_list,
+		    peer_list, lp) {
+			TAILQ_FOREACH_REVERSE(source, &peer->sources,
+			    peer_tmpl_source_list, lp) {
+				ntemplates += tmpl_cache_put_source(&b, n,
+				    source, now - conf->tmpl_cache_valid);
+			}
+		}
+	}
+
+	h.magic = htonl(TMPL_CACHE_MAGIC);
+	h.version = htonl(TMPL_CACHE_VERSION);
+	h.workers = htonl(num_workers);
+	h.length = htonl(b.len - sizeof(h));
+	h.crc = htonl(flowd_crc32(b.data + sizeof(h), b.len - sizeof(h)));
+	h.saved = store_htonll(now);
+	memcpy(b.data, &h, sizeof(h));
+
+	if (lseek(fd, 0, SEEK_SET) == -1 ||
+	    atomicio(vwrite, fd, b.data, b.len) != b.len ||
+	    ftruncate(fd, b.len) == -1) {
+		logitm(LOG_WARNING, "template cache \"%s\" write failed",
+		    conf->tmpl_cache);
+	} else {
+		logit(LOG_DEBUG, "Saved %u templates to template cache",
+		    ntemplates);
+	}
+	free(b.data);
+}
+
+/*
+ * Install a template read from the cache, creating its peer if "*peer" is
+ * NULL. Returns -1 if the template is invalid or the peer can't be made
+ */
+static int
+tmpl_cache_install(struct flowd_config *conf, struct peers *peers,
+    struct peer_state **peer, struct xaddr *addr, const struct timeval *now,
+    u_int version, u_int32_t source_id, const struct tmpl_cache_template *ct,
+    const struct tmpl_cache_record *cr, struct peer_tmpl_source **source)
+{
+	struct peer_template *template;
+	struct peer_tmpl_record *recs;
+	u_int i, num_recs, num_scopes, total_len;
+
+	num_recs = ntohs(ct->num_records);
+	num_scopes = ntohs(ct->num_scopes);
+	if (num_recs == 0 || num_scopes > num_recs)
+		return (-1);
+	if ((recs = calloc(num_recs, sizeof(*recs))) == NULL)
+		logerrx("%s: calloc failed (num %u)", __func__, num_recs);
+	total_len = 0;
+	for (i = 0; i < num_recs; i++) {
+		recs[i].type = ntohs(cr[i].type);
+		recs[i].len = ntohs(cr[i].len);
+		recs[i].enterprise = ntohl(cr[i].enterprise);
+		if (version == 10 && recs[i].len == NF10_VARLEN)
+			total_len++;
+		else if ((num_scopes == 0 && !tmpl_check_rec(&recs[i], 0)) ||
+		    recs[i].len == 0 || recs[i].len > 0x4000)
+			goto bad;
+		else
+			total_len += recs[i].len;
+	}
+	if (total_len != ntohl(ct->total_len) ||
+	    total_len > peers->max_template_len)
+		goto bad;
+
+	/* Only exporters with a valid template take a peer slot */
+	if (*peer == NULL &&
+	    (*peer = new_peer(peers, conf, addr, now)) == NULL)
+		goto bad;
+
+	/* The same template may be in the cache from more than one worker */
+	template = tmpl_store(peers, *peer, version, source_id,
+	    ntohs(ct->template_id), recs, num_recs, total_len, num_scopes);
+	template->received = store_ntohll(ct->received);
+	*source = template->source;
+	return (0);
+
+ bad:
+	free(recs);
+	return (-1);
+}
+
+/*
+ * Load the templates in the cache that are still valid. If the number of
+ * workers has changed, then the worker that each exporter's packets are
+ * steered to has too, so every worker gets a copy.
+ */
+static void
+tmpl_cache_load(struct flowd_config *conf, int fd)
+{
+	struct tmpl_cache_header h;
+	const struct tmpl_cache_source *cs;
+	const struct tmpl_cache_template *ct;
+	const struct tmpl_cache_sampler *csa;
+	struct peer_tmpl_source *source;
+	struct peer_state *peer;
+	struct peer_sampler sampler;
+	struct peers *peers;
+	struct xaddr addr;
+	struct timeval tv;
+	struct stat st;
+	u_int8_t *data, *p, *end, *s;
+	u_int i, j, n, first, last, num_tmpl, num_samp, num_recs;
+	u_int loaded, expired;
+	time_t oldest;
+	int valid;
+
+	if (fstat(fd, &st) == -1) {
+		logitm(LOG_WARNING, "template cache \"%s\" fstat",
+		    conf->tmpl_cache);
+		return;
+	}
+	/* A new, empty file */
+	if (st.st_size == 0)
+		return;
+	if (st.st_size < (off_t)sizeof(h) || st.st_size > TMPL_CACHE_MAX_SIZE)
+		goto bad;
+	if ((data = malloc(st.st_size)) == NULL)
+		logerrx("%s: malloc failed (size %lld)", __func__,
+		    (long long)st.st_size);
+	if (lseek(fd, 0, SEEK_SET) == -1 ||
+	    atomicio(read, fd, data, st.st_size) != (size_t)st.st_size) {
+		logitm(LOG_WARNING, "template cache \"%s\" read",
+		    conf->tmpl_cache);
+		free(data);
+		return;
+	}
+	memcpy(&h, data, sizeof(h));
+	p = data + sizeof(h);
+	end = data + st.st_size;
+	if (ntohl(h.magic) != TMPL_CACHE_MAGIC ||
+	    ntohl(h.version) != TMPL_CACHE_VERSION ||
+	    ntohl(h.length) != (size_t)(end - p) ||
+	    ntohl(h.crc) != flowd_crc32(p, end - p)) {
+		free(data);
+		goto bad;
+	}
+	if (ntohl(h.workers) != num_workers) {
+		logit(LOG_INFO, "Template cache was saved by %u workers, "
+		    "loading it into all %u", ntohl(h.workers), num_workers);
+	}
+
+	gettimeofday(&tv, NULL);
+	oldest = tv.tv_sec - conf->tmpl_cache_valid;
+	loaded = expired = 0;
+	while (p < end) {
+		if ((size_t)(end - p) < sizeof(*cs))
+			break;
+		cs = (const struct tmpl_cache_source *)p;
+		p += sizeof(*cs);
+		num_tmpl = ntohs(cs->num_templates);
+		num_samp = ntohs(cs->num_samplers);
+
+		/* Entries that make no sense are skipped over */
+		valid = (cs->af == 4 || cs->af == 6) &&
+		    (cs->version == 9 || cs->version == 10);
+		bzero(&addr, sizeof(addr));
+		if (cs->af == 4) {
+			addr.af = AF_INET;
+			memcpy(&addr.v4, cs->addr, sizeof(addr.v4));
+		} else if (cs->af == 6) {
+			addr.af = AF_INET6;
+			memcpy(&addr.v6, cs->addr, sizeof(addr.v6));
+			addr.scope_id = ntohl(cs->scope_id);
+		}
+
+		if (!valid)
+			first = last = 0;
+		else if (ntohl(h.workers) == num_workers &&
+		    cs->worker < num_workers)
+			first = last = cs->worker;
+		else {
+			first = 0;
+			last = num_workers - 1;
+		}
+
+		/* Each worker parses the source's templates afresh */
+		for (s = p, n = first; n <= last; n++) {
+			peers = workers[n].peers;
+			peer = valid ? find_peer(peers, &addr) : NULL;
+			source = NULL;
+			for (s = p, i = 0; i < num_tmpl; i++) {
+				if ((size_t)(end - s) < sizeof(*ct))
+					goto truncated;
+				ct = (const struct tmpl_cache_template *)s;
+				s += sizeof(*ct);
+				num_recs = ntohs(ct->num_records);
+				if ((size_t)(end - s) <
+				    num_recs * sizeof(struct tmpl_cache_record))
+					goto truncated;
+				if (!valid) {
+					/* Nothing to install */
+				} else if ((time_t)store_ntohll(ct->received) <
+				    oldest) {
+					if (n == first)
+						expired++;
+				} else if (tmpl_cache_install(conf, peers,
+				    &peer, &addr, &tv, cs->version,
+				    ntohl(cs->source_id), ct,
+				    (const struct tmpl_cache_record *)s,
+				    &source) == 0) {
+					if (n == first)
+						loaded++;
+				}
+				s += num_recs * sizeof(struct tmpl_cache_record);
+			}
+			if ((size_t)(end - s) < num_samp * sizeof(*csa))
+				goto truncated;
+			for (j = 0; j < num_samp; j++) {
+				csa = (const struct tmpl_cache_sampler *)s;
+				s += sizeof(*csa);
+				if (source == NULL)
+					continue;
+				bzero(&sampler, sizeof(sampler));
+				sampler.id = store_ntohll(csa->id);
+				sampler.interval = ntohl(csa->interval);
+				sampler.scope = csa->scope;
+				sampler.algorithm = csa->algorithm;
+				peer_set_sampler(source, &sampler);
+			}
+		}
+		p = s;
+	}
+	free(data);
+	logit(LOG_INFO, "Loaded %u templates from template cache \"%s\" "
+	    "(%u expired)", loaded, conf->tmpl_cache, expired);
+	return;
+
+ truncated:
+	free(data);
+ bad:
+	logit(LOG_WARNING, "Ignoring invalid template cache \"%s\"",
+	    conf->tmpl_cache);
+}
+
+/* Act on a signal delivered through the event loop */
+static void
+signal_dispatch(int signo)
+{
+	switch (signo) {
+	case SIGINT:
+	case SIGTERM:
+		sighand_exit(signo);
+		break;
+	case SIGHUP:
+		sighand_reconf(signo);
+		break;
+	case SIGUSR1:
+		sighand_reopen(signo);
+		break;
+	case SIGUSR2:
+#ifdef SIGINFO
+	case SIGINFO:
+#endif
+		sighand_info(signo);
+		break;
+	}
+}
+
+/*
+ * The main loop has a single timer. Set it for the next template cache
+ * save, or for when a log socket reopen would be permitted once a worker
+ * has seen enough errors, rather than checking the time on every loop.
+ */
+static void
+mainloop_timer_update(struct evloop *ev, int log_socket, time_t when)
+{
+	time_t t;
+	u_int n;
+
+	for (n = 0; log_socket != -1 && n < num_workers; n++) {
+		if (workers[n].logsock_num_errors > LOGSOCK_REOPEN_ERROR_COUNT) {
+			t = workers[n].logsock_first_error +
+			    LOGSOCK_REOPEN_DELAY + 1;
+			if (when == 0 || t < when)
+				when = t;
+			break;
+		}
+	}
+	if (when != 0)
+		evloop_timer(ev, when);
+}
+
+static int
+tmpl_cache_open(struct flowd_config *conf, int monitor_fd)
+{
+	int fd;
+
+	if ((fd = client_open_tmpl_cache(monitor_fd)) == -1) {
+		logit(LOG_WARNING, "Template cache \"%s\" unavailable",
+		    conf->tmpl_cache);
+	}
+	return (fd);
+}
+
+static void
+flowd_mainloop(struct flowd_config *conf, int monitor_fd)
+{
+	struct ev_event ev[EV_MAX_EVENTS];
+	struct evloop *main_ev;
+	struct worker *w;
+	int i, nev, threaded, running, monitor_closed, logsock_check;
+	int tmpl_cache_check, log_fd, log_socket, tmpl_cache_fd;
+	time_t tmpl_cache_next;
+	struct timeval tv;
+	sigset_t sigs;
+	u_int n;
+#ifdef WORKER_THREADS
+	char buf[64];
+#endif
+
+	workers_init(conf);
+	w = &workers[0];
+
+	tmpl_cache_fd = -1;
+	tmpl_cache_next = 0;
+	if (conf->tmpl_cache != NULL &&
+	    (tmpl_cache_fd = tmpl_cache_open(conf, monitor_fd)) != -1) {
+		tmpl_cache_load(conf, tmpl_cache_fd);
+		tmpl_cache_next = time(NULL) + conf->tmpl_cache_save;
+	}
+
+	/*
+	 * With worker threads, the main thread only waits for signals, the
+	 * monitor and requests from the workers. Otherwise it shares the
+	 * only worker's event loop and does the receiving itself.
+	 */
+	threaded = num_workers > 1 || (conf->opts & FLOWD_OPT_PIPELINE);
+	if (!threaded)
+		main_ev = w->ev;
+	else if ((main_ev = evloop_new()) == NULL)
+		logerr("%s: evloop_new", __func__);
+	if (evloop_add(main_ev, monitor_fd, &monitor_fd) == -1)
+		logerr("%s: evloop_add", __func__);
+#ifdef WORKER_THREADS
+	if (threaded && evloop_add(main_ev, worker_wake_pipe[0],
+	    worker_wake_pipe) == -1)
+		logerr("%s: evloop_add", __func__);
+#endif
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGHUP);
+	sigaddset(&sigs, SIGUSR1);
+	sigaddset(&sigs, SIGUSR2);
+#ifdef SIGINFO
+	sigaddset(&sigs, SIGINFO);
+#endif
+	evloop_signals(main_ev, &sigs);
+#ifdef USE_IO_URING
+	if ((conf->opts & FLOWD_OPT_IO_URING) && threaded)
+		logit(LOG_WARNING, "io_uring is not used with worker threads");
+	else if ((conf->opts & FLOWD_OPT_IO_URING) &&
+	    uring_init(conf, w) == -1) {
+		logit(LOG_WARNING, "io_uring unavailable (%s), using the "
+		    "event loop", strerror(errno));
+	}
+#endif
 
 	/* Main loop */
 	log_fd = log_socket = -1;
+	running = monitor_closed = logsock_check = tmpl_cache_check = 0;
 	for(;exit_flag == 0;) {
-		if (log_socket != -1 &&
-		    logsock_num_errors > LOGSOCK_REOPEN_ERROR_COUNT &&
-		    time(NULL) > logsock_first_error + LOGSOCK_REOPEN_DELAY) {
+#ifdef WORKER_THREADS
+		/*
+		 * The worker threads keep running until there is something
+		 * below that needs their state: a reconfigure, info dump,
+		 * log reopen or template cache save.
+		 */
+		if (running && (reconf_flag || info_flag || tmpl_cache_check ||
+		    (logsock_check && log_socket != -1) ||
+		    (reopen_flag && (log_fd != -1 || log_socket != -1)))) {
+			threads_stop(conf);
+			running = 0;
+		}
+#endif
+		/* time() may lag the timer, which measures more finely */
+		if (tmpl_cache_check && tmpl_cache_fd != -1 &&
+		    gettimeofday(&tv, NULL) == 0 &&
+		    tv.tv_sec >= tmpl_cache_next) {
+			tmpl_cache_save(conf, tmpl_cache_fd);
+			tmpl_cache_next = tv.tv_sec + conf->tmpl_cache_save;
+		}
+		tmpl_cache_check = 0;
+		for (n = 0; logsock_check && log_socket != -1 &&
+		    n < num_workers; n++) {
+			if (logsock_need_reopen(&workers[n]))
+				break;
+		}
+		if (logsock_check && log_socket != -1 && n < num_workers) {
 			logit(LOG_INFO, "reopening log socket because of "
 			    "frequent errors");
 			close(log_socket);
 			log_socket = -1;
-			logsock_first_error = logsock_num_errors = 0;
+			for (n = 0; n < num_workers; n++) {
+				workers[n].logsock_first_error = 0;
+				workers[n].logsock_num_errors = 0;
+			}
 		}
+		logsock_check = 0;
 		if (reopen_flag && (log_fd != -1 || log_socket != -1)) {
 			logit(LOG_INFO, "log reopen requested");
+			for (n = 0; n < num_workers; n++)
+				output_flow_sync(&workers[n]);
 			if (log_fd != -1)
 				close(log_fd);
 			if (log_socket != -1)
@@ -1756,54 +5175,265 @@ flowd_mainloop(struct flowd_config *conf, struct peers *peers, int monitor_fd)
 		}
 		if (reconf_flag) {
 			logit(LOG_INFO, "reconfiguration requested");
+			/*
+			 * client_reconfigure closes every listener and the
+			 * monitor sends a fresh set, so all of them come out
+			 * of the event loops here and go back in below.
+			 */
+			for (n = 0; n < num_workers; n++) {
+				listeners_register(conf, &workers[n], 0);
+				forward_flush(&workers[n]);
+				forward_free(&workers[n]);
+			}
 			if (client_reconfigure(monitor_fd, conf) == -1)
 				logerrx("reconfigure failed, exiting");
-			init_pfd(conf, &pfd, monitor_fd, &num_fds);
-			scrub_peers(conf, peers);
+			/* The cache may have moved; rewrite it straight away */
+			if (tmpl_cache_fd != -1)
+				close(tmpl_cache_fd);
+			tmpl_cache_fd = -1;
+			if (conf->tmpl_cache != NULL &&
+			    (tmpl_cache_fd = tmpl_cache_open(conf,
+			    monitor_fd)) != -1) {
+				tmpl_cache_save(conf, tmpl_cache_fd);
+				tmpl_cache_next = time(NULL) +
+				    conf->tmpl_cache_save;
+			}
+			for (n = 0; n < num_workers; n++) {
+				workers[n].filter = conf->filter_prog;
+				listeners_register(conf, &workers[n], 1);
+				forward_init(&workers[n]);
+				scrub_peers(conf, workers[n].peers);
+#ifdef USE_IO_URING
+				/* The kernel holds io_uring's buffers */
+				if (workers[n].ur != NULL)
+					continue;
+#endif
+				if (conf->packet_pool != workers[n].pool.size)
+					packet_pool_init(&workers[n].pool,
+					    conf->packet_pool,
+					    INPUT_MAX_PACKET_SIZE);
+			}
 			reconf_flag = 0;
 		}
 		if (log_fd == -1 && conf->log_file != NULL)
 			log_fd = start_log(monitor_fd);
 		if (log_socket == -1 && conf->log_socket != NULL)
 			log_socket = start_socket(monitor_fd);
+		for (n = 0; !running && n < num_workers; n++) {
+			workers[n].log_fd = log_fd;
+			workers[n].log_socket = log_socket;
+		}
 
 		if (info_flag) {
 			struct filter_rule *fr;
 
 			info_flag = 0;
+			filter_prog_sync(conf->filter_prog);
 			TAILQ_FOREACH(fr, &conf->filter_list, entry)
 				logit(LOG_INFO, "%s", format_rule(fr));
-			dump_peers(peers);
+			for (n = 0; n < num_workers; n++) {
+				dump_recv_stats(&workers[n]);
+				dump_forward_stats(&workers[n]);
+#ifdef PIPELINE_THREADS
+				if (conf->opts & FLOWD_OPT_PIPELINE)
+					dump_pipeline_stats(&workers[n]);
+#endif
+				dump_peers(workers[n].peers);
+			}
+#ifdef PIPELINE_THREADS
+			if (conf->opts & FLOWD_OPT_PIPELINE) {
+				logit(LOG_INFO, "Writer: waits %llu",
+				    (unsigned long long)writer_waits);
+			}
+#endif
 		}
 
-		i = poll(pfd, num_fds, INFTIM);
-		if (i <= 0) {
-			if (i == 0 || errno == EINTR)
-				continue;
-			logerr("%s: poll", __func__);
+		if (!running) {
+			mainloop_timer_update(main_ev, log_socket,
+			    tmpl_cache_fd != -1 ? tmpl_cache_next : 0);
+		}
+#ifdef WORKER_THREADS
+		if (threaded && !running) {
+			threads_start(conf);
+			running = 1;
+		}
+#endif
+		nev = evloop_wait(main_ev, ev, EV_MAX_EVENTS);
+
+		for (i = 0; i < nev; i++) {
+			switch (ev[i].type) {
+			case EV_SIGNAL:
+				signal_dispatch(ev[i].signo);
+				break;
+			case EV_TIMER:
+				logsock_check = tmpl_cache_check = 1;
+				break;
+			case EV_READ:
+				if (ev[i].arg == &monitor_fd)
+					monitor_closed = 1;
+#ifdef WORKER_THREADS
+				else if (ev[i].arg == worker_wake_pipe) {
+					while (read(worker_wake_pipe[0], buf,
+					    sizeof(buf)) > 0)
+						;
+					logsock_check = 1;
+				}
+#endif
+#ifdef USE_IO_URING
+				else if (w->ur != NULL && ev[i].arg == w->ur)
+					uring_receive(w);
+#endif
+				else
+					receive_ready(w, ev[i].arg);
+				break;
+			}
 		}
 
 		/* monitor exited */
-		if (pfd[0].revents != 0) {
+		if (monitor_closed) {
 			logit(LOG_DEBUG, "%s: monitor closed", __func__);
 			break;
 		}
 
-		i = 1;
-		TAILQ_FOREACH(la, &conf->listen_addrs, entry) {
-			if ((pfd[i].revents & POLLIN) != 0)
-				receive_many(conf, peers, pfd[i].fd);
-			i++;
+		if (!threaded) {
+			forward_flush(w);
+			output_flow_flush(w, conf->opts & FLOWD_OPT_VERBOSE);
+#ifdef USE_IO_URING
+			/* Restart receives that stopped for want of buffers */
+			if (w->ur != NULL)
+				uring_arm(w);
+#endif
 		}
+	}
 
-		process_input_queue(conf, peers, log_fd, log_socket);
-		output_flow_flush(log_fd, conf->opts & FLOWD_OPT_VERBOSE);
+#ifdef WORKER_THREADS
+	if (running)
+		threads_stop(conf);
+#endif
+	for (n = 0; n < num_workers; n++)
+		output_flow_sync(&workers[n]);
+	if (tmpl_cache_fd != -1) {
+		tmpl_cache_save(conf, tmpl_cache_fd);
+		close(tmpl_cache_fd);
 	}
 
 	if (exit_flag != 0)
 		logit(LOG_NOTICE, "Exiting on signal %d", exit_flag);
 }
 
+/*
+ * Feed the UDP datagrams sent to our listen ports in a pcap or pcapng
+ * file through the decoders as fast as they will go, without privilege
+ * separation or any sockets, and report how quickly that happened.
+ * Returns -1 if the capture couldn't be read to the end.
+ */
+static int
+flowd_replay(struct flowd_config *conf, const char *path)
+{
+	const struct capture_stats *cs;
+	struct capture *cap;
+	struct capture_udp cu;
+	struct listen_addr *la;
+	struct forward_addr *fa;
+	struct flow_packet *fp;
+	struct worker *w;
+	struct timeval start, end;
+	u_int64_t npackets, nbytes, other;
+	double secs;
+	char ebuf[512];
+	int r, fd;
+
+	if ((cap = capture_open(path, ebuf, sizeof(ebuf))) == NULL)
+		logerrx("%s", ebuf);
+
+	/* A single worker on this thread, with nowhere to send packets */
+	conf->workers = 1;
+	conf->opts &= ~(FLOWD_OPT_PIPELINE|FLOWD_OPT_IO_URING);
+	if (!TAILQ_EMPTY(&conf->forward_addrs))
+		logit(LOG_INFO, "Not forwarding replayed packets");
+	while ((fa = TAILQ_FIRST(&conf->forward_addrs)) != NULL) {
+		TAILQ_REMOVE(&conf->forward_addrs, fa, entry);
+		free(fa);
+	}
+	if (conf->log_socket != NULL)
+		logit(LOG_INFO, "Not logging replayed flows to socket");
+	workers_init(conf);
+	w = &workers[0];
+	/* Replays may use the daemon's templates, but don't update them */
+	if (conf->tmpl_cache != NULL) {
+		if ((fd = open(conf->tmpl_cache, O_RDONLY)) != -1) {
+			tmpl_cache_load(conf, fd);
+			close(fd);
+		} else if (errno != ENOENT)
+			logerr("%s: open(\"%s\")", __func__, conf->tmpl_cache);
+	}
+	if (conf->log_file != NULL) {
+		if ((fd = open(conf->log_file, O_RDWR|O_APPEND|O_CREAT,
+		    0600)) == -1)
+			logerr("%s: open(\"%s\")", __func__, conf->log_file);
+		w->log_fd = check_log(fd);
+	}
+
+	signal(SIGINT, sighand_exit);
+	signal(SIGTERM, sighand_exit);
+
+	npackets = nbytes = other = 0;
+	gettimeofday(&start, NULL);
+	while (exit_flag == 0 &&
+	    (r = capture_next(cap, &cu, ebuf, sizeof(ebuf))) == 1) {
+		TAILQ_FOREACH(la, &conf->listen_addrs, entry) {
+			if (la->port == cu.dport)
+				break;
+		}
+		if (la == NULL) {
+			other++;
+			continue;
+		}
+		if ((fp = flow_packet_alloc(&w->pool)) == NULL)
+			logerrx("%s: packet pool exhausted", __func__);
+		/* Oversized datagrams are truncated, as recv() would */
+		fp->len = MIN(cu.len, INPUT_MAX_PACKET_SIZE);
+		memcpy(fp->packet, cu.data, fp->len);
+		memcpy(&fp->flow_source, &cu.src, sizeof(fp->flow_source));
+		fp->recv_time = cu.ts;
+		npackets++;
+		nbytes += fp->len;
+		packet_accept(w, fp);
+	}
+	output_flow_flush(w, conf->opts & FLOWD_OPT_VERBOSE);
+	gettimeofday(&end, NULL);
+
+	if (r == -1)
+		logit(LOG_WARNING, "%s: %s", path, ebuf);
+	if (exit_flag != 0)
+		logit(LOG_NOTICE, "Replay interrupted by signal %d", exit_flag);
+
+	cs = capture_stats(cap);
+	logit(LOG_INFO, "%s: %llu frames, %llu UDP (%llu to other ports), "
+	    "%llu fragments, %llu truncated, %llu other", path,
+	    (unsigned long long)cs->frames, (unsigned long long)cs->udp,
+	    (unsigned long long)other, (unsigned long long)cs->fragments,
+	    (unsigned long long)cs->truncated, (unsigned long long)cs->skipped);
+	if (conf->opts & FLOWD_OPT_VERBOSE)
+		dump_peers(w->peers);
+
+	secs = (end.tv_sec - start.tv_sec) +
+	    (end.tv_usec - start.tv_usec) / 1000000.0;
+	if (secs <= 0)
+		secs = 0.000001;
+	logit(LOG_NOTICE, "Replayed %llu packets (%llu bytes), %llu valid "
+	    "with %llu flows, in %.3f seconds", (unsigned long long)npackets,
+	    (unsigned long long)nbytes, (unsigned long long)w->peers->npackets,
+	    (unsigned long long)w->peers->nflows, secs);
+	logit(LOG_NOTICE, "%.0f packets/sec, %.0f flows/sec",
+	    npackets / secs, w->peers->nflows / secs);
+
+	if (w->log_fd != -1)
+		close(w->log_fd);
+	capture_close(cap);
+	return (r == -1 ? -1 : 0);
+}
+
 static void
 startup_listen_init(struct flowd_config *conf)
 {
@@ -1811,7 +5441,7 @@ startup_listen_init(struct flowd_config *conf)
 
 	TAILQ_FOREACH(la, &conf->listen_addrs, entry) {
 		if ((la->fd = open_listener(&la->addr, la->port, la->bufsiz,
-		    &conf->join_groups)) == -1) {
+		    conf->workers, &conf->join_groups)) == -1) {
 			logerrx("Listener setup of [%s]:%d failed",
 			    addr_ntop_buf(&la->addr), la->port);
 		}
@@ -1844,6 +5474,7 @@ usage(void)
 	fprintf(stderr, "  -h              Display this help\n");
 	fprintf(stderr, "  -f path         Configuration file (default: %s)\n",
 	    DEFAULT_CONFIG);
+	fprintf(stderr, "  -r path         Replay a pcap or pcapng file and exit\n");
 	fprintf(stderr, "\n");
 }
 
@@ -1854,9 +5485,9 @@ main(int argc, char **argv)
 	extern char *optarg;
 	extern int optind;
 	const char *config_file = DEFAULT_CONFIG;
+	const char *replay_file = NULL;
 	struct flowd_config conf;
 	int monitor_fd;
-	struct peers peers;
 
 #ifndef HAVE_SETPROCTITLE
 	compat_init_setproctitle(argc, &argv);
@@ -1870,15 +5501,8 @@ main(int argc, char **argv)
 	loginit(PROGNAME, 1, 0);
 
 	bzero(&conf, sizeof(conf));
-	bzero(&peers, sizeof(peers));
-	peers.max_peers = DEFAULT_MAX_PEERS;
-	peers.max_templates = DEFAULT_MAX_TEMPLATES;
-	peers.max_sources = DEFAULT_MAX_SOURCES;
-	peers.max_template_len = DEFAULT_MAX_TEMPLATE_LEN;
-	SPLAY_INIT(&peers.peer_tree);
-	TAILQ_INIT(&peers.peer_list);
-
-	while ((ch = getopt(argc, argv, "dghD:f:X:")) != -1) {
+
+	while ((ch = getopt(argc, argv, "dghD:f:r:X:")) != -1) {
 		switch (ch) {
 		case 'X':
 			if (strcmp(optarg, "INSECURE") == 0)
@@ -1906,6 +5530,9 @@ main(int argc, char **argv)
 		case 'f':
 			config_file = optarg;
 			break;
+		case 'r':
+			replay_file = optarg;
+			break;
 		default:
 			fprintf(stderr, "Invalid commandline option.\n");
 			usage();
@@ -1916,6 +5543,9 @@ main(int argc, char **argv)
 	if (read_config(config_file, &conf) == -1)
 		logerrx("Config file has errors");
 
+	if (replay_file != NULL)
+		return (flowd_replay(&conf, replay_file) == -1 ? 1 : 0);
+
 	/* Start listening (do this early to report errors before privsep) */
 	startup_listen_init(&conf);
 
@@ -1934,7 +5564,7 @@ main(int argc, char **argv)
 	signal(SIGINFO, sighand_info);
 #endif
 
-	flowd_mainloop(&conf, &peers, monitor_fd);
+	flowd_mainloop(&conf, monitor_fd);
 
 	return (0);
 }
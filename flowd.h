@@ -44,6 +44,45 @@
 #define DEFAULT_MAX_TEMPLATE_LEN	1024
 #define DEFAULT_MAX_SOURCES		64
 
+/* Number of datagrams to pull from a socket per receive call */
+#define DEFAULT_RECV_BATCH		32
+#define MAX_RECV_BATCH			512
+
+/* Number of preallocated packet buffers for received datagrams */
+#define DEFAULT_PACKET_POOL		2048
+#define MIN_PACKET_POOL			16
+#define MAX_PACKET_POOL			65536
+
+/* NetFlow v.9 / IPFIX template cache, times in seconds */
+#define DEFAULT_TMPL_CACHE_SAVE		300
+#define DEFAULT_TMPL_CACHE_VALID	3600
+#define MIN_TMPL_CACHE_SAVE		10
+
+/* Limits for growing listener receive buffers when datagrams are dropped */
+#define MIN_ADAPTIVE_BUFSIZE		(64 * 1024)
+#define MAX_ADAPTIVE_BUFSIZE		(1024 * 1024 * 1024)
+
+/* Worker threads need POSIX threads and SO_REUSEPORT to share listeners */
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD_CREATE) && \
+    defined(HAVE_DECL_SO_REUSEPORT) && HAVE_DECL_SO_REUSEPORT
+# define WORKER_THREADS
+#endif
+#define MAX_WORKERS			64
+
+/* The staged pipeline also needs atomics for its lock-free rings */
+#if defined(WORKER_THREADS) && defined(HAVE_ATOMIC_BUILTINS)
+# define PIPELINE_THREADS
+#endif
+
+/* io_uring backend needs multishot recvmsg and provided buffer rings */
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_ATOMIC_BUILTINS) && \
+    defined(HAVE_DECL_IORING_RECV_MULTISHOT) && \
+    HAVE_DECL_IORING_RECV_MULTISHOT && \
+    defined(HAVE_DECL_IORING_REGISTER_PBUF_RING) && \
+    HAVE_DECL_IORING_REGISTER_PBUF_RING
+# define USE_IO_URING
+#endif
+
 struct allowed_device {
 	struct xaddr			addr;
 	u_int				masklen;
@@ -56,6 +95,12 @@ struct listen_addr {
 	u_int16_t			port;
 	int				fd;
 	size_t				bufsiz;
+	u_int				worker;
+	/* Kernel drop accounting, updated by the owning worker */
+	u_int32_t			drops_seen;
+	u_int64_t			drops;
+	time_t				rcvbuf_grown;
+	int				rcvbuf_capped;
 	TAILQ_ENTRY(listen_addr)	entry;
 };
 TAILQ_HEAD(listen_addrs, listen_addr);
@@ -79,6 +124,9 @@ TAILQ_HEAD(forward_addrs, forward_addr);
 #define FLOWD_OPT_DONT_FORK		(1)
 #define FLOWD_OPT_VERBOSE		(1<<1)
 #define FLOWD_OPT_INSECURE		(1<<2)
+#define FLOWD_OPT_PIPELINE		(1<<3)
+#define FLOWD_OPT_IO_URING		(1<<4)
+#define FLOWD_OPT_UPSCALE		(1<<5)
 struct flowd_config {
 	char			*log_file;
 	char			*log_socket;
@@ -91,6 +139,14 @@ struct flowd_config {
 	struct filter_list	filter_list;
 	struct allowed_devices	allowed_devices;
 	struct join_groups	join_groups;
+	struct filter_prog	*filter_prog;	/* filter_list, compiled */
+	u_int			recv_batch;
+	u_int			packet_pool;
+	u_int			workers;
+	size_t			rcvbuf_max;	/* Adaptive SO_RCVBUF limit */
+	char			*tmpl_cache;
+	u_int			tmpl_cache_save; /* Seconds between saves */
+	u_int			tmpl_cache_valid; /* Max template age */
 };
 
 /* parse.y */
@@ -37,6 +37,10 @@ typedef struct {
 	PyObject *user_attr;	/* User-specified attributes */
 	PyObject *octets;	/* bah. python >2.5 lacks T_LONGLONG */
 	PyObject *packets;	/* ditto */
+	PyObject *sampler_id;	/* ditto */
+	PyObject *flow_start_ms; /* ditto */
+	PyObject *flow_finish_ms; /* ditto */
+	PyObject *skew_ms;	/* ditto, signed */
 	PyObject *agent_addr;
 	PyObject *src_addr;
 	PyObject *dst_addr;
@@ -61,6 +65,14 @@ newFlowObject(void)
 	Py_INCREF(Py_None);
 	self->packets = Py_None;
 	Py_INCREF(Py_None);
+	self->sampler_id = Py_None;
+	Py_INCREF(Py_None);
+	self->flow_start_ms = Py_None;
+	Py_INCREF(Py_None);
+	self->flow_finish_ms = Py_None;
+	Py_INCREF(Py_None);
+	self->skew_ms = Py_None;
+	Py_INCREF(Py_None);
 	self->agent_addr = Py_None;
 	Py_INCREF(Py_None);
 	self->src_addr = Py_None;
@@ -98,6 +110,8 @@ newFlowObject_from_flow(struct store_flow_complete *flow)
 	self->user_attr = NULL;
 	self->octets = NULL;
 	self->packets = NULL;
+	self->sampler_id = NULL;
+	self->flow_start_ms = self->flow_finish_ms = self->skew_ms = NULL;
 
 	self->src_addr = self->dst_addr = NULL;
 	self->agent_addr = self->gateway_addr = NULL;
@@ -136,11 +150,35 @@ newFlowObject_from_flow(struct store_flow_complete *flow)
 		self->packets = Py_None;
 		Py_INCREF(Py_None);
 	}
+	if ((self->flow.hdr.fields & STORE_FIELD_SAMPLING) != 0) {
+		self->sampler_id = PyLong_FromUnsignedLongLong(
+			    self->flow.samp.sampler_id);
+	} else {
+		self->sampler_id = Py_None;
+		Py_INCREF(Py_None);
+	}
+	if ((self->flow.hdr.fields & STORE_FIELD_ABS_TIMES) != 0) {
+		self->flow_start_ms = PyLong_FromUnsignedLongLong(
+			    self->flow.atimes.flow_start_ms);
+		self->flow_finish_ms = PyLong_FromUnsignedLongLong(
+			    self->flow.atimes.flow_finish_ms);
+		self->skew_ms = PyLong_FromLongLong(
+			    (int64_t)self->flow.atimes.skew_ms);
+	} else {
+		self->flow_start_ms = Py_None;
+		Py_INCREF(Py_None);
+		self->flow_finish_ms = Py_None;
+		Py_INCREF(Py_None);
+		self->skew_ms = Py_None;
+		Py_INCREF(Py_None);
+	}
 
 	self->user_attr = PyDict_New();
 
 	if (self->user_attr == NULL || self->octets == NULL ||
-	    self->packets == NULL) {
+	    self->packets == NULL || self->sampler_id == NULL ||
+	    self->flow_start_ms == NULL || self->flow_finish_ms == NULL ||
+	    self->skew_ms == NULL) {
 		/* Flow_dealloc will clean up for us */
 		Py_XDECREF(self);
 		return (NULL);		
@@ -165,10 +203,27 @@ object_to_u64(PyObject *o, u_int64_t *u64)
 	return (0);
 }
 
+static int 
+object_to_s64(PyObject *o, int64_t *s64)
+{
+	if (o == NULL)
+		return (-1);
+	if (PyLong_Check(o))
+		*s64 = PyLong_AsLongLong(o);
+	else
+		*s64 = PyInt_AsLong(o);
+	if (PyErr_Occurred())
+		return (-1);
+
+	return (0);
+}
+
 static int
 flowobj_normalise(FlowObject *f)
 {
 	const char *tmp;
+	u_int64_t u64;
+	int64_t skew;
 
 	if (f->octets != NULL && f->octets != Py_None) {
 		if (object_to_u64(f->octets,
@@ -192,6 +247,45 @@ flowobj_normalise(FlowObject *f)
 	} else
 		f->flow.hdr.fields &= ~STORE_FIELD_PACKETS;
 
+	if (f->sampler_id != NULL && f->sampler_id != Py_None) {
+		if (object_to_u64(f->sampler_id, &u64) == -1) {
+			PyErr_SetString(PyExc_TypeError,
+			    "incorrect type for Flow.sampler_id");
+			return (-1);
+		}
+		f->flow.samp.sampler_id = u64;
+		f->flow.hdr.fields |= STORE_FIELD_SAMPLING;
+	} else
+		f->flow.hdr.fields &= ~STORE_FIELD_SAMPLING;
+
+	/* Absolute times are present if any of them is set */
+	f->flow.hdr.fields &= ~STORE_FIELD_ABS_TIMES;
+	bzero(&f->flow.atimes, sizeof(f->flow.atimes));
+#define FL_ABS_TIME(member) do { \
+	if (f->member != NULL && f->member != Py_None) { \
+		if (object_to_u64(f->member, &u64) == -1) { \
+			PyErr_SetString(PyExc_TypeError, \
+			    "incorrect type for Flow."#member); \
+			return (-1); \
+		} \
+		f->flow.atimes.member = u64; \
+		f->flow.hdr.fields |= STORE_FIELD_ABS_TIMES; \
+	} } while (0)
+
+	FL_ABS_TIME(flow_start_ms);
+	FL_ABS_TIME(flow_finish_ms);
+#undef FL_ABS_TIME
+
+	if (f->skew_ms != NULL && f->skew_ms != Py_None) {
+		if (object_to_s64(f->skew_ms, &skew) == -1) {
+			PyErr_SetString(PyExc_TypeError,
+			    "incorrect type for Flow.skew_ms");
+			return (-1);
+		}
+		f->flow.atimes.skew_ms = (u_int64_t)skew;
+		f->flow.hdr.fields |= STORE_FIELD_ABS_TIMES;
+	}
+
 #define FL_ADDR_PTON(addr, tag) do { \
 	if (f->addr == NULL || f->addr == Py_None || \
 	    (tmp = PyString_AsString(f->addr)) == NULL || \
@@ -243,6 +337,10 @@ Flow_dealloc(FlowObject *self)
 	Py_XDECREF(self->user_attr);
 	Py_XDECREF(self->octets);
 	Py_XDECREF(self->packets);
+	Py_XDECREF(self->sampler_id);
+	Py_XDECREF(self->flow_start_ms);
+	Py_XDECREF(self->flow_finish_ms);
+	Py_XDECREF(self->skew_ms);
 	Py_XDECREF(self->src_addr);
 	Py_XDECREF(self->dst_addr);
 	Py_XDECREF(self->agent_addr);
@@ -351,6 +449,10 @@ static PyMemberDef Flow_members[] = {
 	{"gateway_addr",T_OBJECT, offsetof(FlowObject, gateway_addr),	0},
 	{"octets",	T_OBJECT, offsetof(FlowObject, octets),		0},
 	{"packets",	T_OBJECT, offsetof(FlowObject, packets),	0},
+	{"sampler_id",	T_OBJECT, offsetof(FlowObject, sampler_id),	0},
+	{"flow_start_ms",T_OBJECT, offsetof(FlowObject, flow_start_ms),	0},
+	{"flow_finish_ms",T_OBJECT,offsetof(FlowObject, flow_finish_ms),0},
+	{"skew_ms",	T_OBJECT, offsetof(FlowObject, skew_ms),	0},
 	{"src_addr_af",	FL_T_AF,  offsetof(FlowObject, flow.src_addr.af),	0},
 	{"dst_addr_af",	FL_T_AF,  offsetof(FlowObject, flow.dst_addr.af),	0},
 	{"agent_addr_af",FL_T_AF, offsetof(FlowObject, flow.agent_addr.af),	0},
@@ -381,6 +483,9 @@ static PyMemberDef Flow_members[] = {
 	{"engine_id",	FL_T_U16, offsetof(FlowObject, flow.finf.engine_id),	0},
 	{"flow_sequence",FL_T_U32,offsetof(FlowObject, flow.finf.flow_sequence),0},
 	{"source_id",	FL_T_U32, offsetof(FlowObject, flow.finf.source_id),	0},
+	{"sampling_interval",FL_T_U32,offsetof(FlowObject, flow.samp.interval),0},
+	{"sampling_algorithm",FL_T_U8,offsetof(FlowObject, flow.samp.algorithm),0},
+	{"sampling_flags",FL_T_U8, offsetof(FlowObject, flow.samp.flags),	0},
 	{"crc32",	FL_T_U32, offsetof(FlowObject, flow.crc32.crc32),	0},
 	{NULL}
 };
@@ -849,6 +954,8 @@ initflowd(void)
 	STORE_CONST(FIELD_FLOW_TIMES);
 	STORE_CONST(FIELD_AS_INFO);
 	STORE_CONST(FIELD_FLOW_ENGINE_INFO);
+	STORE_CONST(FIELD_SAMPLING);
+	STORE_CONST(FIELD_ABS_TIMES);
 	STORE_CONST(FIELD_CRC32);
 	STORE_CONST(FIELD_RESERVED);
 	STORE_CONST(FIELD_ALL);
@@ -859,6 +966,8 @@ initflowd(void)
 	STORE_CONST(FIELD_GATEWAY_ADDR);
 	STORE_CONST(DISPLAY_ALL);
 	STORE_CONST(DISPLAY_BRIEF);
+	STORE_CONST(SAMPLING_UPSCALED);
+	STORE_CONST(VERSION_SFLOW);
 #undef STORE_CONST
 #define STORE_CONST2(c) \
 	PyModule_AddObject(m, "STORE_"#c, PyLong_FromUnsignedLong(STORE_##c))
@@ -71,8 +71,11 @@ vlogit(int level, const char *fmt, va_list args)
 		return;
 
 	if (logstderr) {
+		/* Keep lines from worker threads intact */
+		flockfile(stderr);
 		vfprintf(stderr, fmt, args);
 		fputs("\n", stderr);
+		funlockfile(stderr);
 	} else
 		vsyslog(level, fmt, args);
 }
@@ -64,7 +64,8 @@ struct NF1_FLOW {
 struct NF5_HEADER {
 	struct NF_HEADER_COMMON c;
 	u_int32_t uptime_ms, time_sec, time_nanosec, flow_sequence;
-	u_int8_t engine_type, engine_id, reserved1, reserved2;
+	u_int8_t engine_type, engine_id;
+	u_int16_t sampling_interval;	/* Mode in the top two bits */
 } __packed;
 struct NF5_FLOW {
 	u_int32_t src_ip, dest_ip, nexthop_ip;
@@ -127,10 +128,17 @@ struct NF9_TEMPLATE_FLOWSET_RECORD {
 struct NF9_DATA_FLOWSET_HEADER {
 	struct NF9_FLOWSET_HEADER_COMMON c;
 } __packed;
+struct NF9_OPTIONS_FLOWSET_HEADER {
+	u_int16_t template_id, scope_length, option_length;
+} __packed;
 #define NF9_TEMPLATE_FLOWSET_ID		0
 #define NF9_OPTIONS_FLOWSET_ID		1
 #define NF9_MIN_RECORD_FLOWSET_ID	256
 
+/* Options template scope field types */
+#define NF9_SCOPE_SYSTEM		1
+#define NF9_SCOPE_INTERFACE		2
+
 /* Flowset record types the we care about */
 #define NF9_IN_BYTES			1
 #define NF9_IN_PACKETS			2
@@ -158,9 +166,18 @@ struct NF9_DATA_FLOWSET_HEADER {
 #define NF9_IPV6_SRC_MASK		29
 #define NF9_IPV6_DST_MASK		30
 /* ... */
+#define NF9_SAMPLING_INTERVAL		34
+#define NF9_SAMPLING_ALGORITHM		35
+/* ... */
 #define NF9_ENGINE_TYPE			38
 #define NF9_ENGINE_ID			39
 /* ... */
+#define NF9_FLOW_SAMPLER_ID		48
+#define NF9_FLOW_SAMPLER_MODE		49
+#define NF9_FLOW_SAMPLER_RANDOM_INTERVAL 50
+/* ... */
+#define NF9_IP_PROTOCOL_VERSION		60
+/* ... */
 #define NF9_IPV6_NEXT_HOP		62
 
 /* Netflow v.10 */
@@ -181,11 +198,15 @@ struct NF10_TEMPLATE_FLOWSET_RECORD {
 struct NF10_DATA_FLOWSET_HEADER {
 	struct NF10_FLOWSET_HEADER_COMMON c;
 } __packed;
+struct NF10_OPTIONS_FLOWSET_HEADER {
+	u_int16_t template_id, count, scope_count;
+} __packed;
 #define NF10_TEMPLATE_FLOWSET_ID	2
 #define NF10_OPTIONS_FLOWSET_ID		3
 #define NF10_MIN_RECORD_FLOWSET_ID	256
 
 #define	NF10_ENTERPRISE			(1<<15)
+#define	NF10_VARLEN			0xffff
 
 /* Flowset record types the we care about */
 #define NF10_IN_BYTES			1
@@ -218,6 +239,20 @@ struct NF10_DATA_FLOWSET_HEADER {
 #define NF10_ENGINE_ID			39
 /* ... */
 #define NF10_IPV6_NEXT_HOP		62
+/* ... */
+#define NF10_FLOW_START_SECONDS		150
+#define NF10_FLOW_END_SECONDS		151
+#define NF10_FLOW_START_MILLISECONDS	152
+#define NF10_FLOW_END_MILLISECONDS	153
+/* ... */
+#define NF10_SELECTOR_ID		302
+/* ... */
+#define NF10_SELECTOR_ALGORITHM		304
+#define NF10_SAMPLING_PACKET_INTERVAL	305
+#define NF10_SAMPLING_PACKET_SPACE	306
+/* ... */
+#define NF10_SAMPLING_SIZE		309
+#define NF10_SAMPLING_POPULATION	310
 
 #endif /* _NETFLOW_H */
 
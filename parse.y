@@ -106,6 +106,8 @@ static const char *longdays[7] = {
 %token	ALL TAG ACCEPT DISCARD QUICK AGENT SRC DST PORT PROTO TOS ANY FORWARD TO
 %token	TCP_FLAGS EQUALS MASK INET INET6 DAYS AFTER BEFORE DATE
 %token  IN_IFNDX OUT_IFNDX
+%token	RECEIVE BATCH PACKET POOL WORKERS PIPELINE IO_URING ADAPTIVE
+%token	UPSCALE SAMPLED TEMPLATE CACHE SAVE VALID
 %token	ERROR
 %token	<v.string>		STRING
 %type	<v.number>		number quick logspec not octet tcp_flags tcp_mask af dayname dayrange daylist dayspec daytime abstime
@@ -446,10 +448,89 @@ conf_main	: LISTEN ON address_port	{
 			TAILQ_INSERT_TAIL(&conf->forward_addrs, fa, entry);
 		
 		}
+		| IO_URING			{
+#ifndef USE_IO_URING
+			yyerror("io_uring is not supported on this platform");
+			YYERROR;
+#endif
+			conf->opts |= FLOWD_OPT_IO_URING;
+		}
+		| PACKET POOL number		{
+			if ($3 < MIN_PACKET_POOL || $3 > MAX_PACKET_POOL) {
+				yyerror("packet pool must be between %d "
+				    "and %d", MIN_PACKET_POOL, MAX_PACKET_POOL);
+				YYERROR;
+			}
+			conf->packet_pool = $3;
+		}
 		| PIDFILE string		{
 			conf->pid_file = $2;
 		}
+		| PIPELINE			{
+#ifndef PIPELINE_THREADS
+			yyerror("pipeline is not supported on this platform");
+			YYERROR;
+#endif
+			conf->opts |= FLOWD_OPT_PIPELINE;
+		}
+		| RECEIVE BATCH number		{
+			if ($3 == 0 || $3 > MAX_RECV_BATCH) {
+				yyerror("receive batch must be between 1 "
+				    "and %d", MAX_RECV_BATCH);
+				YYERROR;
+			}
+			conf->recv_batch = $3;
+		}
+		| TEMPLATE CACHE string		{
+			if (conf->tmpl_cache != NULL)
+				free(conf->tmpl_cache);
+			conf->tmpl_cache = $3;
+		}
+		| TEMPLATE CACHE SAVE number	{
+			if ($4 < MIN_TMPL_CACHE_SAVE) {
+				yyerror("template cache save interval must be "
+				    "at least %d", MIN_TMPL_CACHE_SAVE);
+				YYERROR;
+			}
+			conf->tmpl_cache_save = $4;
+		}
+		| TEMPLATE CACHE VALID number	{
+			if ($4 == 0) {
+				yyerror("template cache validity must be "
+				    "positive");
+				YYERROR;
+			}
+			conf->tmpl_cache_valid = $4;
+		}
+		| UPSCALE SAMPLED		{
+			conf->opts |= FLOWD_OPT_UPSCALE;
+		}
+		| ADAPTIVE BUFSIZE number	{
+			if ($3 < MIN_ADAPTIVE_BUFSIZE ||
+			    $3 > MAX_ADAPTIVE_BUFSIZE) {
+				yyerror("adaptive bufsize must be between %d "
+				    "and %d", MIN_ADAPTIVE_BUFSIZE,
+				    MAX_ADAPTIVE_BUFSIZE);
+				YYERROR;
+			}
+			conf->rcvbuf_max = $3;
+		}
 		| STORE logspec		{ conf->store_mask |= $2; }
+		| WORKERS number		{
+#ifndef WORKER_THREADS
+			if ($2 != 1) {
+				yyerror("worker threads are not supported on "
+				    "this platform");
+				YYERROR;
+			}
+#endif
+			if ($2 == 0 || $2 > MAX_WORKERS) {
+				yyerror("workers must be between 1 and %d",
+				    MAX_WORKERS);
+				YYERROR;
+			}
+			conf->workers = $2;
+		}
 		;
 
 logspec		: STRING	{
@@ -503,6 +584,10 @@ logspec		: STRING	{
 				$$ = STORE_FIELD_AS_INFO;
 			else if (strcasecmp($1, "FLOW_ENGINE_INFO") == 0)
 				$$ = STORE_FIELD_FLOW_ENGINE_INFO;
+			else if (strcasecmp($1, "SAMPLING") == 0)
+				$$ = STORE_FIELD_SAMPLING;
+			else if (strcasecmp($1, "ABS_TIMES") == 0)
+				$$ = STORE_FIELD_ABS_TIMES;
 			else if (strcasecmp($1, "CRC32") == 0)
 				$$ = STORE_FIELD_CRC32;
 			else {
@@ -929,12 +1014,15 @@ lookup(char *s)
 	/* this has to be sorted always */
 	static const struct keywords keywords[] = {
 		{ "accept",		ACCEPT},
+		{ "adaptive",		ADAPTIVE},
 		{ "after",		AFTER},
 		{ "agent",		AGENT},
 		{ "all",		ALL},
 		{ "any",		ANY},
+		{ "batch",		BATCH},
 		{ "before",		BEFORE},
 		{ "bufsize",		BUFSIZE},
+		{ "cache",		CACHE},
 		{ "date",		DATE},
 		{ "days",		DAYS},
 		{ "discard",		DISCARD},
@@ -946,6 +1034,7 @@ lookup(char *s)
 		{ "in_ifndx",		IN_IFNDX},
 		{ "inet",		INET},
 		{ "inet6",		INET6},
+		{ "io_uring",		IO_URING},
 		{ "join",		JOIN},
 		{ "listen",		LISTEN},
 		{ "logfile",		LOGFILE},
@@ -953,17 +1042,27 @@ lookup(char *s)
 		{ "mask",		MASK},
 		{ "on",			ON},
 		{ "out_ifndx",		OUT_IFNDX},
+		{ "packet",		PACKET},
 		{ "pidfile",		PIDFILE},
+		{ "pipeline",		PIPELINE},
+		{ "pool",		POOL},
 		{ "port",		PORT},
 		{ "proto",		PROTO},
 		{ "quick",		QUICK},
+		{ "receive",		RECEIVE},
+		{ "sampled",		SAMPLED},
+		{ "save",		SAVE},
 		{ "source",		SOURCE},
 		{ "src",		SRC},
 		{ "store",		STORE},
 		{ "tag",		TAG},
 		{ "tcp_flags",		TCP_FLAGS},
+		{ "template",		TEMPLATE},
 		{ "to",			TO},
 		{ "tos",		TOS},
+		{ "upscale",		UPSCALE},
+		{ "valid",		VALID},
+		{ "workers",		WORKERS},
 	};
 	const struct keywords	*p;
 
@@ -1173,6 +1272,8 @@ parse_config(const char *path, FILE *f, struct flowd_config *mconf,
     int filter_only)
 {
 	struct sym		*sym, *next;
+	struct listen_addr	*la, *nla;
+	u_int			i;
 
 	conf = mconf;
 
@@ -1204,6 +1305,37 @@ parse_config(const char *path, FILE *f, struct flowd_config *mconf,
 		logit(LOG_ERR, "No listening addresses specified");
 		return (-1);
 	}
+	if (!filter_only && conf->recv_batch == 0)
+		conf->recv_batch = DEFAULT_RECV_BATCH;
+	if (!filter_only && conf->packet_pool == 0)
+		conf->packet_pool = DEFAULT_PACKET_POOL;
+	if (!filter_only && conf->workers == 0)
+		conf->workers = 1;
+	if (!filter_only && conf->tmpl_cache_save == 0)
+		conf->tmpl_cache_save = DEFAULT_TMPL_CACHE_SAVE;
+	if (!filter_only && conf->tmpl_cache_valid == 0)
+		conf->tmpl_cache_valid = DEFAULT_TMPL_CACHE_VALID;
+
+	/*
+	 * Each worker thread gets its own socket for every listen address,
+	 * so duplicate them here. The copies are appended to the list and
+	 * skipped by this loop because their worker number is non-zero.
+	 */
+	if (!filter_only && conf->workers > 1) {
+		TAILQ_FOREACH(la, &conf->listen_addrs, entry) {
+			if (la->worker != 0)
+				continue;
+			for (i = 1; i < conf->workers; i++) {
+				if ((nla = calloc(1, sizeof(*nla))) == NULL)
+					logerrx("listen_on: calloc");
+				*nla = *la;
+				nla->worker = i;
+				TAILQ_INSERT_TAIL(&conf->listen_addrs, nla,
+				    entry);
+			}
+		}
+	}
+
 	/* Free macros and check which have not been used. */
 	for (sym = TAILQ_FIRST(&symhead); sym != NULL; sym = next) {
 		next = TAILQ_NEXT(sym, entry);
@@ -1357,9 +1489,34 @@ dump_config(struct flowd_config *c, const char *prefix, int filter_only)
 	logit(LOG_DEBUG, "%s%s# store mask %08x", DCPR(prefix), c->store_mask);
 	if (!filter_only) {
 		logit(LOG_DEBUG, "%s%s# opts %08x", DCPR(prefix), c->opts);
+		logit(LOG_DEBUG, "%s%sreceive batch %u", DCPR(prefix),
+		    c->recv_batch);
+		logit(LOG_DEBUG, "%s%spacket pool %u", DCPR(prefix),
+		    c->packet_pool);
+		logit(LOG_DEBUG, "%s%sworkers %u", DCPR(prefix), c->workers);
+		if (c->rcvbuf_max != 0) {
+			logit(LOG_DEBUG, "%s%sadaptive bufsize %zu",
+			    DCPR(prefix), c->rcvbuf_max);
+		}
+		if (c->tmpl_cache != NULL) {
+			logit(LOG_DEBUG, "%s%stemplate cache \"%s\"",
+			    DCPR(prefix), c->tmpl_cache);
+			logit(LOG_DEBUG, "%s%stemplate cache save %u",
+			    DCPR(prefix), c->tmpl_cache_save);
+			logit(LOG_DEBUG, "%s%stemplate cache valid %u",
+			    DCPR(prefix), c->tmpl_cache_valid);
+		}
+		if (c->opts & FLOWD_OPT_PIPELINE)
+			logit(LOG_DEBUG, "%s%spipeline", DCPR(prefix));
+		if (c->opts & FLOWD_OPT_IO_URING)
+			logit(LOG_DEBUG, "%s%sio_uring", DCPR(prefix));
+		if (c->opts & FLOWD_OPT_UPSCALE)
+			logit(LOG_DEBUG, "%s%supscale sampled", DCPR(prefix));
 		TAILQ_FOREACH(la, &c->listen_addrs, entry) {
-			logit(LOG_DEBUG, "%s%slisten on [%s]:%d # fd = %d",
-			    DCPR(prefix), addr_ntop_buf(&la->addr), la->port, la->fd);
+			logit(LOG_DEBUG, "%s%slisten on [%s]:%d # fd = %d "
+			    "worker = %u", DCPR(prefix),
+			    addr_ntop_buf(&la->addr), la->port, la->fd,
+			    la->worker);
 		}
 		TAILQ_FOREACH(jg, &c->join_groups, entry) {
 			logit(LOG_DEBUG, "%s%sjoin group [%s]",
@@ -38,447 +38,367 @@ RCSID("$Id$");
 /* Debugging for general peer tracking */
 /* #define PEER_DEBUG */
 
-/* Debugging for NetFlow 9 tracking */
+/* Debugging for NetFlow v.9 / IPFIX template tracking */
 /* #define PEER_DEBUG_NF9 */
 
 
-/* NetFlow v.9 specific function */
+/* NetFlow v.9 / IPFIX template state */
 
-static void
-peer_nf9_template_delete(struct peer_nf9_source *nf9src,
-    struct peer_nf9_template *template)
-{
-	TAILQ_REMOVE(&nf9src->templates, template, lp);
-	if (template->records != NULL)
-		free(template->records);
-	free(template);
-	nf9src->num_templates--;
-}
-
-static void peer_nf9_source_delete(struct peer_state *peer,
-    struct peer_nf9_source *nf9src)
-{
-	struct peer_nf9_template *nf9tmpl;
-
-	while ((nf9tmpl = TAILQ_FIRST(&nf9src->templates)) != NULL)
-		peer_nf9_template_delete(nf9src, nf9tmpl);
-	peer->nf9_num_sources--;
-	TAILQ_REMOVE(&peer->nf9, nf9src, lp);
-	free(nf9src);
-}
-
-static void
-peer_nf9_delete(struct peer_state *peer)
+static u_int
+peer_tmpl_hash(const struct peer_tmpl_key *key)
 {
-	struct peer_nf9_source *nf9src;
+	u_int64_t h;
 
-	while ((nf9src = TAILQ_FIRST(&peer->nf9)) != NULL)
-		peer_nf9_source_delete(peer, nf9src);
+	h = (u_int64_t)(uintptr_t)key->peer;
+	h = (h ^ key->source_id) * 0x9e3779b97f4a7c15ULL;
+	h = (h ^ ((u_int64_t)key->template_id << 16) ^
+	    (key->version << 8) ^ key->is_source) * 0x9e3779b97f4a7c15ULL;
+	return ((u_int)(h >> 32));
 }
 
-static struct peer_nf9_source *
-peer_nf9_lookup_source(struct peer_state *peer, u_int32_t source_id)
+static int
+peer_tmpl_key_eq(const struct peer_tmpl_key *a, const struct peer_tmpl_key *b)
 {
-	struct peer_nf9_source *nf9src;
-
-	TAILQ_FOREACH(nf9src, &peer->nf9, lp) {
-		if (nf9src->source_id == source_id)
-			return (nf9src);
-	}
-	return (NULL);
+	return (a->peer == b->peer && a->source_id == b->source_id &&
+	    a->template_id == b->template_id && a->version == b->version &&
+	    a->is_source == b->is_source);
 }
 
-static struct peer_nf9_template *
-peer_nf9_lookup_template(struct peer_nf9_source *nf9src, u_int16_t template_id)
+/* Returns the slot holding key, or the empty slot that ends its chain */
+static u_int
+peer_tmpl_slot(struct peer_tmpl_table *table, const struct peer_tmpl_key *key)
 {
-	struct peer_nf9_template *nf9tmpl;
+	u_int i, mask = table->size - 1;
 
-	TAILQ_FOREACH(nf9tmpl, &nf9src->templates, lp) {
-		if (nf9tmpl->template_id == template_id)
+	for (i = peer_tmpl_hash(key) & mask; table->slots[i] != NULL;
+	    i = (i + 1) & mask) {
+		if (peer_tmpl_key_eq(table->slots[i], key))
 			break;
 	}
-	if (nf9tmpl == NULL)
-		return (NULL);
-
-	return (nf9tmpl);
+	return (i);
 }
 
-struct peer_nf9_template *peer_nf9_find_template(struct peer_state *peer,
-    u_int32_t source_id, u_int16_t template_id)
+static struct peer_tmpl_key *
+peer_tmpl_lookup(struct peer_tmpl_table *table,
+    const struct peer_tmpl_key *key)
 {
-	struct peer_nf9_source *nf9src;
-	struct peer_nf9_template *nf9tmpl;
-
-	nf9src = peer_nf9_lookup_source(peer, source_id);
-
-#ifdef PEER_DEBUG_NF9
-	logit(LOG_DEBUG, "%s: Lookup source 0x%08x for peer %s: %sFOUND",
-	    __func__, source_id, addr_ntop_buf(&peer->from),
-	    nf9src == NULL ? "NOT " : "");
-#endif
-
-	if (nf9src == NULL)
+	if (table->size == 0)
 		return (NULL);
-
-	nf9tmpl = peer_nf9_lookup_template(nf9src, template_id);
-
-#ifdef PEER_DEBUG_NF9
-	logit(LOG_DEBUG, "%s: Lookup template 0x%04x: %sFOUND", __func__,
-	    template_id, nf9tmpl == NULL ? "NOT " : "");
-#endif
-
-	if (nf9tmpl == NULL)
-		return (NULL);
-
-#ifdef PEER_DEBUG_NF9
-	logit(LOG_DEBUG, "%s: Found template %s/0x%08x/0x%04x: %d records %p",
-	    __func__, addr_ntop_buf(&peer->from), source_id, template_id,
-	    nf9tmpl->num_records, nf9tmpl->records);
-#endif
-	return (nf9tmpl);
+	return (table->slots[peer_tmpl_slot(table, key)]);
 }
 
-void
-peer_nf9_template_update(struct peer_state *peer, u_int32_t source_id,
-    u_int16_t template_id)
-{
-	struct peer_nf9_source *nf9src;
-	struct peer_nf9_template *nf9tmpl;
-
-#ifdef PEER_DEBUG_NF9
-	logit(LOG_DEBUG, "%s: Lookup template %s/0x%08x/0x%04x",
-	    __func__, addr_ntop_buf(&peer->from), template_id, source_id);
-#endif
-	nf9src = peer_nf9_lookup_source(peer, source_id);
-	if (nf9src == NULL)
-		return;
-	nf9tmpl = peer_nf9_lookup_template(nf9src, template_id);
-	if (nf9tmpl == NULL)
-		return;
-
-#ifdef PEER_DEBUG_NF9
-	logit(LOG_DEBUG, "%s: found template", __func__);
-#endif
-	/* Move source and template to the head of the list */
-	if (nf9src != TAILQ_FIRST(&peer->nf9)) {
-#ifdef PEER_DEBUG_NF9
-		logit(LOG_DEBUG, "%s: update source", __func__);
-#endif
-		TAILQ_REMOVE(&peer->nf9, nf9src, lp);
-		TAILQ_INSERT_HEAD(&peer->nf9, nf9src, lp);
-	}
-	if (nf9tmpl != TAILQ_FIRST(&nf9src->templates)) {
-#ifdef PEER_DEBUG_NF9
-		logit(LOG_DEBUG, "%s: update template", __func__);
-#endif
-		TAILQ_REMOVE(&nf9src->templates, nf9tmpl, lp);
-		TAILQ_INSERT_HEAD(&nf9src->templates, nf9tmpl, lp);
-	}
-}
-
-static struct peer_nf9_source *
-peer_nf9_new_source(struct peer_state *peer, struct peers *peers,
-    u_int32_t source_id)
+static void
+peer_tmpl_insert(struct peer_tmpl_table *table, struct peer_tmpl_key *key)
 {
-	struct peer_nf9_source *nf9src;
-
-	/* If we have too many sources, then kick out the LRU */
-	peer->nf9_num_sources++;
-	if (peer->nf9_num_sources > peers->max_sources) {
-		nf9src = TAILQ_LAST(&peer->nf9, peer_nf9_list);
-		logit(LOG_WARNING, "forced deletion of source 0x%08x "
-		    "of peer %s", source_id, addr_ntop_buf(&peer->from));
-		/* XXX ratelimit errors */
-		peer_nf9_source_delete(peer, nf9src)    ;
+	struct peer_tmpl_key **old;
+	u_int i, old_size;
+
+	/* Keep the load factor at or below one half */
+	if ((table->count + 1) * 2 > table->size) {
+		old = table->slots;
+		old_size = table->size;
+		table->size = old_size == 0 ? 64 : old_size * 2;
+		if ((table->slots = calloc(table->size,
+		    sizeof(*table->slots))) == NULL)
+			logerrx("%s: calloc failed (num %u)", __func__,
+			    table->size);
+		for (i = 0; i < old_size; i++) {
+			if (old[i] != NULL)
+				table->slots[peer_tmpl_slot(table,
+				    old[i])] = old[i];
+		}
+		free(old);
 	}
-
-	if ((nf9src = calloc(1, sizeof(*nf9src))) == NULL)
-		logerrx("%s: calloc failed", __func__);
-	nf9src->source_id = source_id;
-	TAILQ_INIT(&nf9src->templates);
-	TAILQ_INSERT_HEAD(&peer->nf9, nf9src, lp);
-
-#ifdef PEER_DEBUG_NF9
-	logit(LOG_DEBUG, "%s: new source %s/0x%08x", __func__,
-	    addr_ntop_buf(&peer->from), source_id);
-#endif
-
-	return (nf9src);
+	table->slots[peer_tmpl_slot(table, key)] = key;
+	table->count++;
 }
 
-struct peer_nf9_template *
-peer_nf9_new_template(struct peer_state *peer, struct peers *peers,
-    u_int32_t source_id, u_int16_t template_id)
+static void
+peer_tmpl_remove(struct peer_tmpl_table *table, struct peer_tmpl_key *key)
 {
-	struct peer_nf9_source *nf9src;
-	struct peer_nf9_template *nf9tmpl;
-
-	nf9src = peer_nf9_lookup_source(peer, source_id);
-	if (nf9src == NULL)
-		nf9src = peer_nf9_new_source(peer, peers, source_id);
-
-	/* If the source has too many templates, then kick out the LRU */
-	nf9src->num_templates++;
-	if (nf9src->num_templates > peers->max_templates) {
-		nf9tmpl = TAILQ_LAST(&nf9src->templates,
-		    peer_nf9_template_list);
-		logit(LOG_WARNING, "forced deletion of template 0x%04x from "
-		    "peer %s/0x%08x", template_id, addr_ntop_buf(&peer->from),
-		    source_id);
-		/* XXX ratelimit errors */
-		peer_nf9_template_delete(nf9src, nf9tmpl)    ;
-	}
-
-	if ((nf9tmpl = calloc(1, sizeof(*nf9tmpl))) == NULL)
-		logerrx("%s: calloc failed", __func__);
-	nf9tmpl->template_id = template_id;
-	TAILQ_INSERT_HEAD(&nf9src->templates, nf9tmpl, lp);
-
-#ifdef PEER_DEBUG_NF9
-	logit(LOG_DEBUG, "%s: new template %s/0x%08x/0x%04x", __func__,
-	    addr_ntop_buf(&peer->from), source_id, template_id);
-#endif
-
-	/* Move source and template to the head of the list */
-	if (nf9src != TAILQ_FIRST(&peer->nf9)) {
-		TAILQ_REMOVE(&peer->nf9, nf9src, lp);
-		TAILQ_INSERT_HEAD(&peer->nf9, nf9src, lp);
+	u_int i, j, home, mask = table->size - 1;
+
+	i = peer_tmpl_slot(table, key);
+	if (table->slots[i] != key)
+		logerrx("%s: entry not in table", __func__);
+	table->slots[i] = NULL;
+	table->count--;
+
+	/* Close the gap, moving back entries whose chains ran through it */
+	for (j = (i + 1) & mask; table->slots[j] != NULL; j = (j + 1) & mask) {
+		home = peer_tmpl_hash(table->slots[j]) & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			table->slots[i] = table->slots[j];
+			table->slots[j] = NULL;
+			i = j;
+		}
 	}
-
-	return (nf9tmpl);
 }
 
-
-/* NetFlow v.10 specific function */
-
 static void
-peer_nf10_template_delete(struct peer_nf10_source *nf10src,
-    struct peer_nf10_template *template)
+peer_template_delete(struct peers *peers, struct peer_template *template)
 {
-	TAILQ_REMOVE(&nf10src->templates, template, lp);
+	struct peer_tmpl_source *source = template->source;
+
+	peer_tmpl_remove(&peers->templates, &template->key);
+	TAILQ_REMOVE(&source->templates, template, lp);
 	if (template->records != NULL)
 		free(template->records);
+	if (template->prog.ops != NULL)
+		free(template->prog.ops);
+	if (template->prog.var != NULL)
+		free(template->prog.var);
 	free(template);
-	nf10src->num_templates--;
+	source->num_templates--;
 }
 
-static void peer_nf10_source_delete(struct peer_state *peer,
-    struct peer_nf10_source *nf10src)
+static void
+peer_tmpl_source_delete(struct peers *peers, struct peer_state *peer,
+    struct peer_tmpl_source *source)
 {
-	struct peer_nf10_template *nf10tmpl;
-
-	while ((nf10tmpl = TAILQ_FIRST(&nf10src->templates)) != NULL)
-		peer_nf10_template_delete(nf10src, nf10tmpl);
-	peer->nf10_num_sources--;
-	TAILQ_REMOVE(&peer->nf10, nf10src, lp);
-	free(nf10src);
+	struct peer_template *template;
+
+	while ((template = TAILQ_FIRST(&source->templates)) != NULL)
+		peer_template_delete(peers, template);
+	peer_tmpl_remove(&peers->templates, &source->key);
+	peer->num_sources--;
+	TAILQ_REMOVE(&peer->sources, source, lp);
+	if (source->samplers != NULL)
+		free(source->samplers);
+	free(source);
 }
 
 static void
-peer_nf10_delete(struct peer_state *peer)
+peer_tmpl_delete(struct peers *peers, struct peer_state *peer)
 {
-	struct peer_nf10_source *nf10src;
+	struct peer_tmpl_source *source;
 
-	while ((nf10src = TAILQ_FIRST(&peer->nf10)) != NULL)
-		peer_nf10_source_delete(peer, nf10src);
+	while ((source = TAILQ_FIRST(&peer->sources)) != NULL)
+		peer_tmpl_source_delete(peers, peer, source);
 }
 
-static struct peer_nf10_source *
-peer_nf10_lookup_source(struct peer_state *peer, u_int32_t source_id)
+/* Move a template and its source to the heads of their LRU lists */
+static void
+peer_template_touch(struct peer_state *peer, struct peer_template *template)
 {
-	struct peer_nf10_source *nf10src;
+	struct peer_tmpl_source *source = template->source;
 
-	TAILQ_FOREACH(nf10src, &peer->nf10, lp) {
-		if (nf10src->source_id == source_id)
-			return (nf10src);
+	if (source != TAILQ_FIRST(&peer->sources)) {
+		TAILQ_REMOVE(&peer->sources, source, lp);
+		TAILQ_INSERT_HEAD(&peer->sources, source, lp);
 	}
-	return (NULL);
-}
-
-static struct peer_nf10_template *
-peer_nf10_lookup_template(struct peer_nf10_source *nf10src, u_int16_t template_id)
-{
-	struct peer_nf10_template *nf10tmpl;
-
-	TAILQ_FOREACH(nf10tmpl, &nf10src->templates, lp) {
-		if (nf10tmpl->template_id == template_id)
-			break;
+	if (template != TAILQ_FIRST(&source->templates)) {
+		TAILQ_REMOVE(&source->templates, template, lp);
+		TAILQ_INSERT_HEAD(&source->templates, template, lp);
 	}
-	if (nf10tmpl == NULL)
-		return (NULL);
-
-	return (nf10tmpl);
 }
 
-struct peer_nf10_template *
-peer_nf10_find_template(struct peer_state *peer,
-    u_int32_t source_id, u_int16_t template_id)
+struct peer_template *
+peer_find_template(struct peers *peers, struct peer_state *peer,
+    u_int version, u_int32_t source_id, u_int16_t template_id)
 {
-	struct peer_nf10_source *nf10src;
-	struct peer_nf10_template *nf10tmpl;
-
-	nf10src = peer_nf10_lookup_source(peer, source_id);
+	struct peer_tmpl_key key;
+	struct peer_template *template;
 
-#ifdef PEER_DEBUG_NF10
-	logit(LOG_DEBUG, "%s: Lookup source 0x%08x for peer %s: %sFOUND",
-	    __func__, source_id, addr_ntop_buf(&peer->from),
-	    nf10src == NULL ? "NOT " : "");
-#endif
+	bzero(&key, sizeof(key));
+	key.peer = peer;
+	key.source_id = source_id;
+	key.template_id = template_id;
+	key.version = version;
+	template = (struct peer_template *)peer_tmpl_lookup(&peers->templates,
+	    &key);
 
-	if (nf10src == NULL)
-		return (NULL);
-
-	nf10tmpl = peer_nf10_lookup_template(nf10src, template_id);
-
-#ifdef PEER_DEBUG_NF10
-	logit(LOG_DEBUG, "%s: Lookup template 0x%04x: %sFOUND", __func__,
-	    template_id, nf10tmpl == NULL ? "NOT " : "");
+#ifdef PEER_DEBUG_NF9
+	logit(LOG_DEBUG, "%s: Lookup template %s/v%u/0x%08x/0x%04x: %sFOUND",
+	    __func__, addr_ntop_buf(&peer->from), version, source_id,
+	    template_id, template == NULL ? "NOT " : "");
 #endif
 
-	if (nf10tmpl == NULL)
+	if (template == NULL)
 		return (NULL);
 
-#ifdef PEER_DEBUG_NF10
-	logit(LOG_DEBUG, "%s: Found template %s/0x%08x/0x%04x: %d records %p",
-	    __func__, addr_ntop_buf(&peer->from), source_id, template_id,
-	    nf10tmpl->num_records, nf10tmpl->records);
-#endif
-	return (nf10tmpl);
+	peer_template_touch(peer, template);
+	return (template);
 }
 
-void
-peer_nf10_template_update(struct peer_state *peer, u_int32_t source_id,
-    u_int16_t template_id)
+static struct peer_tmpl_source *
+peer_tmpl_new_source(struct peers *peers, struct peer_state *peer,
+    u_int version, u_int32_t source_id)
 {
-	struct peer_nf10_source *nf10src;
-	struct peer_nf10_template *nf10tmpl;
-
-#ifdef PEER_DEBUG_NF10
-	logit(LOG_DEBUG, "%s: Lookup template %s/0x%08x/0x%04x",
-	    __func__, addr_ntop_buf(&peer->from), template_id, source_id);
-#endif
-	nf10src = peer_nf10_lookup_source(peer, source_id);
-	if (nf10src == NULL)
-		return;
-	nf10tmpl = peer_nf10_lookup_template(nf10src, template_id);
-	if (nf10tmpl == NULL)
-		return;
-
-#ifdef PEER_DEBUG_NF10
-	logit(LOG_DEBUG, "%s: found template", __func__);
-#endif
-	/* Move source and template to the head of the list */
-	if (nf10src != TAILQ_FIRST(&peer->nf10)) {
-#ifdef PEER_DEBUG_NF10
-		logit(LOG_DEBUG, "%s: update source", __func__);
-#endif
-		TAILQ_REMOVE(&peer->nf10, nf10src, lp);
-		TAILQ_INSERT_HEAD(&peer->nf10, nf10src, lp);
-	}
-	if (nf10tmpl != TAILQ_FIRST(&nf10src->templates)) {
-#ifdef PEER_DEBUG_NF10
-		logit(LOG_DEBUG, "%s: update template", __func__);
-#endif
-		TAILQ_REMOVE(&nf10src->templates, nf10tmpl, lp);
-		TAILQ_INSERT_HEAD(&nf10src->templates, nf10tmpl, lp);
-	}
-}
-
-static struct peer_nf10_source *
-peer_nf10_new_source(struct peer_state *peer, struct peers *peers,
-    u_int32_t source_id)
-{
-	struct peer_nf10_source *nf10src;
+	struct peer_tmpl_source *source;
 
 	/* If we have too many sources, then kick out the LRU */
-	peer->nf10_num_sources++;
-	if (peer->nf10_num_sources > peers->max_sources) {
-		nf10src = TAILQ_LAST(&peer->nf10, peer_nf10_list);
+	peer->num_sources++;
+	if (peer->num_sources > peers->max_sources) {
+		source = TAILQ_LAST(&peer->sources, peer_tmpl_source_list);
 		logit(LOG_WARNING, "forced deletion of source 0x%08x "
-		    "of peer %s", source_id, addr_ntop_buf(&peer->from));
+		    "of peer %s", source->key.source_id,
+		    addr_ntop_buf(&peer->from));
 		/* XXX ratelimit errors */
-		peer_nf10_source_delete(peer, nf10src)    ;
+		peer_tmpl_source_delete(peers, peer, source);
 	}
 
-	if ((nf10src = calloc(1, sizeof(*nf10src))) == NULL)
+	if ((source = calloc(1, sizeof(*source))) == NULL)
 		logerrx("%s: calloc failed", __func__);
-	nf10src->source_id = source_id;
-	TAILQ_INIT(&nf10src->templates);
-	TAILQ_INSERT_HEAD(&peer->nf10, nf10src, lp);
+	source->key.peer = peer;
+	source->key.source_id = source_id;
+	source->key.version = version;
+	source->key.is_source = 1;
+	TAILQ_INIT(&source->templates);
+	TAILQ_INSERT_HEAD(&peer->sources, source, lp);
+	peer_tmpl_insert(&peers->templates, &source->key);
 
-#ifdef PEER_DEBUG_NF10
-	logit(LOG_DEBUG, "%s: new source %s/0x%08x", __func__,
-	    addr_ntop_buf(&peer->from), source_id);
+#ifdef PEER_DEBUG_NF9
+	logit(LOG_DEBUG, "%s: new source %s/v%u/0x%08x", __func__,
+	    addr_ntop_buf(&peer->from), version, source_id);
 #endif
 
-	return (nf10src);
+	return (source);
 }
 
-struct peer_nf10_template *
-peer_nf10_new_template(struct peer_state *peer, struct peers *peers,
-    u_int32_t source_id, u_int16_t template_id)
+struct peer_template *
+peer_new_template(struct peers *peers, struct peer_state *peer,
+    u_int version, u_int32_t source_id, u_int16_t template_id)
 {
-	struct peer_nf10_source *nf10src;
-	struct peer_nf10_template *nf10tmpl;
-
-	nf10src = peer_nf10_lookup_source(peer, source_id);
-	if (nf10src == NULL)
-		nf10src = peer_nf10_new_source(peer, peers, source_id);
+	struct peer_tmpl_key key;
+	struct peer_tmpl_source *source;
+	struct peer_template *template;
+
+	bzero(&key, sizeof(key));
+	key.peer = peer;
+	key.source_id = source_id;
+	key.version = version;
+	key.is_source = 1;
+	source = (struct peer_tmpl_source *)peer_tmpl_lookup(&peers->templates,
+	    &key);
+	if (source == NULL)
+		source = peer_tmpl_new_source(peers, peer, version, source_id);
 
 	/* If the source has too many templates, then kick out the LRU */
-	nf10src->num_templates++;
-	if (nf10src->num_templates > peers->max_templates) {
-		nf10tmpl = TAILQ_LAST(&nf10src->templates,
-		    peer_nf10_template_list);
+	source->num_templates++;
+	if (source->num_templates > peers->max_templates) {
+		template = TAILQ_LAST(&source->templates, peer_template_list);
 		logit(LOG_WARNING, "forced deletion of template 0x%04x from "
-		    "peer %s/0x%08x", template_id, addr_ntop_buf(&peer->from),
-		    source_id);
+		    "peer %s/0x%08x", template->key.template_id,
+		    addr_ntop_buf(&peer->from), source_id);
 		/* XXX ratelimit errors */
-		peer_nf10_template_delete(nf10src, nf10tmpl)    ;
+		peer_template_delete(peers, template);
 	}
 
-	if ((nf10tmpl = calloc(1, sizeof(*nf10tmpl))) == NULL)
+	if ((template = calloc(1, sizeof(*template))) == NULL)
 		logerrx("%s: calloc failed", __func__);
-	nf10tmpl->template_id = template_id;
-	TAILQ_INSERT_HEAD(&nf10src->templates, nf10tmpl, lp);
+	template->key = key;
+	template->key.template_id = template_id;
+	template->key.is_source = 0;
+	template->source = source;
+	TAILQ_INSERT_HEAD(&source->templates, template, lp);
+	peer_tmpl_insert(&peers->templates, &template->key);
 
-#ifdef PEER_DEBUG_NF10
-	logit(LOG_DEBUG, "%s: new template %s/0x%08x/0x%04x", __func__,
-	    addr_ntop_buf(&peer->from), source_id, template_id);
+#ifdef PEER_DEBUG_NF9
+	logit(LOG_DEBUG, "%s: new template %s/v%u/0x%08x/0x%04x", __func__,
+	    addr_ntop_buf(&peer->from), version, source_id, template_id);
 #endif
 
-	/* Move source and template to the head of the list */
-	if (nf10src != TAILQ_FIRST(&peer->nf10)) {
-		TAILQ_REMOVE(&peer->nf10, nf10src, lp);
-		TAILQ_INSERT_HEAD(&peer->nf10, nf10src, lp);
+	peer_template_touch(peer, template);
+	return (template);
+}
+
+const struct peer_sampler *
+peer_find_sampler(struct peer_tmpl_source *source, u_int scope, u_int64_t id)
+{
+	u_int i;
+
+	for (i = 0; i < source->num_samplers; i++) {
+		if (source->samplers[i].scope == scope &&
+		    source->samplers[i].id == id)
+			return (&source->samplers[i]);
+	}
+	return (NULL);
+}
+
+/* Add a sampler to a source, or update the one with the same scope and ID */
+void
+peer_set_sampler(struct peer_tmpl_source *source,
+    const struct peer_sampler *sampler)
+{
+	struct peer_sampler *s;
+	u_int i, n;
+
+	for (i = 0; i < source->num_samplers; i++) {
+		s = &source->samplers[i];
+		if (s->scope == sampler->scope && s->id == sampler->id) {
+			*s = *sampler;
+			return;
+		}
+	}
+	if ((n = source->num_samplers) >= PEER_MAX_SAMPLERS) {
+		logit(LOG_WARNING, "too many samplers for source 0x%08x "
+		    "of peer %s", source->key.source_id,
+		    addr_ntop_buf(&source->key.peer->from));
+		/* XXX ratelimit errors */
+		return;
+	}
+	/* Most sources have only one or two, so grow in powers of two */
+	if ((n & (n - 1)) == 0) {
+		if ((s = realloc(source->samplers,
+		    (n == 0 ? 1 : n * 2) * sizeof(*s))) == NULL)
+			logerrx("%s: realloc failed", __func__);
+		source->samplers = s;
 	}
+	source->samplers[source->num_samplers++] = *sampler;
 
-	return (nf10tmpl);
+#ifdef PEER_DEBUG_NF9
+	logit(LOG_DEBUG, "%s: new sampler %s/v%u/0x%08x scope %u id %llu "
+	    "interval %u", __func__, addr_ntop_buf(&source->key.peer->from),
+	    source->key.version, source->key.source_id, sampler->scope,
+	    (unsigned long long)sampler->id, sampler->interval);
+#endif
 }
 
 /* General peer state housekeeping functions */
-static int
-peer_compare(struct peer_state *a, struct peer_state *b)
+static struct peer_bucket *
+peer_hash_bucket(struct peers *peers, const struct xaddr *addr)
 {
-	return (addr_cmp(&a->from, &b->from));
+	u_int32_t h;
+
+	switch (addr->af) {
+	case AF_INET:
+		h = addr->v4.s_addr;
+		break;
+	case AF_INET6:
+		h = addr->addr32[0] ^ addr->addr32[1] ^ addr->addr32[2] ^
+		    addr->addr32[3] ^ addr->scope_id;
+		break;
+	default:
+		h = 0;
+		break;
+	}
+	h *= 0x9e3779b1U;
+	h ^= h >> 16;
+	return (&peers->peer_hash[h & (peers->peer_hash_size - 1)]);
 }
 
-/* Generate functions for peer state tree */
-SPLAY_PROTOTYPE(peer_tree, peer_state, tp, peer_compare);
-SPLAY_GENERATE(peer_tree, peer_state, tp, peer_compare);
-
 static void
 delete_peer(struct peers *peers, struct peer_state *peer)
 {
+	struct peer_seq *seq;
+
+	if (peers->last_peer == peer)
+		peers->last_peer = NULL;
 	TAILQ_REMOVE(&peers->peer_list, peer, lp);
-	SPLAY_REMOVE(peer_tree, &peers->peer_tree, peer);
-	peer_nf9_delete(peer);
+	LIST_REMOVE(peer, hp);
+	peer_tmpl_delete(peers, peer);
+	while ((seq = TAILQ_FIRST(&peer->seqs)) != NULL) {
+		TAILQ_REMOVE(&peer->seqs, seq, lp);
+		free(seq);
+	}
 	free(peer);
 	peers->num_peers--;
 }
 
 struct peer_state *
-new_peer(struct peers *peers, struct flowd_config *conf, struct xaddr *addr)
+new_peer(struct peers *peers, struct flowd_config *conf, struct xaddr *addr,
+    const struct timeval *now)
 {
 	struct peer_state *peer;
 	struct allowed_device *ad;
@@ -493,6 +413,18 @@ new_peer(struct peers *peers, struct flowd_config *conf, struct xaddr *addr)
 			return (NULL);
 	}
 
+	/* Size the hash table for max_peers on first use */
+	if (peers->peer_hash == NULL) {
+		for (peers->peer_hash_size = 16;
+		    peers->peer_hash_size < peers->max_peers * 2;
+		    peers->peer_hash_size <<= 1)
+			;
+		if ((peers->peer_hash = calloc(peers->peer_hash_size,
+		    sizeof(*peers->peer_hash))) == NULL)
+			logerrx("%s: calloc failed (num %u)", __func__,
+			    peers->peer_hash_size);
+	}
+
 	/* If we have overflowed our peer table, then kick out the LRU peer */
 	peers->num_peers++;
 	if (peers->num_peers > peers->max_peers) {
@@ -507,15 +439,17 @@ new_peer(struct peers *peers, struct flowd_config *conf, struct xaddr *addr)
 	if ((peer = calloc(1, sizeof(*peer))) == NULL)
 		logerrx("%s: calloc failed", __func__);
 	memcpy(&peer->from, addr, sizeof(peer->from));
-	TAILQ_INIT(&peer->nf9);
+	TAILQ_INIT(&peer->sources);
+	TAILQ_INIT(&peer->seqs);
 
 #ifdef PEER_DEBUG
 	logit(LOG_DEBUG, "new peer %s", addr_ntop_buf(addr));
 #endif
 
 	TAILQ_INSERT_HEAD(&peers->peer_list, peer, lp);
-	SPLAY_INSERT(peer_tree, &peers->peer_tree, peer);
-	gettimeofday(&peer->firstseen, NULL);
+	LIST_INSERT_HEAD(peer_hash_bucket(peers, addr), peer, hp);
+	peers->last_peer = peer;
+	peer->firstseen = *now;
 
 	return (peer);
 }
@@ -549,35 +483,140 @@ scrub_peers(struct flowd_config *conf, struct peers *peers)
 
 void
 update_peer(struct peers *peers, struct peer_state *peer, u_int nflows,
-    u_int netflow_version)
+    u_int netflow_version, const struct timeval *now)
 {
 	/* Push peer to front of LRU queue, if it isn't there already */
 	if (peer != TAILQ_FIRST(&peers->peer_list)) {
 		TAILQ_REMOVE(&peers->peer_list, peer, lp);
 		TAILQ_INSERT_HEAD(&peers->peer_list, peer, lp);
 	}
-	gettimeofday(&peer->lastvalid, NULL);
+	peer->lastvalid = *now;
 	peer->nflows += nflows;
 	peer->npackets++;
+	peers->nflows += nflows;
+	peers->npackets++;
 	peer->last_version = netflow_version;
 #ifdef PEER_DEBUG
 	logit(LOG_DEBUG, "update peer %s", addr_ntop_buf(&peer->from));
 #endif
 }
 
+/*
+ * Check the sequence number "seq" of a packet of "count" units (flows or
+ * packets, see struct peer_seq) against the one expected for its stream.
+ * A count of PEER_SEQ_UNKNOWN skips the check on the following packet.
+ */
+void
+peer_sequence(struct peers *peers, struct peer_state *peer, u_int version,
+    u_int32_t domain, u_int32_t seq, u_int32_t count)
+{
+	struct peer_seq *ps;
+	int32_t delta;
+
+	TAILQ_FOREACH(ps, &peer->seqs, lp) {
+		if (ps->version == version && ps->domain == domain)
+			break;
+	}
+	if (ps == NULL) {
+		/* If we have too many streams, then recycle the LRU */
+		if (peer->num_seqs >= peers->max_sources) {
+			ps = TAILQ_LAST(&peer->seqs, peer_seq_list);
+			TAILQ_REMOVE(&peer->seqs, ps, lp);
+			bzero(ps, sizeof(*ps));
+		} else {
+			if ((ps = calloc(1, sizeof(*ps))) == NULL)
+				logerrx("%s: calloc failed", __func__);
+			peer->num_seqs++;
+		}
+		ps->version = version;
+		ps->domain = domain;
+		ps->resync = 1;
+		TAILQ_INSERT_HEAD(&peer->seqs, ps, lp);
+	} else if (ps != TAILQ_FIRST(&peer->seqs)) {
+		TAILQ_REMOVE(&peer->seqs, ps, lp);
+		TAILQ_INSERT_HEAD(&peer->seqs, ps, lp);
+	}
+
+	if (count != PEER_SEQ_UNKNOWN)
+		ps->received += count;
+	delta = (int32_t)(seq - ps->next);
+	if (ps->resync || delta == 0) {
+		/* First packet, or in order */
+	} else if (delta > 0 && delta <= PEER_SEQ_MAX_GAP) {
+		ps->lost += delta;
+		peers->seq_lost += delta;
+	} else if (delta < 0 && delta >= -PEER_SEQ_REORDER) {
+		/* A late arrival fills (part of) a gap counted as lost */
+		ps->reordered++;
+		peers->seq_reordered++;
+		if (count != PEER_SEQ_UNKNOWN) {
+			if (count > ps->lost)
+				count = ps->lost;
+			ps->lost -= count;
+			peers->seq_lost -= count;
+		}
+		return;
+	} else {
+		logit(LOG_INFO, "peer %s: sequence reset on %s v.%u stream "
+		    "0x%08x: expected %u got %u", addr_ntop_buf(&peer->from),
+		    (version & STORE_VERSION_SFLOW) ? "sflow" : "netflow",
+		    version & ~STORE_VERSION_SFLOW, domain, ps->next, seq);
+		ps->resets++;
+		peers->seq_resets++;
+	}
+	ps->resync = count == PEER_SEQ_UNKNOWN;
+	ps->next = seq + count;
+}
+
+/*
+ * Update the clock skew of a peer with the skew measured on one packet
+ * "sample_ms" and return the smoothed skew to correct its times by.
+ */
+int64_t
+peer_skew(struct peer_state *peer, int64_t sample_ms)
+{
+	int64_t diff;
+
+	diff = sample_ms - peer->skew_ms;
+	if (peer->nskew != 0 && diff <= PEER_SKEW_STEP &&
+	    diff >= -PEER_SKEW_STEP)
+		peer->skew_ms += diff / (1 << PEER_SKEW_SHIFT);
+	else {
+		if (peer->nskew != 0) {
+			logit(LOG_INFO, "peer %s: clock skew changed from "
+			    "%lld to %lld ms", addr_ntop_buf(&peer->from),
+			    (long long)peer->skew_ms, (long long)sample_ms);
+		}
+		peer->skew_ms = sample_ms;
+	}
+	peer->nskew++;
+
+	return (peer->skew_ms);
+}
+
 struct peer_state *
 find_peer(struct peers *peers, struct xaddr *addr)
 {
-	struct peer_state tmp, *peer;
+	struct peer_state *peer;
 
-	bzero(&tmp, sizeof(tmp));
-	memcpy(&tmp.from, addr, sizeof(tmp.from));
+	/* Packets tend to arrive in runs from the same exporter */
+	peer = peers->last_peer;
+	if (peer != NULL && addr_cmp(&peer->from, addr) == 0)
+		return (peer);
 
-	peer = SPLAY_FIND(peer_tree, &peers->peer_tree, &tmp);
+	peer = NULL;
+	if (peers->peer_hash != NULL) {
+		LIST_FOREACH(peer, peer_hash_bucket(peers, addr), hp) {
+			if (addr_cmp(&peer->from, addr) == 0)
+				break;
+		}
+	}
 #ifdef PEER_DEBUG
 	logit(LOG_DEBUG, "%s: found %s", __func__,
 	    peer == NULL ? "NONE" : addr_ntop_buf(addr));
 #endif
+	if (peer != NULL)
+		peers->last_peer = peer;
 
 	return (peer);
 }
@@ -586,12 +625,21 @@ void
 dump_peers(struct peers *peers)
 {
 	struct peer_state *peer;
-	u_int i;
+	struct peer_tmpl_source *source;
+	struct peer_template *template;
+	const struct peer_sampler *sampler;
+	const struct peer_seq *seq;
+	u_int i, j;
+	static const char *sampler_scopes[] = { "source", "id", "ifindex" };
 
 	logit(LOG_INFO, "Peer state: %u of %u in used, %u forced deletions",
 	    peers->num_peers, peers->max_peers, peers->num_forced);
+	logit(LOG_INFO, "Peer sequences: lost:%llu reordered:%llu resets:%llu",
+	    (unsigned long long)peers->seq_lost,
+	    (unsigned long long)peers->seq_reordered,
+	    (unsigned long long)peers->seq_resets);
 	i = 0;
-	SPLAY_FOREACH(peer, peer_tree, &peers->peer_tree) {
+	TAILQ_FOREACH(peer, &peers->peer_list, lp) {
 		logit(LOG_INFO, "peer %u - %s: "
 		    "packets:%llu flows:%llu invalid:%llu no_template:%llu",
 		    i, addr_ntop_buf(&peer->from),
@@ -601,14 +649,61 @@ dump_peers(struct peers *peers)
 		    i, addr_ntop_buf(&peer->from),
 		    iso_time(peer->firstseen.tv_sec, 0),
 		    (u_int)(peer->firstseen.tv_usec / 1000));
-		logit(LOG_INFO, "peer %u - %s: last valid:%s.%03u netflow v.%u",
+		logit(LOG_INFO, "peer %u - %s: last valid:%s.%03u %s v.%u",
 		    i, addr_ntop_buf(&peer->from),
 		    iso_time(peer->lastvalid.tv_sec, 0),
 		    (u_int)(peer->lastvalid.tv_usec / 1000),
-		    peer->last_version);
+		    (peer->last_version & STORE_VERSION_SFLOW) ?
+		    "sflow" : "netflow",
+		    peer->last_version & ~STORE_VERSION_SFLOW);
+		if (peer->nskew != 0) {
+			logit(LOG_INFO, "peer %u - %s: clock skew:%lld ms "
+			    "packets:%llu", i, addr_ntop_buf(&peer->from),
+			    (long long)peer->skew_ms,
+			    (unsigned long long)peer->nskew);
+		}
+		TAILQ_FOREACH(seq, &peer->seqs, lp) {
+			logit(LOG_INFO, "peer %u - %s: %s v.%u stream 0x%08x: "
+			    "%s:%llu lost:%llu reordered:%llu resets:%llu", i,
+			    addr_ntop_buf(&peer->from),
+			    (seq->version & STORE_VERSION_SFLOW) ?
+			    "sflow" : "netflow",
+			    seq->version & ~STORE_VERSION_SFLOW, seq->domain,
+			    seq->version == 9 ||
+			    (seq->version & STORE_VERSION_SFLOW) ?
+			    "packets" : "flows",
+			    (unsigned long long)seq->received,
+			    (unsigned long long)seq->lost,
+			    (unsigned long long)seq->reordered,
+			    (unsigned long long)seq->resets);
+		}
+		TAILQ_FOREACH(source, &peer->sources, lp) {
+			TAILQ_FOREACH(template, &source->templates, lp) {
+				logit(LOG_INFO, "peer %u - %s: netflow v.%u "
+				    "template 0x%08x/0x%04x: records:%u "
+				    "decoder:%s fast:%llu generic:%llu", i,
+				    addr_ntop_buf(&peer->from),
+				    source->key.version, source->key.source_id,
+				    template->key.template_id,
+				    template->num_records,
+				    template->num_scopes != 0 ? "options" :
+				    template->prog.fast_name == NULL ?
+				    "generic" : template->prog.fast_name,
+				    (unsigned long long)template->prog.nfast,
+				    (unsigned long long)template->prog.ngeneric);
+			}
+			for (j = 0; j < source->num_samplers; j++) {
+				sampler = &source->samplers[j];
+				logit(LOG_INFO, "peer %u - %s: netflow v.%u "
+				    "source 0x%08x sampler %s %llu: "
+				    "interval:%u algorithm:%u", i,
+				    addr_ntop_buf(&peer->from),
+				    source->key.version, source->key.source_id,
+				    sampler_scopes[sampler->scope],
+				    (unsigned long long)sampler->id,
+				    sampler->interval, sampler->algorithm);
+			}
+		}
 		i++;
 	}
-#ifdef PEER_DEBUG_NF9
-	/* XXX netflow 9 data */
-#endif
 }
@@ -45,125 +45,233 @@
  * sources. So the total is:
  *     max_peers * max_templates * max_sources * (max_template_len + overheads)
  *
+ * IPFIX observation domains are treated as sources, and the limits apply to
+ * the NetFlow v.9 and IPFIX state of a peer together.
+ *
+ * The sources and templates of every peer are kept in one open-addressing
+ * hash table, keyed on the peer, protocol version, source and template ID,
+ * so finding the template for a data flowset doesn't depend on how many
+ * sources or templates a peer has. LRU lists per peer and per source pick
+ * the victims when the limits are exceeded.
+ *
  * NB. The peer.c routines are not responsible for filling in the template
  * record structures, just for housekeeping such as allocation and lookup.
- * The filling-in is performed by the netflow v.9 template flowset handler
- *
- * XXX - share these structures with IPFIX in the future
+ * The filling-in is performed by the template flowset handlers
  */
 
-/* A record in a NetFlow v.9 template record */
-struct peer_nf9_record {
+/* A record in a NetFlow v.9 or v.10 template */
+struct peer_tmpl_record {
 	u_int type;
-	u_int len;
+	u_int len;			/* NF10_VARLEN if variable length */
+	u_int32_t enterprise;		/* IPFIX enterprise number, or 0 */
 };
 
-/* A NetFlow v.9 template record */
-struct peer_nf9_template {
-	TAILQ_ENTRY(peer_nf9_template) lp;
-	u_int16_t template_id;
-	u_int num_records;
-	u_int total_len;
-	struct peer_nf9_record *records;
+/*
+ * Templates are compiled into a program of these when they are received:
+ * one copy per field that we understand, straight from the data record into
+ * a struct store_flow_complete. Unknown fields are skipped.
+ */
+struct peer_tmpl_op {
+	u_int16_t src;			/* Offset in data record */
+	u_int16_t dst;			/* Offset in store_flow_complete */
+	u_int16_t len;
+	u_int8_t op;			/* PEER_TMPL_OP_* */
+	u_int8_t af;			/* Address family for PEER_TMPL_OP_ADDR* */
 };
-TAILQ_HEAD(peer_nf9_template_list, peer_nf9_template);
+#define PEER_TMPL_OP_COPY	0	/* Copy "len" bytes */
+#define PEER_TMPL_OP_COPY1	1	/* Fixed-size copies */
+#define PEER_TMPL_OP_COPY2	2
+#define PEER_TMPL_OP_COPY4	3
+#define PEER_TMPL_OP_COPY8	4
+#define PEER_TMPL_OP_ADDR	5	/* Copy address and set its family */
+#define PEER_TMPL_OP_ADDR4	6	/* Whole IPv4 address */
+#define PEER_TMPL_OP_ADDR6	7	/* Whole IPv6 address */
 
-/* A distinct NetFlow v.9 source */
-struct peer_nf9_source {
-	TAILQ_ENTRY(peer_nf9_source) lp;
-	u_int32_t source_id;
-	u_int num_templates;
-	struct peer_nf9_template_list templates;
+/*
+ * A variable-length IPFIX field. These split a template's fixed-length
+ * fields into segments, whose start in each data record is found by reading
+ * the lengths of the variable-length fields in between.
+ */
+struct peer_tmpl_var {
+	u_int16_t skip;			/* Fixed bytes before its length */
+	u_int16_t first_op;		/* First op of the following segment */
+	u_int16_t dst, size;		/* Where a known field goes, if size */
+	u_int8_t af;			/* Address family, for addresses */
+	u_int32_t store_field;		/* Set only if the value is stored */
 };
-TAILQ_HEAD(peer_nf9_list, peer_nf9_source);
 
-/* A record in a NetFlow v.10 template record */
-struct peer_nf10_record {
-	u_int type;
-	u_int len;
+struct store_flow_complete;
+
+/*
+ * A compiled template. Templates with a well-known layout are decoded by a
+ * specialised routine instead of the program.
+ */
+struct peer_tmpl_prog {
+	u_int num_ops;
+	u_int32_t fields;		/* STORE_FIELD_* set by decoding */
+	struct peer_tmpl_op *ops;
+	u_int num_var;			/* Variable-length fields */
+	u_int tail;			/* Fixed bytes after the last of them */
+	struct peer_tmpl_var *var;
+	const char *fast_name;		/* Specialised decoder, if any */
+	void (*fast)(const u_int8_t *, struct store_flow_complete *);
+	u_int64_t nfast, ngeneric;	/* Flows decoded by each path */
 };
 
-/* A NetFlow v.10 template record */
-struct peer_nf10_template {
-	TAILQ_ENTRY(peer_nf10_template) lp;
-	u_int16_t template_id;
+struct peer_state;
+
+/* Hash key of a template, or of the source that holds it */
+struct peer_tmpl_key {
+	struct peer_state *peer;
+	u_int32_t source_id;		/* Source ID or observation domain */
+	u_int16_t template_id;		/* 0 for sources */
+	u_int8_t version;		/* 9 or 10 */
+	u_int8_t is_source;
+};
+
+/* A NetFlow v.9 or IPFIX template */
+struct peer_template {
+	struct peer_tmpl_key key;	/* Must be first */
+	TAILQ_ENTRY(peer_template) lp;
+	struct peer_tmpl_source *source;
+	u_int num_scopes;		/* Options templates only */
 	u_int num_records;
 	u_int total_len;
-	struct peer_nf10_record *records;
+	time_t received;		/* When last sent by the exporter */
+	struct peer_tmpl_record *records;
+	struct peer_tmpl_prog prog;
+};
+TAILQ_HEAD(peer_template_list, peer_template);
+
+/*
+ * A packet sampler, learned from options data. Flows that carry a sampler
+ * or selector ID are matched to the sampler with that ID, then others by
+ * input interface, and finally to one that covers the whole source.
+ */
+struct peer_sampler {
+	u_int64_t id;			/* Sampler ID or interface index */
+	u_int32_t interval;		/* 1 in "interval" packets */
+	u_int8_t scope;			/* PEER_SAMPLER_* */
+	u_int8_t algorithm;		/* STORE_SAMPLING_* */
 };
-TAILQ_HEAD(peer_nf10_template_list, peer_nf10_template);
+#define PEER_SAMPLER_SOURCE	0
+#define PEER_SAMPLER_ID		1
+#define PEER_SAMPLER_IFINDEX	2
+#define PEER_MAX_SAMPLERS	64	/* Per source */
 
-/* A distinct NetFlow v.10 source */
-struct peer_nf10_source {
-	TAILQ_ENTRY(peer_nf10_source) lp;
-	u_int32_t source_id;
+/* A distinct NetFlow v.9 source or IPFIX observation domain */
+struct peer_tmpl_source {
+	struct peer_tmpl_key key;	/* Must be first */
+	TAILQ_ENTRY(peer_tmpl_source) lp;
 	u_int num_templates;
-	struct peer_nf10_template_list templates;
+	struct peer_template_list templates;
+	u_int num_samplers;
+	struct peer_sampler *samplers;
+};
+TAILQ_HEAD(peer_tmpl_source_list, peer_tmpl_source);
+
+/* Open-addressing hash table of sources and templates */
+struct peer_tmpl_table {
+	struct peer_tmpl_key **slots;
+	u_int size;			/* Zero or a power of two */
+	u_int count;
 };
-TAILQ_HEAD(peer_nf10_list, peer_nf10_source);
+
+/*
+ * Export sequence tracking for one stream from a peer: a NetFlow v.5
+ * engine, a NetFlow v.9 source, an IPFIX observation domain or an sFlow
+ * sub-agent. Sequence numbers count flows (records) for NetFlow v.5, v.7
+ * and IPFIX, and packets for NetFlow v.9 and sFlow.
+ */
+struct peer_seq {
+	TAILQ_ENTRY(peer_seq) lp;
+	u_int version;			/* As peer_state.last_version */
+	u_int32_t domain;		/* Engine, source ID, domain, sub-agent */
+	u_int32_t next;			/* Expected next sequence number */
+	int resync;			/* Next is unknown */
+	u_int64_t received, lost, reordered, resets;
+};
+TAILQ_HEAD(peer_seq_list, peer_seq);
+#define PEER_SEQ_REORDER	1024	/* Late arrivals tolerated, in units */
+#define PEER_SEQ_MAX_GAP	(1<<20)	/* Larger jumps are resets */
+#define PEER_SEQ_UNKNOWN	0xffffffff /* Count for undecodable packets */
+
+/*
+ * The exporter's clock skew is the receive time less the export time in
+ * the packet headers. It is smoothed, so that network delay jitter doesn't
+ * move flow times around, but restarts when the exporter's clock is stepped.
+ */
+#define PEER_SKEW_SHIFT		3	/* Each packet moves it 1/8 of the way */
+#define PEER_SKEW_STEP		60000	/* Larger changes restart it, in ms */
 
 /* General per-peer state */
 
 /*
  * Structure to hold per-peer state. NetFlow v.9 / IPFIX will require that we
  * hold state for each peer to retain templates. This peer state is stored in
- * a splay tree for quick access by sender address and in a deque so we can
+ * a hash table for quick access by sender address and in a deque so we can
  * do fast LRU deletions on overflow
  */
 struct peer_state {
-	SPLAY_ENTRY(peer_state) tp;
+	LIST_ENTRY(peer_state) hp;
 	TAILQ_ENTRY(peer_state) lp;
 	struct xaddr from;
 	u_int64_t npackets, nflows, ninvalid, no_template;
 	struct timeval firstseen, lastvalid;
 	u_int last_version;
 
-	/* NetFlow v.9 specific portions */
-	struct peer_nf9_list nf9;
-	u_int nf9_num_sources;
+	/* NetFlow v.9 and IPFIX sources, most recently used first */
+	struct peer_tmpl_source_list sources;
+	u_int num_sources;
+
+	/* Export sequence streams, most recently used first */
+	struct peer_seq_list seqs;
+	u_int num_seqs;
 
-	/* NetFlow v.10 specific portions */
-	struct peer_nf10_list nf10;
-	u_int nf10_num_sources;
+	/* Exporter clock skew, in ms */
+	int64_t skew_ms;
+	u_int64_t nskew;		/* Packets it was measured over */
 };
 
-/* Structures for top of peer state tree and head of list */
-SPLAY_HEAD(peer_tree, peer_state);
+/* Structures for peer hash chains and head of list */
+LIST_HEAD(peer_bucket, peer_state);
 TAILQ_HEAD(peer_list, peer_state);
 
 /* Peer stateholding structure */
 struct peers {
-	struct peer_tree peer_tree;
+	struct peer_bucket *peer_hash;
+	u_int peer_hash_size;		/* Zero or a power of two */
+	struct peer_state *last_peer;	/* Most recently found */
 	struct peer_list peer_list;
 	u_int max_peers, max_templates, max_sources, max_template_len;
 	u_int num_peers, num_forced;
+	u_int64_t npackets, nflows;	/* Totals over all peers, ever */
+	u_int64_t seq_lost, seq_reordered, seq_resets;
+	struct peer_tmpl_table templates;
 };
 
 /* Peer state handling functions */
 struct peer_state *new_peer(struct peers *peers, struct flowd_config *conf,
-    struct xaddr *addr);
+    struct xaddr *addr, const struct timeval *now);
 void scrub_peers(struct flowd_config *conf, struct peers *peers);
 void update_peer(struct peers *peers, struct peer_state *peer, u_int nflows,
-    u_int netflow_version);
+    u_int netflow_version, const struct timeval *now);
 struct peer_state *find_peer(struct peers *peers, struct xaddr *addr);
+void peer_sequence(struct peers *peers, struct peer_state *peer,
+    u_int version, u_int32_t domain, u_int32_t seq, u_int32_t count);
+int64_t peer_skew(struct peer_state *peer, int64_t sample_ms);
 void dump_peers(struct peers *peers);
 
-/* NetFlow v.9 state handling functions */
-struct peer_nf9_template *peer_nf9_find_template(struct peer_state *peer,
-    u_int32_t source_id, u_int16_t template_id);
-struct peer_nf9_template *
-peer_nf9_new_template(struct peer_state *peer, struct peers *peers,
-    u_int32_t source_id, u_int16_t template_id);
-void peer_nf9_template_update(struct peer_state *peer,
-    u_int32_t source_id, u_int16_t template_id);
-
-/* NetFlow v.10 state handling functions */
-struct peer_nf10_template *peer_nf10_find_template(struct peer_state *peer,
-    u_int32_t source_id, u_int16_t template_id);
-struct peer_nf10_template *
-peer_nf10_new_template(struct peer_state *peer, struct peers *peers,
-    u_int32_t source_id, u_int16_t template_id);
-void peer_nf10_template_update(struct peer_state *peer,
-    u_int32_t source_id, u_int16_t template_id);
+/* NetFlow v.9 / IPFIX template state handling functions */
+struct peer_template *peer_find_template(struct peers *peers,
+    struct peer_state *peer, u_int version, u_int32_t source_id,
+    u_int16_t template_id);
+struct peer_template *peer_new_template(struct peers *peers,
+    struct peer_state *peer, u_int version, u_int32_t source_id,
+    u_int16_t template_id);
+const struct peer_sampler *peer_find_sampler(struct peer_tmpl_source *source,
+    u_int scope, u_int64_t id);
+void peer_set_sampler(struct peer_tmpl_source *source,
+    const struct peer_sampler *sampler);
 
 #endif /* _PEER_H */
@@ -32,6 +32,9 @@
 #include <pwd.h>
 #include <grp.h>
 #include <netdb.h>
+#ifdef HAVE_LINUX_FILTER_H
+# include <linux/filter.h>
+#endif
 
 #include "flowd.h"
 #include "privsep.h"
@@ -50,6 +53,7 @@ static int monitor_to_child_sock = -1;
 #define C2M_MSG_OPEN_LOG	1	/* send: nothing   ret: fdpass */
 #define C2M_MSG_OPEN_SOCKET	2	/* send: nothing   ret: fdpass */
 #define C2M_MSG_RECONFIGURE	3	/* send: nothing   ret: conf+fdpass */
+#define C2M_MSG_OPEN_TMPL_CACHE	4	/* send: nothing   ret: ok+fdpass */
 
 /* Utility functions */
 static char *
@@ -121,7 +125,7 @@ write_pid_file(const char *path)
 int
 open_sender(struct xaddr *addr, u_int16_t port, size_t bufsiz)
 {
-	int fd;
+	int fd, fl;
 	struct sockaddr_storage ss;
 	socklen_t slen = sizeof(ss);
 
@@ -135,6 +139,13 @@ open_sender(struct xaddr *addr, u_int16_t port, size_t bufsiz)
 		return (-1);
 	}
 
+	/* A slow target must never hold up the receive path */
+	if ((fl = fcntl(fd, F_GETFL, 0)) == -1 ||
+	    fcntl(fd, F_SETFL, fl | O_NONBLOCK) == -1) {
+		logitm(LOG_ERR, "fcntl(%d, F_SETFL, O_NONBLOCK)", fd);
+		return (-1);
+	}
+
 	if (connect(fd, (struct sockaddr *)&ss, slen) == -1) {
 		logitm(LOG_ERR, "connect");
 		return (-1);
@@ -146,9 +157,49 @@ open_sender(struct xaddr *addr, u_int16_t port, size_t bufsiz)
 	return (fd);
 }
 
+#if defined(HAVE_LINUX_FILTER_H) && defined(SO_ATTACH_REUSEPORT_CBPF)
+/*
+ * Steer datagrams to one of the "workers" sockets sharing a port by a
+ * hash of the sender's address, rather than the kernel's default hash
+ * of address and port. This keeps all of an exporter's flows (and the
+ * templates that describe them) on one worker even if it sends from
+ * several ports. The socket index is the order in which they were bound.
+ */
+static void
+steer_listener(int fd, int af, u_int workers)
+{
+	struct sock_filter prog[] = {
+		/* A = last 32 bits of source address */
+		BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_NET_OFF +
+		    (af == AF_INET6 ? 20 : 12)),
+		/* A = (A ^ (A >> 16)) % workers */
+		BPF_STMT(BPF_MISC|BPF_TAX, 0),
+		BPF_STMT(BPF_ALU|BPF_RSH|BPF_K, 16),
+		BPF_STMT(BPF_ALU|BPF_XOR|BPF_X, 0),
+		BPF_STMT(BPF_ALU|BPF_MOD|BPF_K, workers),
+		BPF_STMT(BPF_RET|BPF_A, 0),
+	};
+	struct sock_fprog fprog = {
+		sizeof(prog) / sizeof(prog[0]), prog
+	};
+
+	/*
+	 * Not fatal, we just fall back to the kernel's hash of address and
+	 * port, but an exporter's templates and data may then be handled by
+	 * different workers.
+	 */
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &fprog,
+	    sizeof(fprog)) == -1) {
+		logit(LOG_WARNING, "Can't steer exporters to workers (%s); "
+		    "those sending from several ports may lose flows",
+		    strerror(errno));
+	}
+}
+#endif
+
 int
 open_listener(struct xaddr *addr, u_int16_t port, size_t bufsiz,
-    struct join_groups *groups)
+    u_int workers, struct join_groups *groups)
 {
 	int fd, fl, i, orig;
 	struct sockaddr_storage ss;
@@ -188,11 +239,31 @@ open_listener(struct xaddr *addr, u_int16_t port, size_t bufsiz,
 	}
 #endif
 
+#if defined(HAVE_DECL_SO_REUSEPORT) && HAVE_DECL_SO_REUSEPORT
+	/* Allow one socket per worker thread; the kernel spreads the load */
+	fl = 1;
+	if (workers > 1 &&
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &fl, sizeof(fl)) == -1) {
+		logitm(LOG_ERR, "setsockopt(SO_REUSEPORT)");
+		return (-1);
+	}
+#endif
+
 	if (bind(fd, (struct sockaddr *)&ss, slen) == -1) {
 		logitm(LOG_ERR, "bind");
 		return (-1);
 	}
 
+#if defined(HAVE_LINUX_FILTER_H) && defined(SO_ATTACH_REUSEPORT_CBPF)
+	if (workers > 1)
+		steer_listener(fd, addr->af, workers);
+#else
+	if (workers > 1) {
+		logit(LOG_WARNING, "Can't steer exporters to workers; those "
+		    "sending from several ports may lose flows");
+	}
+#endif
+
 	logit(LOG_DEBUG, "Listener for [%s]:%d fd = %d", addr_ntop_buf(addr),
 	    port, fd);
 
@@ -225,6 +296,19 @@ open_listener(struct xaddr *addr, u_int16_t port, size_t bufsiz,
 		}
 	}
 
+#ifdef SO_TIMESTAMP
+	/* Have the kernel record when each datagram arrived */
+	fl = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMP, &fl, sizeof(fl)) == -1)
+		logitm(LOG_DEBUG, "setsockopt(SO_TIMESTAMP)");
+#endif
+#ifdef SO_RXQ_OVFL
+	/* And how many datagrams it has dropped for want of buffer space */
+	fl = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &fl, sizeof(fl)) == -1)
+		logitm(LOG_DEBUG, "setsockopt(SO_RXQ_OVFL)");
+#endif
+
 	/* Shrink send buffer, because we never use it */
 	fl = 1024;
 	logit(LOG_DEBUG, "Setting socket send buf to %d", fl);
@@ -265,6 +349,7 @@ static void
 replace_conf(struct flowd_config *conf, struct flowd_config *newconf)
 {
 	struct listen_addr *la;
+	struct forward_addr *fa;
 	struct filter_rule *fr;
 	struct allowed_device *ad;
 	struct join_group *jg;
@@ -274,12 +359,22 @@ replace_conf(struct flowd_config *conf, struct flowd_config *newconf)
 	if (conf->log_socket != NULL)
 		free(conf->log_socket);
 	free(conf->pid_file);
+	if (conf->tmpl_cache != NULL)
+		free(conf->tmpl_cache);
 	while ((la = TAILQ_FIRST(&conf->listen_addrs)) != NULL) {
 		if (la->fd != -1)
 			close(la->fd);
 		TAILQ_REMOVE(&conf->listen_addrs, la, entry);
 		free(la);
 	}
+	while ((fa = TAILQ_FIRST(&conf->forward_addrs)) != NULL) {
+		if (fa->fd != -1)
+			close(fa->fd);
+		TAILQ_REMOVE(&conf->forward_addrs, fa, entry);
+		free(fa);
+	}
+	if (conf->filter_prog != NULL)
+		filter_prog_free(conf->filter_prog);
 	while ((fr = TAILQ_FIRST(&conf->filter_list)) != NULL) {
 		TAILQ_REMOVE(&conf->filter_list, fr, entry);
 		free(fr);
@@ -295,6 +390,7 @@ replace_conf(struct flowd_config *conf, struct flowd_config *newconf)
 
 	memcpy(conf, newconf, sizeof(*conf));
 	TAILQ_INIT(&conf->listen_addrs);
+	TAILQ_INIT(&conf->forward_addrs);
 	TAILQ_INIT(&conf->filter_list);
 	TAILQ_INIT(&conf->allowed_devices);
 	TAILQ_INIT(&conf->join_groups);
@@ -303,6 +399,11 @@ replace_conf(struct flowd_config *conf, struct flowd_config *newconf)
 		TAILQ_REMOVE(&newconf->listen_addrs, la, entry);
 		TAILQ_INSERT_HEAD(&conf->listen_addrs, la, entry);
 	}
+	while ((fa = TAILQ_LAST(&newconf->forward_addrs,
+	    forward_addrs)) != NULL) {
+		TAILQ_REMOVE(&newconf->forward_addrs, fa, entry);
+		TAILQ_INSERT_HEAD(&conf->forward_addrs, fa, entry);
+	}
 	while ((fr = TAILQ_LAST(&newconf->filter_list, filter_list)) != NULL) {
 		TAILQ_REMOVE(&newconf->filter_list, fr, entry);
 		TAILQ_INSERT_HEAD(&conf->filter_list, fr, entry);
@@ -369,6 +470,46 @@ recv_config(int fd, struct flowd_config *conf)
 		return (-1);
 	}
 
+	if (atomicio(read, fd, &newconf.recv_batch,
+	    sizeof(newconf.recv_batch)) != sizeof(newconf.recv_batch)) {
+		logitm(LOG_ERR, "%s: read(conf.recv_batch)", __func__);
+		return (-1);
+	}
+
+	if (atomicio(read, fd, &newconf.packet_pool,
+	    sizeof(newconf.packet_pool)) != sizeof(newconf.packet_pool)) {
+		logitm(LOG_ERR, "%s: read(conf.packet_pool)", __func__);
+		return (-1);
+	}
+
+	if (atomicio(read, fd, &newconf.workers,
+	    sizeof(newconf.workers)) != sizeof(newconf.workers)) {
+		logitm(LOG_ERR, "%s: read(conf.workers)", __func__);
+		return (-1);
+	}
+
+	if (atomicio(read, fd, &newconf.rcvbuf_max,
+	    sizeof(newconf.rcvbuf_max)) != sizeof(newconf.rcvbuf_max)) {
+		logitm(LOG_ERR, "%s: read(conf.rcvbuf_max)", __func__);
+		return (-1);
+	}
+
+	newconf.tmpl_cache = privsep_read_string(fd, 1);
+
+	if (atomicio(read, fd, &newconf.tmpl_cache_save,
+	    sizeof(newconf.tmpl_cache_save)) !=
+	    sizeof(newconf.tmpl_cache_save)) {
+		logitm(LOG_ERR, "%s: read(conf.tmpl_cache_save)", __func__);
+		return (-1);
+	}
+
+	if (atomicio(read, fd, &newconf.tmpl_cache_valid,
+	    sizeof(newconf.tmpl_cache_valid)) !=
+	    sizeof(newconf.tmpl_cache_valid)) {
+		logitm(LOG_ERR, "%s: read(conf.tmpl_cache_valid)", __func__);
+		return (-1);
+	}
+
 	/* Read Listen Addrs */
 	if (atomicio(read, fd, &n, sizeof(n)) != sizeof(n)) {
 		logitm(LOG_ERR, "%s: read(num listen_addrs)", __func__);
@@ -485,6 +626,8 @@ recv_config(int fd, struct flowd_config *conf)
 		TAILQ_INSERT_TAIL(&newconf.join_groups, jg, entry);
 	}
 
+	newconf.filter_prog = filter_compile(&newconf.filter_list);
+
 	replace_conf(conf, &newconf);
 
 	return (0);
@@ -534,6 +677,48 @@ send_config(int fd, struct flowd_config *conf)
 		return (-1);
 	}
 
+	if (atomicio(vwrite, fd, &conf->recv_batch,
+	    sizeof(conf->recv_batch)) != sizeof(conf->recv_batch)) {
+		logitm(LOG_ERR, "%s: write(conf.recv_batch)", __func__);
+		return (-1);
+	}
+
+	if (atomicio(vwrite, fd, &conf->packet_pool,
+	    sizeof(conf->packet_pool)) != sizeof(conf->packet_pool)) {
+		logitm(LOG_ERR, "%s: write(conf.packet_pool)", __func__);
+		return (-1);
+	}
+
+	if (atomicio(vwrite, fd, &conf->workers,
+	    sizeof(conf->workers)) != sizeof(conf->workers)) {
+		logitm(LOG_ERR, "%s: write(conf.workers)", __func__);
+		return (-1);
+	}
+
+	if (atomicio(vwrite, fd, &conf->rcvbuf_max,
+	    sizeof(conf->rcvbuf_max)) != sizeof(conf->rcvbuf_max)) {
+		logitm(LOG_ERR, "%s: write(conf.rcvbuf_max)", __func__);
+		return (-1);
+	}
+
+	if (privsep_write_string(fd, conf->tmpl_cache, 1) == -1) {
+		logit(LOG_ERR, "%s: Couldn't write conf.tmpl_cache", __func__);
+		return (-1);
+	}
+
+	if (atomicio(vwrite, fd, &conf->tmpl_cache_save,
+	    sizeof(conf->tmpl_cache_save)) != sizeof(conf->tmpl_cache_save)) {
+		logitm(LOG_ERR, "%s: write(conf.tmpl_cache_save)", __func__);
+		return (-1);
+	}
+
+	if (atomicio(vwrite, fd, &conf->tmpl_cache_valid,
+	    sizeof(conf->tmpl_cache_valid)) !=
+	    sizeof(conf->tmpl_cache_valid)) {
+		logitm(LOG_ERR, "%s: write(conf.tmpl_cache_valid)", __func__);
+		return (-1);
+	}
+
 	/* Write Listen Addrs */
 	n = 0;
 	TAILQ_FOREACH(la, &conf->listen_addrs, entry)
@@ -829,6 +1014,30 @@ client_open_socket(int monitor_fd)
 	return (fd);
 }
 
+int
+client_open_tmpl_cache(int monitor_fd)
+{
+	int fd = -1;
+	u_int msg = C2M_MSG_OPEN_TMPL_CACHE, ok;
+
+	logit(LOG_DEBUG, "%s: entering", __func__);
+
+	if (atomicio(vwrite, monitor_fd, &msg, sizeof(msg)) != sizeof(msg)) {
+		logitm(LOG_ERR, "%s: write", __func__);
+		return (-1);
+	}
+	if (atomicio(read, monitor_fd, &ok, sizeof(ok)) != sizeof(ok)) {
+		logitm(LOG_ERR, "%s: read(ok)", __func__);
+		return (-1);
+	}
+	if (!ok)
+		return (-1);
+	if ((fd = receive_fd(monitor_fd)) == -1)
+		return (-1);
+
+	return (fd);
+}
+
 int
 client_reconfigure(int monitor_fd, struct flowd_config *conf)
 {
@@ -940,6 +1149,34 @@ answer_open_socket(struct flowd_config *conf, int client_fd)
 	return (0);
 }
 
+/* Failure to open the cache is reported to the child, which can go on */
+static int
+answer_open_tmpl_cache(struct flowd_config *conf, int client_fd)
+{
+	int fd;
+	u_int ok;
+
+	logit(LOG_DEBUG, "%s: entering", __func__);
+
+	if (conf->tmpl_cache == NULL)
+		logerrx("%s: attempt to open NULL template cache", __func__);
+
+	fd = open(conf->tmpl_cache, O_RDWR|O_CREAT, 0600);
+	if (fd == -1)
+		logitm(LOG_WARNING, "open(\"%s\")", conf->tmpl_cache);
+	ok = fd != -1;
+	if (atomicio(vwrite, client_fd, &ok, sizeof(ok)) != sizeof(ok)) {
+		logitm(LOG_ERR, "%s: write(ok)", __func__);
+		return (-1);
+	}
+	if (!ok)
+		return (0);
+	if (send_fd(client_fd, fd) == -1)
+		return (-1);
+	close(fd);
+	return (0);
+}
+
 static int
 answer_reconfigure(struct flowd_config *conf, int client_fd,
     const char *config_path)
@@ -951,6 +1188,7 @@ answer_reconfigure(struct flowd_config *conf, int client_fd,
 
 	bzero(&newconf, sizeof(newconf));
 	TAILQ_INIT(&newconf.listen_addrs);
+	TAILQ_INIT(&newconf.forward_addrs);
 	TAILQ_INIT(&newconf.filter_list);
 	TAILQ_INIT(&newconf.allowed_devices);
 	TAILQ_INIT(&newconf.join_groups);
@@ -967,9 +1205,30 @@ answer_reconfigure(struct flowd_config *conf, int client_fd,
 		ok = 0;
 	}
 
+	/* Worker shards (struct peers) are sized at startup */
+	if (ok && newconf.workers != conf->workers) {
+		logit(LOG_ERR, "Changing the number of workers requires "
+		    "a restart");
+		ok = 0;
+	}
+	if (ok && (newconf.opts & FLOWD_OPT_PIPELINE) !=
+	    (conf->opts & FLOWD_OPT_PIPELINE)) {
+		logit(LOG_ERR, "Changing the pipeline option requires "
+		    "a restart");
+		ok = 0;
+	}
+	if (ok && (newconf.opts & FLOWD_OPT_IO_URING) !=
+	    (conf->opts & FLOWD_OPT_IO_URING)) {
+		logit(LOG_ERR, "Changing the io_uring option requires "
+		    "a restart");
+		ok = 0;
+	}
+
 	TAILQ_FOREACH(la, &newconf.listen_addrs, entry) {
+		if (!ok)
+			break;
 		if ((la->fd = open_listener(&la->addr, la->port, la->bufsiz,
-		    &conf->join_groups)) == -1) {
+		    newconf.workers, &conf->join_groups)) == -1) {
 			logit(LOG_ERR, "Listener setup of [%s]:%d failed",
 			    addr_ntop_buf(&la->addr), la->port);
 			ok = 0;
@@ -1002,6 +1261,10 @@ answer_reconfigure(struct flowd_config *conf, int client_fd,
 		close(la->fd);
 		la->fd = -1;
 	}
+	TAILQ_FOREACH(fa, &newconf.forward_addrs, entry) {
+		close(fa->fd);
+		fa->fd = -1;
+	}
 
 	/* Cleanup old config and move new one into place */
 	rewrite_pidfile = (strcmp(conf->pid_file, newconf.pid_file) != 0);
@@ -1072,6 +1335,13 @@ privsep_master(struct flowd_config *conf, const char *config_path)
 				exit(1);
 			}
 			break;
+		case C2M_MSG_OPEN_TMPL_CACHE:
+			if (answer_open_tmpl_cache(conf,
+			    monitor_to_child_sock)) {
+				unlink(conf->pid_file);
+				exit(1);
+			}
+			break;
 		case C2M_MSG_RECONFIGURE:
 			if (answer_reconfigure(conf, monitor_to_child_sock,
 			    config_path)) {
@@ -27,7 +27,9 @@
 void privsep_init(struct flowd_config *, int *, const char *);
 int client_open_log(int);
 int client_open_socket(int);
-int open_listener(struct xaddr *, u_int16_t, size_t, struct join_groups *);
+int client_open_tmpl_cache(int);
+int open_listener(struct xaddr *, u_int16_t, size_t, u_int,
+    struct join_groups *);
 int read_config(const char *, struct flowd_config *);
 int open_sender(struct xaddr *, u_int16_t, size_t);
 int client_reconfigure(int, struct flowd_config *);
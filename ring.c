@@ -0,0 +1,163 @@
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "flowd-common.h"
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+
+#include "flowd.h"
+#include "ring.h"
+
+RCSID("$Id$");
+
+#ifdef HAVE_ATOMIC_BUILTINS
+
+void
+doorbell_init(struct doorbell *db)
+{
+	bzero(db, sizeof(*db));
+	if (pipe(db->fds) == -1)
+		logerr("%s: pipe", __func__);
+	/* Neither side may block on the pipe itself */
+	if (fcntl(db->fds[0], F_SETFL, O_NONBLOCK) == -1 ||
+	    fcntl(db->fds[1], F_SETFL, O_NONBLOCK) == -1)
+		logerr("%s: fcntl", __func__);
+}
+
+/* Wake the doorbell's thread if it is sleeping. Called by producers */
+void
+doorbell_ring(struct doorbell *db)
+{
+	char c = 0;
+
+	/* Order our ring update before the check of the sleeping flag */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&db->sleeping, __ATOMIC_RELAXED))
+		return;
+	/* EAGAIN means that a wakeup is already pending */
+	if (write(db->fds[1], &c, 1) == -1 && errno != EAGAIN &&
+	    errno != EINTR)
+		logerr("%s: write", __func__);
+}
+
+/* Announce that the calling thread is about to sleep on "db" */
+void
+doorbell_arm(struct doorbell *db)
+{
+	__atomic_store_n(&db->sleeping, 1, __ATOMIC_RELAXED);
+	/* Order the flag before the caller's final check of its rings */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void
+doorbell_disarm(struct doorbell *db)
+{
+	__atomic_store_n(&db->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Sleep until the doorbell is rung or "extra_fd" (if not -1) becomes
+ * readable. Returns non-zero if "extra_fd" is readable.
+ */
+int
+doorbell_wait(struct doorbell *db, int extra_fd)
+{
+	struct pollfd pfd[2];
+	char buf[64];
+	int n = 1;
+
+	pfd[0].fd = db->fds[0];
+	pfd[0].events = POLLIN;
+	pfd[0].revents = 0;
+	if (extra_fd != -1) {
+		pfd[1].fd = extra_fd;
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+		n++;
+	}
+	if (poll(pfd, n, INFTIM) == -1 && errno != EINTR)
+		logerr("%s: poll", __func__);
+	while (read(db->fds[0], buf, sizeof(buf)) > 0)
+		;
+	doorbell_disarm(db);
+
+	return (n > 1 && pfd[1].revents != 0);
+}
+
+void
+ring_init(struct spsc_ring *r, u_int size, struct doorbell *db)
+{
+	u_int n;
+
+	/* Round up to a power of two so we can mask instead of divide */
+	for (n = 1; n < size; n <<= 1)
+		;
+	bzero(r, sizeof(*r));
+	if ((r->slots = calloc(n, sizeof(*r->slots))) == NULL)
+		logerrx("%s: calloc failed (size %u)", __func__, n);
+	r->mask = n - 1;
+	r->db = db;
+}
+
+/* Add an entry to the ring, returns -1 if it is full */
+int
+ring_push(struct spsc_ring *r, void *p)
+{
+	u_int head = r->head, depth;
+
+	depth = head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	if (depth > r->mask)
+		return (-1);
+	r->slots[head & r->mask] = p;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+	r->pushes++;
+	if (depth + 1 > r->high_water)
+		r->high_water = depth + 1;
+	if (r->db != NULL)
+		doorbell_ring(r->db);
+
+	return (0);
+}
+
+/* Take the oldest entry from the ring, returns NULL if it is empty */
+void *
+ring_pop(struct spsc_ring *r)
+{
+	u_int tail = r->tail;
+	void *p;
+
+	if (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+		return (NULL);
+	p = r->slots[tail & r->mask];
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return (p);
+}
+
+/* Number of entries in the ring; only exact when both sides are idle */
+u_int
+ring_depth(struct spsc_ring *r)
+{
+	return (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) -
+	    __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+}
+
+#endif /* HAVE_ATOMIC_BUILTINS */
@@ -0,0 +1,67 @@
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Bounded lock-free single-producer/single-consumer rings of pointers,
+ * used to hand packets and output buffers between pipeline threads.
+ *
+ * A consumer that finds its rings empty can sleep on a doorbell; a
+ * producer rings the doorbell after a push if the consumer is asleep.
+ * Several rings may share a doorbell if they have the same consumer.
+ * To sleep, a consumer calls doorbell_arm(), checks its rings once more
+ * and then calls either doorbell_disarm() (if they are not empty) or
+ * doorbell_wait().
+ */
+
+#ifndef _RING_H
+#define _RING_H
+
+#include <sys/types.h>
+#include "flowd-common.h"
+
+#define RING_CACHELINE		64
+
+struct doorbell {
+	int fds[2];			/* Pipe, read by the sleeping thread */
+	int sleeping;
+};
+
+struct spsc_ring {
+	void **slots;
+	u_int mask;
+	struct doorbell *db;		/* Consumer's doorbell */
+
+	/* Written by producer only */
+	u_int head __aligned(RING_CACHELINE);
+	u_int high_water;		/* Deepest the ring has been */
+	u_int64_t pushes;
+	u_int64_t stalls;		/* Producer had to wait for consumer */
+
+	/* Written by consumer only */
+	u_int tail __aligned(RING_CACHELINE);
+	u_int64_t waits;		/* Consumer slept on an empty ring */
+};
+
+void doorbell_init(struct doorbell *db);
+void doorbell_ring(struct doorbell *db);
+void doorbell_arm(struct doorbell *db);
+void doorbell_disarm(struct doorbell *db);
+int doorbell_wait(struct doorbell *db, int extra_fd);
+
+void ring_init(struct spsc_ring *r, u_int size, struct doorbell *db);
+int ring_push(struct spsc_ring *r, void *p);
+void *ring_pop(struct spsc_ring *r);
+u_int ring_depth(struct spsc_ring *r);
+
+#endif /* _RING_H */
@@ -0,0 +1,137 @@
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* sFlow packet definitions */
+
+#ifndef _SFLOW_H
+#define _SFLOW_H
+
+#include "flowd-common.h"
+
+/*
+ * sFlow version 5 datagram formats
+ * Based on: http://www.sflow.org/sflow_version_5.txt
+ *
+ * sFlow is XDR encoded: every field is a multiple of four bytes long and
+ * variable length data is padded to a four byte boundary.
+ */
+
+#define SFLOW5_VERSION			5
+
+/*
+ * Datagram header. The agent address after the version is variable length
+ * (an address type followed by the address), so the header is split
+ * either side of it.
+ */
+struct SFLOW5_HEADER {
+	u_int32_t version;
+} __packed;
+struct SFLOW5_HEADER_TAIL {
+	u_int32_t sub_agent_id, sequence, uptime_ms, num_samples;
+} __packed;
+
+/* Address types */
+#define SFLOW5_ADDR_IP4			1
+#define SFLOW5_ADDR_IP6			2
+
+/*
+ * Samples and flow records both start with a format and length. The
+ * format has an enterprise number in its top 20 bits, so the standard
+ * (enterprise 0) formats below can be compared with it directly.
+ */
+struct SFLOW5_DATA_HEADER {
+	u_int32_t format, length;
+} __packed;
+
+/* Sample formats */
+#define SFLOW5_FLOW_SAMPLE		1
+#define SFLOW5_COUNTERS_SAMPLE		2
+#define SFLOW5_FLOW_SAMPLE_EXPANDED	3
+#define SFLOW5_COUNTERS_SAMPLE_EXPANDED	4
+
+struct SFLOW5_FLOW_SAMPLE_HEADER {
+	u_int32_t sequence;
+	u_int32_t source_id;		/* Type in the top eight bits */
+	u_int32_t sampling_rate, sample_pool, drops;
+	u_int32_t input, output;	/* Format in the top two bits */
+	u_int32_t num_records;
+} __packed;
+struct SFLOW5_FLOW_SAMPLE_EXPANDED_HEADER {
+	u_int32_t sequence;
+	u_int32_t source_id_type, source_id_index;
+	u_int32_t sampling_rate, sample_pool, drops;
+	u_int32_t input_format, input;
+	u_int32_t output_format, output;
+	u_int32_t num_records;
+} __packed;
+/* Interface formats; only format 0 is an ifIndex */
+#define SFLOW5_IF_FORMAT(x)		((x) >> 30)
+#define SFLOW5_IF_VALUE(x)		((x) & 0x3fffffff)
+#define SFLOW5_IF_INDEX			0
+
+/* Flow record formats that we care about */
+#define SFLOW5_RAW_HEADER		1
+/* ... */
+#define SFLOW5_SAMPLED_IPV4		3
+#define SFLOW5_SAMPLED_IPV6		4
+/* ... */
+#define SFLOW5_EXTENDED_ROUTER		1002
+#define SFLOW5_EXTENDED_GATEWAY		1003
+
+struct SFLOW5_RAW_HEADER_RECORD {
+	u_int32_t protocol, frame_length, stripped, header_length;
+	/* Followed by header_length bytes of packet, padded */
+} __packed;
+/* Header protocols that we can decode */
+#define SFLOW5_HEADER_ETHERNET		1
+#define SFLOW5_HEADER_IPV4		11
+#define SFLOW5_HEADER_IPV6		12
+
+struct SFLOW5_SAMPLED_IPV4_RECORD {
+	u_int32_t length, protocol;
+	u_int32_t src_ip, dst_ip;
+	u_int32_t src_port, dst_port, tcp_flags, tos;
+} __packed;
+struct SFLOW5_SAMPLED_IPV6_RECORD {
+	u_int32_t length, protocol;
+	u_int8_t src_ip[16], dst_ip[16];
+	u_int32_t src_port, dst_port, tcp_flags, priority;
+} __packed;
+
+/*
+ * The extended router record is a next hop address followed by the
+ * source and destination mask lengths. The extended gateway record is
+ * a next hop address followed by this, then the destination AS path,
+ * communities and local preference.
+ */
+struct SFLOW5_EXTENDED_GATEWAY_AS {
+	u_int32_t as, src_as, src_peer_as;
+	u_int32_t num_segments;
+	/* Followed by num_segments x (type, length, length x AS) */
+} __packed;
+
+#ifndef ETHERTYPE_IP
+# define ETHERTYPE_IP			0x0800
+#endif
+#ifndef ETHERTYPE_IPV6
+# define ETHERTYPE_IPV6			0x86dd
+#endif
+#ifndef ETHERTYPE_VLAN
+# define ETHERTYPE_VLAN			0x8100
+#endif
+#ifndef ETHERTYPE_QINQ
+# define ETHERTYPE_QINQ			0x88a8
+#endif
+
+#endif /* _SFLOW_H */
@@ -86,6 +86,8 @@ store_calc_flow_len(struct store_flow *hdr)
 	ADDFIELD(FLOW_TIMES);
 	ADDFIELD(AS_INFO);
 	ADDFIELD(FLOW_ENGINE_INFO);
+	ADDFIELD(SAMPLING);
+	ADDFIELD(ABS_TIMES);
 	ADDFIELD(CRC32);
 #undef ADDFIELD
 
@@ -164,6 +166,8 @@ store_flow_deserialise(u_int8_t *buf, int len, struct store_flow_complete *f,
 	RFIELD(FLOW_TIMES, f->ftimes);
 	RFIELD(AS_INFO, f->asinf);
 	RFIELD(FLOW_ENGINE_INFO, f->finf);
+	RFIELD(SAMPLING, f->samp);
+	RFIELD(ABS_TIMES, f->atimes);
 
 	/* Other fields might live here if minor version > ours */
 	if ((donefields & ~STORE_FIELD_CRC32) != 0) {
@@ -436,6 +440,8 @@ store_flow_serialise(struct store_flow_complete *f, u_int8_t *buf, int buflen,
 	WFIELD(FLOW_TIMES, f->ftimes);
 	WFIELD(AS_INFO, f->asinf);
 	WFIELD(FLOW_ENGINE_INFO, f->finf);
+	WFIELD(SAMPLING, f->samp);
+	WFIELD(ABS_TIMES, f->atimes);
 	if (fields & (STORE_FIELD_CRC32))
 		f->crc32.crc32 = htonl(crc);
 	WFIELD(CRC32, f->crc32);
@@ -547,7 +553,7 @@ const char *
 iso_time(time_t t, int utc_flag)
 {
 	struct tm *tm;
-	static char buf[128];
+	static __tls char buf[128];
 
 	if (utc_flag)
 		tm = gmtime(&t);
@@ -567,7 +573,7 @@ iso_time(time_t t, int utc_flag)
 const char *
 interval_time(time_t t)
 {
-	static char buf[128];
+	static __tls char buf[128];
 	char tmp[128];
 	u_long r;
 	int unit_div[] = { YEAR, WEEK, DAY, HOUR, MINUTE, 1, -1 };
@@ -742,9 +748,12 @@ store_format_flow(struct store_flow_complete *flow, char *buf, size_t len,
 		snprintf(tmp, sizeof(tmp), "time_sec %s ",
 		    iso_time(fmt_ntoh32(flow->ainfo.time_sec), utc_flag));
 		strlcat(buf, tmp, len);
-		snprintf(tmp, sizeof(tmp), "time_nanosec %lu netflow ver %u ",
+		snprintf(tmp, sizeof(tmp), "time_nanosec %lu %s ver %u ",
 		    (u_long)fmt_ntoh32(flow->ainfo.time_nanosec),
-		    fmt_ntoh16(flow->ainfo.netflow_version));
+		    (fmt_ntoh16(flow->ainfo.netflow_version) &
+		    STORE_VERSION_SFLOW) ? "sflow" : "netflow",
+		    fmt_ntoh16(flow->ainfo.netflow_version) &
+		    ~STORE_VERSION_SFLOW);
 		strlcat(buf, tmp, len);
 	}
 	if (SHASFIELD(FLOW_TIMES)) {
@@ -774,6 +783,31 @@ store_format_flow(struct store_flow_complete *flow, char *buf, size_t len,
 		    (u_long)fmt_ntoh32(flow->finf.source_id));
 		strlcat(buf, tmp, len);
 	}
+	if (SHASFIELD(SAMPLING)) {
+		snprintf(tmp, sizeof(tmp), "sampler %llu interval %lu "
+		    "algorithm %u %s",
+		    (unsigned long long)fmt_ntoh64(flow->samp.sampler_id),
+		    (u_long)fmt_ntoh32(flow->samp.interval),
+		    flow->samp.algorithm,
+		    (flow->samp.flags & STORE_SAMPLING_UPSCALED) ?
+		    "upscaled " : "");
+		strlcat(buf, tmp, len);
+	}
+	if (SHASFIELD(ABS_TIMES)) {
+		snprintf(tmp, sizeof(tmp), "flow_start_abs %s.%03u ",
+		    iso_time(fmt_ntoh64(flow->atimes.flow_start_ms) / 1000,
+		    utc_flag),
+		    (u_int)(fmt_ntoh64(flow->atimes.flow_start_ms) % 1000));
+		strlcat(buf, tmp, len);
+		snprintf(tmp, sizeof(tmp), "flow_finish_abs %s.%03u ",
+		    iso_time(fmt_ntoh64(flow->atimes.flow_finish_ms) / 1000,
+		    utc_flag),
+		    (u_int)(fmt_ntoh64(flow->atimes.flow_finish_ms) % 1000));
+		strlcat(buf, tmp, len);
+		snprintf(tmp, sizeof(tmp), "skew_ms %lld ",
+		    (long long)fmt_ntoh64(flow->atimes.skew_ms));
+		strlcat(buf, tmp, len);
+	}
 	if (SHASFIELD(CRC32)) {
 		snprintf(tmp, sizeof(tmp), "crc32 %08x ",
 		    fmt_ntoh32(flow->crc32.crc32));
@@ -880,10 +914,49 @@ store_swab_flow(struct store_flow_complete *flow, int to_net)
 	FLSWAB(16, finf.engine_id);
 	FLSWAB(32, finf.flow_sequence);
 	FLSWAB(16, finf.source_id);
+	FLSWAB(64, samp.sampler_id);
+	FLSWAB(32, samp.interval);
+	FLSWAB(64, atimes.flow_start_ms);
+	FLSWAB(64, atimes.flow_finish_ms);
+	FLSWAB(64, atimes.skew_ms);
 	FLSWAB(32, crc32.crc32);
 #undef FLSWAB
 }
 
+/*
+ * Scale the packet and octet counters of a sampled flow (in network byte
+ * order) up by its sampling interval. Flows are only scaled once; returns 1
+ * if this one was.
+ */
+int
+store_flow_upscale(struct store_flow_complete *flow)
+{
+	u_int32_t fields, interval;
+	u_int64_t v;
+
+	fields = ntohl(flow->hdr.fields);
+	if (!SHASFIELD(SAMPLING) ||
+	    (flow->samp.flags & STORE_SAMPLING_UPSCALED) != 0)
+		return (0);
+	if ((interval = ntohl(flow->samp.interval)) <= 1)
+		return (0);
+
+	/* Saturate rather than wrap */
+	if (SHASFIELD(PACKETS)) {
+		v = store_ntohll(flow->packets.flow_packets);
+		v = v > ~0ULL / interval ? ~0ULL : v * interval;
+		flow->packets.flow_packets = store_htonll(v);
+	}
+	if (SHASFIELD(OCTETS)) {
+		v = store_ntohll(flow->octets.flow_octets);
+		v = v > ~0ULL / interval ? ~0ULL : v * interval;
+		flow->octets.flow_octets = store_htonll(v);
+	}
+	flow->samp.flags |= STORE_SAMPLING_UPSCALED;
+
+	return (1);
+}
+
 u_int64_t
 store_ntohll(u_int64_t v)
 {
@@ -40,7 +40,7 @@ struct store_addr4 {
 #define STORE_VER_GET_MIN(ver)	(ver & STORE_VER_MIN_MASK)
 
 #define STORE_VER_MAJOR		3
-#define STORE_VER_MINOR		0
+#define STORE_VER_MINOR		2
 #define STORE_VERSION		STORE_MKVER(STORE_VER_MAJOR, STORE_VER_MINOR)
 
 /* Start of flow record - present for every flow */
@@ -74,11 +74,13 @@ struct store_flow {
 #define STORE_FIELD_FLOW_TIMES		(1U<<16)
 #define STORE_FIELD_AS_INFO		(1U<<17)
 #define STORE_FIELD_FLOW_ENGINE_INFO	(1U<<18)
+#define STORE_FIELD_SAMPLING		(1U<<19)
+#define STORE_FIELD_ABS_TIMES		(1U<<20)
 /* ... more one day */
 
 #define STORE_FIELD_CRC32		(1U<<30)
 #define STORE_FIELD_RESERVED		(1U<<31) /* For extension header */
-#define STORE_FIELD_ALL			(((1U<<19)-1)|STORE_FIELD_CRC32)
+#define STORE_FIELD_ALL			(((1U<<21)-1)|STORE_FIELD_CRC32)
 
 /* Useful combinations */
 #define STORE_FIELD_AGENT_ADDR		(STORE_FIELD_AGENT_ADDR4|\
@@ -193,6 +195,7 @@ struct store_flow_AGENT_INFO {
 	u_int16_t		netflow_version;
 	u_int16_t		pad;
 } __packed;
+#define STORE_VERSION_SFLOW		0x8000	/* Flag for sFlow versions */
 
 /* Optional flow field - present if STORE_FIELD_FLOW_TIMES */
 struct store_flow_FLOW_TIMES {
@@ -217,6 +220,31 @@ struct store_flow_FLOW_ENGINE_INFO {
 	u_int32_t		source_id;
 } __packed;
 
+/* Optional flow field - present if STORE_FIELD_SAMPLING */
+struct store_flow_SAMPLING {
+	u_int64_t		sampler_id;
+	u_int32_t		interval;	/* 1 in "interval" packets */
+	u_int8_t		algorithm;	/* STORE_SAMPLING_* */
+	u_int8_t		flags;
+	u_int16_t		pad;
+} __packed;
+#define STORE_SAMPLING_UNKNOWN		0
+#define STORE_SAMPLING_DETERMINISTIC	1
+#define STORE_SAMPLING_RANDOM		2
+#define STORE_SAMPLING_UPSCALED		0x01	/* Counters already scaled up */
+
+/*
+ * Optional flow field - present if STORE_FIELD_ABS_TIMES
+ * Flow start and finish in milliseconds since the epoch, corrected for the
+ * exporter's clock skew (receive time less export time), which is also
+ * recorded. The skew is signed.
+ */
+struct store_flow_ABS_TIMES {
+	u_int64_t		flow_start_ms;
+	u_int64_t		flow_finish_ms;
+	u_int64_t		skew_ms;
+} __packed;
+
 /* Optional flow field - present if STORE_FIELD_CRC32 */
 struct store_flow_CRC32 {
 	u_int32_t		crc32;
@@ -240,6 +268,8 @@ struct store_flow_complete {
 	struct store_flow_FLOW_TIMES		ftimes;
 	struct store_flow_AS_INFO		asinf;
 	struct store_flow_FLOW_ENGINE_INFO	finf;
+	struct store_flow_SAMPLING		samp;
+	struct store_flow_ABS_TIMES		atimes;
 	struct store_flow_CRC32			crc32;
 } __packed;
 
@@ -284,6 +314,7 @@ void store_format_flow_flowtools_csv(struct store_flow_complete *flow,
     char *buf, size_t len, int utc_flag, u_int32_t display_mask,
     int hostorder);
 void store_swab_flow(struct store_flow_complete *flow, int to_net);
+int store_flow_upscale(struct store_flow_complete *flow);
 
 /* Utility functions */
 const char *iso_time(time_t t, int utc_flag);
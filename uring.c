@@ -0,0 +1,239 @@
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "flowd-common.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flowd.h"
+
+#ifdef USE_IO_URING
+
+#include "uring.h"
+
+RCSID("$Id$");
+
+/*
+ * Set up a ring with (at least) "entries" submission queue entries and
+ * "cq_entries" completion queue entries, or the kernel's default if 0.
+ */
+struct uring *
+uring_new(u_int entries, u_int cq_entries)
+{
+	struct io_uring_params p;
+	struct uring *ur;
+	u_int8_t *sq, *cq;
+	int saved_errno;
+
+	if ((ur = calloc(1, sizeof(*ur))) == NULL)
+		return (NULL);
+	ur->sq_map = ur->cq_map = ur->sqes = MAP_FAILED;
+
+	bzero(&p, sizeof(p));
+	if (cq_entries != 0) {
+		p.flags |= IORING_SETUP_CQSIZE;
+		p.cq_entries = cq_entries;
+	}
+	if ((ur->fd = syscall(__NR_io_uring_setup, entries, &p)) == -1) {
+		free(ur);
+		return (NULL);
+	}
+	ur->features = p.features;
+	ur->sq_entries = p.sq_entries;
+
+	ur->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(u_int);
+	ur->cq_map_len = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ur->sq_map_len = ur->cq_map_len =
+		    MAX(ur->sq_map_len, ur->cq_map_len);
+	}
+	if ((ur->sq_map = mmap(NULL, ur->sq_map_len, PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING)) == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ur->cq_map = ur->sq_map;
+	else if ((ur->cq_map = mmap(NULL, ur->cq_map_len,
+	    PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ur->fd,
+	    IORING_OFF_CQ_RING)) == MAP_FAILED)
+		goto fail;
+	ur->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	if ((ur->sqes = mmap(NULL, ur->sqes_len, PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE, ur->fd, IORING_OFF_SQES)) == MAP_FAILED)
+		goto fail;
+
+	sq = ur->sq_map;
+	ur->sq_head = (u_int *)(sq + p.sq_off.head);
+	ur->sq_tail = (u_int *)(sq + p.sq_off.tail);
+	ur->sq_mask = (u_int *)(sq + p.sq_off.ring_mask);
+	ur->sq_array = (u_int *)(sq + p.sq_off.array);
+	ur->sq_flags = (u_int *)(sq + p.sq_off.flags);
+	ur->sq_pending_tail = *ur->sq_tail;
+	cq = ur->cq_map;
+	ur->cq_head = (u_int *)(cq + p.cq_off.head);
+	ur->cq_tail = (u_int *)(cq + p.cq_off.tail);
+	ur->cq_mask = (u_int *)(cq + p.cq_off.ring_mask);
+	ur->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return (ur);
+
+ fail:
+	saved_errno = errno;
+	uring_free(ur);
+	errno = saved_errno;
+	return (NULL);
+}
+
+/* Tear down a ring. Any requests still outstanding are cancelled */
+void
+uring_free(struct uring *ur)
+{
+	if (ur->br != NULL)
+		munmap(ur->br, ur->br_entries * sizeof(struct io_uring_buf));
+	if (ur->sqes != MAP_FAILED)
+		munmap(ur->sqes, ur->sqes_len);
+	if (ur->cq_map != MAP_FAILED && ur->cq_map != ur->sq_map)
+		munmap(ur->cq_map, ur->cq_map_len);
+	if (ur->sq_map != MAP_FAILED)
+		munmap(ur->sq_map, ur->sq_map_len);
+	close(ur->fd);
+	free(ur);
+}
+
+/* Get a cleared submission entry, returns NULL if the queue is full */
+struct io_uring_sqe *
+uring_get_sqe(struct uring *ur)
+{
+	struct io_uring_sqe *sqe;
+	u_int head, idx;
+
+	head = __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+	if (ur->sq_pending_tail - head >= ur->sq_entries)
+		return (NULL);
+	idx = ur->sq_pending_tail & *ur->sq_mask;
+	ur->sq_array[idx] = idx;
+	ur->sq_pending_tail++;
+	sqe = &ur->sqes[idx];
+	bzero(sqe, sizeof(*sqe));
+	return (sqe);
+}
+
+/*
+ * Submit any entries obtained from uring_get_sqe() and optionally wait for
+ * "wait_nr" completions. Returns -1 on error.
+ */
+int
+uring_submit(struct uring *ur, u_int wait_nr)
+{
+	u_int to_submit;
+	int r;
+
+	to_submit = ur->sq_pending_tail - *ur->sq_tail;
+	__atomic_store_n(ur->sq_tail, ur->sq_pending_tail, __ATOMIC_RELEASE);
+	if (to_submit == 0 && wait_nr == 0)
+		return (0);
+	do {
+		r = syscall(__NR_io_uring_enter, ur->fd, to_submit, wait_nr,
+		    wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (r == -1 && errno == EINTR);
+	return (r == -1 ? -1 : 0);
+}
+
+/* Returns the oldest unconsumed completion, or NULL if there are none */
+struct io_uring_cqe *
+uring_peek_cqe(struct uring *ur)
+{
+	u_int head = *ur->cq_head;
+
+	if (head == __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE)) {
+		/*
+		 * Completions that didn't fit in the queue are held by the
+		 * kernel until we enter it again, without any wakeup.
+		 */
+		if ((__atomic_load_n(ur->sq_flags, __ATOMIC_RELAXED) &
+		    IORING_SQ_CQ_OVERFLOW) == 0 ||
+		    syscall(__NR_io_uring_enter, ur->fd, 0, 0,
+		    IORING_ENTER_GETEVENTS, NULL, 0) == -1 ||
+		    head == __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE))
+			return (NULL);
+	}
+	return (&ur->cqes[head & *ur->cq_mask]);
+}
+
+/* Consume the completion returned by uring_peek_cqe() */
+void
+uring_cqe_seen(struct uring *ur)
+{
+	__atomic_store_n(ur->cq_head, *ur->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Register a ring of "entries" (a power of two) provided buffers as buffer
+ * group "bgid". Buffers are added with uring_buf_add() and become visible
+ * to the kernel after uring_buf_commit().
+ */
+int
+uring_buf_ring_init(struct uring *ur, u_int entries, u_int16_t bgid)
+{
+	struct io_uring_buf_reg reg;
+	size_t len = entries * sizeof(struct io_uring_buf);
+	void *br;
+	int saved_errno;
+
+	if ((br = mmap(NULL, len, PROT_READ|PROT_WRITE,
+	    MAP_ANONYMOUS|MAP_PRIVATE, -1, 0)) == MAP_FAILED)
+		return (-1);
+	bzero(&reg, sizeof(reg));
+	reg.ring_addr = (u_int64_t)(uintptr_t)br;
+	reg.ring_entries = entries;
+	reg.bgid = bgid;
+	if (syscall(__NR_io_uring_register, ur->fd,
+	    IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+		saved_errno = errno;
+		munmap(br, len);
+		errno = saved_errno;
+		return (-1);
+	}
+	ur->br = br;
+	ur->br_entries = entries;
+	ur->br_tail = 0;
+	return (0);
+}
+
+void
+uring_buf_add(struct uring *ur, void *addr, u_int len, u_int16_t bid)
+{
+	struct io_uring_buf *b;
+
+	b = &ur->br->bufs[ur->br_tail & (ur->br_entries - 1)];
+	b->addr = (u_int64_t)(uintptr_t)addr;
+	b->len = len;
+	b->bid = bid;
+	ur->br_tail++;
+}
+
+void
+uring_buf_commit(struct uring *ur)
+{
+	__atomic_store_n(&ur->br->tail, ur->br_tail, __ATOMIC_RELEASE);
+}
+
+#endif /* USE_IO_URING */
@@ -0,0 +1,60 @@
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Just enough of a Linux io_uring interface for flowd, using the raw
+ * system calls so that we don't depend on liburing: submission and
+ * completion queues plus one ring of provided buffers.
+ */
+
+#ifndef _URING_H
+#define _URING_H
+
+#include <sys/types.h>
+#include <linux/io_uring.h>
+
+struct uring {
+	int fd;
+	u_int features;			/* IORING_FEAT_* */
+
+	/* Submission queue */
+	u_int *sq_head, *sq_tail, *sq_mask, *sq_array, *sq_flags;
+	u_int sq_entries;
+	u_int sq_pending_tail;		/* Includes unsubmitted entries */
+	struct io_uring_sqe *sqes;
+
+	/* Completion queue */
+	u_int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* Provided buffer ring, if any */
+	struct io_uring_buf_ring *br;
+	u_int br_entries;
+	u_int16_t br_tail;
+
+	void *sq_map, *cq_map;
+	size_t sq_map_len, cq_map_len, sqes_len;
+};
+
+struct uring *uring_new(u_int entries, u_int cq_entries);
+void uring_free(struct uring *ur);
+struct io_uring_sqe *uring_get_sqe(struct uring *ur);
+int uring_submit(struct uring *ur, u_int wait_nr);
+struct io_uring_cqe *uring_peek_cqe(struct uring *ur);
+void uring_cqe_seen(struct uring *ur);
+int uring_buf_ring_init(struct uring *ur, u_int entries, u_int16_t bgid);
+void uring_buf_add(struct uring *ur, void *addr, u_int len, u_int16_t bid);
+void uring_buf_commit(struct uring *ur);
+
+#endif /* _URING_H */